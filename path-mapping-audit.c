@@ -0,0 +1,235 @@
+/*
+MIT License
+
+Copyright (c) 2022 Fritz Webering
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Maps the shared libraries which the dynamic loader opens itself, i.e. the dependencies of programs and
+// libraries and the libraries of dlopen(). The loader does not use the functions of the libc for that,
+// so path-mapping.so never sees these paths. This library uses the auditing interface of the loader
+// instead (see rtld-audit(7)). It is linked with path-mapping.c (compiled with TABLE_ONLY), so that it
+// reads PATH_MAPPING or PATH_MAPPING_FILE at startup and maps with exactly the same fix_path().
+//
+// Usage: LD_AUDIT=/path/to/path-mapping-audit.so LD_PRELOAD=/path/to/path-mapping.so program
+//
+// The loader remembers the directories of its search path which do not exist, and it already looks at
+// them while it loads this library, before la_objsearch() is called. So a directory of DT_RPATH, DT_RUNPATH
+// or LD_LIBRARY_PATH which only exists as a virtual path would never be searched. Instead, la_objsearch()
+// searches these directories itself when it is asked for a name without a slash, and passes the real path
+// of the library to the loader. The results are cached per name and search path, so a library which is
+// looked up again (e.g. an optional plugin which does not exist) costs no probes at all, and the
+// directories of the search path which do not exist are only checked once.
+//
+// The loader holds its lock while it calls la_objsearch(), so the calls never overlap.
+
+#define _GNU_SOURCE
+
+#include <link.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
+
+const char *fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size);
+
+// Results of la_objsearch(), which must stay valid, so entries are never removed
+struct audit_entry {
+    struct audit_entry *next;
+    const char *result;         // The path for the loader, or NULL
+    int status;                 // Search: all directories were searched, so the loader can skip them. Directory: it exists.
+    char key[];
+};
+
+#define AUDIT_CACHE_SIZE 1024
+static struct audit_entry *audit_cache[AUDIT_CACHE_SIZE];
+
+// The last search of a name without a slash, whose directories the loader will search again afterwards
+static const struct audit_entry *audit_current = NULL;
+static const char *audit_current_name = NULL;
+
+static uint32_t audit_hash(const char *key)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *key; key++) hash = (hash ^ (unsigned char)*key) * 16777619u;
+    return hash;
+}
+
+static struct audit_entry *audit_cache_get(const char *key)
+{
+    for (struct audit_entry *entry = audit_cache[audit_hash(key) % AUDIT_CACHE_SIZE]; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Copies result, unless it is NULL. Returns NULL if there is no memory, then the caller does not cache anything.
+static struct audit_entry *audit_cache_put(const char *key, const char *result, int status)
+{
+    size_t key_size = strlen(key) + 1;
+    size_t result_size = result != NULL ? strlen(result) + 1 : 0;
+    struct audit_entry *entry = malloc(sizeof *entry + key_size + result_size);
+    if (entry == NULL) return NULL;
+    memcpy(entry->key, key, key_size);
+    entry->result = NULL;
+    if (result != NULL) entry->result = memcpy(entry->key + key_size, result, result_size);
+    entry->status = status;
+    uint32_t bucket = audit_hash(key) % AUDIT_CACHE_SIZE;
+    entry->next = audit_cache[bucket];
+    audit_cache[bucket] = entry;
+    return entry;
+}
+
+// Checks a path which is already mapped with the syscall, because access() is overridden in this library as well
+static int audit_exists(const char *path)
+{
+    return syscall(SYS_faccessat, AT_FDCWD, path, F_OK, 0) == 0;
+}
+
+// Checks whether the mapped directory exists, only once for each directory
+static int audit_dir_exists(const char *dir)
+{
+    char key[PATH_MAX + 1];
+    if (snprintf(key, sizeof key, "d%s", dir) >= (int)sizeof key) return 0;
+    const struct audit_entry *entry = audit_cache_get(key);
+    if (entry != NULL) return entry->status;
+    int exists = audit_exists(dir);
+    audit_cache_put(key, NULL, exists);
+    return exists;
+}
+
+// Returns DT_RPATH or DT_RUNPATH of map, or NULL
+static const char *audit_search_path(const struct link_map *map, ElfW(Sxword) tag)
+{
+    if (map == NULL || map->l_ld == NULL) return NULL;
+    ElfW(Addr) strtab = 0;
+    const ElfW(Dyn) *found = NULL;
+    for (const ElfW(Dyn) *dyn = map->l_ld; dyn->d_tag != DT_NULL; dyn++) {
+        if (dyn->d_tag == DT_STRTAB) strtab = dyn->d_un.d_ptr;
+        if (dyn->d_tag == tag) found = dyn;
+    }
+    if (found == NULL || strtab == 0) return NULL;
+    // The loader relocates the addresses in the dynamic section of most objects, but not of all
+    if (strtab < map->l_addr) strtab += map->l_addr;
+    return (const char *)strtab + found->d_un.d_val;
+}
+
+// Appends the directories of path to dirs, separated by ':'. Returns 0 if dirs is too small.
+static int audit_append(char *dirs, size_t size, const char *path)
+{
+    if (path == NULL || path[0] == '\0') return 1;
+    size_t length = strlen(dirs);
+    return snprintf(dirs + length, size - length, "%s%s", length > 0 ? ":" : "", path) < (int)(size - length);
+}
+
+// Searches name in the directories which the loader would search before its cache and the default
+// directories: DT_RPATH of the object which loads it and of the program, LD_LIBRARY_PATH and DT_RUNPATH.
+// Returns NULL if the loader should search by itself, because none of the directories is mapped,
+// or because a directory contains $ORIGIN or another token, which only the loader can expand.
+static const struct audit_entry *audit_search(const char *name, const struct link_map *loader)
+{
+    const struct link_map *program = loader;
+    while (program != NULL && program->l_prev != NULL) program = program->l_prev;
+    const char *runpath = audit_search_path(loader, DT_RUNPATH);
+
+    // Static, because the calls never overlap
+    static char dirs[4 * PATH_MAX], key[sizeof dirs + NAME_MAX + 2];
+    dirs[0] = '\0';
+    int fits = 1;
+    if (runpath == NULL) {
+        fits = fits && audit_append(dirs, sizeof dirs, audit_search_path(loader, DT_RPATH));
+        if (program != loader && audit_search_path(program, DT_RUNPATH) == NULL) {
+            fits = fits && audit_append(dirs, sizeof dirs, audit_search_path(program, DT_RPATH));
+        }
+    }
+    if (!getauxval(AT_SECURE)) fits = fits && audit_append(dirs, sizeof dirs, getenv("LD_LIBRARY_PATH"));
+    fits = fits && audit_append(dirs, sizeof dirs, runpath);
+    if (!fits || dirs[0] == '\0' || strchr(dirs, '$') != NULL) return NULL;
+
+    snprintf(key, sizeof key, "s%s/%s", dirs, name);
+    const struct audit_entry *entry = audit_cache_get(key);
+    if (entry != NULL) return entry->status ? entry : NULL;
+
+    // Only search if a directory is mapped, otherwise the loader does the same (and checks the subdirectories)
+    int mapped = 0;
+    for (char *dir = dirs, *end; !mapped && dir != NULL; dir = end != NULL ? end + 1 : NULL) {
+        end = strpbrk(dir, ":;");
+        if (end != NULL) *end = '\0';
+        char new_path[PATH_MAX];
+        mapped = dir[0] != '\0' && fix_path("la_objsearch", dir, new_path, sizeof new_path) != dir;
+        if (end != NULL) *end = ':';
+    }
+
+    // found points into new_path or path, which must still exist when it is cached below
+    char path[PATH_MAX], new_dir[PATH_MAX], new_path[PATH_MAX];
+    const char *found = NULL;
+    int searched = mapped;
+    for (char *dir = dirs, *end; searched && found == NULL && dir != NULL; dir = end != NULL ? end + 1 : NULL) {
+        end = strpbrk(dir, ":;");
+        if (end != NULL) *end = '\0';
+        // An empty directory or a relative one is relative to the current directory, which the loader knows better
+        searched = dir[0] == '/' && snprintf(path, sizeof path, "%s/%s", dir, name) < (int)sizeof path;
+        if (searched && audit_dir_exists(fix_path("la_objsearch", dir, new_dir, sizeof new_dir))) {
+            const char *mapped_path = fix_path("la_objsearch", path, new_path, sizeof new_path);
+            if (audit_exists(mapped_path)) found = mapped_path;
+        }
+        if (end != NULL) *end = ':';
+    }
+    entry = audit_cache_put(key, found, searched);
+    return searched ? entry : NULL;
+}
+
+unsigned int la_version(unsigned int version)
+{
+    return version < LAV_CURRENT ? version : LAV_CURRENT;
+}
+
+char *la_objsearch(const char *name, uintptr_t *cookie, unsigned int flag)
+{
+    if (flag == LA_SER_ORIG) audit_current = NULL;
+    if (flag == LA_SER_ORIG && strchr(name, '/') == NULL) {
+        // Unless la_objopen() changes it, the cookie is the link map of the object
+        const struct link_map *loader = cookie != NULL ? (const struct link_map *)*cookie : NULL;
+        audit_current = audit_search(name, loader);
+        audit_current_name = name;
+        if (audit_current != NULL && audit_current->result != NULL) return (char *)audit_current->result;
+        return (char *)name;
+    }
+
+    // The loader tries the directories which audit_search() found nothing in again, with their subdirectories
+    if ((flag == LA_SER_RUNPATH || flag == LA_SER_LIBPATH) && audit_current != NULL) {
+        const char *base = strrchr(name, '/');
+        if (base != NULL && strcmp(base + 1, audit_current_name) == 0) return NULL;
+    }
+
+    // A path of dlopen(), or a path in the loader's cache or its default directories
+    char new_path[PATH_MAX], key[PATH_MAX + 1];
+    const char *mapped_path = fix_path("la_objsearch", name, new_path, sizeof new_path);
+    if (mapped_path == name) return (char *)name;
+    // Without a cache entry, there is no copy of mapped_path which outlives this call
+    if (snprintf(key, sizeof key, "p%s", name) >= (int)sizeof key) return (char *)name;
+    const struct audit_entry *entry = audit_cache_get(key);
+    if (entry == NULL) entry = audit_cache_put(key, mapped_path, 0);
+    return entry != NULL ? (char *)entry->result : (char *)name;
+}
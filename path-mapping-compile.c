@@ -0,0 +1,179 @@
+/*
+MIT License
+
+Copyright (c) 2022 Fritz Webering
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compiles a text file with mappings into an index file for PATH_MAPPING_FILE.
+// This is linked with path-mapping.c (compiled with NO_INIT), so that it uses exactly the same table format.
+//
+// Usage: path-mapping-compile RULES -o INDEX
+//
+// Each line of RULES contains a prefix and its destination, separated by spaces or tabs.
+// If a line contains more than one destination, they are layers which are searched in order.
+// Lines with an exclusion (a prefix which starts with !) or a section header (@) need no destination.
+// A backslash includes the next character literally, e.g. "\ " for a space or "\\" for a backslash,
+// so the escapes of patterns need two, e.g. "\\[" for a literal [.
+// Empty lines and everything after a # are ignored. Use - to read RULES from stdin.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "path-mapping.h"
+
+void *path_mapping_compile_index(const char *(*map)[2], int length, size_t *size);
+
+static char *read_file(const char *filename, size_t *size)
+{
+    FILE *file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (file == NULL) return NULL;
+    size_t capacity = 4096, length = 0;
+    char *data = malloc(capacity);
+    while (data != NULL) {
+        length += fread(data + length, 1, capacity - length - 1, file);
+        if (length < capacity - 1) break;
+        char *new_data = realloc(data, 2 * capacity);
+        if (new_data == NULL) free(data);
+        data = new_data;
+        capacity *= 2;
+    }
+    if (data != NULL && ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    if (file != stdin) fclose(file);
+    if (data != NULL) {
+        data[length] = '\0';
+        *size = length;
+    }
+    return data;
+}
+
+// Splits the next field of a line in place, resolving escapes.
+// Returns NULL at the end of the line or at the start of a comment.
+static char *next_field(char **position)
+{
+    char *c = *position;
+    while (*c == ' ' || *c == '\t') c++;
+    if (*c == '\0' || *c == '\n' || *c == '#') {
+        *position = c;
+        return NULL;
+    }
+    char *field = c, *out = c;
+    while (*c != '\0' && *c != '\n' && *c != ' ' && *c != '\t') {
+        if (*c == '\\' && c[1] != '\0' && c[1] != '\n') c++;
+        *out++ = *c++;
+    }
+    *position = *c == '\0' || *c == '\n' ? c : c + 1;
+    *out = '\0'; // May overwrite the newline, which main() has already found
+    return field;
+}
+
+int main(int argc, char **argv)
+{
+    const char *input = NULL, *output = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+        else if (input == NULL) input = argv[i];
+        else output = NULL, input = NULL, i = argc;
+    }
+    if (input == NULL || output == NULL) {
+        fprintf(stderr, "Usage: %s RULES -o INDEX\n", argv[0]);
+        fprintf(stderr, "Each line of RULES contains a prefix and one or more destinations, separated by whitespace.\n");
+        fprintf(stderr, "Use a backslash to escape spaces, tabs, # or backslashes in paths. # starts a comment.\n");
+        return 1;
+    }
+
+    size_t size;
+    char *rules = read_file(input, &size);
+    if (rules == NULL) {
+        fprintf(stderr, "Can not read %s: %s\n", input, strerror(errno));
+        return 1;
+    }
+
+    int length = 0, capacity = 64;
+    const char *(*map)[2] = malloc(capacity * sizeof *map);
+    int line_number = 0;
+    for (char *line = rules; map != NULL && line < rules + size; ) {
+        line_number++;
+        char *line_end = strchr(line, '\n');
+        if (line_end == NULL) line_end = rules + size;
+        char *position = line;
+        char *prefix = next_field(&position);
+        char *dest = next_field(&position);
+        if (prefix != NULL && dest == NULL) {
+            if (prefix[0] != '!' && prefix[0] != '@') {
+                fprintf(stderr, "%s:%d: expected a prefix and a destination\n", input, line_number);
+                return 1;
+            }
+            *line_end = '\0'; // An empty destination
+            dest = line_end;
+        }
+        // Each layer becomes a mapping with the same prefix
+        for (; dest != NULL; dest = next_field(&position)) {
+            if (length == capacity) {
+                capacity *= 2;
+                const char *(*new_map)[2] = realloc(map, capacity * sizeof *map);
+                if (new_map == NULL) free(map);
+                map = new_map;
+                if (map == NULL) break;
+            }
+            map[length][0] = prefix;
+            map[length][1] = dest;
+            length++;
+        }
+        line = line_end + 1;
+    }
+
+    size_t index_size = 0;
+    void *index = map != NULL ? path_mapping_compile_index(map, length, &index_size) : NULL;
+    if (index == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Write to a temporary file and rename it, so that running processes never see a partial index
+    size_t temp_size = strlen(output) + 32;
+    char *temp = malloc(temp_size);
+    if (temp == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    snprintf(temp, temp_size, "%s.tmp.%d", output, (int)getpid());
+    FILE *file = fopen(temp, "w");
+    if (file == NULL || fwrite(index, 1, index_size, file) != index_size || fclose(file) != 0) {
+        fprintf(stderr, "Can not write %s: %s\n", temp, strerror(errno));
+        unlink(temp);
+        return 1;
+    }
+    if (rename(temp, output) != 0) {
+        fprintf(stderr, "Can not rename %s to %s: %s\n", temp, output, strerror(errno));
+        unlink(temp);
+        return 1;
+    }
+    printf("Compiled %d mappings from %s into %s (%zu bytes)\n", length, input, output, index_size);
+    return 0;
+}
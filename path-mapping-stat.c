@@ -0,0 +1,247 @@
+/*
+MIT License
+
+Copyright (c) 2022 Fritz Webering
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Prints the counters which path-mapping.so publishes if PATH_MAPPING_STATS is set.
+//
+// Usage: path-mapping-stat               List all processes which publish counters
+//        path-mapping-stat [-a] PID      Print the counters of one process
+//        path-mapping-stat -c            Remove the segments of processes which no longer exist
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h> // offsetof
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "path-mapping.h"
+
+struct stats_view {
+    const struct path_mapping_stats_header *header;
+    size_t size;
+};
+
+// Maps the segment of process pid read-only. Returns 0 on success.
+static int stats_open(int pid, struct stats_view *view)
+{
+    char name[64];
+    snprintf(name, sizeof name, "/" PATH_MAPPING_STATS_PREFIX "%d", pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No counters for process %d: %s\n", pid, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct path_mapping_stats_header)) {
+        fprintf(stderr, "Counters of process %d are not initialized\n", pid);
+        close(fd);
+        return -1;
+    }
+    view->size = st.st_size;
+    view->header = mmap(NULL, view->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view->header == MAP_FAILED) {
+        fprintf(stderr, "Can not map counters of process %d: %s\n", pid, strerror(errno));
+        return -1;
+    }
+
+    const struct path_mapping_stats_header *h = view->header;
+    if (h->magic != PATH_MAPPING_STATS_MAGIC || h->version != PATH_MAPPING_STATS_VERSION || h->size > view->size
+            || h->names_offset + (uint64_t)h->n_functions * PATH_MAPPING_STATS_NAME_SIZE > h->rules_offset
+            || h->rules_offset + (uint64_t)h->n_rules * 2 * sizeof(uint32_t) > h->strings_offset
+            || h->strings_offset > h->shards_offset
+            || h->shards_offset + (uint64_t)h->n_shards * h->shard_size > h->size
+            || (uint64_t)h->n_functions * sizeof(struct path_mapping_function_counters) + h->n_rules * sizeof(uint64_t) > h->shard_size) {
+        fprintf(stderr, "Counters of process %d have an unknown format\n", pid);
+        munmap((void *)view->header, view->size);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *stats_string(const struct path_mapping_stats_header *h, uint32_t offset)
+{
+    const char *strings = (const char *)h + h->strings_offset;
+    size_t strings_size = h->shards_offset - h->strings_offset;
+    if (offset >= strings_size || memchr(strings + offset, '\0', strings_size - offset) == NULL) return "?";
+    return strings + offset;
+}
+
+// Sums one counter over all shards. The process may still be writing, which is fine for 64 bit loads.
+static uint64_t stats_sum(const struct path_mapping_stats_header *h, size_t offset_in_shard)
+{
+    uint64_t sum = 0;
+    for (uint32_t s = 0; s < h->n_shards; s++) {
+        const uint64_t *counter = (const uint64_t *)((const char *)h + h->shards_offset + s * h->shard_size + offset_in_shard);
+        sum += __atomic_load_n(counter, __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+static size_t function_counter_offset(uint32_t function, size_t member)
+{
+    return function * sizeof(struct path_mapping_function_counters) + member;
+}
+
+struct rule_hits {
+    uint32_t rule;
+    uint64_t hits;
+};
+
+static int compare_rule_hits(const void *left, const void *right)
+{
+    const struct rule_hits *a = left, *b = right;
+    if (a->hits != b->hits) return a->hits < b->hits ? 1 : -1;
+    return a->rule < b->rule ? -1 : a->rule > b->rule;
+}
+
+static int print_stats(int pid, int all)
+{
+    struct stats_view view;
+    if (stats_open(pid, &view) != 0) return 1;
+    const struct path_mapping_stats_header *h = view.header;
+    int timing = h->flags & PATH_MAPPING_STATS_TIMING;
+
+    printf("%-24s %12s %12s %9s", "function", "calls", "mapped", "too long");
+    printf(timing ? " %12s\n" : "\n", "time ms");
+    const char *names = (const char *)h + h->names_offset;
+    for (uint32_t f = 0; f < h->n_functions; f++) {
+        const char *name = names + f * PATH_MAPPING_STATS_NAME_SIZE;
+        if (name[0] == '\0') continue; // Padding in the dispatch table
+        uint64_t calls = stats_sum(h, function_counter_offset(f, offsetof(struct path_mapping_function_counters, calls)));
+        if (calls == 0 && !all) continue;
+        uint64_t mapped = stats_sum(h, function_counter_offset(f, offsetof(struct path_mapping_function_counters, mapped)));
+        uint64_t too_long = stats_sum(h, function_counter_offset(f, offsetof(struct path_mapping_function_counters, too_long)));
+        printf("%-24.*s %12llu %12llu %9llu", PATH_MAPPING_STATS_NAME_SIZE, name,
+                (unsigned long long)calls, (unsigned long long)mapped, (unsigned long long)too_long);
+        if (timing) {
+            uint64_t time_ns = stats_sum(h, function_counter_offset(f, offsetof(struct path_mapping_function_counters, time_ns)));
+            printf(" %12.3f", time_ns / 1e6);
+        }
+        printf("\n");
+    }
+
+    // Rules are sorted by the number of hits, so that hot rules come first and dead rules last
+    struct rule_hits *rules = malloc((h->n_rules + 1) * sizeof *rules);
+    if (rules == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    size_t hits_offset = h->n_functions * sizeof(struct path_mapping_function_counters);
+    for (uint32_t r = 0; r < h->n_rules; r++) {
+        rules[r].rule = r;
+        rules[r].hits = stats_sum(h, hits_offset + r * sizeof(uint64_t));
+    }
+    qsort(rules, h->n_rules, sizeof *rules, compare_rule_hits);
+
+    printf("\n%12s  %s\n", "hits", "rule");
+    const uint32_t *rule_strings = (const uint32_t *)((const char *)h + h->rules_offset);
+    for (uint32_t i = 0; i < h->n_rules; i++) {
+        uint32_t r = rules[i].rule;
+        printf("%12llu  [%u] %s => %s%s\n", (unsigned long long)rules[i].hits, r,
+                stats_string(h, rule_strings[2 * r]), stats_string(h, rule_strings[2 * r + 1]),
+                rules[i].hits == 0 ? " (unused)" : "");
+    }
+    free(rules);
+    munmap((void *)h, view.size);
+    return 0;
+}
+
+// Calls func for the pid of each segment in PATH_MAPPING_STATS_DIR
+static int for_each_segment(void (*func)(int pid))
+{
+    DIR *dir = opendir(PATH_MAPPING_STATS_DIR);
+    if (dir == NULL) {
+        fprintf(stderr, "Can not open " PATH_MAPPING_STATS_DIR ": %s\n", strerror(errno));
+        return 1;
+    }
+    struct dirent *entry;
+    size_t prefix_length = strlen(PATH_MAPPING_STATS_PREFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, PATH_MAPPING_STATS_PREFIX, prefix_length) != 0) continue;
+        char *end;
+        long pid = strtol(entry->d_name + prefix_length, &end, 10);
+        if (*end != '\0' || pid <= 0) continue;
+        func((int)pid);
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int process_exists(int pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static void list_segment(int pid)
+{
+    char exe_link[64], exe[4096] = "";
+    snprintf(exe_link, sizeof exe_link, "/proc/%d/exe", pid);
+    ssize_t length = readlink(exe_link, exe, sizeof exe - 1);
+    if (length > 0) exe[length] = '\0';
+    printf("%8d  %s\n", pid, process_exists(pid) ? exe : "(exited)");
+}
+
+static void clean_segment(int pid)
+{
+    if (process_exists(pid)) return;
+    char name[64];
+    snprintf(name, sizeof name, "/" PATH_MAPPING_STATS_PREFIX "%d", pid);
+    if (shm_unlink(name) == 0) printf("Removed counters of process %d\n", pid);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s             List all processes which publish counters\n", program);
+    fprintf(stderr, "       %s [-a] PID    Print the counters of process PID (-a: include uncalled functions)\n", program);
+    fprintf(stderr, "       %s -c          Remove counters of processes which no longer exist\n", program);
+    fprintf(stderr, "Processes publish counters if PATH_MAPPING_STATS is set (PATH_MAPPING_STATS=time also measures the time).\n");
+}
+
+int main(int argc, char **argv)
+{
+    int all = 0, clean = 0, opt;
+    while ((opt = getopt(argc, argv, "ach")) != -1) {
+        switch (opt) {
+            case 'a': all = 1; break;
+            case 'c': clean = 1; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (clean) return for_each_segment(clean_segment);
+    if (optind == argc) return for_each_segment(list_segment);
+    if (optind + 1 != argc || atoi(argv[optind]) <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    return print_stats(atoi(argv[optind]), all);
+}
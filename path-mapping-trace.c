@@ -0,0 +1,311 @@
+/*
+MIT License
+
+Copyright (c) 2022 Fritz Webering
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Prints the trace files which path-mapping.so writes if PATH_MAPPING_TRACE is set.
+// The records of all files are merged in the order in which the calls started.
+//
+// Usage: path-mapping-trace FILE|DIR...       Print one line per call
+//        path-mapping-trace -j FILE|DIR...    Print JSON for chrome://tracing or https://ui.perfetto.dev
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "path-mapping.h"
+
+struct trace_view {
+    const char *filename;
+    const struct path_mapping_trace_header *header;
+    size_t size;
+};
+
+struct trace_entry {
+    const struct trace_view *view;
+    const struct path_mapping_trace_record *record;
+};
+
+static struct trace_view *views = NULL;
+static size_t n_views = 0, views_capacity = 0;
+static struct trace_entry *entries = NULL;
+static size_t n_entries = 0, entries_capacity = 0;
+
+// Maps a trace file read-only and adds it to views. Returns 0 on success.
+static int trace_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Can not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct path_mapping_trace_header)) {
+        fprintf(stderr, "%s is not a trace file\n", filename);
+        close(fd);
+        return -1;
+    }
+    const struct path_mapping_trace_header *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        fprintf(stderr, "Can not map %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (h->magic != PATH_MAPPING_TRACE_MAGIC || h->version != PATH_MAPPING_TRACE_VERSION || h->size > (uint64_t)st.st_size
+            || h->names_offset + (uint64_t)h->n_functions * PATH_MAPPING_STATS_NAME_SIZE > h->rings_offset
+            || h->ring_size <= sizeof(struct path_mapping_trace_ring) || h->ring_size % 8 != 0
+            || h->rings_offset + (uint64_t)h->n_rings * h->ring_size > h->size) {
+        fprintf(stderr, "%s has an unknown format\n", filename);
+        munmap((void *)h, st.st_size);
+        return -1;
+    }
+    if (n_views == views_capacity) {
+        views_capacity = views_capacity ? 2 * views_capacity : 16;
+        views = realloc(views, views_capacity * sizeof *views);
+        if (views == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    views[n_views].filename = filename;
+    views[n_views].header = h;
+    views[n_views].size = st.st_size;
+    n_views++;
+    return 0;
+}
+
+// Opens all trace files in a directory
+static int trace_open_directory(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        fprintf(stderr, "Can not open %s: %s\n", directory, strerror(errno));
+        return -1;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, PATH_MAPPING_TRACE_PREFIX, strlen(PATH_MAPPING_TRACE_PREFIX)) != 0) continue;
+        char *filename;
+        if (asprintf(&filename, "%s/%s", directory, entry->d_name) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (trace_open(filename) != 0) result = -1;
+    }
+    closedir(dir);
+    return result;
+}
+
+static void add_entry(const struct trace_view *view, const struct path_mapping_trace_record *record)
+{
+    if (n_entries == entries_capacity) {
+        entries_capacity = entries_capacity ? 2 * entries_capacity : 4096;
+        entries = realloc(entries, entries_capacity * sizeof *entries);
+        if (entries == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    entries[n_entries].view = view;
+    entries[n_entries].record = record;
+    n_entries++;
+}
+
+// Collects the records of all rings of a file. Stops at the first broken record of a ring,
+// which can only happen if the process is still writing into it.
+static void collect_records(const struct trace_view *view)
+{
+    const struct path_mapping_trace_header *h = view->header;
+    uint64_t capacity = h->ring_size - sizeof(struct path_mapping_trace_ring);
+    for (uint32_t r = 0; r < h->n_rings; r++) {
+        const struct path_mapping_trace_ring *ring =
+            (const struct path_mapping_trace_ring *)((const char *)h + h->rings_offset + r * h->ring_size);
+        const char *records = (const char *)(ring + 1);
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head < tail || head - tail > capacity) continue;
+        for (uint64_t position = tail; position < head; ) {
+            uint64_t offset = position % capacity;
+            const struct path_mapping_trace_record *record = (const struct path_mapping_trace_record *)(records + offset);
+            if (offset + 8 > capacity || record->size < 8 || record->size % 8 != 0 || offset + record->size > capacity) break;
+            if (record->function != PATH_MAPPING_TRACE_PADDING) {
+                if (record->size < sizeof *record + record->path_length + record->mapped_length + 2
+                        || record->function >= h->n_functions) break;
+                add_entry(view, record);
+            }
+            position += record->size;
+        }
+        if (ring->dropped > 0) {
+            fprintf(stderr, "%s: %llu calls of a signal handler were not recorded\n", view->filename, (unsigned long long)ring->dropped);
+        }
+        if (tail > 0) {
+            fprintf(stderr, "%s: the oldest records of ring %u were overwritten (see PATH_MAPPING_TRACE_SIZE)\n", view->filename, r);
+        }
+    }
+    if (h->untraced > 0) {
+        fprintf(stderr, "%s: %llu calls of threads without a free ring were not recorded\n", view->filename, (unsigned long long)h->untraced);
+    }
+}
+
+static int compare_entries(const void *left, const void *right)
+{
+    const struct trace_entry *a = left, *b = right;
+    if (a->record->time_ns != b->record->time_ns) return a->record->time_ns < b->record->time_ns ? -1 : 1;
+    return a->view->header->pid < b->view->header->pid ? -1 : a->view->header->pid > b->view->header->pid;
+}
+
+static const char *function_name(const struct trace_entry *entry)
+{
+    const struct path_mapping_trace_header *h = entry->view->header;
+    return (const char *)h + h->names_offset + entry->record->function * PATH_MAPPING_STATS_NAME_SIZE;
+}
+
+static const char *record_path(const struct path_mapping_trace_record *record)
+{
+    return (const char *)(record + 1);
+}
+
+static const char *record_mapped_path(const struct path_mapping_trace_record *record)
+{
+    return (const char *)(record + 1) + record->path_length + 1;
+}
+
+static const char *error_name(int error)
+{
+    static char buffer[16];
+    if (error == 0) return "-";
+#if __GLIBC_PREREQ(2, 32) // strerrorname_np() exists since glibc 2.32
+    const char *name = strerrorname_np(error);
+    if (name != NULL) return name;
+#endif
+    snprintf(buffer, sizeof buffer, "%d", error);
+    return buffer;
+}
+
+static void print_text(uint64_t start_ns)
+{
+    printf("%12s %7s %7s %-24s %10s %-12s %s\n", "time s", "pid", "tid", "function", "us", "error", "path");
+    for (size_t i = 0; i < n_entries; i++) {
+        const struct path_mapping_trace_record *record = entries[i].record;
+        printf("%12.6f %7u %7u %-24.*s %10.3f %-12s %s", (record->time_ns - start_ns) / 1e9,
+                entries[i].view->header->pid, record->tid, PATH_MAPPING_STATS_NAME_SIZE, function_name(&entries[i]),
+                record->duration_ns / 1e3, error_name(record->error), record_path(record));
+        if (record->mapped_length > 0) printf(" => %s [%d]", record_mapped_path(record), record->rule);
+        printf("\n");
+    }
+}
+
+static void print_json_string(const char *string, size_t length)
+{
+    putchar('"');
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = string[i];
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+// Prints complete events ("ph": "X") in the Trace Event Format, with the times in microseconds
+static void print_json(uint64_t start_ns)
+{
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    const char *separator = "";
+    for (size_t v = 0; v < n_views; v++) {
+        const struct path_mapping_trace_header *h = views[v].header;
+        printf("%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %u, \"args\": {\"name\": ", separator, h->pid);
+        print_json_string(h->exe, strnlen(h->exe, sizeof h->exe));
+        printf("}}");
+        separator = ",\n";
+    }
+    for (size_t i = 0; i < n_entries; i++) {
+        const struct path_mapping_trace_record *record = entries[i].record;
+        const char *name = function_name(&entries[i]);
+        printf("%s{\"name\": ", separator);
+        print_json_string(name, strnlen(name, PATH_MAPPING_STATS_NAME_SIZE));
+        printf(", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %u, \"tid\": %u, \"args\": {\"path\": ",
+                record->mapped_length > 0 ? "mapped" : "unmapped", (record->time_ns - start_ns) / 1e3, record->duration_ns / 1e3,
+                entries[i].view->header->pid, record->tid);
+        print_json_string(record_path(record), record->path_length);
+        if (record->mapped_length > 0) {
+            printf(", \"mapped\": ");
+            print_json_string(record_mapped_path(record), record->mapped_length);
+            printf(", \"rule\": %d", record->rule);
+        }
+        if (record->error != 0) printf(", \"error\": \"%s\"", error_name(record->error));
+        printf("}}");
+        separator = ",\n";
+    }
+    printf("\n]}\n");
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-j] FILE|DIR...\n", program);
+    fprintf(stderr, "Prints the calls recorded in trace files, or in all trace files of a directory (-j: as JSON for chrome://tracing).\n");
+    fprintf(stderr, "Processes write trace files into the directory $PATH_MAPPING_TRACE if it is set.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int json = 0, opt;
+    while ((opt = getopt(argc, argv, "jh")) != -1) {
+        switch (opt) {
+            case 'j': json = 1; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    int result = 0;
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (trace_open_directory(argv[i]) != 0) result = 1;
+        } else if (trace_open(argv[i]) != 0) {
+            result = 1;
+        }
+    }
+
+    uint64_t start_ns = UINT64_MAX;
+    for (size_t v = 0; v < n_views; v++) {
+        collect_records(&views[v]);
+        if (views[v].header->start_ns < start_ns) start_ns = views[v].header->start_ns;
+    }
+    qsort(entries, n_entries, sizeof *entries, compare_entries);
+    if (json) print_json(start_ns);
+    else print_text(start_ns);
+    return result;
+}
@@ -34,14 +34,35 @@ SOFTWARE.
 #include <sys/vfs.h> // statfs
 #include <sys/statvfs.h> // statvfs
 #include <unistd.h> // uid_t, gid_t
-#include <malloc.h> // for execl
+#include <spawn.h> // posix_spawn
 #include <utime.h> // utimebuf
 #include <sys/time.h> // struct timeval
 #include <sys/types.h> // dev_t
 #include <ftw.h> // ftw
 #include <fts.h> // fts
+#include <stdint.h> // uint32_t
+#include <stddef.h> // offsetof
+#include <limits.h> // PATH_MAX
+#include <sys/mman.h> // mmap, shm_open
+#include <sys/stat.h> // fstat
+#include <time.h> // clock_gettime
+#include <pthread.h> // pthread_atfork, pthread_create
+#include <signal.h> // pthread_sigmask
+#include <sys/inotify.h>
+#include <sys/syscall.h> // SYS_getcwd
+#include <sys/ioctl.h> // ioctl
+#include <sys/prctl.h> // PR_SET_NO_NEW_PRIVS
+#include <sys/personality.h> // ADDR_NO_RANDOMIZE
+#include <link.h> // dl_iterate_phdr
+#include <linux/filter.h> // struct sock_filter
+#include <linux/seccomp.h>
+#include <linux/audit.h> // AUDIT_ARCH_*
+#include <linux/io_uring.h> // struct io_uring_sqe
+#include <errno.h>
 #include <assert.h>
 
+#include "path-mapping.h"
+
 //#define DEBUG
 //#define QUIET
 
@@ -87,6 +108,37 @@ SOFTWARE.
 // #define DISABLE_EXEC
 // #define DISABLE_RENAME
 // #define DISABLE_LINK
+// #define DISABLE_TRUNCATE
+// #define DISABLE_HANDLE
+// #define DISABLE_DIRFD // Do not map paths relative to the dirfd of openat() and similar functions
+// #define DISABLE_READDIR // Do not show mapped prefixes in directory listings (implied by DISABLE_DIRFD)
+// #define DISABLE_SECCOMP // Remove the syscall level backend enabled by PATH_MAPPING_SECCOMP
+// #define DISABLE_IO_URING // Do not map paths in io_uring submissions (implied by DISABLE_DIRFD)
+// #define DISABLE_PATH_CACHE // Do not remember the rules which matched recently mapped paths
+// #define DISABLE_SHARED_TABLE // Do not pass the compiled table to child processes in a memfd
+// #define DISABLE_OVERLAY // Remove the copy-on-write layers enabled by PATH_MAPPING_OVERLAY
+
+// Remove the counters which can be read with path-mapping-stat
+// #define DISABLE_STATS
+
+// Do not read the configuration from the environment at startup (used by path-mapping-compile)
+// #define NO_INIT
+
+#ifdef NO_INIT
+    #define PATH_MAPPING_CONSTRUCTOR __attribute__((unused))
+#else
+    #define PATH_MAPPING_CONSTRUCTOR __attribute__((constructor))
+#endif
+
+// Only load the mappings at startup, without statistics, traces, seccomp, PATH_MAPPING_RELOAD or publishing
+// the table to child processes (used by path-mapping-audit.so, which runs inside the dynamic loader)
+// #define TABLE_ONLY
+
+#ifdef TABLE_ONLY
+    static const int path_mapping_table_only = 1;
+#else
+    static const int path_mapping_table_only = 0;
+#endif
 
 // List of path pairs. Paths beginning with the first item will be
 // translated by replacing the matching part with the second item.
@@ -98,20 +150,123 @@ static const char *(*path_map)[2] = default_path_map;
 static int path_map_length = (sizeof default_path_map) / (sizeof default_path_map[0]);
 static char *path_map_buffer = NULL;
 
+// Compiled form of path_map, which is what fix_path() actually uses (see below)
+struct path_map_table;
+static struct path_map_table *path_table = NULL;
+static int path_table_reloadable = 0; // Set if PATH_MAPPING_RELOAD is used, see path_table_replace()
+static int path_reverse_enabled = 0; // Set if PATH_MAPPING_REVERSE is used, see unmap_path()
+static int overlay_enabled = 0; // Set if PATH_MAPPING_OVERLAY is used, see overlay_prepare()
+static unsigned path_table_generation = 0; // Incremented whenever path_table changes, see path_cache_get()
+
+// Set if PATH_MAPPING_SECCOMP is used, in which case paths are only mapped by seccomp_handler() (see below).
+// Syscalls which pass SECCOMP_MAGIC as their sixth argument are not trapped.
+static int seccomp_active = 0;
+static __thread int seccomp_in_handler __attribute__((tls_model("initial-exec"))) = 0;
+#define SECCOMP_MAGIC 0x50415448 // "PATH"
+// See seccomp_syscalls and uring_map_sqe()
+#define SECCOMP_NOT_TRAPPED(function_name) (strncmp(function_name, "exec", 4) == 0 || strncmp(function_name, "posix_spawn", 11) == 0 \
+        || strncmp(function_name, "io_uring", 8) == 0)
+static void seccomp_init();
+static int path_table_exiting = 0;
+int path_mapping_load(const char *(*map)[2], int length);
+int path_mapping_load_index(const char *filename);
+static void path_table_replace(struct path_map_table *table, void *mapping, size_t mapping_size);
+static struct path_map_table *path_map_compile(const char *(*map)[2], int length);
+static int path_table_install(struct path_map_table *table, void *mapping, size_t mapping_size);
+static void path_mapping_print();
+int path_mapping_watch(const char *filename);
+
+// Looks up the original versions of all overridden functions (see below)
+static void resolve_original_functions();
+
+// Reads PATH_MAPPING_CACHE_TTL (see below)
+static void layer_cache_init();
+
+// Checks the whiteouts of PATH_MAPPING_OVERLAY in the first layer (see below)
+static int overlay_hidden(const char *upper, size_t upper_length, const char *rest, size_t rest_length);
+
+// Registers the fork handlers of the table of directory file descriptors, and takes over $PWD (see below)
+static void fd_paths_init();
+
+// Use or publish the compiled table in a memfd which is inherited by child processes (see below)
+static int shared_table_load(const char *mapping);
+static void shared_table_publish(const char *mapping, const struct path_map_table *table);
+
+// Remembers the variables which exec_env() passes on to new programs (see below)
+static void exec_env_init();
+
+// Prints the hit rate of the translation cache in the debug build (see below)
+static void path_cache_print_stats();
+
+// Allocates the counters for path-mapping-stat (see below)
+static void stats_init();
+static void stats_deinit();
+static void stats_rules_changed();
+static inline void stats_count_rule(int rule);
+
+// Creates the trace file if PATH_MAPPING_TRACE is set (see below)
+static void trace_init();
+static inline void trace_rule(int rule);
+
 
 //////////////////////////////////////////////////////////
 // Constructor to inspect the PATH_MAPPING env variable //
 //////////////////////////////////////////////////////////
 
 
-__attribute__((constructor))
+// Starts everything else once the table is loaded
+static void path_mapping_start()
+{
+    path_mapping_print();
+    if (path_mapping_table_only) return;
+    exec_env_init(); // After shared_table_publish(), so that PATH_MAPPING_TABLE is passed on
+    stats_init();
+    trace_init();
+    // If no rules apply to this program (see profile_select()), there are no virtual paths to keep track of
+    if (path_table == NULL && !path_table_reloadable) return;
+    fd_paths_init();
+    seccomp_init();
+}
+
+PATH_MAPPING_CONSTRUCTOR
 static void path_mapping_init()
 {
+    resolve_original_functions();
+    layer_cache_init();
+    const char *reverse = getenv("PATH_MAPPING_REVERSE");
+    path_reverse_enabled = reverse != NULL && strlen(reverse) > 0;
+#ifndef DISABLE_OVERLAY
+    const char *overlay = getenv("PATH_MAPPING_OVERLAY");
+    overlay_enabled = overlay != NULL && strlen(overlay) > 0;
+#endif
     if (path_map != default_path_map) return;
 
+    // A compiled index file takes precedence over PATH_MAPPING, and does not need any parsing
+    const char *index_file = getenv("PATH_MAPPING_FILE");
+    if (index_file != NULL && strlen(index_file) > 0) {
+        info_fprintf(stderr, "PATH_MAPPING_FILE: %s\n", index_file);
+        const char *reload = getenv("PATH_MAPPING_RELOAD");
+        if (reload != NULL && strlen(reload) > 0 && !path_mapping_table_only && path_mapping_watch(index_file) != 0) {
+            error_fprintf(stderr, "PATH_MAPPING_RELOAD: can not start watcher thread\n");
+        }
+        if (path_mapping_load_index(index_file) != 0) {
+            exit(255);
+        }
+        path_mapping_start();
+        return;
+    }
+
     // If environment variable is set and non-empty, override the default
     const char *env_string = getenv("PATH_MAPPING");
-    if (env_string != NULL && strlen(env_string) > 0) {
+    int has_env_string = env_string != NULL && strlen(env_string) > 0;
+
+    // A child of a process with the same PATH_MAPPING uses the compiled table of the parent (see shared_table_load())
+    if (has_env_string && shared_table_load(env_string) == 0) {
+        path_mapping_start();
+        return;
+    }
+
+    if (has_env_string) {
 
         // Allocate a buffer to store the entries of the map in one big block, separated by null bytes
         size_t buffersize = strlen(env_string) + 1;
@@ -154,80 +309,4710 @@ static void path_mapping_init()
         assert(linear_index == n_segments);
     }
 
-    for (int i = 0; i < path_map_length; i++) {
-        info_fprintf(stderr, "PATH_MAPPING[%d]: %s => %s\n", i, path_map[i][0], path_map[i][1]);
+    struct path_map_table *table = path_map_compile(path_map, path_map_length);
+    if (table != NULL && has_env_string && !path_mapping_table_only) shared_table_publish(env_string, table);
+    if (table == NULL || path_table_install(table, NULL, 0) != 0) {
+        error_fprintf(stderr, "PATH_MAPPING out of memory\n");
+        exit(255);
+    }
+    path_mapping_start();
+}
+
+__attribute__((destructor))
+static void path_mapping_deinit()
+{
+    if (path_map != default_path_map) {
+        free(path_map);
+    }
+    free(path_map_buffer);
+    if (path_table_reloadable) {
+        // Other threads may still use the table, so leave it to the kernel to clean up
+        __atomic_store_n(&path_table_exiting, 1, __ATOMIC_RELAXED);
+    } else {
+        path_table_replace(NULL, NULL, 0);
+    }
+    path_cache_print_stats();
+    stats_deinit();
+}
+
+
+/////////////////////////////////////////////////////////
+//   Helper functions to do the actual path mapping    //
+/////////////////////////////////////////////////////////
+
+
+#ifndef MAX_PATH
+#define MAX_PATH 4096
+#endif
+
+// Returns strlen(path) without trailing slashes
+size_t pathlen(const char *path)
+{
+    size_t path_length = strlen(path);
+    while (path_length > 0 && path[path_length - 1] == '/') {
+        // If the prefix ends with a slash ("/example/dir/"), ignore the slash.
+        // Otherwise it would not match the dir itself ("/examle/dir"), e.g. in opendir().
+        path_length -= 1;
+    }
+    return path_length;
+}
+
+// Returns true if the first path components of path match those of prefix (whole word matches only)
+int path_prefix_matches(const char *prefix, const char *path)
+{
+    size_t prefix_len = pathlen(prefix);
+    if (strncmp(prefix, path, prefix_len) == 0) {
+        // The prefix matches, but "/example/dir" would also match "/example/dirty/file"
+        // Thus we only return true if a slash or end-of-string follows the match.
+        char char_after_match = path[prefix_len];
+        return char_after_match == '/' || char_after_match == '\0';
+    }
+    return 0;
+}
+
+
+/////////////////////////////////////////////////////////
+//    Compiled prefix trie used to look up mappings    //
+/////////////////////////////////////////////////////////
+
+
+// The mappings are compiled into a trie with one node per path component, so that
+// looking up a path costs O(depth of the path) instead of O(number of mappings).
+//
+// The first level of the trie holds everything before the first slash, which is the
+// empty string for absolute paths. Every deeper level holds the text between two slashes.
+// The children of each node are stored next to each other, sorted by (length, bytes),
+// so that they can be searched with a binary search.
+//
+// The whole table is one contiguous block of memory which only uses offsets instead of
+// pointers, so that it can be freed with a single free().
+//
+// If several prefixes match a path, the longest one wins. If the same prefix
+// is given more than once, its destinations are layers (see layer_select()).
+// Prefixes with wildcards and exclusions are not part of the trie, but of a DFA (see below).
+//
+// A second trie with the same layout holds the destinations of all absolute prefixes,
+// which is used to map returned paths back to the prefix (see unmap_path()).
+//
+// Most paths do not match any mapping, so the table also contains two small bitmaps
+// which allow fix_path() to reject most of those paths without looking at the trie.
+// first_filter has one bit set for the hash of the first component of each prefix
+// which only has one component (e.g. "/opt"), and second_filter has one bit set for the
+// hash of the first two components of all longer prefixes (e.g. "/usr/share/program").
+// A path can only match if the bit for its own first or first two components is set.
+
+struct path_trie_node {
+    uint32_t name;          // Offset of the path component in the string pool
+    uint32_t name_length;
+    uint32_t first_child;   // Index of the first child in the node array
+    uint32_t n_children;
+    int32_t rule;           // Index of the mapping that ends here, or -1
+};
+
+#define RULE_PATTERN 1      // The prefix contains wildcards or is an exclusion, so it is matched by the DFA
+#define RULE_EXCLUDE 2      // The prefix starts with !, so paths which it matches are not mapped
+#define RULE_PROFILE 4      // The prefix starts with @, so it is the header of a section (see profile_select())
+
+struct path_map_rule {
+    uint32_t prefix;        // Offset of the prefix in the string pool
+    uint32_t prefix_length; // Length of the prefix without trailing slashes (of the pattern, see rule_pattern())
+    uint32_t dest;          // Offset of the destination in the string pool
+    uint32_t dest_length;
+    int32_t next_layer;     // Index of the next rule with the same prefix, or -1
+    uint32_t flags;         // RULE_* flags
+};
+
+#define FILTER_BITS 1024
+#define FILTER_WORDS (FILTER_BITS / 64)
+
+#define TABLE_MATCHES_ALL_ABSOLUTE 1    // A prefix has no components ("/"), so the filters can not be used
+#define TABLE_HAS_RELATIVE_PREFIXES 2   // A prefix does not start with a slash
+#define TABLE_HAS_PROFILES 4            // Some rules only apply to some processes (see profile_select())
+
+struct path_map_table {
+    uint32_t size;          // Size of the whole table in bytes
+    uint32_t flags;         // TABLE_* flags
+    uint32_t n_rules;
+    uint32_t n_nodes;
+    uint32_t n_reverse_nodes;
+    uint32_t rules_offset;
+    uint32_t nodes_offset;
+    uint32_t reverse_nodes_offset;
+    uint32_t strings_offset;
+    uint32_t n_dfa_states;  // 0 if there are no patterns
+    uint32_t n_dfa_classes;
+    uint32_t dfa_offset;    // Transitions of all states, the rule accepted in each state, and the class of each byte
+    uint64_t first_filter[FILTER_WORDS];
+    uint64_t second_filter[FILTER_WORDS];
+};
+
+#define TABLE_RULES(table) ((const struct path_map_rule *)((const char *)(table) + (table)->rules_offset))
+#define TABLE_NODES(table) ((const struct path_trie_node *)((const char *)(table) + (table)->nodes_offset))
+#define TABLE_REVERSE_NODES(table) ((const struct path_trie_node *)((const char *)(table) + (table)->reverse_nodes_offset))
+#define TABLE_STRINGS(table) ((const char *)(table) + (table)->strings_offset)
+#define TABLE_DFA_TRANSITIONS(table) ((const uint32_t *)((const char *)(table) + (table)->dfa_offset))
+#define TABLE_DFA_ACCEPT(table) ((const int32_t *)(TABLE_DFA_TRANSITIONS(table) + (table)->n_dfa_states * (table)->n_dfa_classes))
+#define TABLE_DFA_CLASSES(table) ((const unsigned char *)(TABLE_DFA_ACCEPT(table) + (table)->n_dfa_states))
+#define DFA_SIZE(n_states, n_classes) (((size_t)(n_states) * (n_classes) + (n_states)) * sizeof(uint32_t) + 256)
+
+// Rotate-xor hash, one byte at a time, so that the hash can be computed while scanning the path.
+// It is weak, but cheap, and the bits are mixed with one multiplication in filter_bit().
+#define FILTER_HASH_INIT 0x811C9DC5u
+static inline uint32_t filter_hash_step(uint32_t hash, char c)
+{
+    return ((hash << 5) | (hash >> 27)) ^ (unsigned char)c;
+}
+
+static inline uint32_t filter_bit(uint32_t hash)
+{
+    return (hash * 0x9E3779B1u) >> 22; // 10 bits for FILTER_BITS == 1024
+}
+
+static inline void filter_set(uint64_t *filter, uint32_t hash)
+{
+    uint32_t bit = filter_bit(hash);
+    filter[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static inline int filter_test(const uint64_t *filter, uint32_t hash)
+{
+    uint32_t bit = filter_bit(hash);
+    return (filter[bit / 64] >> (bit % 64)) & 1;
+}
+
+// Returns false if path can not match any prefix in table. If it returns true, the trie must be checked.
+static inline int table_may_match(const struct path_map_table *table, const char *path)
+{
+    if (path[0] != '/') return table->flags & TABLE_HAS_RELATIVE_PREFIXES;
+    if (table->flags & TABLE_MATCHES_ALL_ABSOLUTE) return 1;
+
+    uint32_t hash = FILTER_HASH_INIT;
+    const char *c = path + 1;
+    for (; *c != '/' && *c != '\0'; c++) hash = filter_hash_step(hash, *c);
+    if (filter_test(table->first_filter, hash)) return 1;
+    if (*c == '\0') return 0;
+
+    hash = filter_hash_step(hash, '/');
+    for (c++; *c != '/' && *c != '\0'; c++) hash = filter_hash_step(hash, *c);
+    return filter_test(table->second_filter, hash);
+}
+
+// Set the filter bits for one prefix (without trailing slashes)
+static void table_add_to_filter(struct path_map_table *table, const char *prefix, size_t prefix_length)
+{
+    if (prefix_length == 0 || prefix[0] != '/') {
+        table->flags |= prefix_length == 0 ? TABLE_MATCHES_ALL_ABSOLUTE : TABLE_HAS_RELATIVE_PREFIXES;
+        return;
+    }
+    uint32_t hash = FILTER_HASH_INIT;
+    size_t i = 1;
+    for (; i < prefix_length && prefix[i] != '/'; i++) hash = filter_hash_step(hash, prefix[i]);
+    if (i == prefix_length) {
+        filter_set(table->first_filter, hash);
+        return;
+    }
+    hash = filter_hash_step(hash, '/');
+    for (i++; i < prefix_length && prefix[i] != '/'; i++) hash = filter_hash_step(hash, prefix[i]);
+    filter_set(table->second_filter, hash);
+}
+
+// Set the filter bits for a pattern, using only the components before the first wildcard
+static void table_add_pattern_to_filter(struct path_map_table *table, const char *pattern, size_t pattern_length)
+{
+    if (pattern[0] != '/') {
+        table->flags |= TABLE_HAS_RELATIVE_PREFIXES;
+        return;
+    }
+    size_t literal_length = 0;
+    for (size_t i = 0; i < pattern_length && strchr("*?[\\", pattern[i]) == NULL; i++) {
+        if (pattern[i] == '/') literal_length = i;
+    }
+    table_add_to_filter(table, pattern, literal_length);
+}
+
+// Temporary tree used while compiling the table, before it is flattened
+struct trie_builder_node {
+    const char *name;
+    size_t name_length;
+    int source;     // Index of the rule whose prefix contains name
+    int rule;
+    int last_rule;  // Index of the last rule with this prefix, which gets the next layer
+    int n_children, capacity;
+    struct trie_builder_node **children;
+    uint32_t index; // Index in the flattened node array
+};
+
+static struct trie_builder_node *trie_builder_child(struct trie_builder_node *parent, const char *name, size_t name_length, int source)
+{
+    for (int i = 0; i < parent->n_children; i++) {
+        struct trie_builder_node *child = parent->children[i];
+        if (child->name_length == name_length && memcmp(child->name, name, name_length) == 0) {
+            return child;
+        }
+    }
+    if (parent->n_children == parent->capacity) {
+        int capacity = parent->capacity ? 2 * parent->capacity : 4;
+        struct trie_builder_node **children = realloc(parent->children, capacity * sizeof *children);
+        if (children == NULL) return NULL;
+        parent->children = children;
+        parent->capacity = capacity;
+    }
+    struct trie_builder_node *child = calloc(1, sizeof *child);
+    if (child == NULL) return NULL;
+    child->name = name;
+    child->name_length = name_length;
+    child->source = source;
+    child->rule = -1;
+    parent->children[parent->n_children++] = child;
+    return child;
+}
+
+static void trie_builder_free(struct trie_builder_node *node)
+{
+    for (int i = 0; i < node->n_children; i++) {
+        trie_builder_free(node->children[i]);
+    }
+    free(node->children);
+    free(node);
+}
+
+static int trie_builder_compare(const void *left, const void *right)
+{
+    const struct trie_builder_node *a = *(struct trie_builder_node * const *)left;
+    const struct trie_builder_node *b = *(struct trie_builder_node * const *)right;
+    if (a->name_length != b->name_length) return a->name_length < b->name_length ? -1 : 1;
+    return memcmp(a->name, b->name, a->name_length);
+}
+
+// Compare a path component against a trie node name using the same order as trie_builder_compare
+static inline int trie_name_compare(const char *name, uint32_t name_length, const char *component, size_t component_length)
+{
+    if (name_length != component_length) return name_length < component_length ? -1 : 1;
+    return memcmp(name, component, component_length);
+}
+
+static const struct path_trie_node *trie_find_child(const struct path_trie_node *nodes, const char *strings,
+        const struct path_trie_node *parent, const char *component, size_t component_length)
+{
+    uint32_t low = parent->first_child;
+    uint32_t high = parent->first_child + parent->n_children;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const struct path_trie_node *node = &nodes[middle];
+        int order = trie_name_compare(strings + node->name, node->name_length, component, component_length);
+        if (order == 0) return node;
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    return NULL;
+}
+
+// Returns the index of the rule with the longest path in nodes which matches path, or -1 if none matches.
+// nodes is either the trie of the prefixes or the trie of the destinations of table.
+static int trie_lookup(const struct path_map_table *table, const struct path_trie_node *nodes, const char *path)
+{
+    const char *strings = TABLE_STRINGS(table);
+    const struct path_trie_node *node = &nodes[0];
+    int rule = -1;
+
+    const char *component = path;
+    for (;;) {
+        const char *end = component;
+        while (*end != '/' && *end != '\0') end++;
+        node = trie_find_child(nodes, strings, node, component, end - component);
+        if (node == NULL) break;
+        if (node->rule >= 0) rule = node->rule;
+        if (*end == '\0' || node->n_children == 0) break;
+        component = end + 1;
+    }
+    return rule;
+}
+
+#ifndef DISABLE_DIRFD
+#define PATH_IS_MAPPED 1            // A prefix matches the path
+#define PATH_HAS_PREFIXES_BELOW 2   // A longer prefix starts with the path
+
+// Returns the PATH_* flags which describe how path relates to the prefixes in table.
+// Only the prefixes below a path can change the meaning of paths relative to it.
+static int trie_classify(const struct path_map_table *table, const char *path)
+{
+    const struct path_trie_node *nodes = TABLE_NODES(table);
+    const char *strings = TABLE_STRINGS(table);
+    const struct path_trie_node *node = &nodes[0];
+    const char *path_end = path + pathlen(path);
+    int flags = 0;
+
+    const char *component = path;
+    for (;;) {
+        const char *end = component;
+        while (*end != '/' && end < path_end) end++;
+        node = trie_find_child(nodes, strings, node, component, end - component);
+        if (node == NULL) return flags;
+        if (node->rule >= 0) flags |= PATH_IS_MAPPED;
+        if (end == path_end) return node->n_children > 0 ? flags | PATH_HAS_PREFIXES_BELOW : flags;
+        component = end + 1;
+    }
+}
+#endif // DISABLE_DIRFD
+
+/////////////////////////////////////////////////////////
+//    Wildcard patterns compiled into one DFA          //
+/////////////////////////////////////////////////////////
+
+
+// A prefix which contains *, ? or [ is a pattern instead of a literal prefix:
+//   *      matches any number of characters within one path component
+//   ?      matches one character except /
+//   [...]  matches one character of a set, e.g. [a-z0-9] or [!.] (anything except a dot)
+//   **     as a whole component, matches any number of whole components, also none
+//   \      makes the next character literal, e.g. \* or \[
+// Each wildcard captures what it matched, which is inserted for $1 to $9 in the destination,
+// e.g. /home/*/.cache/app => /scratch/$1/app, or /opt/app-*/share => /data/share-$1.
+// A trailing /** is ignored, because the rest of the path is appended to the destination anyway.
+//
+// A prefix which starts with ! is an exclusion, which may be literal or a pattern. Paths which
+// it matches are not mapped, and its destination is ignored (e.g. "!/home/admin:" in PATH_MAPPING).
+//
+// Patterns match whole components like literal prefixes, and the longest match wins. If a pattern
+// and a literal prefix match equally long parts of a path, the literal prefix wins, unless the pattern
+// is an exclusion. Among patterns of the same length, exclusions win, and then the first one.
+// Patterns can not have layers, are not mapped back by PATH_MAPPING_REVERSE, and do not add
+// entries to directory listings.
+//
+// All patterns and exclusions are compiled into one deterministic automaton over the bytes of the
+// path, which is stored in the table after the tries. The bytes are first translated into classes
+// of bytes which no pattern distinguishes, so that each state only needs one transition per class.
+// Each state also stores the best rule which matches if a / or the end of the path follows.
+// So looking up a path is a single pass over its bytes, no matter how many patterns there are,
+// which ends as soon as no pattern can match anymore. The automaton only finds the rule, so the
+// captures are extracted afterwards by matching that one pattern (see pattern_match()).
+//
+// Compiling the automaton takes time exponential in the number of wildcards in the worst case,
+// so it gives up after DFA_MAX_STATES states.
+
+#define DFA_DEAD 0                  // No pattern can match anymore
+#define DFA_START 1
+#define DFA_MAX_STATES 65536
+#define PATTERN_MAX_CAPTURES 9      // $1 to $9
+
+// Tokens of a pattern
+#define PATTERN_LITERAL 0           // One byte
+#define PATTERN_ANY 1               // One byte of a set (? or [...])
+#define PATTERN_STAR 2              // Any number of bytes except / (*)
+#define PATTERN_GLOBSTAR 3          // Any number of whole components (**), including the / after them
+
+struct pattern_token {
+    int kind;
+    unsigned char byte;             // For PATTERN_LITERAL
+    uint64_t set[4];                // For PATTERN_ANY
+};
+
+struct pattern_capture {
+    const char *start;
+    size_t length;
+};
+
+static inline int byte_set_contains(const uint64_t *set, unsigned char c)
+{
+    return (set[c / 64] >> (c % 64)) & 1;
+}
+
+static inline void byte_set_add(uint64_t *set, unsigned char c)
+{
+    set[c / 64] |= (uint64_t)1 << (c % 64);
+}
+
+// Returns the flags of a rule with the given prefix
+static uint32_t rule_flags(const char *prefix)
+{
+    if (prefix[0] == '@') return RULE_PROFILE;
+    if (prefix[0] == '!') return RULE_PATTERN | RULE_EXCLUDE;
+    return strpbrk(prefix, "*?[") != NULL ? RULE_PATTERN : 0;
+}
+
+// Returns the pattern of a rule with RULE_PATTERN, without the ! of an exclusion,
+// and its length without trailing slashes and without a trailing /**
+static const char *rule_pattern(const char *prefix, size_t *length)
+{
+    if (prefix[0] == '!') prefix++;
+    size_t n = pathlen(prefix);
+    for (;;) {
+        if (n == 2 && memcmp(prefix, "**", 2) == 0) n = 0;
+        else if (n >= 3 && memcmp(prefix + n - 3, "/**", 3) == 0) n -= 3;
+        else break;
+        while (n > 0 && prefix[n - 1] == '/') n--;
+    }
+    *length = n;
+    return prefix;
+}
+
+// Reads the token at p, where component_start is true if p is at the start of a path component.
+// Returns the position after the token.
+static const char *pattern_token(const char *p, const char *p_end, int component_start, struct pattern_token *token)
+{
+    if (component_start && p_end - p >= 2 && p[0] == '*' && p[1] == '*' && (p_end - p == 2 || p[2] == '/')) {
+        token->kind = PATTERN_GLOBSTAR;
+        return p_end - p == 2 ? p_end : p + 3;
+    }
+    if (*p == '*') {
+        token->kind = PATTERN_STAR;
+        return p + 1;
+    }
+    if (*p == '?' || *p == '[') {
+        token->kind = PATTERN_ANY;
+        memset(token->set, 0, sizeof token->set);
+        if (*p == '?') {
+            memset(token->set, 0xff, sizeof token->set);
+        } else {
+            // [...] with ranges, negated by [!...] or [^...]. A ] directly after [ or [! is literal.
+            const char *c = p + 1;
+            int negate = c < p_end && (*c == '!' || *c == '^');
+            if (negate) c++;
+            for (const char *first = c; c < p_end && (*c != ']' || c == first); ) {
+                unsigned char low = *c == '\\' && c + 1 < p_end ? *++c : *c;
+                unsigned char high = low;
+                if (c + 2 < p_end && c[1] == '-' && c[2] != ']') {
+                    c += 2;
+                    high = *c == '\\' && c + 1 < p_end ? *++c : *c;
+                }
+                for (unsigned b = low; b <= high; b++) byte_set_add(token->set, b);
+                c++;
+            }
+            if (c == p_end) {
+                // No closing ], so the [ is literal
+                token->kind = PATTERN_LITERAL;
+                token->byte = '[';
+                return p + 1;
+            }
+            if (negate) {
+                for (int i = 0; i < 4; i++) token->set[i] = ~token->set[i];
+            }
+            p = c;
+        }
+        token->set[0] &= ~(((uint64_t)1 << '/') | 1); // Never / or the end of the string
+        return p + 1;
+    }
+    token->kind = PATTERN_LITERAL;
+    if (*p == '\\' && p + 1 < p_end) p++;
+    token->byte = *p;
+    return p + 1;
+}
+
+static inline void pattern_capture(struct pattern_capture *captures, int n, const char *start, size_t length)
+{
+    if (n < PATTERN_MAX_CAPTURES) {
+        captures[n].start = start;
+        captures[n].length = length;
+    }
+}
+
+// Returns true if the pattern [p, p_end) matches all of [s, s_end), and stores what the wildcards matched,
+// starting with captures[n]. If there are several ways to match, the earlier wildcards match as much as possible.
+static int pattern_match(const char *p, const char *p_end, const char *s, const char *s_end, int component_start,
+        struct pattern_capture *captures, int n)
+{
+    while (p < p_end) {
+        struct pattern_token token;
+        const char *next = pattern_token(p, p_end, component_start, &token);
+        switch (token.kind) {
+            case PATTERN_LITERAL:
+                if (s == s_end || *s != (char)token.byte) return 0;
+                component_start = token.byte == '/';
+                s++;
+                break;
+            case PATTERN_ANY:
+                if (s == s_end || !byte_set_contains(token.set, *s)) return 0;
+                pattern_capture(captures, n++, s, 1);
+                component_start = 0;
+                s++;
+                break;
+            case PATTERN_STAR: {
+                const char *end = s;
+                while (end < s_end && *end != '/') end++;
+                for (;; end--) {
+                    pattern_capture(captures, n, s, end - s);
+                    if (pattern_match(next, p_end, end, s_end, 0, captures, n + 1)) return 1;
+                    if (end == s) return 0;
+                }
+            }
+            case PATTERN_GLOBSTAR:
+                // The components up to each following slash, longest first, and then none
+                for (const char *end = s_end; end-- > s; ) {
+                    if (*end != '/') continue;
+                    pattern_capture(captures, n, s, end - s);
+                    if (pattern_match(next, p_end, end + 1, s_end, 1, captures, n + 1)) return 1;
+                }
+                pattern_capture(captures, n, s, 0);
+                return pattern_match(next, p_end, s, s_end, 1, captures, n + 1);
+        }
+        p = next;
+    }
+    return s == s_end;
+}
+
+// Returns the rule of the longest pattern in table which matches path, or -1 if none does.
+// *match_length receives the length of the part of path which the pattern matched.
+static int dfa_lookup(const struct path_map_table *table, const char *path, size_t *match_length)
+{
+    const uint32_t *transitions = TABLE_DFA_TRANSITIONS(table);
+    const int32_t *accept = TABLE_DFA_ACCEPT(table);
+    const unsigned char *classes = TABLE_DFA_CLASSES(table);
+    uint32_t n_classes = table->n_dfa_classes;
+    uint32_t state = DFA_START;
+    int rule = -1;
+
+    for (const char *c = path; ; c++) {
+        if (*c == '/' || *c == '\0') {
+            if (accept[state] >= 0) {
+                rule = accept[state];
+                *match_length = c - path;
+            }
+            if (*c == '\0') break;
+        }
+        state = transitions[state * n_classes + classes[(unsigned char)*c]];
+        if (state == DFA_DEAD) break;
+    }
+    return rule;
+}
+
+#ifndef DISABLE_DIRFD
+// Same as trie_classify() for the patterns in table
+static int dfa_classify(const struct path_map_table *table, const char *path)
+{
+    const uint32_t *transitions = TABLE_DFA_TRANSITIONS(table);
+    const int32_t *accept = TABLE_DFA_ACCEPT(table);
+    const unsigned char *classes = TABLE_DFA_CLASSES(table);
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    const char *path_end = path + pathlen(path);
+    uint32_t state = DFA_START;
+    int flags = 0;
+
+    for (const char *c = path; ; c++) {
+        if (c == path_end || *c == '/') {
+            if (accept[state] >= 0 && !(rules[accept[state]].flags & RULE_EXCLUDE)) flags |= PATH_IS_MAPPED;
+        }
+        // A pattern can still match a path below, if the automaton survives the next slash
+        state = transitions[state * table->n_dfa_classes + classes[c == path_end ? '/' : (unsigned char)*c]];
+        if (state == DFA_DEAD) return flags;
+        if (c == path_end) return flags | PATH_HAS_PREFIXES_BELOW;
+    }
+}
+#endif // DISABLE_DIRFD
+
+// Writes the destination of a pattern rule for path into new_path, with $1 to $9 replaced by the captures,
+// followed by the rest of path after the match. Returns false if the result does not fit.
+static int pattern_expand(const struct path_map_table *table, const struct path_map_rule *rule, const char *path,
+        size_t path_length, char *new_path, size_t new_path_size)
+{
+    const char *strings = TABLE_STRINGS(table);
+    size_t pattern_length;
+    const char *pattern = rule_pattern(strings + rule->prefix, &pattern_length);
+    struct pattern_capture captures[PATTERN_MAX_CAPTURES];
+    for (int i = 0; i < PATTERN_MAX_CAPTURES; i++) {
+        captures[i].start = "";
+        captures[i].length = 0;
+    }
+
+    // The rule was chosen for the longest match of the automaton, which is cheaper to find again
+    // than trying the pattern at every slash
+    size_t match_length = 0;
+    dfa_lookup(table, path, &match_length);
+    if (!pattern_match(pattern, pattern + pattern_length, path, path + match_length, 1, captures, 0)) return 0;
+
+    size_t length = 0;
+    const char *dest = strings + rule->dest;
+    for (const char *c = dest; c < dest + rule->dest_length; c++) {
+        const char *part = c;
+        size_t part_length = 1;
+        if (c[0] == '$' && c[1] >= '1' && c[1] <= '9') {
+            part = captures[c[1] - '1'].start;
+            part_length = captures[c[1] - '1'].length;
+            c++;
+        }
+        if (length + part_length >= new_path_size) return 0;
+        memcpy(new_path + length, part, part_length);
+        length += part_length;
+    }
+    size_t rest_length = path_length - match_length;
+    if (length + rest_length >= new_path_size) return 0;
+    memcpy(new_path + length, path + match_length, rest_length + 1);
+    return 1;
+}
+
+// Nondeterministic automaton of all patterns, which is only used while compiling the DFA.
+// The states of each pattern are consecutive, so most transitions lead to the next state.
+#define NFA_BYTE 0                  // Consumes one byte of set, and continues with the next state
+#define NFA_STAR 1                  // Consumes bytes of set, or continues with the next state without consuming
+#define NFA_GLOBSTAR 2              // At the start of a component: leads into NFA_GLOBSTAR_BODY, or skips it
+#define NFA_GLOBSTAR_BODY 3         // Within a component matched by **: a / leads back to NFA_GLOBSTAR
+#define NFA_ACCEPT 4                // The whole pattern matched
+
+struct nfa_state {
+    int kind;
+    int rule;                       // For NFA_ACCEPT
+    int excludes;                   // For NFA_ACCEPT, if the rule has RULE_EXCLUDE
+    uint64_t set[4];
+};
+
+// The DFA while it is built, before it is copied into the table
+struct dfa_builder {
+    struct nfa_state *nfa;
+    uint32_t n_nfa;
+    uint32_t n_classes;
+    unsigned char classes[256];
+    uint32_t n_states, capacity;
+    uint32_t *transitions;          // n_classes per state
+    int32_t *accept;
+    uint32_t *member_offsets;       // NFA states of each DFA state in members, sorted
+    uint32_t *members;
+    size_t n_members, members_capacity;
+    uint32_t *hash_table;           // Index of each DFA state + 1, or 0 if the slot is empty
+    uint32_t hash_size;
+    uint32_t *marks;                // Used to avoid duplicates while collecting NFA states
+    uint32_t mark;
+};
+
+static void dfa_builder_free(struct dfa_builder *dfa)
+{
+    free(dfa->nfa);
+    free(dfa->transitions);
+    free(dfa->accept);
+    free(dfa->member_offsets);
+    free(dfa->members);
+    free(dfa->hash_table);
+    free(dfa->marks);
+}
+
+// Splits the classes of bytes, so that no class contains bytes which are in set and bytes which are not
+static void dfa_refine_classes(struct dfa_builder *dfa, const uint64_t *set)
+{
+    int new_class[2 * 256];
+    memset(new_class, -1, sizeof new_class);
+    uint32_t n_classes = 0;
+    for (int b = 0; b < 256; b++) {
+        int key = 2 * dfa->classes[b] + byte_set_contains(set, b);
+        if (new_class[key] < 0) new_class[key] = n_classes++;
+        dfa->classes[b] = new_class[key];
+    }
+    dfa->n_classes = n_classes;
+}
+
+// Creates the NFA of all rules with RULE_PATTERN, and the classes of bytes. Returns false if out of memory.
+static int nfa_build(struct dfa_builder *dfa, const char *(*map)[2], int length)
+{
+    size_t capacity = 0;
+    for (int i = 0; i < length; i++) {
+        // Each byte of the pattern creates at most 2 states, plus one NFA_ACCEPT
+        if (rule_flags(map[i][0]) & RULE_PATTERN) capacity += 2 * strlen(map[i][0]) + 1;
+    }
+    dfa->nfa = calloc(capacity + 1, sizeof *dfa->nfa);
+    if (dfa->nfa == NULL) return 0;
+
+    uint64_t slash[4] = { 0 }, end[4] = { 0 };
+    byte_set_add(slash, '/');
+    byte_set_add(end, '\0');
+    dfa_refine_classes(dfa, slash);
+    dfa_refine_classes(dfa, end);
+
+    for (int i = 0; i < length; i++) {
+        if (!(rule_flags(map[i][0]) & RULE_PATTERN)) continue;
+        size_t pattern_length;
+        const char *pattern = rule_pattern(map[i][0], &pattern_length);
+        const char *p = pattern, *p_end = pattern + pattern_length;
+        int component_start = 1;
+        while (p < p_end) {
+            struct pattern_token token;
+            p = pattern_token(p, p_end, component_start, &token);
+            struct nfa_state *state = &dfa->nfa[dfa->n_nfa++];
+            component_start = 0;
+            switch (token.kind) {
+                case PATTERN_LITERAL:
+                    state->kind = NFA_BYTE;
+                    byte_set_add(state->set, token.byte);
+                    component_start = token.byte == '/';
+                    break;
+                case PATTERN_ANY:
+                    state->kind = NFA_BYTE;
+                    memcpy(state->set, token.set, sizeof state->set);
+                    break;
+                case PATTERN_STAR:
+                    state->kind = NFA_STAR;
+                    memset(state->set, 0xff, sizeof state->set);
+                    state->set[0] &= ~(((uint64_t)1 << '/') | 1);
+                    break;
+                case PATTERN_GLOBSTAR:
+                    state->kind = NFA_GLOBSTAR;
+                    dfa->nfa[dfa->n_nfa++].kind = NFA_GLOBSTAR_BODY;
+                    component_start = 1;
+                    break;
+            }
+            if (state->kind != NFA_GLOBSTAR) dfa_refine_classes(dfa, state->set);
+        }
+        dfa->nfa[dfa->n_nfa].kind = NFA_ACCEPT;
+        dfa->nfa[dfa->n_nfa].rule = i;
+        dfa->nfa[dfa->n_nfa].excludes = map[i][0][0] == '!';
+        dfa->n_nfa++;
+    }
+    dfa->marks = calloc(dfa->n_nfa + 1, sizeof *dfa->marks);
+    return dfa->marks != NULL;
+}
+
+// Adds NFA state i and the states which it leads to without consuming a byte to the members of the new DFA state
+static int nfa_add(struct dfa_builder *dfa, uint32_t i)
+{
+    for (;;) {
+        if (dfa->marks[i] == dfa->mark) return 1;
+        dfa->marks[i] = dfa->mark;
+        if (dfa->n_members == dfa->members_capacity) {
+            size_t capacity = dfa->members_capacity ? 2 * dfa->members_capacity : 1024;
+            uint32_t *members = realloc(dfa->members, capacity * sizeof *members);
+            if (members == NULL) return 0;
+            dfa->members = members;
+            dfa->members_capacity = capacity;
+        }
+        dfa->members[dfa->n_members++] = i;
+        if (dfa->nfa[i].kind == NFA_STAR) i += 1;
+        else if (dfa->nfa[i].kind == NFA_GLOBSTAR) i += 2;
+        else return 1;
+    }
+}
+
+static int compare_uint32(const void *left, const void *right)
+{
+    uint32_t a = *(const uint32_t *)left, b = *(const uint32_t *)right;
+    return a < b ? -1 : a > b;
+}
+
+static uint32_t dfa_hash(const uint32_t *members, size_t n_members)
+{
+    uint32_t hash = FILTER_HASH_INIT;
+    for (size_t i = 0; i < n_members; i++) hash = (hash ^ members[i]) * 0x01000193u;
+    return hash;
+}
+
+// Turns the NFA states collected since start into a DFA state. Returns its index,
+// which is an existing state if one has the same NFA states, or -1 on failure.
+static int64_t dfa_add_state(struct dfa_builder *dfa, size_t start)
+{
+    uint32_t *members = dfa->members + start;
+    size_t n_members = dfa->n_members - start;
+    if (n_members > 1) qsort(members, n_members, sizeof *members, compare_uint32);
+    uint32_t hash = dfa_hash(members, n_members);
+    uint32_t slot = hash & (dfa->hash_size - 1);
+    for (; dfa->hash_table[slot] != 0; slot = (slot + 1) & (dfa->hash_size - 1)) {
+        uint32_t state = dfa->hash_table[slot] - 1;
+        size_t state_members = dfa->member_offsets[state + 1] - dfa->member_offsets[state];
+        if (state_members == n_members
+                && memcmp(dfa->members + dfa->member_offsets[state], members, n_members * sizeof *members) == 0) {
+            dfa->n_members = start;
+            return state;
+        }
+    }
+
+    if (dfa->n_states == DFA_MAX_STATES) {
+        error_fprintf(stderr, "PATH_MAPPING: the patterns need more than %d states\n", DFA_MAX_STATES);
+        return -1;
+    }
+    if (dfa->n_states == dfa->capacity) {
+        uint32_t capacity = 2 * dfa->capacity;
+        uint32_t *transitions = realloc(dfa->transitions, (size_t)capacity * dfa->n_classes * sizeof *transitions);
+        if (transitions != NULL) dfa->transitions = transitions;
+        int32_t *accept = realloc(dfa->accept, capacity * sizeof *accept);
+        if (accept != NULL) dfa->accept = accept;
+        uint32_t *member_offsets = realloc(dfa->member_offsets, (capacity + 1) * sizeof *member_offsets);
+        if (member_offsets != NULL) dfa->member_offsets = member_offsets;
+        if (transitions == NULL || accept == NULL || member_offsets == NULL) return -1;
+        dfa->capacity = capacity;
+    }
+    if (2 * (dfa->n_states + 1) > dfa->hash_size) {
+        // Rehash into a table of twice the size
+        uint32_t hash_size = 2 * dfa->hash_size;
+        uint32_t *hash_table = calloc(hash_size, sizeof *hash_table);
+        if (hash_table == NULL) return -1;
+        for (uint32_t state = 0; state < dfa->n_states; state++) {
+            uint32_t offset = dfa->member_offsets[state];
+            uint32_t h = dfa_hash(dfa->members + offset, dfa->member_offsets[state + 1] - offset) & (hash_size - 1);
+            while (hash_table[h] != 0) h = (h + 1) & (hash_size - 1);
+            hash_table[h] = state + 1;
+        }
+        free(dfa->hash_table);
+        dfa->hash_table = hash_table;
+        dfa->hash_size = hash_size;
+        slot = hash & (hash_size - 1);
+        while (hash_table[slot] != 0) slot = (slot + 1) & (hash_size - 1);
+    }
+
+    uint32_t state = dfa->n_states++;
+    dfa->hash_table[slot] = state + 1;
+    dfa->member_offsets[state] = start;
+    dfa->member_offsets[state + 1] = dfa->n_members;
+    // The best rule which matches in this state: exclusions first, then the first rule
+    int32_t best = -1;
+    int best_excludes = 0;
+    for (size_t i = 0; i < n_members; i++) {
+        const struct nfa_state *nfa_state = &dfa->nfa[members[i]];
+        if (nfa_state->kind != NFA_ACCEPT) continue;
+        if (best < 0 || nfa_state->excludes > best_excludes || (nfa_state->excludes == best_excludes && nfa_state->rule < best)) {
+            best = nfa_state->rule;
+            best_excludes = nfa_state->excludes;
+        }
+    }
+    dfa->accept[state] = best;
+    return state;
+}
+
+// Builds the DFA of all rules in map with RULE_PATTERN by the subset construction.
+// Returns false if out of memory or if there are too many states.
+static int dfa_build(struct dfa_builder *dfa, const char *(*map)[2], int length)
+{
+    memset(dfa, 0, sizeof *dfa);
+    if (!nfa_build(dfa, map, length)) return 0;
+    if (dfa->n_nfa == 0) return 1;
+    dfa->capacity = 64;
+    dfa->hash_size = 256;
+    dfa->transitions = malloc((size_t)dfa->capacity * dfa->n_classes * sizeof *dfa->transitions);
+    dfa->accept = malloc(dfa->capacity * sizeof *dfa->accept);
+    dfa->member_offsets = malloc((dfa->capacity + 1) * sizeof *dfa->member_offsets);
+    dfa->hash_table = calloc(dfa->hash_size, sizeof *dfa->hash_table);
+    if (dfa->transitions == NULL || dfa->accept == NULL || dfa->member_offsets == NULL || dfa->hash_table == NULL) return 0;
+
+    // The dead state has no NFA states, and the start state the first state of each pattern
+    dfa->mark++;
+    if (dfa_add_state(dfa, 0) != DFA_DEAD) return 0;
+    dfa->mark++;
+    size_t start = dfa->n_members;
+    for (uint32_t i = 0; i < dfa->n_nfa; i++) {
+        if ((i == 0 || dfa->nfa[i - 1].kind == NFA_ACCEPT) && !nfa_add(dfa, i)) return 0;
+    }
+    if (dfa_add_state(dfa, start) != DFA_START) return 0;
+
+    // One byte of each class, which stands for all others
+    unsigned char representative[256];
+    for (int b = 255; b >= 0; b--) representative[dfa->classes[b]] = b;
+
+    for (uint32_t state = 0; state < dfa->n_states; state++) {
+        for (uint32_t class = 0; class < dfa->n_classes; class++) {
+            unsigned char c = representative[class];
+            size_t start = dfa->n_members;
+            dfa->mark++;
+            // members may be reallocated by nfa_add(), so it is indexed each time
+            for (uint32_t m = dfa->member_offsets[state]; m < dfa->member_offsets[state + 1]; m++) {
+                uint32_t i = dfa->members[m];
+                const struct nfa_state *nfa_state = &dfa->nfa[i];
+                int ok = 1;
+                switch (nfa_state->kind) {
+                    case NFA_BYTE: if (byte_set_contains(nfa_state->set, c)) ok = nfa_add(dfa, i + 1); break;
+                    case NFA_STAR: if (byte_set_contains(nfa_state->set, c)) ok = nfa_add(dfa, i); break;
+                    case NFA_GLOBSTAR: if (c != '/' && c != '\0') ok = nfa_add(dfa, i + 1); break;
+                    case NFA_GLOBSTAR_BODY: if (c != '\0') ok = nfa_add(dfa, c == '/' ? i - 1 : i); break;
+                }
+                if (!ok) return 0;
+            }
+            int64_t next = dfa_add_state(dfa, start);
+            if (next < 0) return 0;
+            dfa->transitions[(size_t)state * dfa->n_classes + class] = next;
+        }
+    }
+    return 1;
+}
+
+// Copies the DFA into table at table->dfa_offset
+static void dfa_store(struct path_map_table *table, const struct dfa_builder *dfa)
+{
+    table->n_dfa_states = dfa->n_states;
+    table->n_dfa_classes = dfa->n_classes;
+    if (dfa->n_states == 0) return;
+    memcpy((uint32_t *)TABLE_DFA_TRANSITIONS(table), dfa->transitions,
+            (size_t)dfa->n_states * dfa->n_classes * sizeof *dfa->transitions);
+    memcpy((int32_t *)TABLE_DFA_ACCEPT(table), dfa->accept, dfa->n_states * sizeof *dfa->accept);
+    memcpy((unsigned char *)TABLE_DFA_CLASSES(table), dfa->classes, sizeof dfa->classes);
+}
+
+/////////////////////////////////////////////////////////
+//       Compiling the mappings into a table           //
+/////////////////////////////////////////////////////////
+
+
+// Insert the literal prefixes (key 0) or the absolute destinations of absolute prefixes (key 1) into a temporary tree.
+// For prefixes, next_layer receives the chain of rules with the same prefix. For destinations,
+// the first rule wins if several rules have the same destination. Returns false if out of memory.
+static int trie_builder_insert(struct trie_builder_node *root, const char *(*map)[2], int length, int key, int *next_layer)
+{
+    for (int i = 0; i < length; i++) {
+        const char *path = map[i][key];
+        if (next_layer != NULL) next_layer[i] = -1;
+        if (rule_flags(map[i][0]) & (RULE_PATTERN | RULE_PROFILE)) continue;
+        if (key == 1 && (path[0] != '/' || map[i][0][0] != '/')) continue;
+        size_t path_length = pathlen(path);
+        struct trie_builder_node *node = root;
+        const char *component = path;
+        const char *path_end = path + path_length;
+        for (;;) {
+            const char *end = component;
+            while (end < path_end && *end != '/') end++;
+            node = trie_builder_child(node, component, end - component, i);
+            if (node == NULL) return 0;
+            if (end == path_end) break;
+            component = end + 1;
+        }
+        if (next_layer != NULL) {
+            if (node->rule >= 0) next_layer[node->last_rule] = i;
+            node->last_rule = i;
+        }
+        if (node->rule < 0) node->rule = i;
+    }
+    return 1;
+}
+
+// Flatten the tree breadth first, so that the children of each node are adjacent.
+// Returns the nodes in their final order, allocated with malloc(), or NULL if out of memory.
+static struct trie_builder_node **trie_builder_flatten(struct trie_builder_node *root, int *n_nodes)
+{
+    int queue_length = 1, queue_capacity = 16;
+    struct trie_builder_node **queue = malloc(queue_capacity * sizeof *queue);
+    if (queue == NULL) return NULL;
+    queue[0] = root;
+    for (int i = 0; i < queue_length; i++) {
+        struct trie_builder_node *node = queue[i];
+        node->index = i;
+        if (node->n_children > 1) qsort(node->children, node->n_children, sizeof *node->children, trie_builder_compare);
+        if (queue_length + node->n_children > queue_capacity) {
+            queue_capacity = 2 * (queue_length + node->n_children);
+            struct trie_builder_node **new_queue = realloc(queue, queue_capacity * sizeof *queue);
+            if (new_queue == NULL) {
+                free(queue);
+                return NULL;
+            }
+            queue = new_queue;
+        }
+        for (int c = 0; c < node->n_children; c++) {
+            queue[queue_length++] = node->children[c];
+        }
+    }
+    *n_nodes = queue_length;
+    return queue;
+}
+
+// Copy the flattened tree of prefixes (key 0) or destinations (key 1) into nodes
+static void trie_builder_store(struct path_trie_node *nodes, struct trie_builder_node **queue, int n_nodes,
+        const struct path_map_rule *rules, const char *(*map)[2], int key)
+{
+    for (int i = 0; i < n_nodes; i++) {
+        struct trie_builder_node *node = queue[i];
+        nodes[i].rule = node->rule;
+        nodes[i].n_children = node->n_children;
+        nodes[i].first_child = node->n_children ? node->children[0]->index : 0;
+        nodes[i].name_length = node->name_length;
+        if (i > 0) {
+            // Node names point into the copy of the prefix or destination which created the node
+            uint32_t source = key == 0 ? rules[node->source].prefix : rules[node->source].dest;
+            nodes[i].name = source + (node->name - map[node->source][key]);
+        }
+    }
+}
+
+// Compile map into a path_map_table. Returns NULL if out of memory.
+static struct path_map_table *path_map_compile(const char *(*map)[2], int length)
+{
+    struct path_map_table *table = NULL;
+    struct trie_builder_node **queue = NULL, **reverse_queue = NULL;
+    struct dfa_builder dfa;
+    struct trie_builder_node *root = calloc(1, sizeof *root);
+    struct trie_builder_node *reverse_root = calloc(1, sizeof *reverse_root);
+    int *next_layer = malloc((length + 1) * sizeof *next_layer);
+    int dfa_ok = dfa_build(&dfa, map, length);
+    if (root == NULL || reverse_root == NULL || next_layer == NULL || !dfa_ok) goto cleanup;
+    root->rule = -1;
+    reverse_root->rule = -1;
+
+    if (!trie_builder_insert(root, map, length, 0, next_layer)) goto cleanup;
+    if (!trie_builder_insert(reverse_root, map, length, 1, NULL)) goto cleanup;
+    int n_nodes, n_reverse_nodes;
+    if ((queue = trie_builder_flatten(root, &n_nodes)) == NULL) goto cleanup;
+    if ((reverse_queue = trie_builder_flatten(reverse_root, &n_reverse_nodes)) == NULL) goto cleanup;
+
+    size_t strings_size = 0;
+    for (int i = 0; i < length; i++) {
+        strings_size += strlen(map[i][0]) + 1 + strlen(map[i][1]) + 1;
+    }
+    size_t rules_offset = sizeof *table;
+    size_t nodes_offset = rules_offset + length * sizeof(struct path_map_rule);
+    size_t reverse_nodes_offset = nodes_offset + n_nodes * sizeof(struct path_trie_node);
+    size_t dfa_offset = reverse_nodes_offset + n_reverse_nodes * sizeof(struct path_trie_node);
+    size_t strings_offset = dfa_offset + (dfa.n_states > 0 ? DFA_SIZE(dfa.n_states, dfa.n_classes) : 0);
+    size_t size = strings_offset + strings_size;
+    if (size > UINT32_MAX || (table = calloc(1, size)) == NULL) goto cleanup;
+    table->size = size;
+    table->n_rules = length;
+    table->n_nodes = n_nodes;
+    table->n_reverse_nodes = n_reverse_nodes;
+    table->rules_offset = rules_offset;
+    table->nodes_offset = nodes_offset;
+    table->reverse_nodes_offset = reverse_nodes_offset;
+    table->strings_offset = strings_offset;
+    table->dfa_offset = dfa_offset;
+    dfa_store(table, &dfa);
+
+    // Copy all strings into the pool and remember where each prefix ended up
+    struct path_map_rule *rules = (struct path_map_rule *)TABLE_RULES(table);
+    char *strings = (char *)TABLE_STRINGS(table);
+    size_t position = 0;
+    for (int i = 0; i < length; i++) {
+        size_t prefix_size = strlen(map[i][0]) + 1, dest_size = strlen(map[i][1]) + 1;
+        rules[i].prefix = position;
+        rules[i].prefix_length = pathlen(map[i][0]);
+        rules[i].flags = rule_flags(map[i][0]);
+        memcpy(strings + position, map[i][0], prefix_size);
+        position += prefix_size;
+        rules[i].dest = position;
+        rules[i].dest_length = dest_size - 1;
+        rules[i].next_layer = next_layer[i];
+        memcpy(strings + position, map[i][1], dest_size);
+        position += dest_size;
+        if (rules[i].flags & RULE_PATTERN) {
+            size_t pattern_length;
+            const char *pattern = rule_pattern(map[i][0], &pattern_length);
+            rules[i].prefix_length = pattern_length;
+            // Exclusions never map anything, so they need no filter bits
+            if (!(rules[i].flags & RULE_EXCLUDE)) table_add_pattern_to_filter(table, pattern, pattern_length);
+        } else if (rules[i].flags & RULE_PROFILE) {
+            table->flags |= TABLE_HAS_PROFILES;
+        } else {
+            table_add_to_filter(table, map[i][0], rules[i].prefix_length);
+        }
+    }
+
+    trie_builder_store((struct path_trie_node *)TABLE_NODES(table), queue, n_nodes, rules, map, 0);
+    trie_builder_store((struct path_trie_node *)TABLE_REVERSE_NODES(table), reverse_queue, n_reverse_nodes, rules, map, 1);
+
+cleanup:
+    free(queue);
+    free(reverse_queue);
+    free(next_layer);
+    dfa_builder_free(&dfa);
+    if (root != NULL) trie_builder_free(root);
+    if (reverse_root != NULL) trie_builder_free(reverse_root);
+    return table;
+}
+
+/////////////////////////////////////////////////////////
+//      Profiles: rules for some programs only         //
+/////////////////////////////////////////////////////////
+
+
+// One PATH_MAPPING is often set for a whole tree of processes, although each program in it (the shell,
+// the compiler, the linker) only needs a few of the rules. So the rules can be divided into sections,
+// which start with one or more headers. A header is a rule whose prefix starts with @, and whose
+// destination is ignored. The rules of a section only apply if the process matches any of its headers:
+//   @exe=NAME       the executable (the target of /proc/self/exe), where NAME is a pattern like python3*
+//                   which is matched against the whole path if it contains a slash, and otherwise the basename
+//   @uid=N          the real user id
+//   @cgroup=PATH    the cgroup (v2) of the process is PATH or below it
+//   @               all processes, which ends the previous section
+// Rules before the first header apply to all processes.
+//
+// Tables are always compiled with all rules, so that an index file or the table shared with the
+// child processes is the same for all programs. The headers are part of the table, but not of the
+// tries. When a table with headers is loaded, the process is identified once, and if any rule does
+// not apply, the rules which do are compiled into a new table, which is small and quick to build.
+// If no rule applies, no table is used at all, so the overrides only check for that and call the libc.
+
+static struct {
+    char exe[PATH_MAX];             // Target of /proc/self/exe, or empty if it can not be read
+    const char *exe_name;           // Basename of exe
+    char cgroup[PATH_MAX];          // Path of the cgroup v2 of the process, or empty
+    uid_t uid;
+} profile_process;
+static pthread_once_t profile_process_once = PTHREAD_ONCE_INIT;
+
+// Identifies the process for profile_matches(). SECCOMP_MAGIC, because these paths must not be mapped.
+static void profile_process_init()
+{
+    ssize_t length = syscall(SYS_readlinkat, AT_FDCWD, "/proc/self/exe", profile_process.exe,
+            sizeof profile_process.exe - 1, 0, SECCOMP_MAGIC);
+    profile_process.exe[length > 0 ? length : 0] = '\0';
+    const char *slash = strrchr(profile_process.exe, '/');
+    profile_process.exe_name = slash != NULL ? slash + 1 : profile_process.exe;
+    profile_process.uid = getuid();
+
+    // The entry of cgroup v2 is the line "0::/path"
+    char buffer[PATH_MAX + 256];
+    int fd = syscall(SYS_openat, AT_FDCWD, "/proc/self/cgroup", O_RDONLY | O_CLOEXEC, 0, 0, SECCOMP_MAGIC);
+    ssize_t size = fd >= 0 ? read(fd, buffer, sizeof buffer - 1) : -1;
+    if (fd >= 0) close(fd);
+    buffer[size > 0 ? size : 0] = '\0';
+    const char *line = strstr(buffer, "0::");
+    while (line != NULL && line != buffer && line[-1] != '\n') line = strstr(line + 1, "0::");
+    size_t cgroup_length = line != NULL ? strcspn(line + 3, "\n") : 0;
+    if (line != NULL && cgroup_length < sizeof profile_process.cgroup) {
+        memcpy(profile_process.cgroup, line + 3, cgroup_length);
+        profile_process.cgroup[cgroup_length] = '\0';
+    }
+}
+
+// Returns true if the process matches the header of a section
+static int profile_matches(const char *header)
+{
+    pthread_once(&profile_process_once, profile_process_init);
+    if (strcmp(header, "@") == 0) return 1;
+    if (strncmp(header, "@exe=", 5) == 0) {
+        const char *pattern = header + 5;
+        const char *name = strchr(pattern, '/') != NULL ? profile_process.exe : profile_process.exe_name;
+        struct pattern_capture captures[PATTERN_MAX_CAPTURES];
+        return name[0] != '\0' && pattern_match(pattern, pattern + strlen(pattern), name, name + strlen(name), 1, captures, 0);
+    }
+    if (strncmp(header, "@uid=", 5) == 0) {
+        char *end;
+        unsigned long uid = strtoul(header + 5, &end, 10);
+        return end != header + 5 && *end == '\0' && uid == profile_process.uid;
+    }
+    if (strncmp(header, "@cgroup=", 8) == 0) {
+        return profile_process.cgroup[0] != '\0' && path_prefix_matches(header + 8, profile_process.cgroup);
+    }
+    error_fprintf(stderr, "PATH_MAPPING: unknown section header %s\n", header);
+    return 0;
+}
+
+// Stores the table of the rules of table which apply to this process in *selected: table itself if all rules apply,
+// a new table allocated with malloc(), or NULL if no rule applies. Returns -1 if out of memory.
+static int profile_select(const struct path_map_table *table, struct path_map_table **selected)
+{
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    const char *strings = TABLE_STRINGS(table);
+    const char *(*map)[2] = malloc((table->n_rules + 1) * sizeof *map);
+    if (map == NULL) return -1;
+    int length = 0, applies = 1, all_apply = 1;
+    for (uint32_t i = 0; i < table->n_rules; i++) {
+        if (rules[i].flags & RULE_PROFILE) {
+            // Consecutive headers are alternatives
+            int matches = profile_matches(strings + rules[i].prefix);
+            applies = i > 0 && (rules[i - 1].flags & RULE_PROFILE) ? applies || matches : matches;
+        } else if (applies) {
+            map[length][0] = strings + rules[i].prefix;
+            map[length][1] = strings + rules[i].dest;
+            length++;
+        } else {
+            all_apply = 0;
+        }
+    }
+    if (all_apply) {
+        *selected = (struct path_map_table *)table;
+    } else {
+        *selected = length > 0 ? path_map_compile(map, length) : NULL;
+    }
+    free(map);
+    return *selected == NULL && length > 0 && !all_apply ? -1 : 0;
+}
+
+// Replaces the current table with the rules of table which apply to this process. If table is not used,
+// it is released like by path_table_replace(). Returns -1 if out of memory.
+static int path_table_install(struct path_map_table *table, void *mapping, size_t mapping_size)
+{
+    struct path_map_table *selected = table;
+    int result = table->flags & TABLE_HAS_PROFILES ? profile_select(table, &selected) : 0;
+    if (result != 0 || selected != table) {
+        if (mapping != NULL) {
+            munmap(mapping, mapping_size);
+        } else {
+            free(table);
+        }
+        if (result != 0) return result;
+        mapping = NULL;
+        mapping_size = 0;
+        if (selected == NULL) info_fprintf(stderr, "PATH_MAPPING: no rules apply to %s\n", profile_process.exe);
+    }
+    path_table_replace(selected, mapping, mapping_size);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////
+//   Replacing the table while other threads use it    //
+/////////////////////////////////////////////////////////
+
+
+// Normally the table is loaded once by the constructor and never changes while other threads
+// use it. If PATH_MAPPING_RELOAD is set, a watcher thread loads the index file again whenever
+// it is replaced, and other threads may be looking up paths in the old table at the same time.
+//
+// In that mode, lookups use a scheme similar to sleepable RCU: Each lookup increments one of two
+// counters before it loads path_table, and decrements it afterwards. The writer stores the new
+// table, flips readers over to the other counter, and waits until the counters of the old side
+// are zero. A reader may have read the epoch just before the flip, and increment the old counter
+// only after the writer found it at zero. It then uses the new table, but after a single flip the
+// next writer would only wait for the other counter. So the writer flips and drains twice, like
+// SRCU: the epoch then points to the counter of such a reader again, which the next writer drains
+// first. Only then the old table is released. Readers never wait for anything, and the counters
+// are sharded like the stats, so that threads do not share cache lines.
+// If the readers do not finish within a second (e.g. because a signal handler did not return),
+// the old table is never released.
+
+#define THREAD_SHARDS PATH_MAPPING_STATS_SHARDS
+
+struct table_readers {
+    unsigned long count[2];
+} __attribute__((aligned(64)));
+
+static struct table_readers table_readers[THREAD_SHARDS];
+static unsigned table_epoch = 0;
+static pthread_mutex_t path_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int thread_next_shard = 0;
+static __thread int thread_shard_index __attribute__((tls_model("initial-exec"))) = -1;
+
+// Returns the shard of the counters which the current thread uses
+static inline int thread_shard()
+{
+    int shard = thread_shard_index;
+    if (shard < 0) {
+        shard = __atomic_fetch_add(&thread_next_shard, 1, __ATOMIC_RELAXED) % THREAD_SHARDS;
+        thread_shard_index = shard;
+    }
+    return shard;
+}
+
+// Marks the start of a lookup in path_table. Returns the counter which must be passed to table_read_unlock().
+static inline unsigned long *table_read_lock()
+{
+    unsigned epoch = __atomic_load_n(&table_epoch, __ATOMIC_SEQ_CST) & 1;
+    unsigned long *counter = &table_readers[thread_shard()].count[epoch];
+    __atomic_fetch_add(counter, 1, __ATOMIC_SEQ_CST);
+    return counter;
+}
+
+static inline void table_read_unlock(unsigned long *counter)
+{
+    __atomic_fetch_sub(counter, 1, __ATOMIC_RELEASE);
+}
+
+// Waits until all lookups which may have loaded the previous path_table have finished.
+// Returns false if they did not finish in time. Must be called with path_table_lock held.
+static int table_synchronize()
+{
+    for (int flip = 0; flip < 2; flip++) {
+        unsigned epoch = __atomic_fetch_add(&table_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (int attempt = 0; ; attempt++) {
+            unsigned long readers = 0;
+            for (int s = 0; s < THREAD_SHARDS; s++) {
+                readers += __atomic_load_n(&table_readers[s].count[epoch], __ATOMIC_ACQUIRE);
+            }
+            if (readers == 0) break;
+            if (attempt == 500) return 0;
+            struct timespec delay = { 0, 1000000 };
+            nanosleep(&delay, NULL);
+        }
+    }
+    return 1;
+}
+
+// The index file which contains path_table, or NULL if path_table was allocated with malloc()
+static void *path_table_mapping = NULL;
+static size_t path_table_mapping_size = 0;
+
+// Replace the current table and release the old one
+static void path_table_replace(struct path_map_table *table, void *mapping, size_t mapping_size)
+{
+    pthread_mutex_lock(&path_table_lock);
+    struct path_map_table *old_table = path_table;
+    void *old_mapping = path_table_mapping;
+    size_t old_mapping_size = path_table_mapping_size;
+
+    __atomic_store_n(&path_table, table, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&path_table_generation, 1, __ATOMIC_SEQ_CST); // After the table, see path_cache_get()
+    path_table_mapping = mapping;
+    path_table_mapping_size = mapping_size;
+    if (table != NULL) stats_rules_changed();
+
+    if (!path_table_reloadable || table_synchronize()) {
+        if (old_mapping != NULL) {
+            munmap(old_mapping, old_mapping_size);
+        } else {
+            free(old_table);
+        }
+    }
+    pthread_mutex_unlock(&path_table_lock);
+}
+
+struct path_mapping_watcher {
+    int fd;             // inotify instance which watches the directory of filename
+    char filename[];
+};
+
+// Reload the index file each time it is replaced or written
+static void *path_mapping_watch_thread(void *arg)
+{
+    struct path_mapping_watcher *watcher = arg;
+    const char *filename = watcher->filename;
+    const char *slash = strrchr(filename, '/');
+    const char *name = slash ? slash + 1 : filename;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t length = read(watcher->fd, events, sizeof events);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) break;
+        int changed = 0;
+        for (char *e = events; e < events + length; ) {
+            struct inotify_event *event = (struct inotify_event *)e;
+            if (event->len > 0 && strcmp(event->name, name) == 0) changed = 1;
+            e += sizeof *event + event->len;
+        }
+        if (!changed || __atomic_load_n(&path_table_exiting, __ATOMIC_RELAXED)) continue;
+        // If the new file is broken, an error is printed and the old table stays in use
+        if (path_mapping_load_index(filename) == 0) {
+            info_fprintf(stderr, "PATH_MAPPING_FILE: reloaded %s\n", filename);
+        }
+    }
+    close(watcher->fd);
+    free(watcher);
+    return NULL;
+}
+
+// Start a thread which reloads filename whenever it changes.
+// Must be called before the table is loaded, so that all lookups use the counters.
+int path_mapping_watch(const char *filename)
+{
+    path_table_reloadable = 1;
+    size_t filename_length = strlen(filename);
+    struct path_mapping_watcher *watcher = malloc(sizeof *watcher + filename_length + 1);
+    char *directory = strdup(filename);
+    if (watcher == NULL || directory == NULL) {
+        free(watcher);
+        free(directory);
+        return -1;
+    }
+    memcpy(watcher->filename, filename, filename_length + 1);
+    char *slash = strrchr(directory, '/');
+    if (slash == directory) slash[1] = '\0'; // File in the root directory
+    else if (slash != NULL) *slash = '\0';
+
+    // The watch is added before returning, so that no change after this call can be missed
+    watcher->fd = inotify_init1(IN_CLOEXEC);
+    if (watcher->fd < 0 || inotify_add_watch(watcher->fd, slash ? directory : ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        error_fprintf(stderr, "PATH_MAPPING_RELOAD: can not watch %s: %s\n", filename, strerror(errno));
+        if (watcher->fd >= 0) close(watcher->fd);
+        free(watcher);
+        free(directory);
+        return -1;
+    }
+    free(directory);
+
+    // Block all signals in the watcher, so that it never runs signal handlers of the program
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, path_mapping_watch_thread, watcher);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (result != 0) {
+        close(watcher->fd);
+        free(watcher);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Replace the current mappings with a new table compiled from map
+int path_mapping_load(const char *(*map)[2], int length)
+{
+    struct path_map_table *table = path_map_compile(map, length);
+    if (table == NULL) return -1;
+    return path_table_install(table, NULL, 0);
+}
+
+static void path_mapping_print()
+{
+    if (path_table == NULL) return;
+    const struct path_map_rule *rules = TABLE_RULES(path_table);
+    const char *strings = TABLE_STRINGS(path_table);
+    for (uint32_t i = 0; i < path_table->n_rules; i++) {
+        if (rules[i].flags & (RULE_EXCLUDE | RULE_PROFILE)) {
+            info_fprintf(stderr, "PATH_MAPPING[%u]: %s\n", i, strings + rules[i].prefix);
+        } else {
+            info_fprintf(stderr, "PATH_MAPPING[%u]: %s => %s\n", i, strings + rules[i].prefix, strings + rules[i].dest);
+        }
+    }
+    (void)rules, (void)strings; // Unused if QUIET
+}
+
+
+/////////////////////////////////////////////////////////
+//      Index files created by path-mapping-compile    //
+/////////////////////////////////////////////////////////
+
+
+// An index file is a struct path_mapping_index_header, followed by a path_map_table exactly
+// like it is used in memory. The table only contains offsets, so the constructor can map the
+// file read-only and use it directly, and all processes share the same pages of the page cache.
+//
+// When loading, every index, offset and length in the table is checked once, so that a damaged
+// or truncated file is rejected instead of crashing the lookups. This reads the whole file once,
+// but the lookups themselves can then trust the table like one compiled in memory.
+
+// Returns true if nodes is a trie of prefixes (key 0) or destinations (key 1) like trie_builder_store() creates it.
+// The lookups rely on more than the bounds: the children of each node must follow the nodes before them,
+// and the path which leads to a node must be as long as the prefix or destination of its rule.
+static int trie_nodes_valid(const struct path_map_table *table, const struct path_trie_node *nodes, uint32_t n_nodes, int key)
+{
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    const char *strings = TABLE_STRINGS(table);
+    size_t strings_size = table->size - table->strings_offset;
+    uint64_t *lengths = malloc(n_nodes * sizeof *lengths); // Length of the path which leads to each node
+    if (lengths == NULL) return 0;
+    lengths[0] = 0;
+    uint32_t next_child = 1;
+    int valid = 1;
+    for (uint32_t i = 0; i < n_nodes && valid; i++) {
+        const struct path_trie_node *node = &nodes[i];
+        if (node->n_children > 0) {
+            valid = node->first_child == next_child && node->first_child > i && node->n_children <= n_nodes - next_child;
+            for (uint32_t c = node->first_child; valid && c < node->first_child + node->n_children; c++) {
+                // The first component of an absolute path is empty, the others follow a slash
+                lengths[c] = (i == 0 ? 0 : lengths[i] + 1) + nodes[c].name_length;
+            }
+            next_child += node->n_children;
+        }
+        if ((uint64_t)node->name + node->name_length > strings_size) valid = 0;
+        if (valid && node->rule != -1) {
+            if (node->rule < 0 || (uint32_t)node->rule >= table->n_rules) valid = 0;
+            else if (rules[node->rule].flags & (RULE_PATTERN | RULE_PROFILE)) valid = 0;
+            else if (key == 0) valid = lengths[i] == rules[node->rule].prefix_length;
+            else valid = lengths[i] == pathlen(strings + rules[node->rule].dest);
+        }
+    }
+    free(lengths);
+    return valid && next_child == n_nodes;
+}
+
+// Returns true if the rules, tries and DFA of table only refer to rules, states and strings within it.
+// The header must already have been checked by path_map_table_valid().
+static int path_map_table_contents_valid(const struct path_map_table *table)
+{
+    size_t strings_size = table->size - table->strings_offset;
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    for (uint32_t i = 0; i < table->n_rules; i++) {
+        // The strings are followed by a terminating null byte, which the last one shares with the table
+        if ((uint64_t)rules[i].prefix + rules[i].prefix_length >= strings_size) return 0;
+        if ((uint64_t)rules[i].dest + rules[i].dest_length >= strings_size) return 0;
+        // layer_select() and the overlay functions follow the chain forward, and cut the same prefix from the path
+        int32_t next = rules[i].next_layer;
+        if (next == -1) continue;
+        if (next < 0 || (uint32_t)next <= i || (uint32_t)next >= table->n_rules) return 0;
+        if ((rules[i].flags | rules[next].flags) & (RULE_PATTERN | RULE_PROFILE)) return 0;
+        if (rules[next].prefix_length != rules[i].prefix_length) return 0;
+    }
+    if (!trie_nodes_valid(table, TABLE_NODES(table), table->n_nodes, 0)) return 0;
+    if (!trie_nodes_valid(table, TABLE_REVERSE_NODES(table), table->n_reverse_nodes, 1)) return 0;
+    if (table->n_dfa_states > 0) {
+        const uint32_t *transitions = TABLE_DFA_TRANSITIONS(table);
+        const int32_t *accept = TABLE_DFA_ACCEPT(table);
+        const unsigned char *classes = TABLE_DFA_CLASSES(table);
+        for (uint64_t i = 0; i < (uint64_t)table->n_dfa_states * table->n_dfa_classes; i++) {
+            if (transitions[i] >= table->n_dfa_states) return 0;
+        }
+        for (uint32_t i = 0; i < table->n_dfa_states; i++) {
+            if (accept[i] == -1) continue;
+            if (accept[i] < 0 || (uint32_t)accept[i] >= table->n_rules) return 0;
+            if ((rules[accept[i]].flags & (RULE_PATTERN | RULE_PROFILE)) != RULE_PATTERN) return 0;
+        }
+        for (int i = 0; i < 256; i++) {
+            if (classes[i] >= table->n_dfa_classes) return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns true if the sizes and offsets in the header of table are consistent with size,
+// and its contents only refer to memory within the table
+static int path_map_table_valid(const struct path_map_table *table, size_t size)
+{
+    if (size < sizeof *table || table->size != size) return 0;
+    if (table->rules_offset < sizeof *table || table->rules_offset % sizeof(uint32_t) != 0) return 0;
+    if (table->nodes_offset % sizeof(uint32_t) != 0 || table->n_nodes == 0) return 0;
+    if (table->rules_offset + (uint64_t)table->n_rules * sizeof(struct path_map_rule) > table->nodes_offset) return 0;
+    if (table->nodes_offset + (uint64_t)table->n_nodes * sizeof(struct path_trie_node) > table->reverse_nodes_offset) return 0;
+    if (table->reverse_nodes_offset % sizeof(uint32_t) != 0 || table->n_reverse_nodes == 0) return 0;
+    if (table->reverse_nodes_offset + (uint64_t)table->n_reverse_nodes * sizeof(struct path_trie_node) > table->strings_offset) return 0;
+    if (table->n_dfa_states > 0) {
+        if (table->dfa_offset % sizeof(uint32_t) != 0 || table->n_dfa_states <= DFA_START) return 0;
+        if (table->n_dfa_classes == 0 || table->n_dfa_classes > 256) return 0;
+        if (table->reverse_nodes_offset + (uint64_t)table->n_reverse_nodes * sizeof(struct path_trie_node) > table->dfa_offset) return 0;
+        if (table->dfa_offset + (uint64_t)DFA_SIZE(table->n_dfa_states, table->n_dfa_classes) > table->strings_offset) return 0;
+    }
+    if (table->strings_offset > size) return 0;
+    // All strings must be terminated within the table
+    if (table->n_rules > 0 && (table->strings_offset == size || ((const char *)table)[size - 1] != '\0')) return 0;
+    return path_map_table_contents_valid(table);
+}
+
+// Compile map into the contents of an index file, allocated with malloc(). Returns NULL if out of memory.
+void *path_mapping_compile_index(const char *(*map)[2], int length, size_t *size)
+{
+    struct path_map_table *table = path_map_compile(map, length);
+    if (table == NULL) return NULL;
+    struct path_mapping_index_header header = {
+        .magic = PATH_MAPPING_INDEX_MAGIC,
+        .version = PATH_MAPPING_INDEX_VERSION,
+        .table_offset = sizeof header,
+        .table_size = table->size,
+    };
+    char *index = malloc(header.table_offset + header.table_size);
+    if (index != NULL) {
+        memcpy(index, &header, sizeof header);
+        memcpy(index + header.table_offset, table, table->size);
+        *size = header.table_offset + header.table_size;
+    }
+    free(table);
+    return index;
+}
+
+// Maps the index in fd read-only and checks its header. Returns the mapping, or NULL if it is not a valid index.
+static const struct path_mapping_index_header *index_map(int fd, size_t *size)
+{
+    struct stat st;
+    void *index = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct path_mapping_index_header)) {
+        index = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (index == MAP_FAILED) return NULL;
+
+    const struct path_mapping_index_header *header = index;
+    const struct path_map_table *table = (const struct path_map_table *)((char *)index + header->table_offset);
+    if (header->magic != PATH_MAPPING_INDEX_MAGIC || header->version != PATH_MAPPING_INDEX_VERSION
+            || header->table_offset < sizeof *header || header->table_offset % sizeof(uint64_t) != 0
+            || header->table_offset + (uint64_t)header->table_size != (uint64_t)st.st_size
+            || !path_map_table_valid(table, header->table_size)) {
+        munmap(index, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return header;
+}
+
+// Replace the current mappings with the table in an index file. Prints an error and returns -1 on failure.
+int path_mapping_load_index(const char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error_fprintf(stderr, "PATH_MAPPING_FILE: can not open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    size_t size;
+    const struct path_mapping_index_header *header = index_map(fd, &size);
+    close(fd);
+    if (header == NULL) {
+        error_fprintf(stderr, "PATH_MAPPING_FILE: %s is not an index file of this version of path-mapping-compile\n", filename);
+        return -1;
+    }
+    if (path_table_install((struct path_map_table *)((char *)header + header->table_offset), (void *)header, size) != 0) {
+        error_fprintf(stderr, "PATH_MAPPING_FILE: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/////////////////////////////////////////////////////////
+//     Sharing the table with child processes          //
+/////////////////////////////////////////////////////////
+
+
+// Every new process would parse PATH_MAPPING and compile the table again, which adds up when a
+// build starts thousands of compilers. So the first process writes its table in the format of an
+// index file into a memfd, seals it against writes, and leaves the fd open across exec().
+// PATH_MAPPING_TABLE=fd:inode:hash tells the children where to find it. They map the memfd
+// read-only like an index file, so all processes share the same pages and nothing is parsed.
+//
+// A child only uses the memfd if the fd still refers to the same sealed file, if hash matches
+// its own PATH_MAPPING (e.g. "env PATH_MAPPING=... program" changes the mapping of a subtree),
+// and if the table passes the same checks as an index file (see path_map_table_valid()).
+// Otherwise it parses PATH_MAPPING as usual and publishes its own table. Small mappings are
+// parsed faster than the memfd can be mapped, so they are not published.
+
+#define SHARED_TABLE_VARIABLE "PATH_MAPPING_TABLE"
+#define SHARED_TABLE_MIN_RULES 16
+#define SHARED_TABLE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+#define SHARED_TABLE_MIN_FD 100 // Above the fds which shell scripts use for redirections
+
+#if !defined(DISABLE_SHARED_TABLE) && !defined(MFD_ALLOW_SEALING)
+    #define DISABLE_SHARED_TABLE // memfd_create() exists since glibc 2.27
+#endif
+
+#ifndef DISABLE_SHARED_TABLE
+
+// FNV-1a of the mapping, seeded with the format of the table, so that e.g. 32 bit programs do not use the table of a 64 bit parent
+static uint64_t shared_table_hash(const char *mapping)
+{
+    uint64_t hash = 0xcbf29ce484222325ull ^ (PATH_MAPPING_INDEX_VERSION << 8 | sizeof(void *));
+    for (const char *c = mapping; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Uses the table published by a parent process for the same mapping. Returns 0 on success.
+static int shared_table_load(const char *mapping)
+{
+    const char *variable = getenv(SHARED_TABLE_VARIABLE);
+    int fd;
+    unsigned long long inode, hash;
+    if (variable == NULL || sscanf(variable, "%d:%llu:%llx", &fd, &inode, &hash) != 3) return -1;
+    struct stat st;
+    if (hash != shared_table_hash(mapping) || fstat(fd, &st) != 0 || st.st_ino != inode
+            || fcntl(fd, F_GET_SEALS) != SHARED_TABLE_SEALS) {
+        return -1;
+    }
+    size_t size;
+    const struct path_mapping_index_header *header = index_map(fd, &size);
+    if (header == NULL) {
+        info_fprintf(stderr, SHARED_TABLE_VARIABLE ": the table in fd %d is damaged, parsing PATH_MAPPING\n", fd);
+        return -1;
+    }
+    info_fprintf(stderr, SHARED_TABLE_VARIABLE ": using the table of the parent process in fd %d\n", fd);
+    return path_table_install((struct path_map_table *)((char *)header + header->table_offset), (void *)header, size);
+}
+
+// Writes table into a sealed memfd, and sets PATH_MAPPING_TABLE for the children.
+// This is the table with all rules, because the children may be other programs (see profile_select()).
+static void shared_table_publish(const char *mapping, const struct path_map_table *table)
+{
+    if (table->n_rules < SHARED_TABLE_MIN_RULES) return;
+    struct path_mapping_index_header header = {
+        .magic = PATH_MAPPING_INDEX_MAGIC,
+        .version = PATH_MAPPING_INDEX_VERSION,
+        .table_offset = sizeof header,
+        .table_size = table->size,
+    };
+    int fd = memfd_create("path-mapping-table", MFD_ALLOW_SEALING); // Without MFD_CLOEXEC, so that exec() keeps it
+    if (fd < 0) return;
+    int high_fd = fcntl(fd, F_DUPFD, SHARED_TABLE_MIN_FD);
+    if (high_fd >= 0) {
+        close(fd);
+        fd = high_fd;
+    }
+    struct stat st;
+    char variable[64];
+    if (write(fd, &header, sizeof header) != sizeof header
+            || write(fd, table, table->size) != (ssize_t)table->size
+            || fcntl(fd, F_ADD_SEALS, SHARED_TABLE_SEALS) != 0 || fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+    snprintf(variable, sizeof variable, "%d:%llu:%llx", fd, (unsigned long long)st.st_ino, (unsigned long long)shared_table_hash(mapping));
+    setenv(SHARED_TABLE_VARIABLE, variable, 1);
+}
+
+#else // DISABLE_SHARED_TABLE
+
+static int shared_table_load(const char *mapping)
+{
+    return -1;
+}
+
+static void shared_table_publish(const char *mapping, const struct path_map_table *table)
+{
+}
+
+#endif // DISABLE_SHARED_TABLE
+
+/////////////////////////////////////////////////////////
+//   Layered destinations and their existence cache    //
+/////////////////////////////////////////////////////////
+
+
+// If the same prefix is given more than once, each destination is a layer, like the directories in $PATH.
+// A path is mapped into the first layer which contains it. If no layer contains it (e.g. for a file which
+// is about to be created), the first layer is used. Rules without other layers are not affected.
+//
+// Checking all layers would cost one syscall per layer and per call, which adds up quickly for
+// Python imports or compiler include searches, which mostly look for files that do not exist.
+// Therefore the result of each check is cached for PATH_MAPPING_CACHE_TTL milliseconds (default 1000,
+// 0 disables the cache), so that repeated lookups of the same path only cost the call itself.
+// Changes to the layers are noticed after at most that time, even if they are made by this process.
+//
+// The cache is a hash table with a fixed number of buckets, each with a few entries of a fixed size,
+// which is allocated with mmap() on first use. Paths longer than LAYER_CACHE_MAX_LENGTH are not cached.
+// Each group of buckets has its own lock, so that threads rarely wait for each other. The cache never
+// calls malloc(), so that it also works in signal handlers. A signal handler which interrupts the same
+// thread while it uses the cache (e.g. seccomp_handler()) bypasses it, like the per-thread path cache.
+
+#define LAYER_CACHE_BUCKETS 4096
+#define LAYER_CACHE_WAYS 4          // Entries per bucket
+#define LAYER_CACHE_MAX_LENGTH 232  // So that each entry has 256 bytes
+#define LAYER_CACHE_LOCKS 16
+#define LAYER_CACHE_DEFAULT_TTL 1000
+
+struct layer_cache_entry {
+    uint64_t hash;
+    uint64_t time;                  // When the path was checked, in milliseconds
+    uint32_t flushes;               // Value of layer_cache_flushes when the path was checked
+    uint16_t length;                // 0 for unused entries
+    uint8_t exists;
+    char path[LAYER_CACHE_MAX_LENGTH];
+};
+
+struct layer_cache_bucket {
+    struct layer_cache_entry entries[LAYER_CACHE_WAYS];
+};
+
+static struct layer_cache_bucket *layer_cache = NULL;
+static pthread_mutex_t layer_cache_locks[LAYER_CACHE_LOCKS] = {
+    [0 ... LAYER_CACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static uint64_t layer_cache_ttl = LAYER_CACHE_DEFAULT_TTL;
+// Incremented when layer_cache_forget() can not remove an entry, which expires all entries
+static uint32_t layer_cache_flushes = 0;
+// Set while the thread uses the cache, or must not use it (see map_exec_path_at())
+static __thread int layer_cache_busy __attribute__((tls_model("initial-exec"))) = 0;
+
+static inline uint64_t layer_cache_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // Coarse is enough, and never makes a syscall
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static inline uint64_t layer_cache_hash(const char *path, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)path[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Returns the buckets of the cache, which are allocated on first use, or NULL if that failed
+static struct layer_cache_bucket *layer_cache_buckets()
+{
+    struct layer_cache_bucket *buckets = __atomic_load_n(&layer_cache, __ATOMIC_ACQUIRE);
+    if (buckets != NULL) return buckets;
+    buckets = mmap(NULL, LAYER_CACHE_BUCKETS * sizeof *buckets, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buckets == MAP_FAILED) return NULL;
+    struct layer_cache_bucket *expected = NULL;
+    if (!__atomic_compare_exchange_n(&layer_cache, &expected, buckets, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(buckets, LAYER_CACHE_BUCKETS * sizeof *buckets); // Another thread was faster
+        buckets = expected;
+    }
+    return buckets;
+}
+
+// Returns the entry of path in bucket, or NULL. Must be called with the lock of the bucket held.
+static inline struct layer_cache_entry *layer_cache_find(struct layer_cache_bucket *bucket, uint64_t hash,
+        const char *path, size_t length)
+{
+    for (int i = 0; i < LAYER_CACHE_WAYS; i++) {
+        struct layer_cache_entry *entry = &bucket->entries[i];
+        if (entry->length == length && entry->hash == hash && memcmp(entry->path, path, length) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Returns true if path exists, using the cache if possible
+static int layer_path_exists(const char *path)
+{
+    size_t length = strlen(path);
+    struct layer_cache_bucket *buckets;
+    // SECCOMP_MAGIC, because path is already mapped
+    if (layer_cache_ttl == 0 || layer_cache_busy || length == 0 || length > LAYER_CACHE_MAX_LENGTH
+            || (buckets = layer_cache_buckets()) == NULL) {
+        return syscall(SYS_faccessat, AT_FDCWD, path, F_OK, 0, 0, SECCOMP_MAGIC) == 0;
+    }
+    layer_cache_busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    uint64_t hash = layer_cache_hash(path, length);
+    struct layer_cache_bucket *bucket = &buckets[hash % LAYER_CACHE_BUCKETS];
+    pthread_mutex_t *lock = &layer_cache_locks[hash % LAYER_CACHE_BUCKETS % LAYER_CACHE_LOCKS];
+    uint64_t now = layer_cache_now();
+    uint32_t flushes = __atomic_load_n(&layer_cache_flushes, __ATOMIC_ACQUIRE);
+    int exists = -1;
+
+    pthread_mutex_lock(lock);
+    struct layer_cache_entry *entry = layer_cache_find(bucket, hash, path, length);
+    if (entry != NULL && now - entry->time < layer_cache_ttl && entry->flushes == flushes) exists = entry->exists;
+    pthread_mutex_unlock(lock);
+
+    if (exists < 0) {
+        // Check without holding the lock. Another thread may do the same, which only wastes one syscall.
+        exists = syscall(SYS_faccessat, AT_FDCWD, path, F_OK, 0, 0, SECCOMP_MAGIC) == 0;
+
+        pthread_mutex_lock(lock);
+        entry = layer_cache_find(bucket, hash, path, length);
+        if (entry == NULL) {
+            // Replace an unused entry, or else the oldest one
+            entry = &bucket->entries[0];
+            for (int i = 1; i < LAYER_CACHE_WAYS && entry->length != 0; i++) {
+                struct layer_cache_entry *candidate = &bucket->entries[i];
+                if (candidate->length == 0 || candidate->time < entry->time) entry = candidate;
+            }
+        }
+        entry->hash = hash;
+        entry->time = now;
+        entry->flushes = flushes;
+        entry->length = length;
+        entry->exists = exists;
+        memcpy(entry->path, path, length);
+        pthread_mutex_unlock(lock);
+    }
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    layer_cache_busy = 0;
+    return exists;
+}
+
+#ifndef DISABLE_OVERLAY
+// Removes the cached check of path, because this process just created or removed it
+static void layer_cache_forget(const char *path)
+{
+    size_t length = strlen(path);
+    struct layer_cache_bucket *buckets = __atomic_load_n(&layer_cache, __ATOMIC_ACQUIRE);
+    if (layer_cache_ttl == 0 || buckets == NULL || length == 0 || length > LAYER_CACHE_MAX_LENGTH) return;
+    if (layer_cache_busy) {
+        // A signal handler which interrupted the cache can not take its lock, so all entries expire instead
+        __atomic_add_fetch(&layer_cache_flushes, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    layer_cache_busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    uint64_t hash = layer_cache_hash(path, length);
+    pthread_mutex_t *lock = &layer_cache_locks[hash % LAYER_CACHE_BUCKETS % LAYER_CACHE_LOCKS];
+    pthread_mutex_lock(lock);
+    struct layer_cache_entry *entry = layer_cache_find(&buckets[hash % LAYER_CACHE_BUCKETS], hash, path, length);
+    if (entry != NULL) entry->length = 0;
+    pthread_mutex_unlock(lock);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    layer_cache_busy = 0;
+}
+#endif // DISABLE_OVERLAY
+
+// Returns the first layer of rule first_rule which contains rest, or first_rule if none does
+static int layer_select(const struct path_map_table *table, int first_rule, const char *rest, size_t rest_length)
+{
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    const char *strings = TABLE_STRINGS(table);
+    char candidate[MAX_PATH];
+    for (int rule = first_rule; rule >= 0; ) {
+        if (rules[rule].dest_length + rest_length < sizeof candidate) {
+            memcpy(candidate, strings + rules[rule].dest, rules[rule].dest_length);
+            memcpy(candidate + rules[rule].dest_length, rest, rest_length + 1);
+            if (layer_path_exists(candidate)) {
+                // A whiteout in the first layer hides the path in the others (see overlay_prepare())
+                if (rule != first_rule && overlay_enabled
+                        && overlay_hidden(strings + rules[first_rule].dest, rules[first_rule].dest_length, rest, rest_length)) {
+                    return first_rule;
+                }
+                return rule;
+            }
+        }
+        // Layers always point forward, so that a damaged index file can not cause an endless loop
+        int next = rules[rule].next_layer;
+        rule = next > rule && (uint32_t)next < table->n_rules ? next : -1;
+    }
+    return first_rule;
+}
+
+// Keep the cache consistent in the child of a fork(), if another thread used it at that time
+static void layer_cache_atfork_prepare()
+{
+    for (int i = 0; i < LAYER_CACHE_LOCKS; i++) pthread_mutex_lock(&layer_cache_locks[i]);
+}
+
+static void layer_cache_atfork_release()
+{
+    for (int i = 0; i < LAYER_CACHE_LOCKS; i++) pthread_mutex_unlock(&layer_cache_locks[i]);
+}
+
+static void layer_cache_init()
+{
+    const char *ttl = getenv("PATH_MAPPING_CACHE_TTL");
+    if (ttl != NULL && strlen(ttl) > 0) layer_cache_ttl = strtoull(ttl, NULL, 10);
+    pthread_atfork(layer_cache_atfork_prepare, layer_cache_atfork_release, layer_cache_atfork_release);
+}
+
+/////////////////////////////////////////////////////////
+//   Copy-on-write overlays of layered destinations    //
+/////////////////////////////////////////////////////////
+
+
+// If PATH_MAPPING_OVERLAY is set, the first layer of each prefix with layers is a writable upper
+// directory (e.g. one per job), and the other layers are read-only lower directories (e.g. a shared
+// installation), like the layers of overlayfs. Reads still use the first layer which contains the path.
+// Before a call changes a path which only exists in a lower layer, the path is copied up into the upper
+// layer, with a reflink (FICLONE) where the filesystem supports it, or with copy_file_range(), and the
+// call changes the copy. The lower layers are never written, so they should be read-only: if a copy-up
+// fails, the call gets the lower path and fails there.
+//
+// Deletions leave a whiteout, an empty file .wh.NAME in the same directory of the upper layer, which hides
+// NAME and everything below it in the lower layers (see layer_select()). If the upper layer contains NAME
+// as well, the whiteout only hides the lower layers, e.g. for a directory which was removed and created again.
+// Names starting with .wh. are never listed. Listings of directories with layers contain the entries of
+// all layers (see dir_listing_create()).
+//
+// Directories are not copied up with their contents, so rename() fails with EXDEV for directories which
+// exist in a lower layer, and programs like mv copy them instead. Extended attributes are not copied up.
+
+#define OVERLAY_READ 0              // The call only reads the path
+#define OVERLAY_CREATE 1            // The call creates the path and fails if it exists, e.g. mkdir()
+#define OVERLAY_WRITE 2             // The call changes the contents or the metadata, e.g. chmod()
+#define OVERLAY_REPLACE 3           // The call replaces the contents, so only the metadata is copied up, e.g. O_TRUNC
+#define OVERLAY_UNLINK 4            // The call removes a path which is not a directory
+#define OVERLAY_RMDIR 5             // The call removes an empty directory
+#define OVERLAY_REMOVE 6            // The call removes either, like remove()
+#define OVERLAY_RENAME 7            // The call moves the path away, which leaves a whiteout
+
+#define OVERLAY_WHITEOUT_PREFIX ".wh."
+#define OVERLAY_WHITEOUT_PREFIX_LENGTH 4
+
+// Returns how open() with flags uses its path (OVERLAY_*)
+static inline int overlay_open_access(int flags)
+{
+    if ((flags & O_CREAT) && (flags & O_EXCL)) return OVERLAY_CREATE;
+    if (flags & O_TRUNC) return OVERLAY_REPLACE;
+    if ((flags & O_ACCMODE) == O_RDONLY) return flags & O_CREAT ? OVERLAY_CREATE : OVERLAY_READ;
+    return OVERLAY_WRITE;
+}
+
+// Returns how fopen() with mode uses its path (OVERLAY_*)
+static inline int overlay_fopen_access(const char *mode)
+{
+    if (mode == NULL) return OVERLAY_READ;
+    if (strchr(mode, 'x') != NULL) return OVERLAY_CREATE;
+    if (mode[0] == 'w') return OVERLAY_REPLACE;
+    return mode[0] == 'a' || strchr(mode, '+') != NULL ? OVERLAY_WRITE : OVERLAY_READ;
+}
+
+// Returns true if name is a whiteout, which is not listed
+static inline int overlay_is_whiteout(const char *name)
+{
+    return strncmp(name, OVERLAY_WHITEOUT_PREFIX, OVERLAY_WHITEOUT_PREFIX_LENGTH) == 0;
+}
+
+#ifndef DISABLE_OVERLAY
+
+#ifndef FICLONE
+    #define FICLONE _IOW(0x94, 9, int)
+#endif
+#ifndef RENAME_NOREPLACE
+    #define RENAME_NOREPLACE 1
+#endif
+
+#define OVERLAY_MAX_LAYERS 16
+#define OVERLAY_COPY_BUFFER (1 << 20)  // For read() and write() if copy_file_range() does not work
+
+// The layers of a mapped path, copied out of the table so that it need not stay locked during the copy-up
+struct overlay_location {
+    int n_layers;
+    int layer;                      // The layer which contains the mapped path, 0 is the upper layer
+    const char *dests[OVERLAY_MAX_LAYERS]; // Destinations without trailing slashes
+    size_t dest_lengths[OVERLAY_MAX_LAYERS];
+    const char *rest;               // The rest of the mapped path after the destination, empty or starting with a slash
+    size_t rest_length;             // Length of rest without trailing slashes
+    char strings[2 * MAX_PATH];
+};
+
+// The helpers below make their syscalls with SECCOMP_MAGIC, because their paths are already mapped,
+// and because they are also called by seccomp_handler(). Like the overrides, they may run in signal
+// handlers, so they never call malloc(), and layer_cache_forget() takes no lock when it is re-entered.
+
+static int overlay_lstat(const char *path, struct stat *st)
+{
+    return syscall(SYS_newfstatat, AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW, 0, SECCOMP_MAGIC);
+}
+
+// Writes the path of the whiteout of the first rest_length bytes of rest in the upper layer to buffer (MAX_PATH bytes).
+// Returns false if it does not fit.
+static int overlay_whiteout_path(const char *upper, size_t upper_length, const char *rest, size_t rest_length, char *buffer)
+{
+    size_t name = rest_length;
+    while (name > 0 && rest[name - 1] != '/') name--;
+    if (upper_length + rest_length + OVERLAY_WHITEOUT_PREFIX_LENGTH >= MAX_PATH) return 0;
+    char *end = buffer;
+    memcpy(end, upper, upper_length);
+    end += upper_length;
+    memcpy(end, rest, name);
+    end += name;
+    memcpy(end, OVERLAY_WHITEOUT_PREFIX, OVERLAY_WHITEOUT_PREFIX_LENGTH);
+    end += OVERLAY_WHITEOUT_PREFIX_LENGTH;
+    memcpy(end, rest + name, rest_length - name);
+    end[rest_length - name] = '\0';
+    return 1;
+}
+
+// Returns true if a whiteout in the upper layer hides the first rest_length bytes of rest or one of its parents
+static int overlay_hidden(const char *upper, size_t upper_length, const char *rest, size_t rest_length)
+{
+    char whiteout[MAX_PATH];
+    for (size_t end = 1; end <= rest_length; end++) {
+        if (rest[end - 1] == '/' || (end < rest_length && rest[end] != '/')) continue; // Not the end of a component
+        if (overlay_whiteout_path(upper, upper_length, rest, end, whiteout) && layer_path_exists(whiteout)) return 1;
+    }
+    return 0;
+}
+
+// Writes the path of the first rest_length bytes of the rest in layer to buffer (MAX_PATH bytes).
+// Returns false if it does not fit.
+static int overlay_layer_path(const struct overlay_location *location, int layer, size_t rest_length, char *buffer)
+{
+    size_t length = location->dest_lengths[layer];
+    if (length + rest_length >= MAX_PATH) return 0;
+    memcpy(buffer, location->dests[layer], length);
+    memcpy(buffer + length, location->rest, rest_length);
+    buffer[length + rest_length] = '\0';
+    return 1;
+}
+
+// Finds the layers of the mapped path in table. Returns false if path is not in a layer of a prefix with layers.
+static int overlay_locate_in_table(const struct path_map_table *table, const char *path, struct overlay_location *location)
+{
+    if (table == NULL || path[0] != '/') return 0;
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    const char *strings = TABLE_STRINGS(table);
+    // The trie of the destinations has the first rule with the destination of path, and
+    // the trie of the prefixes has the first layer of its prefix
+    int rule = trie_lookup(table, TABLE_REVERSE_NODES(table), path);
+    int first = rule >= 0 ? trie_lookup(table, TABLE_NODES(table), strings + rules[rule].prefix) : -1;
+    if (first < 0 || rules[first].next_layer < 0) return 0;
+
+    size_t used = 0;
+    location->n_layers = 0;
+    location->layer = -1;
+    for (int i = first; i >= 0; ) {
+        const char *dest = strings + rules[i].dest;
+        size_t length = pathlen(dest);
+        if (location->n_layers == OVERLAY_MAX_LAYERS || used + length + 1 > MAX_PATH) return 0;
+        if (i == rule) location->layer = location->n_layers;
+        memcpy(location->strings + used, dest, length);
+        location->strings[used + length] = '\0';
+        location->dests[location->n_layers] = location->strings + used;
+        location->dest_lengths[location->n_layers++] = length;
+        used += length + 1;
+        int next = rules[i].next_layer;
+        i = next > i && (uint32_t)next < table->n_rules ? next : -1; // See layer_select()
+    }
+    if (location->layer < 0) return 0;
+
+    const char *rest = path + location->dest_lengths[location->layer];
+    size_t rest_size = strlen(rest) + 1;
+    if (rest_size > MAX_PATH) return 0;
+    location->rest = memcpy(location->strings + used, rest, rest_size);
+    location->rest_length = pathlen(location->rest);
+    // Parents named . or .. can not be copied up one by one, so such paths are left alone
+    for (const char *c = location->rest; *c != '\0'; c++) {
+        if (c[0] == '.' && c > location->rest && c[-1] == '/'
+                && (c[1] == '/' || c[1] == '\0' || (c[1] == '.' && (c[2] == '/' || c[2] == '\0')))) return 0;
+    }
+    return 1;
+}
+
+static int overlay_locate(const char *path, struct overlay_location *location)
+{
+    unsigned long *reader = path_table_reloadable ? table_read_lock() : NULL;
+    const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_SEQ_CST);
+    int found = overlay_locate_in_table(table, path, location);
+    if (reader != NULL) table_read_unlock(reader);
+    return found;
+}
+
+// Called after this process created or removed path in the upper layer, so that all threads look at the layers again
+static void overlay_changed(const char *path)
+{
+    layer_cache_forget(path);
+    __atomic_add_fetch(&path_table_generation, 1, __ATOMIC_SEQ_CST); // Invalidates the path caches
+}
+
+// Creates the upper layer and the parents of the rest in it which are only in the lower layers,
+// with the modes of the same directories there. Returns false if that failed.
+static int overlay_make_parents(const struct overlay_location *location)
+{
+    size_t parent = location->rest_length;
+    while (parent > 0 && location->rest[parent - 1] != '/') parent--;
+    while (parent > 0 && location->rest[parent - 1] == '/') parent--;
+    char path[MAX_PATH], lower[MAX_PATH];
+    if (!overlay_layer_path(location, 0, parent, path)) return 0;
+    if (layer_path_exists(path)) return 1;
+
+    for (size_t end = 0; end <= parent; end++) {
+        if (end > 0 && end < parent && (location->rest[end] != '/' || location->rest[end - 1] == '/')) continue;
+        struct stat st;
+        if (!overlay_layer_path(location, 0, end, path)) return 0;
+        if (overlay_lstat(path, &st) == 0) continue;
+        int mode = -1;
+        for (int layer = 1; layer < location->n_layers && mode < 0; layer++) {
+            if (overlay_layer_path(location, layer, end, lower) && overlay_lstat(lower, &st) == 0 && S_ISDIR(st.st_mode)) {
+                mode = st.st_mode & 07777;
+            }
+        }
+        // Parents which are in no layer are missing in the merged directory as well, so the call fails with ENOENT
+        if (mode < 0 && end > 0) return 1;
+        if (syscall(SYS_mkdirat, AT_FDCWD, path, mode >= 0 ? mode : 0777, 0, 0, SECCOMP_MAGIC) != 0 && errno != EEXIST) return 0;
+        // mkdir() applies the umask, which the copy of a lower directory should not
+        if (mode >= 0) syscall(SYS_fchmodat, AT_FDCWD, path, mode, 0, 0, SECCOMP_MAGIC);
+        overlay_changed(path);
+    }
+    return 1;
+}
+
+// Copies the data of the file in to out, with a reflink if the filesystem supports it. Returns false if that failed.
+static int overlay_copy_data(int in, int out, off_t size)
+{
+    if (ioctl(out, FICLONE, in) == 0) return 1;
+    off_t copied = 0;
+    ssize_t n = 0;
+    while (copied < size && (n = copy_file_range(in, NULL, out, NULL, size - copied, 0)) > 0) copied += n;
+    if (n >= 0) return 1; // Done, or the file became shorter
+
+    // copy_file_range() does not work between these files, so the rest is read and written.
+    // The buffer comes from mmap(), not malloc(), because the copy-up may run in a signal handler.
+    char small[4096];
+    char *buffer = mmap(NULL, OVERLAY_COPY_BUFFER, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t buffer_size = buffer != MAP_FAILED ? OVERLAY_COPY_BUFFER : sizeof small;
+    if (buffer == MAP_FAILED) buffer = small;
+    int ok = 1;
+    while (ok) {
+        ssize_t length = read(in, buffer, buffer_size);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) {
+            ok = length == 0;
+            break;
+        }
+        for (ssize_t written = 0; ok && written < length; ) {
+            ssize_t w = write(out, buffer + written, length - written);
+            if (w > 0) written += w;
+            else if (w == 0 || errno != EINTR) ok = 0;
+        }
+    }
+    if (buffer != small) munmap(buffer, OVERLAY_COPY_BUFFER);
+    return ok;
+}
+
+// Copies the path in a lower layer up into the upper layer, with its data only if with_data is set.
+// The copy is made under a temporary name and linked into place, so that other processes never see a
+// partial copy, and the first copy-up wins if several processes copy the same file. Returns false if that failed.
+static int overlay_copy_up(const struct overlay_location *location, int with_data)
+{
+    char lower[MAX_PATH], upper[MAX_PATH], temp[MAX_PATH];
+    struct stat st;
+    if (!overlay_layer_path(location, location->layer, location->rest_length, lower)
+            || !overlay_layer_path(location, 0, location->rest_length, upper)
+            || overlay_lstat(lower, &st) != 0) return 0;
+    mode_t mode = st.st_mode & 07777;
+    if (S_ISDIR(st.st_mode)) {
+        if (syscall(SYS_mkdirat, AT_FDCWD, upper, mode, 0, 0, SECCOMP_MAGIC) != 0 && errno != EEXIST) return 0;
+        syscall(SYS_fchmodat, AT_FDCWD, upper, mode, 0, 0, SECCOMP_MAGIC);
+        overlay_changed(upper);
+        return 1;
+    }
+
+    // The temporary name looks like a whiteout, so that it is never listed
+    size_t dir = strlen(upper);
+    while (dir > 0 && upper[dir - 1] != '/') dir--;
+    int length = snprintf(temp, sizeof temp, "%.*s" OVERLAY_WHITEOUT_PREFIX ".copy-up.%ld", (int)dir, upper, (long)syscall(SYS_gettid));
+    if (length < 0 || (size_t)length >= sizeof temp) return 0;
+    syscall(SYS_unlinkat, AT_FDCWD, temp, 0, 0, 0, SECCOMP_MAGIC); // Left behind by a thread which was killed
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    int ok = 0;
+    if (S_ISREG(st.st_mode)) {
+        int in = with_data ? syscall(SYS_openat, AT_FDCWD, lower, O_RDONLY | O_CLOEXEC, 0, 0, SECCOMP_MAGIC) : -1;
+        int out = in >= 0 || !with_data
+            ? syscall(SYS_openat, AT_FDCWD, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600, 0, SECCOMP_MAGIC) : -1;
+        ok = out >= 0 && (!with_data || overlay_copy_data(in, out, st.st_size));
+        if (out >= 0) {
+            // Keeping the owner only works for root, or for the groups of the owner
+            if (fchown(out, st.st_uid, st.st_gid) != 0) debug_fprintf(stderr, "Overlay: can not keep the owner of %s\n", lower);
+            fchmod(out, mode);
+            syscall(SYS_utimensat, out, NULL, times, 0, 0, SECCOMP_MAGIC); // futimens()
+            close(out);
+        }
+        if (in >= 0) close(in);
+    } else if (S_ISLNK(st.st_mode)) {
+        char target[MAX_PATH];
+        ssize_t target_length = syscall(SYS_readlinkat, AT_FDCWD, lower, target, sizeof target - 1, 0, SECCOMP_MAGIC);
+        if (target_length >= 0) {
+            target[target_length] = '\0';
+            ok = syscall(SYS_symlinkat, target, AT_FDCWD, temp, 0, 0, SECCOMP_MAGIC) == 0;
+            if (ok) syscall(SYS_utimensat, AT_FDCWD, temp, times, AT_SYMLINK_NOFOLLOW, 0, SECCOMP_MAGIC);
+        }
+    } else {
+        // Devices only work for root
+        ok = syscall(SYS_mknodat, AT_FDCWD, temp, st.st_mode, st.st_rdev, 0, SECCOMP_MAGIC) == 0;
+        if (ok) syscall(SYS_fchmodat, AT_FDCWD, temp, mode, 0, 0, SECCOMP_MAGIC);
+    }
+
+    // linkat() does not replace the copy of another process, renameat2() is for filesystems without hard links
+    if (ok) {
+        ok = syscall(SYS_linkat, AT_FDCWD, temp, AT_FDCWD, upper, 0, SECCOMP_MAGIC) == 0 || errno == EEXIST
+            || syscall(SYS_renameat2, AT_FDCWD, temp, AT_FDCWD, upper, RENAME_NOREPLACE, SECCOMP_MAGIC) == 0 || errno == EEXIST;
+    }
+    syscall(SYS_unlinkat, AT_FDCWD, temp, 0, 0, 0, SECCOMP_MAGIC);
+    if (ok) {
+        info_fprintf(stderr, "Overlay: copied up '%s' => '%s'\n", lower, upper);
+        overlay_changed(upper);
+    }
+    return ok;
+}
+
+// Creates the whiteout of the rest in the upper layer. Returns false if that failed.
+static int overlay_whiteout(const struct overlay_location *location)
+{
+    char whiteout[MAX_PATH];
+    if (!overlay_whiteout_path(location->dests[0], location->dest_lengths[0], location->rest, location->rest_length, whiteout)) return 0;
+    int fd = syscall(SYS_openat, AT_FDCWD, whiteout, O_WRONLY | O_CREAT | O_CLOEXEC, 0644, 0, SECCOMP_MAGIC);
+    if (fd < 0) return 0;
+    close(fd);
+    info_fprintf(stderr, "Overlay: whiteout '%s'\n", whiteout);
+    overlay_changed(whiteout);
+    return 1;
+}
+
+// Returns the first lower layer in which the rest is visible, or 0 if it is in none
+static int overlay_find_lower(const struct overlay_location *location)
+{
+    if (overlay_hidden(location->dests[0], location->dest_lengths[0], location->rest, location->rest_length)) return 0;
+    char path[MAX_PATH];
+    for (int layer = 1; layer < location->n_layers; layer++) {
+        if (overlay_layer_path(location, layer, location->rest_length, path) && layer_path_exists(path)) return layer;
+    }
+    return 0;
+}
+
+// Returns the first layer from the layer of the path on, in which the directory at the rest has a visible
+// entry, or -1 if the merged directory is empty. Entries of the lower layers are hidden by whiteouts.
+static int overlay_dir_entry(const struct overlay_location *location)
+{
+    // If the directory is in the upper layer and has a whiteout, it hides the lower layers completely
+    if (location->layer == 0 && overlay_hidden(location->dests[0], location->dest_lengths[0], location->rest, location->rest_length)) {
+        return -1;
+    }
+    char path[MAX_PATH], child[MAX_PATH], whiteout[MAX_PATH];
+    char buffer[4096];
+    for (int layer = location->layer; layer < location->n_layers; layer++) {
+        if (!overlay_layer_path(location, layer, location->rest_length, path)) continue;
+        int fd = syscall(SYS_openat, AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0, 0, SECCOMP_MAGIC);
+        if (fd < 0) continue;
+        int found = 0;
+        long n;
+        while (!found && (n = syscall(SYS_getdents64, fd, buffer, sizeof buffer)) > 0) {
+            for (long offset = 0; offset < n && !found; ) {
+                struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+                offset += entry->d_reclen;
+                const char *name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || overlay_is_whiteout(name)) continue;
+                int length = snprintf(child, sizeof child, "%.*s/%s", (int)location->rest_length, location->rest, name);
+                found = layer == 0 || length < 0 || (size_t)length >= sizeof child
+                    || !overlay_whiteout_path(location->dests[0], location->dest_lengths[0], child, length, whiteout)
+                    || syscall(SYS_faccessat, AT_FDCWD, whiteout, F_OK, 0, 0, SECCOMP_MAGIC) != 0;
+            }
+        }
+        close(fd);
+        if (found) return layer;
+    }
+    return -1;
+}
+
+// Removes the whiteouts in the directory at the rest in the upper layer, so that rmdir() can remove it
+static void overlay_remove_whiteouts(const struct overlay_location *location)
+{
+    char path[MAX_PATH], whiteout[MAX_PATH];
+    char buffer[4096];
+    if (!overlay_layer_path(location, 0, location->rest_length, path)) return;
+    int fd = syscall(SYS_openat, AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0, 0, SECCOMP_MAGIC);
+    if (fd < 0) return;
+    // Start again after removing entries, because the directory changed while it was read
+    for (int removed = 1; removed; ) {
+        removed = 0;
+        lseek(fd, 0, SEEK_SET);
+        long n;
+        while ((n = syscall(SYS_getdents64, fd, buffer, sizeof buffer)) > 0) {
+            for (long offset = 0; offset < n; ) {
+                struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+                offset += entry->d_reclen;
+                if (!overlay_is_whiteout(entry->d_name)) continue;
+                if (syscall(SYS_unlinkat, fd, entry->d_name, 0, 0, 0, SECCOMP_MAGIC) != 0) continue;
+                removed = 1;
+                if (snprintf(whiteout, sizeof whiteout, "%s/%s", path, entry->d_name) < (int)sizeof whiteout) overlay_changed(whiteout);
+            }
+        }
+    }
+    close(fd);
+}
+
+// Prepares the layers for a call which uses the mapped path as described by access (OVERLAY_*), and returns
+// the path which the call should use: path itself, or its copy in the upper layer written to buffer.
+// Returns NULL and sets errno if the call must fail.
+static const char *overlay_apply(int access, const char *path, char *buffer, size_t buffer_size)
+{
+    struct overlay_location location;
+    // The destinations themselves are left alone
+    if (!overlay_locate(path, &location) || location.rest_length == 0) return path;
+    int saved_errno = errno;
+    int in_lower = location.layer > 0;
+    int ok = 1;
+    struct stat st;
+    char layer_path[MAX_PATH];
+
+    switch (access) {
+    case OVERLAY_CREATE:
+        if (in_lower) return path; // The call fails with EEXIST
+        ok = overlay_make_parents(&location);
+        break;
+    case OVERLAY_WRITE:
+    case OVERLAY_REPLACE:
+        ok = overlay_make_parents(&location) && (!in_lower || overlay_copy_up(&location, access == OVERLAY_WRITE));
+        break;
+    case OVERLAY_RENAME: {
+        int lower = in_lower ? location.layer : overlay_find_lower(&location);
+        if (lower > 0 && (overlay_lstat(path, &st) != 0 || S_ISDIR(st.st_mode))) {
+            errno = EXDEV;
+            return NULL;
+        }
+        ok = overlay_make_parents(&location) && (!in_lower || overlay_copy_up(&location, 1)) && (lower == 0 || overlay_whiteout(&location));
+        break;
+    }
+    case OVERLAY_UNLINK:
+    case OVERLAY_RMDIR:
+    case OVERLAY_REMOVE: {
+        if (overlay_lstat(path, &st) != 0) return path;
+        int is_dir = S_ISDIR(st.st_mode);
+        // The call fails with EISDIR or ENOTDIR without changing the lower layer
+        if ((access == OVERLAY_UNLINK && is_dir) || (access == OVERLAY_RMDIR && !is_dir)) return path;
+        if (is_dir) {
+            int layer = overlay_dir_entry(&location);
+            // The call fails with ENOTEMPTY, or EROFS
+            errno = saved_errno;
+            if (layer == 0) return path;
+            if (layer > 0) return overlay_layer_path(&location, layer, location.rest_length, layer_path) && strlen(layer_path) < buffer_size
+                ? strcpy(buffer, layer_path) : path;
+            if (!in_lower) overlay_remove_whiteouts(&location);
+        }
+        int lower = in_lower ? location.layer : overlay_find_lower(&location);
+        ok = lower == 0 || (overlay_make_parents(&location) && overlay_whiteout(&location));
+        if (ok && in_lower) {
+            // The call removes an empty placeholder in the upper layer, so that it returns its usual result
+            ok = overlay_layer_path(&location, 0, location.rest_length, layer_path);
+            if (ok && is_dir) {
+                ok = syscall(SYS_mkdirat, AT_FDCWD, layer_path, 0700, 0, 0, SECCOMP_MAGIC) == 0 || errno == EEXIST;
+            } else if (ok) {
+                int fd = syscall(SYS_openat, AT_FDCWD, layer_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600, 0, SECCOMP_MAGIC);
+                ok = fd >= 0;
+                if (ok) close(fd);
+            }
+            if (ok) overlay_changed(layer_path);
+        }
+        break;
+    }
+    }
+
+    if (!ok) {
+        error_fprintf(stderr, "PATH_MAPPING_OVERLAY: can not prepare the upper layer for %s: %s\n", path, strerror(errno));
+        errno = saved_errno;
+        return path;
+    }
+    errno = saved_errno;
+    if (!in_lower || !overlay_layer_path(&location, 0, strlen(location.rest), layer_path) || strlen(layer_path) >= buffer_size) return path;
+    info_fprintf(stderr, "Overlay Path: '%s' => '%s'\n", path, layer_path);
+    return strcpy(buffer, layer_path);
+}
+
+// Called with every mapped path, see overlay_apply()
+static inline const char *overlay_prepare(int access, const char *original, const char *path, char *buffer, size_t buffer_size)
+{
+    if (!overlay_enabled || access == OVERLAY_READ || path == NULL || path == original) return path;
+    return overlay_apply(access, path, buffer, buffer_size);
+}
+
+#ifndef DISABLE_DIRFD
+// Returns true if the virtual directory path is in a prefix with layers, whose listings are merged
+static int overlay_merges(const char *path)
+{
+    if (!overlay_enabled) return 0;
+    unsigned long *reader = path_table_reloadable ? table_read_lock() : NULL;
+    const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_SEQ_CST);
+    int rule = table != NULL ? trie_lookup(table, TABLE_NODES(table), path) : -1;
+    int merges = rule >= 0 && TABLE_RULES(table)[rule].next_layer >= 0;
+    if (reader != NULL) table_read_unlock(reader);
+    return merges;
+}
+#endif // DISABLE_DIRFD
+
+#if !defined(DISABLE_DIRFD) && !defined(DISABLE_READDIR)
+// Returns the names in the directories of the virtual directory path in all layers, except the first layer which
+// contains it, because the real readdir() lists that one. The names are consecutive strings in a block allocated
+// with malloc(), or NULL if there are none. Must be called with the table locked.
+static char *overlay_list_layers(const struct path_map_table *table, const char *path, int *n_names, size_t *names_size)
+{
+    *n_names = 0;
+    *names_size = 0;
+    int rule = overlay_enabled && table != NULL ? trie_lookup(table, TABLE_NODES(table), path) : -1;
+    const struct path_map_rule *rules = rule >= 0 ? TABLE_RULES(table) : NULL;
+    if (rule < 0 || rules[rule].next_layer < 0) return NULL;
+
+    const char *rest = path + rules[rule].prefix_length;
+    char *names = NULL;
+    size_t capacity = 0;
+    int listed_first = 0;
+    char dir[MAX_PATH];
+    char buffer[4096];
+    for (int i = rule; i >= 0; ) {
+        if (rules[i].dest_length + strlen(rest) < sizeof dir) {
+            snprintf(dir, sizeof dir, "%s%s", TABLE_STRINGS(table) + rules[i].dest, rest);
+            int fd = syscall(SYS_openat, AT_FDCWD, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0, 0, SECCOMP_MAGIC);
+            if (fd >= 0 && !listed_first) {
+                listed_first = 1;
+                close(fd);
+                fd = -1;
+            }
+            long n;
+            while (fd >= 0 && (n = syscall(SYS_getdents64, fd, buffer, sizeof buffer)) > 0) {
+                for (long offset = 0; offset < n; ) {
+                    struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+                    offset += entry->d_reclen;
+                    const char *name = entry->d_name;
+                    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || overlay_is_whiteout(name)) continue;
+                    size_t length = strlen(name) + 1;
+                    if (*names_size + length > capacity) {
+                        size_t new_capacity = capacity > 0 ? 2 * capacity : sizeof buffer;
+                        char *new_names = realloc(names, new_capacity);
+                        if (new_names == NULL) continue;
+                        names = new_names;
+                        capacity = new_capacity;
+                    }
+                    memcpy(names + *names_size, name, length);
+                    *names_size += length;
+                    (*n_names)++;
+                }
+            }
+            if (fd >= 0) close(fd);
+        }
+        int next = rules[i].next_layer;
+        i = next > i && (uint32_t)next < table->n_rules ? next : -1;
+    }
+    return names;
+}
+#endif // DISABLE_READDIR
+
+#else // DISABLE_OVERLAY
+
+static int overlay_hidden(const char *upper, size_t upper_length, const char *rest, size_t rest_length) { return 0; }
+static inline const char *overlay_prepare(int access, const char *original, const char *path, char *buffer, size_t buffer_size)
+{
+    return path;
+}
+static inline int overlay_merges(const char *path) { return 0; }
+static inline char *overlay_list_layers(const struct path_map_table *table, const char *path, int *n_names, size_t *names_size)
+{
+    *n_names = 0;
+    *names_size = 0;
+    return NULL;
+}
+
+#endif // DISABLE_OVERLAY
+
+// Prepares both paths of rename() (see overlay_prepare()). Returns false if the call must fail with errno.
+static inline int overlay_prepare_rename(const char *oldpath, const char **new_oldpath, char *buffer,
+        const char *newpath, const char **new_newpath, char *buffer2, size_t buffer_size)
+{
+    const char *prepared = overlay_prepare(OVERLAY_RENAME, oldpath, *new_oldpath, buffer, buffer_size);
+    if (prepared == NULL) return 0;
+    *new_oldpath = prepared;
+    *new_newpath = overlay_prepare(OVERLAY_REPLACE, newpath, *new_newpath, buffer2, buffer_size);
+    return 1;
+}
+
+
+/////////////////////////////////////////////////////////
+//     Per-thread cache of recent translations         //
+/////////////////////////////////////////////////////////
+
+
+// Programs look up the same paths over and over (Python stats the same directories for every import,
+// compilers open the same headers for every file), and each lookup walks the trie again, and checks
+// the layers of layered rules. So each thread remembers which rule matched its recently mapped paths
+// in a small direct mapped cache, and a hit only costs hashing and comparing the path.
+// Paths which are rejected by table_may_match() are never cached, because rejecting them is cheaper.
+//
+// Entries are valid for one generation of path_table, which changes whenever the table is replaced.
+// The generation is read before the table and incremented after it is replaced, so an entry can at
+// worst be stored for an outdated generation, and is then never used. Entries for layered rules also
+// expire after PATH_MAPPING_CACHE_TTL, like the results of layer_path_exists() which they depend on.
+//
+// The cache of a thread is allocated with mmap() on first use, so that it also works after vfork()
+// and in signal handlers. A signal handler which interrupts the same thread while it uses the cache
+// (e.g. seccomp_handler()) bypasses it, and so does one which runs after the cache was released,
+// while the thread exits.
+
+#define PATH_CACHE_ENTRIES 64       // Power of two
+#define PATH_CACHE_MAX_LENGTH 232   // Longer paths are not cached, so each entry has 256 bytes
+#define PATH_CACHE_MISS (-2)
+#define PATH_CACHE_NO_LAYERS 0      // Value of time for rules without layers, which never expire
+#define PATH_CACHE_RELEASED ((struct path_cache *)-1) // The cache of a thread which exits
+
+#ifndef DISABLE_PATH_CACHE
+
+struct path_cache_entry {
+    uint64_t hash;
+    unsigned generation;            // 0 for unused entries, because the first table has generation 1
+    int rule;                       // The matching rule or layer, or -1 if no rule matches
+    uint32_t length;
+    uint32_t time;                  // When the layers were checked, in milliseconds, or PATH_CACHE_NO_LAYERS
+    char path[PATH_CACHE_MAX_LENGTH];
+};
+
+struct path_cache {
+    int busy;                       // Set while the thread uses the cache
+    struct path_cache_entry entries[PATH_CACHE_ENTRIES];
+};
+
+static __thread struct path_cache *path_cache __attribute__((tls_model("initial-exec"))) = NULL;
+static pthread_key_t path_cache_key;
+static pthread_once_t path_cache_key_once = PTHREAD_ONCE_INIT;
+
+#ifdef DEBUG
+static unsigned long path_cache_hits = 0, path_cache_misses = 0;
+#endif
+
+static void path_cache_free(void *cache)
+{
+    path_cache = PATH_CACHE_RELEASED; // Signals can still arrive, and must neither use it nor allocate a new one
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    munmap(cache, sizeof(struct path_cache));
+}
+
+static void path_cache_create_key()
+{
+    pthread_key_create(&path_cache_key, path_cache_free);
+}
+
+// Returns the cache of the current thread with busy set, or NULL if it is already in use or can not be allocated
+static struct path_cache *path_cache_acquire()
+{
+    struct path_cache *cache = path_cache;
+    if (cache == PATH_CACHE_RELEASED) return NULL;
+    if (cache == NULL) {
+        cache = mmap(NULL, sizeof *cache, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (cache == MAP_FAILED) return NULL;
+        pthread_once(&path_cache_key_once, path_cache_create_key);
+        pthread_setspecific(path_cache_key, cache); // Releases the cache when the thread exits
+        path_cache = cache;
+    }
+    if (cache->busy) return NULL;
+    cache->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    return cache;
+}
+
+static inline void path_cache_release(struct path_cache *cache)
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    cache->busy = 0;
+}
+
+// Hashes 8 bytes at a time, which is much faster than byte-wise hashes like FNV for long paths
+static inline uint64_t path_cache_hash(const char *path, size_t length)
+{
+    uint64_t hash = length * 0x9E3779B97F4A7C15ull;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, path + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, path + i, length - i);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+// Returns the cached rule for path, or PATH_CACHE_MISS. On a miss, *slot is set to the entry which
+// path_cache_put() must fill, or to NULL if path can not be cached.
+static inline int path_cache_get(unsigned generation, const char *path, size_t length, struct path_cache_entry **slot)
+{
+    *slot = NULL;
+    if (length > PATH_CACHE_MAX_LENGTH || generation == 0) return PATH_CACHE_MISS;
+    struct path_cache *cache = path_cache_acquire();
+    if (cache == NULL) return PATH_CACHE_MISS;
+    uint64_t hash = path_cache_hash(path, length);
+    struct path_cache_entry *entry = &cache->entries[hash & (PATH_CACHE_ENTRIES - 1)];
+    if (entry->generation == generation && entry->hash == hash && entry->length == length
+            && memcmp(entry->path, path, length) == 0
+            && (entry->time == PATH_CACHE_NO_LAYERS || (uint32_t)layer_cache_now() - entry->time < layer_cache_ttl)) {
+        int rule = entry->rule;
+        path_cache_release(cache);
+#ifdef DEBUG
+        __atomic_fetch_add(&path_cache_hits, 1, __ATOMIC_RELAXED);
+#endif
+        return rule;
+    }
+#ifdef DEBUG
+    __atomic_fetch_add(&path_cache_misses, 1, __ATOMIC_RELAXED);
+#endif
+    entry->generation = 0;
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->path, path, length);
+    *slot = entry;
+    return PATH_CACHE_MISS; // The cache stays busy until path_cache_put()
+}
+
+// Stores the rule for the path of a miss. layered is set if the rule was selected by layer_select().
+static inline void path_cache_put(struct path_cache_entry *slot, unsigned generation, int rule, int layered)
+{
+    if (slot == NULL) return;
+    if (!layered || layer_cache_ttl > 0) {
+        slot->rule = rule;
+        slot->time = layered ? (uint32_t)layer_cache_now() | 1 : PATH_CACHE_NO_LAYERS; // Odd, so never PATH_CACHE_NO_LAYERS
+        slot->generation = generation;
+    }
+    path_cache_release(path_cache);
+}
+
+// Prints the hit rate in the debug build
+static void path_cache_print_stats()
+{
+#ifdef DEBUG
+    unsigned long hits = path_cache_hits, misses = path_cache_misses;
+    debug_fprintf(stderr, "path cache: %lu hits, %lu misses (%.1f%% hits)\n", hits, misses,
+            hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+#endif
+}
+
+#else // DISABLE_PATH_CACHE
+
+struct path_cache_entry;
+
+static inline int path_cache_get(unsigned generation, const char *path, size_t length, struct path_cache_entry **slot)
+{
+    *slot = NULL;
+    return PATH_CACHE_MISS;
+}
+
+static inline void path_cache_put(struct path_cache_entry *slot, unsigned generation, int rule, int layered)
+{
+}
+
+static void path_cache_print_stats()
+{
+}
+
+#endif // DISABLE_PATH_CACHE
+
+/////////////////////////////////////////////////////////
+//         Mapping paths with the current table        //
+/////////////////////////////////////////////////////////
+
+
+// Returns the index of the rule which maps path, from the trie of literal prefixes or from the DFA
+// of patterns, whichever matches the longer part of path. Returns -1 if none does, or if an exclusion wins.
+static int table_lookup(const struct path_map_table *table, const char *path)
+{
+    int rule = trie_lookup(table, TABLE_NODES(table), path);
+    if (table->n_dfa_states == 0) return rule;
+    size_t pattern_length = 0;
+    int pattern_rule = dfa_lookup(table, path, &pattern_length);
+    if (pattern_rule < 0) return rule;
+    const struct path_map_rule *rules = TABLE_RULES(table);
+    int excludes = rules[pattern_rule].flags & RULE_EXCLUDE;
+    if (rule >= 0 && (rules[rule].prefix_length > pattern_length || (rules[rule].prefix_length == pattern_length && !excludes))) {
+        return rule;
+    }
+    return excludes ? -1 : pattern_rule;
+}
+
+// Check if path matches any prefix in table, and if so, replace it with its substitution.
+// generation must be read before table, see path_cache_get().
+// If counters is not NULL, the mapped path or the error is counted for path-mapping-stat.
+static inline const char *map_path_in_table(const struct path_map_table *table, unsigned generation, const char *function_name,
+        struct path_mapping_function_counters *counters, const char *path, char *new_path, size_t new_path_size)
+{
+    if (table == NULL) return path;
+    if (!table_may_match(table, path)) return path;
+
+    size_t path_length = strlen(path);
+    struct path_cache_entry *slot;
+    int rule_index = path_cache_get(generation, path, path_length, &slot);
+    if (rule_index == PATH_CACHE_MISS) {
+        rule_index = table_lookup(table, path);
+        int layered = rule_index >= 0 && TABLE_RULES(table)[rule_index].next_layer >= 0;
+        if (layered) {
+            size_t prefix_length = TABLE_RULES(table)[rule_index].prefix_length;
+            rule_index = layer_select(table, rule_index, path + prefix_length, path_length - prefix_length);
+        }
+        path_cache_put(slot, generation, rule_index, layered);
+    }
+    if (rule_index < 0) return path;
+
+    const struct path_map_rule *rule = &TABLE_RULES(table)[rule_index];
+    const char *strings = TABLE_STRINGS(table);
+    int fits;
+    if (rule->flags & RULE_PATTERN) {
+        fits = pattern_expand(table, rule, path, path_length, new_path, new_path_size);
+    } else {
+        const char *rest = path + rule->prefix_length;
+        size_t rest_length = path_length - rule->prefix_length;
+        fits = rule->dest_length + rest_length <= new_path_size - 1;
+        if (fits) {
+            memcpy(new_path, strings + rule->dest, rule->dest_length);
+            memcpy(new_path + rule->dest_length, rest, rest_length + 1);
+        }
+    }
+    if (!fits) {
+        error_fprintf(stderr, "ERROR fix_path: Path too long: %s(%s)\n", function_name, path);
+        if (counters != NULL) __atomic_fetch_add(&counters->too_long, 1, __ATOMIC_RELAXED);
+        return path;
+    }
+    info_fprintf(stderr, "Mapped Path: %s('%s') => '%s'\n", function_name, path, new_path);
+    trace_rule(rule_index);
+    if (counters != NULL) {
+        __atomic_fetch_add(&counters->mapped, 1, __ATOMIC_RELAXED);
+        stats_count_rule(rule_index);
+    }
+    return new_path;
+}
+
+// Check if path matches any defined prefix, and if so, replace it with its substitution
+static inline const char *map_path(const char *function_name, struct path_mapping_function_counters *counters,
+        const char *path, char *new_path, size_t new_path_size)
+{
+    if (path == NULL) return path;
+    if (!path_table_reloadable) {
+        unsigned generation = __atomic_load_n(&path_table_generation, __ATOMIC_RELAXED);
+        const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_RELAXED);
+        return map_path_in_table(table, generation, function_name, counters, path, new_path, new_path_size);
+    }
+    unsigned long *reader = table_read_lock();
+    unsigned generation = __atomic_load_n(&path_table_generation, __ATOMIC_SEQ_CST);
+    const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_SEQ_CST);
+    const char *result = map_path_in_table(table, generation, function_name, counters, path, new_path, new_path_size);
+    table_read_unlock(reader);
+    return result;
+}
+
+// Same as map_path(), without counting
+const char *fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size)
+{
+    return map_path(function_name, NULL, path, new_path, new_path_size);
+}
+
+/////////////////////////////////////////////////////////
+//   Mapping returned paths back to virtual paths      //
+/////////////////////////////////////////////////////////
+
+
+// Paths returned by functions like realpath() or getcwd() are real paths, so a program which
+// remembers them mixes real and virtual paths, and its own caches miss. If PATH_MAPPING_REVERSE
+// is set, those paths are mapped back, so realpath("/usr/virtual1/file") returns itself
+// instead of "/map/dest1/file". The lookup uses the trie of the destinations, so it costs
+// the same as map_path(). If several prefixes have the same destination, the first one wins,
+// and all layers of a prefix are mapped back to that prefix.
+
+static inline const char *unmap_path_in_table(const struct path_map_table *table, const char *function_name,
+        const char *path, char *new_path, size_t new_path_size)
+{
+    if (table == NULL || path[0] != '/') return path;
+    int rule_index = trie_lookup(table, TABLE_REVERSE_NODES(table), path);
+    if (rule_index < 0) return path;
+
+    const struct path_map_rule *rule = &TABLE_RULES(table)[rule_index];
+    const char *strings = TABLE_STRINGS(table);
+    const char *rest = path + pathlen(strings + rule->dest);
+    size_t rest_length = strlen(rest);
+    if (rule->prefix_length + rest_length + 1 > new_path_size - 1) {
+        error_fprintf(stderr, "ERROR unmap_path: Path too long: %s(%s)\n", function_name, path);
+        return path;
+    }
+    memcpy(new_path, strings + rule->prefix, rule->prefix_length);
+    memcpy(new_path + rule->prefix_length, rest, rest_length + 1);
+    if (new_path[0] == '\0') strcpy(new_path, "/"); // The prefix was "/"
+    info_fprintf(stderr, "Unmapped Path: %s('%s') => '%s'\n", function_name, path, new_path);
+    return new_path;
+}
+
+// Replace a real path with the virtual path which is mapped to it, if any
+static inline const char *unmap_path(const char *function_name, const char *path, char *new_path, size_t new_path_size)
+{
+    if (path == NULL) return path;
+    unsigned long *reader = path_table_reloadable ? table_read_lock() : NULL;
+    const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_SEQ_CST);
+    const char *result = unmap_path_in_table(table, function_name, path, new_path, new_path_size);
+    if (reader != NULL) table_read_unlock(reader);
+    return result;
+}
+
+// Same as unmap_path(), which is used for PATH_MAPPING_REVERSE
+const char *reverse_fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size)
+{
+    return unmap_path(function_name, path, new_path, new_path_size);
+}
+
+// Replaces the path returned by a function with its virtual path, if PATH_MAPPING_REVERSE is set.
+// result is either a buffer of result_size bytes which the caller passed in, or was allocated with
+// malloc() if result_size is 0. Returns the (possibly reallocated) result. If the virtual path
+// does not fit, the real path is returned.
+static char *unmap_result(const char *function_name, char *result, size_t result_size)
+{
+    if (result == NULL || !path_reverse_enabled) return result;
+    char buffer[MAX_PATH];
+    const char *virtual_path = unmap_path(function_name, result, buffer, sizeof buffer);
+    if (virtual_path == result) return result;
+    size_t size = strlen(virtual_path) + 1;
+    if (result_size == 0) {
+        char *new_result = realloc(result, size);
+        if (new_result == NULL) return result;
+        result = new_result;
+    } else if (size > result_size) {
+        return result;
+    }
+    memcpy(result, virtual_path, size);
+    return result;
+}
+
+// Same as unmap_result() for the target of a symlink returned by readlink(), which is not null-terminated
+static ssize_t unmap_link(const char *function_name, char *buf, size_t bufsiz, ssize_t length)
+{
+    if (length <= 0 || !path_reverse_enabled || buf[0] != '/' || (size_t)length >= MAX_PATH) return length;
+    char target[MAX_PATH], buffer[MAX_PATH];
+    memcpy(target, buf, length);
+    target[length] = '\0';
+    const char *virtual_path = unmap_path(function_name, target, buffer, sizeof buffer);
+    if (virtual_path == target) return length;
+    size_t new_length = strlen(virtual_path);
+    if (new_length > bufsiz) new_length = bufsiz; // Truncated like readlink() does
+    memcpy(buf, virtual_path, new_length);
+    return new_length;
+}
+
+/////////////////////////////////////////////////////////
+//  Virtual paths of the cwd and of directory fds      //
+/////////////////////////////////////////////////////////
+
+
+// Functions like openat() resolve relative paths relative to a directory file descriptor, and all
+// other functions resolve them relative to the current working directory. The kernel only knows
+// the real directories, so relative paths which lead into a mapped prefix (e.g. openat(open("/usr"),
+// "virtual1/file") or chdir("/usr") followed by open("virtual1/file")) would not be found.
+//
+// Therefore the virtual path of each directory which is opened through one of the overrides is
+// recorded in a table indexed by the file descriptor, if a longer prefix starts with that path.
+// All other directories need no entry, because relative paths below them are either not mapped
+// at all, or resolved by the kernel in the mapped destination, which gives the same result.
+// Relative paths are appended to the recorded path and then mapped like absolute paths.
+// If there is no entry for the dirfd, the path is left alone.
+//
+// The current working directory has an entry at index AT_FDCWD, which is set by chdir() and
+// fchdir() if the new directory is mapped, or if a longer prefix starts with it. It is also set
+// at startup from $PWD, if the real path of $PWD is the current directory. getcwd() returns this
+// virtual path. As long as the process never enters such a directory, relative paths cost one
+// pointer load more than before.
+//
+// ".." in relative paths is resolved on the virtual path (like "cd" in a shell), so that
+// leaving a mapped directory with chdir("..") leads back to the virtual parent.
+//
+// Entries are removed by close(), closedir() and close_range(), and copied by dup(), dup2()
+// and dup3(), but not by fcntl(F_DUPFD). Each open through an override replaces the entry of
+// the returned file descriptor. Forked children inherit the table together with the file
+// descriptors, but the table is lost by exec(), except for the cwd if $PWD is up to date.
+//
+// The table has two levels, so that it only needs memory for the file descriptors in use,
+// and lookups need no lock: the chunks are never freed, and entries are only read under
+// fd_paths_lock if they are not NULL. Most directories have no entry, so that close() and
+// the *at() functions usually only load one pointer.
+//
+// Signal handlers may call the overrides as well (open() and close() are async-signal-safe), so all
+// signals are blocked while the lock is held or an entry is allocated or freed. Otherwise a handler
+// could wait for the lock which the interrupted thread holds, or re-enter malloc().
+
+#ifndef DISABLE_DIRFD
+
+// Returns the PATH_* flags of path in table, for the literal prefixes and the patterns
+static int table_classify(const struct path_map_table *table, const char *path)
+{
+    int flags = trie_classify(table, path);
+    return table->n_dfa_states > 0 ? flags | dfa_classify(table, path) : flags;
+}
+
+// Returns the PATH_* flags of path in the current table (see trie_classify())
+static int path_classify(const char *path)
+{
+    if (!path_table_reloadable) {
+        const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_RELAXED);
+        return table != NULL ? table_classify(table, path) : 0;
+    }
+    unsigned long *reader = table_read_lock();
+    const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_SEQ_CST);
+    int result = table != NULL ? table_classify(table, path) : 0;
+    table_read_unlock(reader);
+    return result;
+}
+
+// Removes "." and empty components from an absolute path, and resolves ".." by removing the previous component.
+// A trailing slash is kept. Works in place, because the result is never longer than path.
+static void normalize_path(char *path)
+{
+    char *out = path;
+    const char *component = path;
+    while (*component != '\0') {
+        while (*component == '/') component++;
+        const char *end = component;
+        while (*end != '/' && *end != '\0') end++;
+        size_t length = end - component;
+        if (length == 2 && component[0] == '.' && component[1] == '.') {
+            while (out > path && *--out != '/') {}
+        } else if (length > 0 && !(length == 1 && component[0] == '.')) {
+            *out++ = '/';
+            memmove(out, component, length);
+            out += length;
+        }
+        if (*end == '\0' && end > path && end[-1] == '/' && out > path) *out++ = '/';
+        component = end;
+    }
+    if (out == path) *out++ = '/';
+    *out = '\0';
+}
+
+// Returns true if path contains ".." as a component
+static int path_has_dotdot(const char *path)
+{
+    for (const char *c = path; (c = strstr(c, "..")) != NULL; c += 2) {
+        if ((c == path || c[-1] == '/') && (c[2] == '/' || c[2] == '\0')) return 1;
+    }
+    return 0;
+}
+
+#define FD_PATHS_CHUNK 256
+#define FD_PATHS_MAX_FD (1 << 20)
+
+struct dir_listing;
+
+struct fd_path {
+    struct dir_listing *listing;    // Virtual entries for readdir(), created on demand (see below)
+    char path[];
+};
+
+static struct fd_path **fd_paths[FD_PATHS_MAX_FD / FD_PATHS_CHUNK];
+static struct fd_path *cwd_path = NULL; // The entry of AT_FDCWD
+static pthread_mutex_t fd_paths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the entry of fd in fd_paths. Returns NULL if there is none, unless create is set.
+static inline struct fd_path **fd_paths_entry(int fd, int create)
+{
+    if (fd == AT_FDCWD) return &cwd_path;
+    if (fd < 0 || fd >= FD_PATHS_MAX_FD) return NULL;
+    struct fd_path **chunk = __atomic_load_n(&fd_paths[fd / FD_PATHS_CHUNK], __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        if (!create) return NULL;
+        struct fd_path **new_chunk = calloc(FD_PATHS_CHUNK, sizeof *new_chunk);
+        if (new_chunk == NULL) return NULL;
+        if (__atomic_compare_exchange_n(&fd_paths[fd / FD_PATHS_CHUNK], &chunk, new_chunk, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            chunk = new_chunk;
+        } else {
+            free(new_chunk); // Another thread was faster, and chunk now contains its chunk
+        }
+    }
+    return &chunk[fd % FD_PATHS_CHUNK];
+}
+
+// Blocks all signals in the current thread until fd_paths_unblock_signals()
+static inline void fd_paths_block_signals(sigset_t *old_signals)
+{
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, old_signals);
+}
+
+static inline void fd_paths_unblock_signals(const sigset_t *old_signals)
+{
+    pthread_sigmask(SIG_SETMASK, old_signals, NULL);
+}
+
+// Returns true if fd may have an entry. This is the fast path, which takes no lock.
+static inline int fd_paths_exists(int fd)
+{
+    struct fd_path **entry = fd_paths_entry(fd, 0);
+    return entry != NULL && __atomic_load_n(entry, __ATOMIC_RELAXED) != NULL;
+}
+
+// Copies the virtual path of fd into buffer. Returns its length, or -1 if fd has no entry or it is too long.
+static ssize_t fd_paths_get(int fd, char *buffer, size_t buffer_size)
+{
+    if (!fd_paths_exists(fd)) return -1;
+    ssize_t length = -1;
+    sigset_t old_signals;
+    fd_paths_block_signals(&old_signals);
+    pthread_mutex_lock(&fd_paths_lock);
+    const struct fd_path *entry = *fd_paths_entry(fd, 0);
+    if (entry != NULL && strlen(entry->path) < buffer_size) {
+        length = strlen(entry->path);
+        memcpy(buffer, entry->path, length + 1);
+    }
+    pthread_mutex_unlock(&fd_paths_lock);
+    fd_paths_unblock_signals(&old_signals);
+    return length;
+}
+
+// Sets the virtual path of fd, or removes the entry if path is NULL.
+// path must be normalized, but may end with a slash, which is not stored.
+static void fd_paths_set(int fd, const char *path)
+{
+    if (path == NULL && !fd_paths_exists(fd)) return;
+    sigset_t old_signals;
+    fd_paths_block_signals(&old_signals);
+    struct fd_path *new_entry = NULL;
+    if (path != NULL) {
+        size_t path_length = pathlen(path);
+        if (path_length == 0) path_length = 1; // The root directory
+        new_entry = malloc(sizeof *new_entry + path_length + 1);
+        if (new_entry != NULL) {
+            new_entry->listing = NULL;
+            memcpy(new_entry->path, path, path_length);
+            new_entry->path[path_length] = '\0';
+        }
+    }
+    struct fd_path **entry = fd_paths_entry(fd, new_entry != NULL);
+    struct fd_path *old = new_entry;
+    if (entry != NULL) {
+        pthread_mutex_lock(&fd_paths_lock);
+        old = *entry;
+        __atomic_store_n(entry, new_entry, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&fd_paths_lock);
+    }
+    if (old != NULL) free(old->listing);
+    free(old);
+    fd_paths_unblock_signals(&old_signals);
+}
+
+// Gives new_fd the same entry as old_fd, after new_fd was created by dup()
+static void fd_paths_dup(int old_fd, int new_fd)
+{
+    if (old_fd == new_fd) return;
+    if (!fd_paths_exists(old_fd)) {
+        fd_paths_set(new_fd, NULL);
+        return;
+    }
+    char path[MAX_PATH];
+    fd_paths_set(new_fd, fd_paths_get(old_fd, path, sizeof path) >= 0 ? path : NULL);
+}
+
+// Removes the entries of all file descriptors from first to last
+static void fd_paths_clear_range(unsigned int first, unsigned int last)
+{
+    if (last >= FD_PATHS_MAX_FD) last = FD_PATHS_MAX_FD - 1;
+    for (unsigned int fd = first; fd <= last && fd < FD_PATHS_MAX_FD; fd++) {
+        if (__atomic_load_n(&fd_paths[fd / FD_PATHS_CHUNK], __ATOMIC_ACQUIRE) == NULL) {
+            fd = (fd / FD_PATHS_CHUNK + 1) * FD_PATHS_CHUNK - 1; // Skip the whole chunk
+            continue;
+        }
+        fd_paths_set(fd, NULL);
+    }
+}
+
+// Joins the virtual path of dirfd (or the cwd) and the relative path into buffer, and normalizes the result.
+// Returns false if dirfd has no entry, or if the result does not fit into buffer.
+static int fd_paths_join(int dirfd, const char *path, char *buffer, size_t buffer_size)
+{
+    ssize_t dir_length = fd_paths_get(dirfd, buffer, buffer_size);
+    if (dir_length < 0) return 0;
+    size_t path_length = strlen(path);
+    if (dir_length + 1 + path_length + 1 > buffer_size) return 0;
+    buffer[dir_length] = '/';
+    memcpy(buffer + dir_length + 1, path, path_length + 1);
+    normalize_path(buffer);
+    return 1;
+}
+
+// Called after fd was opened for path (relative to at_fd) by one of the overrides
+static void fd_paths_opened(int fd, int at_fd, const char *path)
+{
+    char buffer[MAX_PATH];
+    const char *virtual_path = NULL;
+    if (path[0] == '/' && strlen(path) < sizeof buffer) {
+        strcpy(buffer, path);
+        normalize_path(buffer);
+        virtual_path = buffer;
+    } else if (fd_paths_join(at_fd, path, buffer, sizeof buffer)) {
+        virtual_path = buffer;
+    }
+    struct stat st;
+    if (virtual_path != NULL && ((path_classify(virtual_path) & PATH_HAS_PREFIXES_BELOW) || overlay_merges(virtual_path))
+            && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        fd_paths_set(fd, virtual_path);
+    } else {
+        fd_paths_set(fd, NULL);
+    }
+}
+
+// Keeps the lock consistent in the child of a fork(), if another thread held it at that time
+static void fd_paths_atfork_prepare() { pthread_mutex_lock(&fd_paths_lock); }
+static void fd_paths_atfork_parent() { pthread_mutex_unlock(&fd_paths_lock); }
+static void fd_paths_atfork_child() { pthread_mutex_unlock(&fd_paths_lock); }
+
+// Called after chdir(path) succeeded
+static void fd_paths_chdir(const char *path)
+{
+    char buffer[MAX_PATH];
+    const char *virtual_path = NULL;
+    if (path[0] == '/' && strlen(path) < sizeof buffer) {
+        strcpy(buffer, path);
+        normalize_path(buffer);
+        virtual_path = buffer;
+    } else if (fd_paths_join(AT_FDCWD, path, buffer, sizeof buffer)) {
+        virtual_path = buffer;
+    }
+    fd_paths_set(AT_FDCWD, virtual_path != NULL && path_classify(virtual_path) != 0 ? virtual_path : NULL);
+}
+
+// Takes over $PWD as the virtual cwd, if it is mapped to the real cwd (e.g. after "cd /usr/virtual1" in a shell)
+static void fd_paths_init_cwd()
+{
+    const char *pwd = getenv("PWD");
+    char virtual_path[MAX_PATH], buffer[MAX_PATH], cwd[MAX_PATH];
+    if (pwd == NULL || pwd[0] != '/' || strlen(pwd) >= sizeof virtual_path) return;
+    strcpy(virtual_path, pwd);
+    normalize_path(virtual_path);
+    if (path_classify(virtual_path) == 0) return;
+    const char *real_path = map_path("PWD", NULL, virtual_path, buffer, sizeof buffer);
+    // Ask the kernel directly, because getcwd() returns the virtual cwd
+    if (syscall(SYS_getcwd, cwd, sizeof cwd) > 0 && strcmp(cwd, real_path) == 0) {
+        fd_paths_set(AT_FDCWD, virtual_path);
+    }
+}
+
+// Must be called after the table was loaded
+static void fd_paths_init()
+{
+    pthread_atfork(fd_paths_atfork_prepare, fd_paths_atfork_parent, fd_paths_atfork_child);
+    fd_paths_init_cwd();
+}
+
+#define NO_DIRFD -1
+
+// Same as map_path(), but resolves relative paths relative to the virtual path of dirfd,
+// or of the current working directory if dirfd is AT_FDCWD. Pass NO_DIRFD to only map relative paths
+// which match a relative prefix, e.g. for the file name of execvp(), which is searched in $PATH.
+static inline const char *map_path_at(const char *function_name, struct path_mapping_function_counters *counters,
+        int dirfd, const char *path, char *new_path, size_t new_path_size)
+{
+    if (seccomp_active && !seccomp_in_handler && !SECCOMP_NOT_TRAPPED(function_name)) return path; // Mapped by seccomp_handler()
+    const char *result = map_path(function_name, counters, path, new_path, new_path_size);
+    if (result != path || path == NULL || path[0] == '/' || path[0] == '\0') return result;
+    if (!fd_paths_exists(dirfd)) return path;
+    char virtual_path[MAX_PATH];
+    if (!fd_paths_join(dirfd, path, virtual_path, sizeof virtual_path)) return path;
+    result = map_path(function_name, counters, virtual_path, new_path, new_path_size);
+    if (result != virtual_path) return result;
+
+    // Not mapped, but ".." must still be resolved on the virtual path, because the kernel would resolve it on the real path
+    if (!path_has_dotdot(path) || strlen(virtual_path) >= new_path_size) return path;
+    strcpy(new_path, virtual_path);
+    return new_path;
+}
+
+
+#ifndef DISABLE_READDIR
+/////////////////////////////////////////////////////////
+//    Virtual entries in listings of directories       //
+/////////////////////////////////////////////////////////
+
+
+// A mapped prefix like /usr/virtual1 does not exist in the real /usr, so readdir() would never return it.
+// Therefore the overrides of readdir(), readdir64() and getdents64() append the names of mapped prefixes
+// directly below a directory to its listing, unless the real directory already contains them.
+// With PATH_MAPPING_OVERLAY, the names in the other layers of a directory are appended as well.
+//
+// The trie already holds the children of each directory in sorted order, so the names of the mapped
+// children only have to be copied from there. This is done once per open directory, by the first call
+// of readdir() on a file descriptor which has an entry in fd_paths. Directories without mapped children
+// never have such an entry, so listing them only costs the check of fd_paths.
+// While the real entries are returned, their names are marked as seen, so that they are not repeated.
+// After the last real entry, the remaining names are returned, with the inode and type of the
+// destination. Names whose destination does not exist are skipped.
+
+// Returns the node of table for exactly path, or NULL if there is none
+static const struct path_trie_node *trie_find_node(const struct path_map_table *table, const char *path)
+{
+    const struct path_trie_node *nodes = TABLE_NODES(table);
+    const char *strings = TABLE_STRINGS(table);
+    const struct path_trie_node *node = &nodes[0];
+    const char *path_end = path + pathlen(path);
+
+    const char *component = path;
+    for (;;) {
+        const char *end = component;
+        while (*end != '/' && end < path_end) end++;
+        node = trie_find_child(nodes, strings, node, component, end - component);
+        if (node == NULL || end == path_end) return node;
+        component = end + 1;
+    }
+}
+
+
+struct dir_listing {
+    int n_names;
+    int next;                   // Index of the next name to check after the real entries
+    const char **names;         // Sorted like the children in the trie
+    unsigned char *seen;        // One byte per name
+    union {
+        struct dirent entry;
+        struct dirent64 entry64;
+    } buffer;                   // Returned by readdir(), valid until the next call
+};
+
+// Orders names like the children in the trie, for qsort()
+static int dir_listing_compare(const void *left, const void *right)
+{
+    const char *a = *(const char * const *)left;
+    const char *b = *(const char * const *)right;
+    return trie_name_compare(a, strlen(a), b, strlen(b));
+}
+
+// Allocates the listing for the virtual directory path in one block, or returns NULL if out of memory
+static struct dir_listing *dir_listing_create(const char *path)
+{
+    struct dir_listing *listing = NULL;
+    unsigned long *reader = path_table_reloadable ? table_read_lock() : NULL;
+    const struct path_map_table *table = __atomic_load_n(&path_table, __ATOMIC_SEQ_CST);
+    const struct path_trie_node *node = table != NULL ? trie_find_node(table, path) : NULL;
+    const struct path_trie_node *nodes = table != NULL ? TABLE_NODES(table) : NULL;
+    int n_layer_names;
+    size_t layer_names_size;
+    char *layer_names = overlay_list_layers(table, path, &n_layer_names, &layer_names_size);
+    int n_names = n_layer_names;
+    size_t names_size = layer_names_size;
+    for (uint32_t i = 0; node != NULL && i < node->n_children; i++) {
+        const struct path_trie_node *child = &nodes[node->first_child + i];
+        if (child->rule >= 0 && child->name_length < sizeof listing->buffer.entry.d_name) {
+            n_names++;
+            names_size += child->name_length + 1;
+        }
+    }
+    listing = malloc(sizeof *listing + n_names * (sizeof(char *) + 1) + names_size);
+    if (listing != NULL) {
+        listing->n_names = n_names;
+        listing->next = 0;
+        listing->names = (const char **)(listing + 1);
+        listing->seen = (unsigned char *)(listing->names + n_names);
+        memset(listing->seen, 0, n_names);
+        char *name = (char *)(listing->seen + n_names);
+        int n = 0;
+        for (uint32_t i = 0; node != NULL && i < node->n_children; i++) {
+            const struct path_trie_node *child = &nodes[node->first_child + i];
+            if (child->rule >= 0 && child->name_length < sizeof listing->buffer.entry.d_name) {
+                memcpy(name, TABLE_STRINGS(table) + child->name, child->name_length);
+                name[child->name_length] = '\0';
+                listing->names[n++] = name;
+                name += child->name_length + 1;
+            }
+        }
+        // The names in the other layers are sorted in, without duplicates
+        if (n_layer_names > 0) {
+            memcpy(name, layer_names, layer_names_size);
+            for (; n < n_names; n++) {
+                listing->names[n] = name;
+                name += strlen(name) + 1;
+            }
+            qsort(listing->names, n_names, sizeof *listing->names, dir_listing_compare);
+            n = 0;
+            for (int i = 0; i < n_names; i++) {
+                if (n == 0 || strcmp(listing->names[n - 1], listing->names[i]) != 0) listing->names[n++] = listing->names[i];
+            }
+            listing->n_names = n;
+        }
+    }
+    if (reader != NULL) table_read_unlock(reader);
+    free(layer_names);
+    return listing;
+}
+
+// Returns the listing of fd, which is created if necessary. Must be called with fd_paths_lock held.
+static struct dir_listing *dir_listing_get(int fd)
+{
+    struct fd_path **entry = fd_paths_entry(fd, 0);
+    if (entry == NULL || *entry == NULL) return NULL;
+    if ((*entry)->listing == NULL) (*entry)->listing = dir_listing_create((*entry)->path);
+    return (*entry)->listing;
+}
+
+// Marks name as seen in the listing of fd, because it was returned by the real readdir()
+static void dir_listing_seen(int fd, const char *name)
+{
+    sigset_t old_signals;
+    fd_paths_block_signals(&old_signals);
+    pthread_mutex_lock(&fd_paths_lock);
+    struct dir_listing *listing = dir_listing_get(fd);
+    int low = 0, high = listing != NULL ? listing->n_names : 0;
+    size_t name_length = strlen(name);
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        const char *candidate = listing->names[middle];
+        int order = trie_name_compare(candidate, strlen(candidate), name, name_length);
+        if (order == 0) {
+            listing->seen[middle] = 1;
+            break;
+        }
+        if (order < 0) low = middle + 1;
+        else high = middle;
+    }
+    pthread_mutex_unlock(&fd_paths_lock);
+    fd_paths_unblock_signals(&old_signals);
+}
+
+// Finds the next name of the listing of fd which was not returned by the real readdir(), and whose
+// destination exists. Copies it to name (as large as d_name of struct dirent) and returns true, or false at the end.
+static int dir_listing_next(int fd, char *name, ino64_t *ino, unsigned char *type)
+{
+    for (;;) {
+        char path[MAX_PATH];
+        int at_end = 1, found = 0;
+        sigset_t old_signals;
+        fd_paths_block_signals(&old_signals);
+        pthread_mutex_lock(&fd_paths_lock);
+        struct dir_listing *listing = dir_listing_get(fd);
+        while (listing != NULL && listing->next < listing->n_names && listing->seen[listing->next]) listing->next++;
+        if (listing != NULL && listing->next < listing->n_names) {
+            const char *dir_path = (*fd_paths_entry(fd, 0))->path;
+            const char *child = listing->names[listing->next++];
+            at_end = 0;
+            size_t dir_length = strcmp(dir_path, "/") == 0 ? 0 : strlen(dir_path), child_length = strlen(child);
+            found = dir_length + 1 + child_length < sizeof path;
+            if (found) {
+                memcpy(path, dir_path, dir_length);
+                path[dir_length] = '/';
+                memcpy(path + dir_length + 1, child, child_length + 1);
+                strcpy(name, child);
+            }
+        }
+        pthread_mutex_unlock(&fd_paths_lock);
+        fd_paths_unblock_signals(&old_signals);
+        if (at_end) return 0;
+        if (!found) continue;
+
+        // stat() is overridden as well, so this returns the destination
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            *ino = st.st_ino;
+            *type = IFTODT(st.st_mode);
+            return 1;
+        }
+    }
+}
+
+// Returns the buffer for the dirent returned by readdir() on fd
+static void *dir_listing_buffer(int fd)
+{
+    sigset_t old_signals;
+    fd_paths_block_signals(&old_signals);
+    pthread_mutex_lock(&fd_paths_lock);
+    struct dir_listing *listing = dir_listing_get(fd);
+    pthread_mutex_unlock(&fd_paths_lock);
+    fd_paths_unblock_signals(&old_signals);
+    return listing != NULL ? &listing->buffer : NULL;
+}
+
+// Starts the listing of fd from the beginning, e.g. after rewinddir()
+static void dir_listing_reset(int fd)
+{
+    sigset_t old_signals;
+    fd_paths_block_signals(&old_signals);
+    pthread_mutex_lock(&fd_paths_lock);
+    struct fd_path **entry = fd_paths_entry(fd, 0);
+    if (entry != NULL && *entry != NULL) {
+        free((*entry)->listing);
+        (*entry)->listing = NULL;
+    }
+    pthread_mutex_unlock(&fd_paths_lock);
+    fd_paths_unblock_signals(&old_signals);
+}
+#endif // DISABLE_READDIR
+
+
+#else // DISABLE_DIRFD
+
+#define NO_DIRFD -1
+
+static void fd_paths_init() {}
+static inline void fd_paths_opened(int fd, int at_fd, const char *path) {}
+static inline void fd_paths_chdir(const char *path) {}
+static inline ssize_t fd_paths_get(int fd, char *buffer, size_t buffer_size) { return -1; }
+static inline const char *map_path_at(const char *function_name, struct path_mapping_function_counters *counters,
+        int dirfd, const char *path, char *new_path, size_t new_path_size)
+{
+    if (seccomp_active && !seccomp_in_handler && !SECCOMP_NOT_TRAPPED(function_name)) return path; // Mapped by seccomp_handler()
+    return map_path(function_name, counters, path, new_path, new_path_size);
+}
+
+#endif // DISABLE_DIRFD
+
+
+/////////////////////////////////////////////////////////
+//   Syscall level backend with a seccomp filter       //
+/////////////////////////////////////////////////////////
+
+
+// The overrides only see calls through the dynamic symbols of the libc. Calls inside the libc
+// (e.g. NSS or locale files opened by the libc itself), functions which were looked up with dlsym(),
+// and syscall() bypass them. If PATH_MAPPING_SECCOMP is set, a seccomp filter traps the syscalls
+// which take paths instead, and seccomp_handler() maps the paths and makes the syscall itself.
+// Then the overrides do not map paths anymore, so that no path is mapped twice.
+//
+// The filter only traps the syscall numbers in seccomp_syscalls, and only if the syscall instruction
+// is in the code of the libc, so all other syscalls stay at full speed. The code of the libc is at a
+// different address after exec() because of address space randomization, so programs which are
+// started without path-mapping.so (e.g. static binaries) are not affected by the filter they inherit.
+// Without randomization (e.g. setarch -R or in gdb), their libc would be at the same address, and
+// they would be killed by the first trapped syscall, because they have no handler. So the filter is
+// not installed if randomization is disabled, and only the overrides map paths.
+// The handler passes SECCOMP_MAGIC as sixth argument, which none of these syscalls use, to get through.
+//
+// seccomp requires no_new_privs, so setuid programs do not get their privileges after exec().
+// A SIGSYS which is blocked or has no handler kills the process, so the overrides of sigaction(),
+// sigprocmask() and pthread_sigmask() at the end of this file keep seccomp_handler() installed.
+
+#if !defined(DISABLE_SECCOMP) && !defined(__x86_64__) && !defined(__aarch64__)
+    #define DISABLE_SECCOMP // Not implemented for other architectures
+#endif
+
+#ifndef DISABLE_SECCOMP
+
+#if defined(__x86_64__)
+    #define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+    #define SECCOMP_ARG(context, i) ((context)->uc_mcontext.gregs[(int[]){ REG_RDI, REG_RSI, REG_RDX, REG_R10, REG_R8, REG_R9 }[i]])
+    #define SECCOMP_RESULT(context) ((context)->uc_mcontext.gregs[REG_RAX])
+#else
+    #define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+    #define SECCOMP_ARG(context, i) ((context)->uc_mcontext.regs[i])
+    #define SECCOMP_RESULT(context) ((context)->uc_mcontext.regs[0])
+#endif
+
+// Positions of the arguments of a syscall. A dirfd of -1 means AT_FDCWD, and a path of -1 means none.
+struct seccomp_syscall {
+    const char *name;
+    int nr;
+    signed char dirfd, path, dirfd2, path2;
+};
+
+#define SECCOMP_SYSCALL(name, dirfd, path, dirfd2, path2) { #name, SYS_##name, dirfd, path, dirfd2, path2 },
+
+// Only the link path of symlink() is mapped, like in the override.
+// execve() is not trapped, because posix_spawn() (also used by system() and popen()) calls it in a child
+// which has reset all signal handlers. The exec overrides still map the path, see SECCOMP_NOT_TRAPPED.
+static const struct seccomp_syscall seccomp_syscalls[] = {
+#ifdef SYS_open
+    SECCOMP_SYSCALL(open, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(creat, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(stat, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(lstat, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(access, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(readlink, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(mkdir, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(rmdir, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(unlink, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(chmod, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(chown, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(lchown, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(mknod, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(rename, -1, 0, -1, 1)
+    SECCOMP_SYSCALL(link, -1, 0, -1, 1)
+    SECCOMP_SYSCALL(symlink, -1, 1, -1, -1)
+    SECCOMP_SYSCALL(utime, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(utimes, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(futimesat, 0, 1, -1, -1)
+#endif
+    SECCOMP_SYSCALL(openat, 0, 1, -1, -1)
+#ifdef SYS_openat2
+    SECCOMP_SYSCALL(openat2, 0, 1, -1, -1)
+#endif
+    SECCOMP_SYSCALL(newfstatat, 0, 1, -1, -1)
+#ifdef SYS_statx
+    SECCOMP_SYSCALL(statx, 0, 1, -1, -1)
+#endif
+    SECCOMP_SYSCALL(faccessat, 0, 1, -1, -1)
+#ifdef SYS_faccessat2
+    SECCOMP_SYSCALL(faccessat2, 0, 1, -1, -1)
+#endif
+    SECCOMP_SYSCALL(readlinkat, 0, 1, -1, -1)
+    SECCOMP_SYSCALL(mkdirat, 0, 1, -1, -1)
+    SECCOMP_SYSCALL(unlinkat, 0, 1, -1, -1)
+    SECCOMP_SYSCALL(chdir, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(chroot, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(fchmodat, 0, 1, -1, -1)
+    SECCOMP_SYSCALL(fchownat, 0, 1, -1, -1)
+    SECCOMP_SYSCALL(truncate, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(mknodat, 0, 1, -1, -1)
+#ifdef SYS_renameat
+    SECCOMP_SYSCALL(renameat, 0, 1, 2, 3)
+#endif
+    SECCOMP_SYSCALL(renameat2, 0, 1, 2, 3)
+    SECCOMP_SYSCALL(linkat, 0, 1, 2, 3)
+    SECCOMP_SYSCALL(symlinkat, 1, 2, -1, -1)
+    SECCOMP_SYSCALL(utimensat, 0, 1, -1, -1)
+    SECCOMP_SYSCALL(statfs, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(getxattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(lgetxattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(setxattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(lsetxattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(listxattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(llistxattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(removexattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(lremovexattr, -1, 0, -1, -1)
+    SECCOMP_SYSCALL(inotify_add_watch, -1, 1, -1, -1)
+    SECCOMP_SYSCALL(name_to_handle_at, 0, 1, -1, -1)
+};
+
+#define SECCOMP_N_SYSCALLS (int)(sizeof seccomp_syscalls / sizeof seccomp_syscalls[0])
+#define SECCOMP_MAX_NR 1024
+
+// Index in seccomp_syscalls + 1 for each syscall number, so that the handler does not search
+static unsigned char seccomp_syscall_index[SECCOMP_MAX_NR];
+
+// Returns how the trapped syscall nr uses its first or second path (OVERLAY_*), like the overrides
+static int seccomp_overlay_access(int nr, ucontext_t *context, int second)
+{
+    switch (nr) {
+#ifdef SYS_open
+    case SYS_open: return overlay_open_access((int)SECCOMP_ARG(context, 1));
+    case SYS_creat: return OVERLAY_REPLACE;
+    case SYS_mkdir: case SYS_mknod: case SYS_symlink: return OVERLAY_CREATE;
+    case SYS_rmdir: return OVERLAY_RMDIR;
+    case SYS_unlink: return OVERLAY_UNLINK;
+    case SYS_chmod: case SYS_chown: case SYS_lchown: case SYS_utime: case SYS_utimes: case SYS_futimesat: return OVERLAY_WRITE;
+    case SYS_rename: return second ? OVERLAY_REPLACE : OVERLAY_RENAME;
+    case SYS_link: return second ? OVERLAY_CREATE : OVERLAY_WRITE;
+#endif
+    case SYS_openat: return overlay_open_access((int)SECCOMP_ARG(context, 2));
+#ifdef SYS_openat2
+    case SYS_openat2: {
+        const uint64_t *how = (const uint64_t *)SECCOMP_ARG(context, 2); // The flags are the first field of struct open_how
+        return how != NULL ? overlay_open_access((int)*how) : OVERLAY_READ;
+    }
+#endif
+    case SYS_mkdirat: case SYS_mknodat: case SYS_symlinkat: return OVERLAY_CREATE;
+    case SYS_unlinkat: return SECCOMP_ARG(context, 2) & AT_REMOVEDIR ? OVERLAY_RMDIR : OVERLAY_UNLINK;
+    case SYS_fchmodat: case SYS_fchownat: case SYS_utimensat: return OVERLAY_WRITE;
+    case SYS_setxattr: case SYS_lsetxattr: case SYS_removexattr: case SYS_lremovexattr: return OVERLAY_WRITE;
+    case SYS_truncate: return SECCOMP_ARG(context, 1) == 0 ? OVERLAY_REPLACE : OVERLAY_WRITE;
+#ifdef SYS_renameat
+    case SYS_renameat:
+#endif
+    case SYS_renameat2: return second ? OVERLAY_REPLACE : OVERLAY_RENAME;
+    case SYS_linkat: return second ? OVERLAY_CREATE : OVERLAY_WRITE;
+    default: return OVERLAY_READ;
+    }
+}
+
+// Replaces the path argument at position path with its mapping, if it has one, and prepares it for
+// the access overlay (see overlay_prepare()). Returns false if the syscall must fail with errno.
+static int seccomp_map_arg(const char *name, ucontext_t *context, int dirfd, int path, int overlay, char *buffer, size_t buffer_size)
+{
+    const char *arg = (const char *)SECCOMP_ARG(context, path);
+    if (path < 0 || arg == NULL || arg[0] == '\0') return 1; // "" is used with AT_EMPTY_PATH
+    int at_fd = dirfd >= 0 ? (int)SECCOMP_ARG(context, dirfd) : AT_FDCWD;
+    const char *new_path = map_path_at(name, NULL, at_fd, arg, buffer, buffer_size);
+    new_path = overlay_prepare(overlay, arg, new_path, buffer, buffer_size);
+    if (new_path == NULL) return 0;
+    if (new_path != arg) SECCOMP_ARG(context, path) = (uintptr_t)new_path;
+    return 1;
+}
+
+// Called for each trapped syscall. The registers in context hold the arguments, and receive the result.
+static void seccomp_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    ucontext_t *context = ucontext;
+    int nr = info->si_syscall;
+    if (nr < 0 || nr >= SECCOMP_MAX_NR || seccomp_syscall_index[nr] == 0) {
+        SECCOMP_RESULT(context) = -ENOSYS;
+        return;
+    }
+    const struct seccomp_syscall *call = &seccomp_syscalls[seccomp_syscall_index[nr] - 1];
+    int saved_errno = errno;
+    seccomp_in_handler++;
+    char buffer[MAX_PATH], buffer2[MAX_PATH];
+    int overlay = overlay_enabled ? seccomp_overlay_access(nr, context, 0) : OVERLAY_READ;
+    int overlay2 = overlay_enabled ? seccomp_overlay_access(nr, context, 1) : OVERLAY_READ;
+    int ok = 1;
+    if (call->path >= 0) ok = seccomp_map_arg(call->name, context, call->dirfd, call->path, overlay, buffer, sizeof buffer);
+    if (ok && call->path2 >= 0) ok = seccomp_map_arg(call->name, context, call->dirfd2, call->path2, overlay2, buffer2, sizeof buffer2);
+    long result = !ok ? -1 : syscall(nr, SECCOMP_ARG(context, 0), SECCOMP_ARG(context, 1), SECCOMP_ARG(context, 2),
+            SECCOMP_ARG(context, 3), SECCOMP_ARG(context, 4), SECCOMP_MAGIC);
+    SECCOMP_RESULT(context) = result == -1 ? -errno : result;
+    seccomp_in_handler--;
+    errno = saved_errno;
+}
+
+struct code_range {
+    uintptr_t address; // Address inside the range which is searched
+    uintptr_t start, end;
+};
+
+// Finds the executable segment which contains range->address
+static int find_code_range(struct dl_phdr_info *info, size_t size, void *data)
+{
+    struct code_range *range = data;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if (range->address >= start && range->address < start + phdr->p_memsz) {
+            range->start = start;
+            range->end = start + phdr->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns false if the libc of a new program would be loaded at the same address, see above
+static int seccomp_randomized()
+{
+    int persona = personality(0xffffffff);
+    if (persona != -1 && (persona & ADDR_NO_RANDOMIZE)) return 0;
+    char setting = '2';
+    int fd = syscall(SYS_openat, AT_FDCWD, "/proc/sys/kernel/randomize_va_space", O_RDONLY | O_CLOEXEC, 0, 0, SECCOMP_MAGIC);
+    if (fd >= 0) {
+        if (read(fd, &setting, 1) != 1) setting = '2';
+        close(fd);
+    }
+    return setting != '0';
+}
+
+// Installs the SIGSYS handler and the filter, if PATH_MAPPING_SECCOMP is set
+static void seccomp_init()
+{
+    const char *env = getenv("PATH_MAPPING_SECCOMP");
+    if (env == NULL || strlen(env) == 0) return;
+    if (!seccomp_randomized()) {
+        error_fprintf(stderr, "PATH_MAPPING_SECCOMP: address space randomization is disabled, only the overrides map paths\n");
+        return;
+    }
+
+    // The code of the libc is found through getpid(), which is not overridden
+    struct code_range libc = { (uintptr_t)&getpid, 0, 0 };
+    if (!dl_iterate_phdr(find_code_range, &libc) || (libc.start >> 32) != ((libc.end - 1) >> 32)) {
+        error_fprintf(stderr, "PATH_MAPPING_SECCOMP: can not find the code of the libc\n");
+        return;
+    }
+    for (int i = 0; i < SECCOMP_N_SYSCALLS; i++) {
+        if (seccomp_syscalls[i].nr < SECCOMP_MAX_NR) seccomp_syscall_index[seccomp_syscalls[i].nr] = i + 1;
+    }
+
+    // Check the architecture, then the syscall number, then the address of the syscall instruction and SECCOMP_MAGIC
+    struct sock_filter filter[4 + SECCOMP_N_SYSCALLS + 10];
+    int n = 0;
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+    for (int i = 0; i < SECCOMP_N_SYSCALLS; i++) {
+        filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, seccomp_syscalls[i].nr, SECCOMP_N_SYSCALLS - i, 0);
+    }
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    // Little endian: the low half of each 64 bit field comes first
+    size_t ip = offsetof(struct seccomp_data, instruction_pointer);
+    size_t arg5 = offsetof(struct seccomp_data, args) + 5 * sizeof(uint64_t);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ip + 4);
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, libc.start >> 32, 0, 6);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ip);
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, (uint32_t)libc.start, 0, 4);
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, (uint32_t)(libc.end - 1), 3, 0);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, arg5);
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_MAGIC, 1, 0);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP);
+    filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    struct sock_fprog program = { .len = n, .filter = filter };
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = seccomp_handler;
+    action.sa_flags = SA_SIGINFO;
+    if (sigaction(SIGSYS, &action, NULL) != 0) {
+        error_fprintf(stderr, "PATH_MAPPING_SECCOMP: can not install the SIGSYS handler: %s\n", strerror(errno));
+        return;
+    }
+    seccomp_active = 1; // Before the filter, so that no path is mapped twice
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0
+            || syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_TSYNC, &program) != 0) {
+        error_fprintf(stderr, "PATH_MAPPING_SECCOMP: can not install the filter: %s\n", strerror(errno));
+        seccomp_active = 0;
+        return;
+    }
+    info_fprintf(stderr, "PATH_MAPPING_SECCOMP: trapping %d syscalls\n", SECCOMP_N_SYSCALLS);
+}
+
+#else // DISABLE_SECCOMP
+
+static void seccomp_init()
+{
+    const char *env = getenv("PATH_MAPPING_SECCOMP");
+    if (env != NULL && strlen(env) > 0) error_fprintf(stderr, "PATH_MAPPING_SECCOMP is not supported by this build\n");
+}
+
+#endif // DISABLE_SECCOMP
+
+
+/////////////////////////////////////////////////////////
+//      Paths in io_uring submission queue entries     //
+/////////////////////////////////////////////////////////
+
+
+// io_uring opens, stats, renames etc. files without calling any function of the libc. The paths
+// are pointers in the submission queue entries (SQEs), which the program writes into memory shared
+// with the kernel. So the SQEs are rewritten right before the kernel gets to see them:
+// * with liburing, io_uring_submit() and friends publish the SQEs between sq.sqe_head and sq.sqe_tail,
+//   so they are mapped before the original function is called (this also works with SQPOLL).
+// * with io_uring_setup() and io_uring_enter() (the liburing wrappers or syscall()), the ring is mapped
+//   a second time when it is set up, and the SQEs between the kernel's head and tail are mapped
+//   before io_uring_enter(). Rings with SQPOLL, IORING_SETUP_NO_MMAP or registered ring fds are skipped.
+//
+// The mapped paths are allocated per SQE slot and only freed when the slot is mapped again, because
+// the kernel reads the path when it consumes the SQE, which is before the slot can be reused.
+// An SQE whose path already points to the string of its slot is not mapped again, so it does not
+// matter if an SQE is seen by both the liburing and the syscall level override.
+
+#if defined(DISABLE_DIRFD) && !defined(DISABLE_IO_URING)
+    #define DISABLE_IO_URING // The rings are forgotten by close(), which is overridden for the fd table
+#endif
+
+#ifndef DISABLE_IO_URING
+
+struct uring {
+    struct uring *next;
+    int fd;
+    pthread_mutex_t lock; // Protects paths, the list is protected by uring_list_lock
+    unsigned entries;
+    char *(*paths)[2]; // Mapped paths of each SQE slot, allocated on first use
+    // Second mapping of the rings, only if the ring was set up through the syscall
+    void *sq_ring;
+    size_t sq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *head, *tail, *mask, *array;
+    unsigned sqe_shift; // 1 for IORING_SETUP_SQE128
+};
+
+static struct uring *uring_list = NULL;
+static pthread_mutex_t uring_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Number of rings per fd % URING_FD_BUCKETS, so that close() and io_uring_enter() of other fds need no lock
+#define URING_FD_BUCKETS 256
+static unsigned uring_fd_buckets[URING_FD_BUCKETS];
+
+static inline int uring_maybe_tracked(int fd)
+{
+    return __atomic_load_n(&uring_fd_buckets[(unsigned)fd % URING_FD_BUCKETS], __ATOMIC_RELAXED) != 0;
+}
+
+// Returns the state of the ring fd with uring->lock held, or NULL. If create is set, creates the state.
+static struct uring *uring_get(int fd, unsigned entries, int create)
+{
+    if (!create && !uring_maybe_tracked(fd)) return NULL;
+    pthread_mutex_lock(&uring_list_lock);
+    struct uring *uring = uring_list;
+    while (uring != NULL && uring->fd != fd) uring = uring->next;
+    if (uring == NULL && create) {
+        uring = calloc(1, sizeof *uring);
+        if (uring != NULL) {
+            uring->fd = fd;
+            uring->entries = entries;
+            pthread_mutex_init(&uring->lock, NULL);
+            uring->next = uring_list;
+            uring_list = uring;
+            __atomic_add_fetch(&uring_fd_buckets[(unsigned)fd % URING_FD_BUCKETS], 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (uring != NULL) pthread_mutex_lock(&uring->lock);
+    pthread_mutex_unlock(&uring_list_lock);
+    return uring;
+}
+
+static void uring_free(struct uring *uring)
+{
+    if (uring->paths != NULL) {
+        for (unsigned i = 0; i < uring->entries; i++) {
+            free(uring->paths[i][0]);
+            free(uring->paths[i][1]);
+        }
+        free(uring->paths);
+    }
+    if (uring->sq_ring != NULL) munmap(uring->sq_ring, uring->sq_ring_size);
+    if (uring->sqes != NULL) munmap(uring->sqes, uring->sqes_size);
+    pthread_mutex_destroy(&uring->lock);
+    free(uring);
+}
+
+// Removes the state of the ring fd, which is closed
+static void uring_forget(int fd)
+{
+    if (!uring_maybe_tracked(fd)) return;
+    pthread_mutex_lock(&uring_list_lock);
+    struct uring **link = &uring_list;
+    while (*link != NULL && (*link)->fd != fd) link = &(*link)->next;
+    struct uring *uring = *link;
+    if (uring != NULL) {
+        *link = uring->next;
+        __atomic_sub_fetch(&uring_fd_buckets[(unsigned)fd % URING_FD_BUCKETS], 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&uring_list_lock);
+    if (uring != NULL) uring_free(uring);
+}
+
+// Replaces the path at *field (sqe->addr or sqe->addr2) with its mapping, which is kept in *slot
+static void uring_map_path(const char *function_name, struct path_mapping_function_counters *counters,
+        int dirfd, __u64 *field, char **slot)
+{
+    const char *path = (const char *)(uintptr_t)*field;
+    if (path == NULL || path == *slot) return; // Not set, or already mapped
+    char buffer[MAX_PATH];
+    const char *new_path = map_path_at(function_name, counters, dirfd, path, buffer, sizeof buffer);
+    if (new_path == path) return;
+    char *copy = strdup(new_path);
+    if (copy == NULL) return;
+    free(*slot);
+    *slot = copy;
+    *field = (uintptr_t)copy;
+}
+
+// Maps the paths of the SQE with the index in sqes, if its opcode takes paths
+static void uring_map_sqe(struct uring *uring, struct path_mapping_function_counters *counters,
+        struct io_uring_sqe *sqe, unsigned index)
+{
+    const char *name;
+    int paths = 1, dirfd2 = sqe->len; // The second path and its dirfd are only used by some opcodes
+    switch (sqe->opcode) {
+        case IORING_OP_OPENAT: name = "io_uring_openat"; break;
+        case IORING_OP_OPENAT2: name = "io_uring_openat2"; break;
+        case IORING_OP_STATX: name = "io_uring_statx"; break;
+        case IORING_OP_UNLINKAT: name = "io_uring_unlinkat"; break;
+        case IORING_OP_MKDIRAT: name = "io_uring_mkdirat"; break;
+        case IORING_OP_RENAMEAT: name = "io_uring_renameat"; paths = 3; break;
+        case IORING_OP_LINKAT: name = "io_uring_linkat"; paths = 3; break;
+        case IORING_OP_SYMLINKAT: name = "io_uring_symlinkat"; paths = 2; dirfd2 = sqe->fd; break; // Only the link path
+        default: return;
+    }
+    if (index >= uring->entries) return;
+    if (uring->paths == NULL) {
+        uring->paths = calloc(uring->entries, sizeof *uring->paths);
+        if (uring->paths == NULL) return;
+    }
+    // With IOSQE_FIXED_FILE, fd is an index into the registered files, so only absolute paths are mapped
+    int fixed = sqe->flags & IOSQE_FIXED_FILE;
+    if (paths & 1) uring_map_path(name, counters, fixed ? NO_DIRFD : sqe->fd, &sqe->addr, &uring->paths[index][0]);
+    if (paths & 2) uring_map_path(name, counters, fixed ? NO_DIRFD : dirfd2, &sqe->addr2, &uring->paths[index][1]);
+}
+
+// Maps the SQEs which liburing is about to publish. The members of struct io_uring before flags are
+// part of the ABI of liburing 2.x, so only these are declared here instead of including liburing.h.
+struct liburing_ring {
+    struct {
+        unsigned *khead, *ktail, *kring_mask, *kring_entries, *kflags, *kdropped, *array;
+        struct io_uring_sqe *sqes;
+        unsigned sqe_head, sqe_tail;
+        size_t ring_sz;
+        void *ring_ptr;
+        unsigned ring_mask, ring_entries, pad[2];
+    } sq;
+    struct {
+        unsigned *khead, *ktail, *kring_mask, *kring_entries, *kflags, *koverflow;
+        void *cqes;
+        size_t ring_sz;
+        void *ring_ptr;
+        unsigned ring_mask, ring_entries, pad[2];
+    } cq;
+    unsigned flags;
+    int ring_fd;
+};
+
+static void uring_map_liburing(struct liburing_ring *ring, struct path_mapping_function_counters *counters)
+{
+    unsigned head = ring->sq.sqe_head, tail = ring->sq.sqe_tail;
+    if (head == tail) return;
+    unsigned mask = *ring->sq.kring_mask;
+    struct uring *uring = uring_get(ring->ring_fd, mask + 1, 1);
+    if (uring == NULL) return;
+    if (uring->entries != mask + 1) { // The fd was closed without io_uring_queue_exit() and reused
+        pthread_mutex_unlock(&uring->lock);
+        uring_forget(ring->ring_fd);
+        uring = uring_get(ring->ring_fd, mask + 1, 1);
+        if (uring == NULL) return;
+    }
+    unsigned shift = ring->flags & IORING_SETUP_SQE128 ? 1 : 0;
+    for (unsigned i = head; i != tail; i++) {
+        uring_map_sqe(uring, counters, &ring->sq.sqes[(i & mask) << shift], i & mask);
+    }
+    pthread_mutex_unlock(&uring->lock);
+}
+
+// Maps the ring of a new fd a second time, so that uring_map_submitted() can read the SQEs
+static void uring_setup(int fd, const struct io_uring_params *params)
+{
+    uring_forget(fd); // In case the fd was closed without close()
+#ifdef IORING_SETUP_NO_MMAP
+    if (params->flags & IORING_SETUP_NO_MMAP) return;
+#endif
+    if (params->flags & IORING_SETUP_SQPOLL) return; // The kernel may consume SQEs before io_uring_enter()
+
+    const struct io_sqring_offsets *off = &params->sq_off;
+    size_t sq_ring_size = off->array + params->sq_entries * sizeof(unsigned);
+#ifdef IORING_SETUP_NO_SQARRAY
+    if (params->flags & IORING_SETUP_NO_SQARRAY) sq_ring_size = off->ring_entries + sizeof(unsigned);
+#endif
+    unsigned sqe_shift = params->flags & IORING_SETUP_SQE128 ? 1 : 0;
+    size_t sqes_size = (size_t)params->sq_entries * (sizeof(struct io_uring_sqe) << sqe_shift);
+    void *sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) return;
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(sq_ring, sq_ring_size);
+        return;
+    }
+
+    struct uring *uring = uring_get(fd, params->sq_entries, 1);
+    if (uring == NULL) {
+        munmap(sq_ring, sq_ring_size);
+        munmap(sqes, sqes_size);
+        return;
+    }
+    uring->sq_ring = sq_ring;
+    uring->sq_ring_size = sq_ring_size;
+    uring->sqes = sqes;
+    uring->sqes_size = sqes_size;
+    uring->head = (unsigned *)((char *)sq_ring + off->head);
+    uring->tail = (unsigned *)((char *)sq_ring + off->tail);
+    uring->mask = (unsigned *)((char *)sq_ring + off->ring_mask);
+    uring->array = (unsigned *)((char *)sq_ring + off->array);
+#ifdef IORING_SETUP_NO_SQARRAY
+    if (params->flags & IORING_SETUP_NO_SQARRAY) uring->array = NULL;
+#endif
+    uring->sqe_shift = sqe_shift;
+    pthread_mutex_unlock(&uring->lock);
+}
+
+// Maps the SQEs which the kernel will consume in io_uring_enter(fd, to_submit, ...)
+static void uring_map_submitted(int fd, unsigned to_submit, unsigned flags, struct path_mapping_function_counters *counters)
+{
+    if (to_submit == 0 || (flags & IORING_ENTER_REGISTERED_RING)) return;
+    struct uring *uring = uring_get(fd, 0, 0);
+    if (uring == NULL) return;
+    if (uring->sqes != NULL) {
+        unsigned head = __atomic_load_n(uring->head, __ATOMIC_ACQUIRE);
+        unsigned tail = __atomic_load_n(uring->tail, __ATOMIC_ACQUIRE);
+        unsigned mask = *uring->mask;
+        if (tail - head < to_submit) to_submit = tail - head;
+        for (unsigned i = head; i != head + to_submit; i++) {
+            unsigned index = uring->array != NULL ? uring->array[i & mask] : i & mask;
+            if (index >= uring->entries) continue; // The kernel skips invalid indexes
+            uring_map_sqe(uring, counters, (struct io_uring_sqe *)((char *)uring->sqes + (index << uring->sqe_shift) * sizeof(struct io_uring_sqe)), index);
+        }
+    }
+    pthread_mutex_unlock(&uring->lock);
+}
+
+#endif // DISABLE_IO_URING
+
+
+/////////////////////////////////////////////////////////
+//     Environment and arguments of new programs       //
+/////////////////////////////////////////////////////////
+
+
+// execve(), execle(), posix_spawn() and friends take the environment of the new program as an argument.
+// If the caller builds its own environment (e.g. to sanitize it), LD_PRELOAD and PATH_MAPPING* would
+// not reach the new program, which would then see the real paths. So exec_env() adds the variables
+// which are missing, with the values they had when this process started, and puts this library
+// into LD_PRELOAD if the caller has set LD_PRELOAD to something else.
+//
+// The exec functions are often called in the child after vfork(), which shares the memory and the
+// malloc() state of the parent. So neither the environment nor the arguments of execl() are copied
+// to the heap, but into arrays on the stack, like the libc does itself. For the same reason, the
+// layers of the path are checked without the layer cache, which shares its locks with the other
+// threads of the parent (see map_exec_path_at()).
+
+// Number of variables which are passed on, and number of arguments which are copied to the stack.
+// The kernel refuses more arguments than EXEC_MAX_ARGS anyway, unless the stack limit is raised above 8 MiB.
+#define EXEC_ENV_MAX 16
+#define EXEC_MAX_ARGS (1 << 18)
+
+#ifndef DISABLE_EXEC
+
+static const char *exec_env_vars[EXEC_ENV_MAX]; // "NAME=value" as found in environ at startup
+static size_t exec_env_name_lengths[EXEC_ENV_MAX]; // Length of "NAME="
+static int exec_env_length = 0;
+static const char *exec_env_library = NULL; // The name of this library in LD_PRELOAD, if it is there
+
+// Returns 1 if the colon or space separated list contains the item
+static int exec_env_list_contains(const char *list, const char *item, size_t item_length)
+{
+    while (*list != '\0') {
+        size_t length = strcspn(list, ": ");
+        if (length == item_length && strncmp(list, item, length) == 0) return 1;
+        list += length;
+        if (*list != '\0') list++;
+    }
+    return 0;
+}
+
+// Remembers LD_PRELOAD and PATH_MAPPING*, and the name under which this library was preloaded
+static void exec_env_init()
+{
+    Dl_info info;
+    const char *library = dladdr((void *)exec_env_init, &info) != 0 ? info.dli_fname : NULL;
+    for (char **var = environ; var != NULL && *var != NULL && exec_env_length < EXEC_ENV_MAX; var++) {
+        const char *equals = strchr(*var, '=');
+        if (equals == NULL || (strncmp(*var, "PATH_MAPPING", 12) != 0 && strncmp(*var, "LD_PRELOAD=", 11) != 0)) continue;
+        exec_env_vars[exec_env_length] = *var;
+        exec_env_name_lengths[exec_env_length++] = equals - *var + 1;
+        if (strncmp(*var, "LD_PRELOAD=", 11) == 0) {
+            if (library != NULL && exec_env_list_contains(*var + 11, library, strlen(library))) {
+                exec_env_library = library;
+            }
+        }
+    }
+}
+
+// Number of entries of the environment, which exec_env() needs as buffer, including the NULL
+static size_t exec_env_size(char * const* env)
+{
+    size_t size = 1 + exec_env_length;
+    for (; env != NULL && *env != NULL && size <= EXEC_MAX_ARGS; env++) size++;
+    return size <= EXEC_MAX_ARGS ? size : 0;
+}
+
+// Returns env, or a copy in buffer with the missing variables added. buffer has exec_env_size(env) entries.
+// If LD_PRELOAD needs to be extended, the new variable is written to preload.
+static char * const* exec_env(char * const* env, const char **buffer, size_t buffer_size, char *preload, size_t preload_size)
+{
+    if (exec_env_length == 0 || buffer_size == 0) return env;
+    int found[EXEC_ENV_MAX] = { 0 };
+    int changed = 0;
+    size_t n = 0;
+    for (; env != NULL && env[n] != NULL; n++) {
+        const char *var = buffer[n] = env[n];
+        if (var[0] != 'P' && var[0] != 'L') continue; // Most variables are neither LD_PRELOAD nor PATH_MAPPING*
+        for (int i = 0; i < exec_env_length; i++) {
+            if (strncmp(var, exec_env_vars[i], exec_env_name_lengths[i]) == 0) found[i] = 1;
+        }
+        if (exec_env_library != NULL && strncmp(var, "LD_PRELOAD=", 11) == 0
+                && !exec_env_list_contains(var + 11, exec_env_library, strlen(exec_env_library))) {
+            int length = snprintf(preload, preload_size, "LD_PRELOAD=%s %s", exec_env_library, var + 11);
+            if (length > 0 && (size_t)length < preload_size) {
+                buffer[n] = preload;
+                changed = 1;
+            }
+        }
+    }
+    for (int i = 0; i < exec_env_length; i++) {
+        if (!found[i]) {
+            buffer[n++] = exec_env_vars[i];
+            changed = 1;
+        }
+    }
+    if (!changed) return env;
+    buffer[n] = NULL;
+    return (char * const*)buffer;
+}
+
+// Replaces the variable env with an environment which passes on the mapping, using buffers on the stack
+#define EXEC_ENV(env) \
+    size_t env##_size = exec_env_size(env);\
+    const char *env##_buffer[env##_size > 0 ? env##_size : 1];\
+    char env##_preload[MAX_PATH];\
+    env = exec_env(env, env##_buffer, env##_size, env##_preload, sizeof env##_preload)
+
+// Collects arg0 and the following arguments of execl() and friends up to the NULL into the array argv on the stack.
+// args is left behind the NULL, so that execle() can read env from it. Returns E2BIG if there are too many.
+#define EXECL_ARGV(argv, arg0, args) \
+    va_list args;\
+    size_t argv##_count = 1;\
+    va_start(args, arg0);\
+    while (va_arg(args, char *) != NULL && argv##_count <= EXEC_MAX_ARGS) argv##_count++;\
+    va_end(args);\
+    if (argv##_count > EXEC_MAX_ARGS) {\
+        errno = E2BIG;\
+        return -1;\
+    }\
+    const char *argv[argv##_count + 1];\
+    argv[0] = arg0;\
+    va_start(args, arg0);\
+    for (size_t i = 1; i <= argv##_count; i++) argv[i] = va_arg(args, char *)
+
+// Same as map_path_at(), but bypasses the layer cache, because the caller may be the child of vfork()
+static const char *map_exec_path_at(const char *function_name, struct path_mapping_function_counters *counters,
+        int dirfd, const char *path, char *new_path, size_t new_path_size)
+{
+    int busy = layer_cache_busy;
+    layer_cache_busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    const char *result = map_path_at(function_name, counters, dirfd, path, new_path, new_path_size);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    layer_cache_busy = busy; // Before the exec, which shares this variable with the parent after vfork()
+    return result;
+}
+
+#else // DISABLE_EXEC
+
+static void exec_env_init()
+{
+}
+
+#endif // DISABLE_EXEC
+
+
+/////////////////////////////////////////////////////////
+//  Dispatch table of the original library functions   //
+/////////////////////////////////////////////////////////
+
+
+// Each override puts one struct original_function into the section path_mapping_originals.
+// The linker places all of them next to each other, so that the section forms one table,
+// which starts at __start_path_mapping_originals and ends at __stop_path_mapping_originals.
+// All entries are resolved with dlsym() at once by path_mapping_init(). Afterwards, only an entry whose
+// original was not found then is written again, when it is first called (see resolve_original_late()).
+// The table is not write-protected, because that would need a page of its own, and every late
+// resolution would have to unprotect it while other threads may do the same.
+//
+// Until then, each entry points to a stub function with the same signature as the original,
+// which resolves the whole table and then calls the original. That way, calls which happen
+// before the constructor (e.g. from constructors of other libraries) still work,
+// and the overrides can call the original without any check or lazy lookup.
+
+typedef void (*original_func_t)(void);
+
+struct original_function {
+    original_func_t func;   // Either the original function or the stub which resolves it
+    const char *name;
+};
+
+#define ORIGINAL_FUNCTION_SECTION path_mapping_originals
+#define ORIGINAL_FUNCTION_STRINGIFY(x) ORIGINAL_FUNCTION_STRINGIFY_(x)
+#define ORIGINAL_FUNCTION_STRINGIFY_(x) #x
+#define ORIGINAL_FUNCTION_ATTRIBUTES \
+    __attribute__((section(ORIGINAL_FUNCTION_STRINGIFY(ORIGINAL_FUNCTION_SECTION)), used, aligned(sizeof(struct original_function))))
+
+// Align the start of the table to a cache line, so that it shares no cache line with other (written) data.
+// The end is padded to a cache line as well, by a section with one aligned byte which the linker places right
+// behind it (both are orphan sections with the same flags, which GNU ld keeps in their input order).
+__asm__(".section " ORIGINAL_FUNCTION_STRINGIFY(ORIGINAL_FUNCTION_SECTION) ",\"aw\"\n\t.balign 64\n\t.previous");
+__asm__(".section " ORIGINAL_FUNCTION_STRINGIFY(ORIGINAL_FUNCTION_SECTION) "_end,\"aw\"\n\t.balign 64\n\t.byte 0\n\t.previous");
+
+extern struct original_function __start_path_mapping_originals[];
+extern struct original_function __stop_path_mapping_originals[];
+
+// Returns the original function for an override, cast to the correct type
+#define ORIGINAL_FUNCTION(funcname) \
+    ((OVERRIDE_TYPEDEF_NAME(funcname))__atomic_load_n(&original_##funcname.func, __ATOMIC_RELAXED))
+
+static void resolve_original_functions()
+{
+    static int resolved = 0;
+    if (__atomic_load_n(&resolved, __ATOMIC_ACQUIRE)) return;
+
+    // If several threads get here at the same time, they all store the same values
+    for (struct original_function *entry = __start_path_mapping_originals; entry < __stop_path_mapping_originals; entry++) {
+        if (entry->name == NULL) continue; // Padding between entries
+        original_func_t func = (original_func_t)dlsym(RTLD_NEXT, entry->name);
+        if (func != NULL) {
+            __atomic_store_n(&entry->func, func, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&resolved, 1, __ATOMIC_RELEASE);
+}
+
+// Resolves one function which was not found by resolve_original_functions(), e.g. because it is
+// in a library which was loaded later with dlopen(). Aborts if it still does not exist.
+static original_func_t resolve_original_late(struct original_function *entry)
+{
+    original_func_t func = (original_func_t)dlsym(RTLD_NEXT, entry->name);
+    if (func == NULL) {
+        error_fprintf(stderr, "ERROR path-mapping: Original function %s not found\n", entry->name);
+        abort();
+    }
+    __atomic_store_n(&entry->func, func, __ATOMIC_RELAXED);
+    return func;
+}
+
+
+/////////////////////////////////////////////////////////
+//    Counters which can be read by path-mapping-stat  //
+/////////////////////////////////////////////////////////
+
+
+// Every override counts its calls, the mapped paths and the paths which were too long,
+// and every rule counts how often it was used. The counters live in one block of memory
+// with the layout described in path-mapping.h. If PATH_MAPPING_STATS is set, the block is a
+// shared memory segment named /path-mapping-stats.<pid>, which path-mapping-stat can read while
+// the process is running. Otherwise it is private memory, which only costs the increments.
+// If PATH_MAPPING_STATS=time, the time spent in each override is measured as well.
+//
+// Each thread uses the shard given by thread_shard(), so that threads usually do not write to the
+// same cache lines. The increments are still atomic, because there may be more threads than shards.
+
+#ifndef DISABLE_STATS
+
+static struct path_mapping_stats_header *stats = NULL;
+static int stats_timing = 0;
+static char stats_name[64] = ""; // Name of the shared memory segment, if it is published
+
+static inline char *stats_thread_shard(const struct path_mapping_stats_header *header)
+{
+    return (char *)header + header->shards_offset + thread_shard() * header->shard_size;
+}
+
+// Returns the counters of an override in the shard of the current thread, or NULL before the constructor
+static inline struct path_mapping_function_counters *stats_function_counters(const struct original_function *entry)
+{
+    struct path_mapping_stats_header *header = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    if (header == NULL) return NULL;
+    struct path_mapping_function_counters *counters = (struct path_mapping_function_counters *)stats_thread_shard(header);
+    return &counters[entry - __start_path_mapping_originals];
+}
+
+static inline uint64_t stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Counts one call of an override. Returns the start time if the time is measured, otherwise 0.
+static inline uint64_t stats_start(struct path_mapping_function_counters *counters)
+{
+    if (counters == NULL) return 0;
+    __atomic_fetch_add(&counters->calls, 1, __ATOMIC_RELAXED);
+    return stats_timing ? stats_now() : 0;
+}
+
+static inline void stats_finish(struct path_mapping_function_counters *counters, uint64_t start_time)
+{
+    if (start_time != 0) {
+        __atomic_fetch_add(&counters->time_ns, stats_now() - start_time, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void stats_count_rule(int rule)
+{
+    struct path_mapping_stats_header *header = __atomic_load_n(&stats, __ATOMIC_ACQUIRE);
+    // The rules may have been replaced by path_mapping_load() after the counters were allocated
+    if (header == NULL || (uint32_t)rule >= header->n_rules) return;
+    uint64_t *hits = (uint64_t *)(stats_thread_shard(header) + header->n_functions * sizeof(struct path_mapping_function_counters));
+    __atomic_fetch_add(&hits[rule], 1, __ATOMIC_RELAXED);
+}
+
+static inline size_t stats_align(size_t size)
+{
+    return (size + 63) & ~(size_t)63;
+}
+
+// Allocates and fills a new block of counters, published under stats_name if that is not empty
+static struct path_mapping_stats_header *stats_create()
+{
+    uint32_t n_functions = __stop_path_mapping_originals - __start_path_mapping_originals;
+    uint32_t n_rules = path_table ? path_table->n_rules : 0;
+    size_t strings_size = path_table ? path_table->size - path_table->strings_offset : 0;
+
+    size_t names_offset = sizeof(struct path_mapping_stats_header);
+    size_t rules_offset = names_offset + n_functions * PATH_MAPPING_STATS_NAME_SIZE;
+    size_t strings_offset = rules_offset + n_rules * 2 * sizeof(uint32_t);
+    size_t shards_offset = stats_align(strings_offset + strings_size);
+    size_t shard_size = stats_align(n_functions * sizeof(struct path_mapping_function_counters) + n_rules * sizeof(uint64_t));
+    size_t size = shards_offset + PATH_MAPPING_STATS_SHARDS * shard_size;
+
+    void *memory = MAP_FAILED;
+    if (stats_name[0] != '\0') {
+        // shm_open() and ftruncate() are not overridden, so this does not count itself
+        int fd = shm_open(stats_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0 && ftruncate(fd, size) == 0) {
+            memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (memory == MAP_FAILED) {
+            error_fprintf(stderr, "PATH_MAPPING_STATS: can not create %s: %s\n", stats_name, strerror(errno));
+            if (fd >= 0) shm_unlink(stats_name);
+            stats_name[0] = '\0';
+        }
+        if (fd >= 0) close(fd);
+    }
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return NULL;
+    }
+
+    struct path_mapping_stats_header *header = memory;
+    header->magic = PATH_MAPPING_STATS_MAGIC;
+    header->version = PATH_MAPPING_STATS_VERSION;
+    header->pid = getpid();
+    header->flags = stats_timing ? PATH_MAPPING_STATS_TIMING : 0;
+    header->n_functions = n_functions;
+    header->n_rules = n_rules;
+    header->n_shards = PATH_MAPPING_STATS_SHARDS;
+    header->size = size;
+    header->names_offset = names_offset;
+    header->rules_offset = rules_offset;
+    header->strings_offset = strings_offset;
+    header->shards_offset = shards_offset;
+    header->shard_size = shard_size;
+
+    char *names = (char *)memory + names_offset;
+    for (uint32_t i = 0; i < n_functions; i++) {
+        const char *name = __start_path_mapping_originals[i].name;
+        if (name == NULL) continue; // Padding between entries
+        strncpy(names + i * PATH_MAPPING_STATS_NAME_SIZE, name, PATH_MAPPING_STATS_NAME_SIZE - 1);
+    }
+    // The string pool of the table already contains each prefix and destination
+    uint32_t *rule_strings = (uint32_t *)((char *)memory + rules_offset);
+    for (uint32_t i = 0; i < n_rules; i++) {
+        rule_strings[2 * i] = TABLE_RULES(path_table)[i].prefix;
+        rule_strings[2 * i + 1] = TABLE_RULES(path_table)[i].dest;
+    }
+    if (strings_size > 0) memcpy((char *)memory + strings_offset, TABLE_STRINGS(path_table), strings_size);
+    return header;
+}
+
+// Gives the child of a fork() its own segment, instead of counting into the segment of the parent
+static void stats_atfork_child()
+{
+    struct path_mapping_stats_header *old = stats;
+    if (old == NULL || stats_name[0] == '\0') return;
+    snprintf(stats_name, sizeof stats_name, "/" PATH_MAPPING_STATS_PREFIX "%d", (int)getpid());
+    __atomic_store_n(&stats, stats_create(), __ATOMIC_RELEASE);
+    munmap(old, old->size);
+}
+
+static void stats_init()
+{
+    if (stats != NULL) return;
+    const char *env = getenv("PATH_MAPPING_STATS");
+    if (env != NULL && env[0] != '\0') {
+        stats_timing = strcmp(env, "time") == 0;
+        snprintf(stats_name, sizeof stats_name, "/" PATH_MAPPING_STATS_PREFIX "%d", (int)getpid());
+        pthread_atfork(NULL, NULL, stats_atfork_child);
+    }
+    __atomic_store_n(&stats, stats_create(), __ATOMIC_RELEASE);
+}
+
+static void stats_deinit()
+{
+    // The memory is not unmapped, because other threads may still be running
+    if (stats_name[0] != '\0') shm_unlink(stats_name);
+    stats_name[0] = '\0';
+}
+
+// Called by path_table_replace() after new rules were loaded. Publishes a new segment with the new
+// rules, where the counters of the functions continue and the hits of the rules start from zero.
+// The old segment is never unmapped, because the counters of the functions are incremented outside
+// of table_read_lock(), so there is no way to know when the last thread stopped using it.
+static void stats_rules_changed()
+{
+    struct path_mapping_stats_header *old = stats;
+    if (old == NULL) return;
+    if (stats_name[0] != '\0') shm_unlink(stats_name); // Otherwise shm_open() would truncate the old segment
+    struct path_mapping_stats_header *header = stats_create();
+    if (header == NULL) return;
+
+    struct path_mapping_function_counters *totals = (struct path_mapping_function_counters *)((char *)header + header->shards_offset);
+    for (uint32_t s = 0; s < old->n_shards; s++) {
+        const struct path_mapping_function_counters *counters =
+            (const struct path_mapping_function_counters *)((char *)old + old->shards_offset + s * old->shard_size);
+        for (uint32_t f = 0; f < old->n_functions; f++) {
+            totals[f].calls += __atomic_load_n(&counters[f].calls, __ATOMIC_RELAXED);
+            totals[f].mapped += __atomic_load_n(&counters[f].mapped, __ATOMIC_RELAXED);
+            totals[f].too_long += __atomic_load_n(&counters[f].too_long, __ATOMIC_RELAXED);
+            totals[f].time_ns += __atomic_load_n(&counters[f].time_ns, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&stats, header, __ATOMIC_RELEASE);
+}
+
+#else // DISABLE_STATS
+
+static inline struct path_mapping_function_counters *stats_function_counters(const struct original_function *entry) { return NULL; }
+static inline uint64_t stats_start(struct path_mapping_function_counters *counters) { return 0; }
+static inline void stats_finish(struct path_mapping_function_counters *counters, uint64_t start_time) {}
+static inline void stats_count_rule(int rule) {}
+static void stats_init() {}
+static void stats_deinit() {}
+static void stats_rules_changed() {}
+
+#endif // DISABLE_STATS
+
+
+/////////////////////////////////////////////////////////
+//     Binary traces of the calls (trace files)        //
+/////////////////////////////////////////////////////////
+
+
+// If PATH_MAPPING_TRACE is set, the overrides which map a path record each call in the trace file of the
+// process (see path-mapping.h): when it started, how long it took, the errno it set, the path before and
+// after mapping, and the rule which mapped it. path-mapping-trace prints them as text or as JSON for the
+// trace viewer of Chrome (chrome://tracing or https://ui.perfetto.dev).
+//
+// Unlike debug_fprintf(), which takes the lock of stderr for each message, a thread only writes into its
+// own ring in the mmap()ed file, without locks or atomic read-modify-write operations, and the kernel
+// writes the pages back to the file, even if the process crashes. A thread takes a free ring on its
+// first call and gives it back when it exits. Calls of threads which find no free ring are only counted.
+// A signal handler which interrupts the thread while it writes a record counts its own calls as dropped.
+// A successful exec() does not return, so it is not recorded, but the new program starts its own file.
+
+#ifndef DISABLE_TRACE
+
+#define TRACE_RINGS 64
+#define TRACE_DEFAULT_RING_KB 1024
+#define TRACE_MIN_RING_KB 64        // Leaves room for a record with two paths of MAX_PATH
+
+struct trace_thread {
+    struct path_mapping_trace_header *header;   // The file which ring belongs to
+    struct path_mapping_trace_ring *ring;       // NULL if the thread found no free ring
+    int busy;                                   // Set while the thread writes a record
+    int rule;                                   // The rule which mapped the path of the current call
+};
+
+// State of one call between trace_start() and trace_finish()
+struct trace_call {
+    uint64_t start_ns;                          // 0 if the call is not recorded
+    int saved_errno;
+    int saved_rule;                             // Of the call which a signal handler interrupted
+};
+
+static struct path_mapping_trace_header *trace_file = NULL;
+static char trace_directory[PATH_MAX] = "";
+static size_t trace_ring_size = 0;
+static __thread struct trace_thread trace_thread __attribute__((tls_model("initial-exec")));
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline struct path_mapping_trace_ring *trace_ring(struct path_mapping_trace_header *header, uint32_t i)
+{
+    return (struct path_mapping_trace_ring *)((char *)header + header->rings_offset + i * header->ring_size);
+}
+
+// Gives the ring of a thread back when it exits. A signal handler which runs afterwards counts its calls as untraced.
+static void trace_release_ring(void *ring)
+{
+    if (trace_thread.header != __atomic_load_n(&trace_file, __ATOMIC_RELAXED)) return; // The file of the parent after fork()
+    trace_thread.ring = NULL;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&((struct path_mapping_trace_ring *)ring)->owner, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_create_key()
+{
+    pthread_key_create(&trace_key, trace_release_ring);
+}
+
+// Takes a free ring of header for the current thread. Returns NULL if all rings are in use.
+static struct path_mapping_trace_ring *trace_acquire_ring(struct path_mapping_trace_header *header)
+{
+    trace_thread.header = header;
+    trace_thread.ring = NULL;
+    uint32_t tid = syscall(SYS_gettid);
+    for (uint32_t i = 0; i < header->n_rings; i++) {
+        struct path_mapping_trace_ring *ring = trace_ring(header, i);
+        uint32_t owner = 0;
+        if (__atomic_compare_exchange_n(&ring->owner, &owner, tid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            pthread_once(&trace_key_once, trace_create_key);
+            pthread_setspecific(trace_key, ring);
+            trace_thread.ring = ring;
+            break;
+        }
+    }
+    return trace_thread.ring;
+}
+
+// Moves the tail of ring past the records which the bytes up to new_head overwrite
+static void trace_make_room(struct path_mapping_trace_ring *ring, const char *records, uint64_t capacity, uint64_t new_head)
+{
+    uint64_t tail = ring->tail;
+    if (new_head - tail <= capacity) return;
+    while (new_head - tail > capacity) {
+        tail += ((const struct path_mapping_trace_record *)(records + tail % capacity))->size;
     }
+    // Before the records are overwritten, so that a reader of a running process can check which are still valid
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 }
 
-__attribute__((destructor))
-static void path_mapping_deinit()
+static void trace_write(const struct trace_call *call, uint32_t function, const char *path, const char *new_path, int error)
 {
-    if (path_map != default_path_map) {
-        free(path_map);
+    uint64_t end_ns = trace_now();
+    struct path_mapping_trace_header *header = __atomic_load_n(&trace_file, __ATOMIC_ACQUIRE);
+    struct path_mapping_trace_ring *ring = trace_thread.header == header ? trace_thread.ring : trace_acquire_ring(header);
+    if (ring == NULL) {
+        __atomic_fetch_add(&header->untraced, 1, __ATOMIC_RELAXED);
+        return;
     }
-    free(path_map_buffer);
+    if (trace_thread.busy) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    trace_thread.busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    size_t path_length = path != NULL ? strnlen(path, MAX_PATH - 1) : 0;
+    size_t mapped_length = new_path != path ? strnlen(new_path, MAX_PATH - 1) : 0;
+    uint32_t size = (sizeof(struct path_mapping_trace_record) + path_length + mapped_length + 2 + 7) & ~7u;
+    uint64_t capacity = header->ring_size - sizeof *ring;
+    char *records = (char *)(ring + 1);
+    uint64_t head = ring->head;
+    if (head % capacity + size > capacity) {
+        // The record does not fit before the end, so the rest of the ring becomes padding
+        uint32_t padding = capacity - head % capacity;
+        trace_make_room(ring, records, capacity, head + padding);
+        struct path_mapping_trace_record *record = (struct path_mapping_trace_record *)(records + head % capacity);
+        record->size = padding;
+        record->function = PATH_MAPPING_TRACE_PADDING;
+        head += padding;
+    }
+    trace_make_room(ring, records, capacity, head + size);
+
+    struct path_mapping_trace_record *record = (struct path_mapping_trace_record *)(records + head % capacity);
+    record->size = size;
+    record->function = function;
+    record->path_length = path_length;
+    record->mapped_length = mapped_length;
+    record->reserved = 0;
+    record->tid = ring->owner;
+    record->rule = mapped_length > 0 ? trace_thread.rule : -1;
+    record->error = error;
+    record->time_ns = call->start_ns;
+    record->duration_ns = end_ns - call->start_ns;
+    char *paths = (char *)(record + 1);
+    memcpy(paths, path != NULL ? path : "", path_length);
+    paths[path_length] = '\0';
+    memcpy(paths + path_length + 1, mapped_length > 0 ? new_path : "", mapped_length);
+    paths[path_length + 1 + mapped_length] = '\0';
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    trace_thread.busy = 0;
 }
 
+// Starts recording a call of an override. Must be called before the path is mapped.
+static inline void trace_start(struct trace_call *call)
+{
+    call->start_ns = 0;
+    if (__builtin_expect(__atomic_load_n(&trace_file, __ATOMIC_RELAXED) == NULL, 1)) return;
+    call->saved_errno = errno;
+    call->saved_rule = trace_thread.rule;
+    trace_thread.rule = -1;
+    call->start_ns = trace_now();
+}
 
-/////////////////////////////////////////////////////////
-//   Helper functions to do the actual path mapping    //
-/////////////////////////////////////////////////////////
-
+// Called right before the original function, so that trace_finish() sees the errno which it sets
+static inline void trace_call_original(const struct trace_call *call)
+{
+    if (call->start_ns != 0) errno = 0;
+}
 
-#ifndef MAX_PATH
-#define MAX_PATH 4096
-#endif
+// Records the call after the original function returned. new_path is the mapped path, or path itself.
+static inline void trace_finish(const struct trace_call *call, const struct original_function *entry, const char *path, const char *new_path)
+{
+    if (call->start_ns == 0) return;
+    int error = errno;
+    trace_write(call, entry - __start_path_mapping_originals, path, new_path, error);
+    trace_thread.rule = call->saved_rule;
+    errno = error != 0 ? error : call->saved_errno;
+}
 
-// Returns strlen(path) without trailing slashes
-size_t pathlen(const char *path)
+// Called by map_path_in_table() when a rule mapped the path of the current call
+static inline void trace_rule(int rule)
 {
-    size_t path_length = strlen(path);
-    while (path_length > 0 && path[path_length - 1] == '/') {
-        // If the prefix ends with a slash ("/example/dir/"), ignore the slash.
-        // Otherwise it would not match the dir itself ("/examle/dir"), e.g. in opendir().
-        path_length -= 1;
-    }
-    return path_length;
+    trace_thread.rule = rule;
 }
 
-// Returns true if the first path components of path match those of prefix (whole word matches only)
-int path_prefix_matches(const char *prefix, const char *path)
+// Creates the trace file of this process and fills in the header
+static struct path_mapping_trace_header *trace_create()
 {
-    size_t prefix_len = pathlen(prefix);
-    if (strncmp(prefix, path, prefix_len) == 0) {
-        // The prefix matches, but "/example/dir" would also match "/example/dirty/file"
-        // Thus we only return true if a slash or end-of-string follows the match.
-        char char_after_match = path[prefix_len];
-        return char_after_match == '/' || char_after_match == '\0';
+    uint32_t n_functions = __stop_path_mapping_originals - __start_path_mapping_originals;
+    size_t names_offset = sizeof(struct path_mapping_trace_header);
+    size_t rings_offset = (names_offset + n_functions * PATH_MAPPING_STATS_NAME_SIZE + 63) & ~(size_t)63;
+    size_t size = rings_offset + TRACE_RINGS * trace_ring_size;
+
+    // After exec(), the process keeps its pid, so the file of the previous program gets a successor
+    char name[PATH_MAX + 64];
+    int fd = -1;
+    for (int n = 0; fd < 0 && n < 1000; n++) {
+        if (n == 0) snprintf(name, sizeof name, "%s/" PATH_MAPPING_TRACE_PREFIX "%d", trace_directory, (int)getpid());
+        else snprintf(name, sizeof name, "%s/" PATH_MAPPING_TRACE_PREFIX "%d.%d", trace_directory, (int)getpid(), n);
+        // SECCOMP_MAGIC, because the trace file is not mapped
+        fd = syscall(SYS_openat, AT_FDCWD, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644, 0, SECCOMP_MAGIC);
+        if (fd < 0 && errno != EEXIST) break;
     }
-    return 0;
+    void *memory = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (memory == MAP_FAILED) {
+        error_fprintf(stderr, "PATH_MAPPING_TRACE: can not create %s: %s\n", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    // The rings are already zero, because the file was empty
+    struct path_mapping_trace_header *header = memory;
+    header->version = PATH_MAPPING_TRACE_VERSION;
+    header->pid = getpid();
+    header->n_functions = n_functions;
+    header->n_rings = TRACE_RINGS;
+    header->size = size;
+    header->names_offset = names_offset;
+    header->rings_offset = rings_offset;
+    header->ring_size = trace_ring_size;
+    header->start_ns = trace_now();
+    pthread_once(&profile_process_once, profile_process_init);
+    size_t exe_length = strlen(profile_process.exe);
+    size_t exe_skip = exe_length >= sizeof header->exe ? exe_length - (sizeof header->exe - 1) : 0;
+    memcpy(header->exe, profile_process.exe + exe_skip, exe_length - exe_skip + 1);
+
+    char *names = (char *)memory + names_offset;
+    for (uint32_t i = 0; i < n_functions; i++) {
+        const char *function_name = __start_path_mapping_originals[i].name;
+        if (function_name == NULL) continue; // Padding between entries
+        strncpy(names + i * PATH_MAPPING_STATS_NAME_SIZE, function_name, PATH_MAPPING_STATS_NAME_SIZE - 1);
+    }
+    __atomic_store_n(&header->magic, PATH_MAPPING_TRACE_MAGIC, __ATOMIC_RELEASE);
+    return header;
 }
 
-// Check if path matches any defined prefix, and if so, replace it with its substitution
-static const char *fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size)
+// Gives the child of a fork() its own file, instead of writing into the rings of the parent
+static void trace_atfork_child()
 {
-    if (path == NULL) return path;
+    struct path_mapping_trace_header *old = trace_file;
+    if (old == NULL) return;
+    __atomic_store_n(&trace_file, trace_create(), __ATOMIC_RELEASE);
+    munmap(old, old->size);
+}
 
-    for (int i = 0; i < path_map_length; i++) {
-        const char *prefix = path_map[i][0];
-        if (path_prefix_matches(prefix, path)) {
-            const char *replace = path_map[i][1];
-            size_t prefix_length = pathlen(prefix);
-            size_t new_length = strlen(path) + pathlen(replace) - prefix_length;
-            if (new_length > new_path_size - 1) {
-                error_fprintf(stderr, "ERROR fix_path: Path too long: %s(%s)", function_name, path);
-                return path;
-            }
-            const char *rest = path + prefix_length;
-            strcpy(new_path, replace);
-            strcat(new_path, rest);
-            info_fprintf(stderr, "Mapped Path: %s('%s') => '%s'\n", function_name, path, new_path);
-            return new_path;
-        }
+static void trace_init()
+{
+    const char *directory = getenv("PATH_MAPPING_TRACE");
+    if (trace_file != NULL || directory == NULL || directory[0] == '\0') return;
+    if (strlen(directory) >= sizeof trace_directory) {
+        error_fprintf(stderr, "PATH_MAPPING_TRACE: path too long: %s\n", directory);
+        return;
     }
-    return path;
+    strcpy(trace_directory, directory);
+    const char *ring_kb = getenv("PATH_MAPPING_TRACE_SIZE");
+    size_t kb = ring_kb != NULL && ring_kb[0] != '\0' ? strtoull(ring_kb, NULL, 10) : TRACE_DEFAULT_RING_KB;
+    trace_ring_size = (kb < TRACE_MIN_RING_KB ? TRACE_MIN_RING_KB : kb) * 1024;
+    pthread_atfork(NULL, NULL, trace_atfork_child);
+    __atomic_store_n(&trace_file, trace_create(), __ATOMIC_RELEASE);
 }
 
+#else // DISABLE_TRACE
+
+struct trace_call { char unused; };
+static inline void trace_start(struct trace_call *call) {}
+static inline void trace_call_original(const struct trace_call *call) {}
+static inline void trace_finish(const struct trace_call *call, const struct original_function *entry, const char *path, const char *new_path) {}
+static inline void trace_rule(int rule) {}
+static void trace_init() {}
+
+#endif // DISABLE_TRACE
+
 
 /////////////////////////////////////////////////////////
 // Macro definitions for generating function overrides //
@@ -245,7 +5030,7 @@ static const char *fix_path(const char *function_name, const char *path, char *n
 #define OVERRIDE_ARG_2(type1, arg1, type2, arg2, ...)  arg2
 #define OVERRIDE_ARG_3(type1, arg1, type2, arg2, type3, arg3, ...)  arg3
 #define OVERRIDE_ARG_4(type1, arg1, type2, arg2, type3, arg3, type4, arg4, ...)  arg4
-#define OVERRIDE_ARG_5(type1, arg1, type2, arg2, type3, arg3, type4, arg4, arg5, ...)  arg5
+#define OVERRIDE_ARG_5(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, ...)  arg5
 
 // Create the function pointer typedef for the function
 #define OVERRIDE_TYPEDEF_NAME(funcname) orig_##funcname##_func_type
@@ -253,15 +5038,30 @@ static const char *fix_path(const char *function_name, const char *path, char *n
 
 // Create a valid C argument list including types
 #define OVERRIDE_ARGS(has_varargs, nargs, ...)  OVERRIDE_ARGS_##nargs(has_varargs, __VA_ARGS__)
+#define OVERRIDE_ARGS_0(has_varargs, ...)  void
 #define OVERRIDE_ARGS_1(has_varargs, type1, arg1)  type1 arg1 OVERRIDE_VARARGS(has_varargs)
 #define OVERRIDE_ARGS_2(has_varargs, type1, arg1, type2, arg2)  type1 arg1, type2 arg2 OVERRIDE_VARARGS(has_varargs)
 #define OVERRIDE_ARGS_3(has_varargs, type1, arg1, type2, arg2, type3, arg3)  type1 arg1, type2 arg2, type3 arg3 OVERRIDE_VARARGS(has_varargs)
 #define OVERRIDE_ARGS_4(has_varargs, type1, arg1, type2, arg2, type3, arg3, type4, arg4)  type1 arg1, type2 arg2, type3 arg3, type4 arg4 OVERRIDE_VARARGS(has_varargs)
 #define OVERRIDE_ARGS_5(has_varargs, type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5)  type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5 OVERRIDE_VARARGS(has_varargs)
-// Print ", ..." in the argument list if has_varargs is 1
+#define OVERRIDE_ARGS_6(has_varargs, type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  type1 arg1, type2 arg2, type3 arg3, type4 arg4, type5 arg5, type6 arg6 OVERRIDE_VARARGS(has_varargs)
+// Print ", ..." in the argument list if has_varargs is 1 (mode of open()) or 2 (argument of fcntl())
 #define OVERRIDE_VARARGS(has_varargs) OVERRIDE_VARARGS_##has_varargs
 #define OVERRIDE_VARARGS_0
 #define OVERRIDE_VARARGS_1 , ...
+#define OVERRIDE_VARARGS_2 , ...
+#define OVERRIDE_VARARGS_3 , ...
+#define OVERRIDE_VARARGS_4
+
+// Create an argument list without types
+#define OVERRIDE_CALL_ARGS(nargs, ...)  OVERRIDE_CALL_ARGS_##nargs(__VA_ARGS__)
+#define OVERRIDE_CALL_ARGS_0(...)
+#define OVERRIDE_CALL_ARGS_1(type1, arg1)  arg1
+#define OVERRIDE_CALL_ARGS_2(type1, arg1, type2, arg2)  arg1, arg2
+#define OVERRIDE_CALL_ARGS_3(type1, arg1, type2, arg2, type3, arg3)  arg1, arg2, arg3
+#define OVERRIDE_CALL_ARGS_4(type1, arg1, type2, arg2, type3, arg3, type4, arg4)  arg1, arg2, arg3, arg4
+#define OVERRIDE_CALL_ARGS_5(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5)  arg1, arg2, arg3, arg4, arg5
+#define OVERRIDE_CALL_ARGS_6(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  arg1, arg2, arg3, arg4, arg5, arg6
 
 // Create an argument list without types where one argument is replaced with new_path
 #define OVERRIDE_RETURN_ARGS(nargs, path_arg_pos, ...)  OVERRIDE_RETURN_ARGS_##nargs##_##path_arg_pos(__VA_ARGS__)
@@ -280,32 +5080,110 @@ static const char *fix_path(const char *function_name, const char *path, char *n
 #define OVERRIDE_RETURN_ARGS_5_3(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5)  arg1, arg2, new_path, arg4, arg5
 #define OVERRIDE_RETURN_ARGS_5_4(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5)  arg1, arg2, arg3, new_path, arg5
 #define OVERRIDE_RETURN_ARGS_5_5(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5)  arg1, arg2, arg3, arg4, new_path
+#define OVERRIDE_RETURN_ARGS_6_1(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  new_path, arg2, arg3, arg4, arg5, arg6
+#define OVERRIDE_RETURN_ARGS_6_2(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  arg1, new_path, arg3, arg4, arg5, arg6
+#define OVERRIDE_RETURN_ARGS_6_3(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  arg1, arg2, new_path, arg4, arg5, arg6
+#define OVERRIDE_RETURN_ARGS_6_4(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  arg1, arg2, arg3, new_path, arg5, arg6
+#define OVERRIDE_RETURN_ARGS_6_5(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  arg1, arg2, arg3, arg4, new_path, arg6
+#define OVERRIDE_RETURN_ARGS_6_6(type1, arg1, type2, arg2, type3, arg3, type4, arg4, type5, arg5, type6, arg6)  arg1, arg2, arg3, arg4, arg5, new_path
 
 // Use this to override a function without varargs
 #define OVERRIDE_FUNCTION(nargs, path_arg_pos, returntype, funcname, ...) \
-    OVERRIDE_FUNCTION_MODE_GENERIC(0, nargs, path_arg_pos, returntype, funcname, __VA_ARGS__)
+    OVERRIDE_FUNCTION_MODE_GENERIC(0, nargs, path_arg_pos, AT_FDCWD, NONE, OVERLAY_READ, returntype, funcname, __VA_ARGS__)
 
 // Use this to override a function with a vararg mode that works like open() or openat()
 #define OVERRIDE_FUNCTION_VARARGS(nargs, path_arg_pos, returntype, funcname, ...) \
-    OVERRIDE_FUNCTION_MODE_GENERIC(1, nargs, path_arg_pos, returntype, funcname, __VA_ARGS__)
-
-#define OVERRIDE_FUNCTION_MODE_GENERIC(has_varargs, nargs, path_arg_pos, returntype, funcname, ...) \
-OVERRIDE_TYPEDEF(has_varargs, nargs, returntype, funcname, __VA_ARGS__) \
+    OVERRIDE_FUNCTION_MODE_GENERIC(1, nargs, path_arg_pos, AT_FDCWD, NONE, OVERLAY_READ, returntype, funcname, __VA_ARGS__)
+
+// Use this to override a function like fstatat(), where relative paths are resolved relative to a dirfd argument
+#define OVERRIDE_FUNCTION_AT(nargs, dirfd_arg_pos, path_arg_pos, returntype, funcname, ...) \
+    OVERRIDE_FUNCTION_MODE_GENERIC(0, nargs, path_arg_pos, OVERRIDE_ARG(dirfd_arg_pos, __VA_ARGS__), NONE, OVERLAY_READ, returntype, funcname, __VA_ARGS__)
+
+// Same as OVERRIDE_FUNCTION and OVERRIDE_FUNCTION_AT for functions which change their path,
+// where overlay is the expression for the OVERLAY_* access (see overlay_prepare())
+#define OVERRIDE_FUNCTION_WRITE(overlay, nargs, path_arg_pos, returntype, funcname, ...) \
+    OVERRIDE_FUNCTION_MODE_GENERIC(0, nargs, path_arg_pos, AT_FDCWD, NONE, overlay, returntype, funcname, __VA_ARGS__)
+#define OVERRIDE_FUNCTION_AT_WRITE(overlay, nargs, dirfd_arg_pos, path_arg_pos, returntype, funcname, ...) \
+    OVERRIDE_FUNCTION_MODE_GENERIC(0, nargs, path_arg_pos, OVERRIDE_ARG(dirfd_arg_pos, __VA_ARGS__), NONE, overlay, returntype, funcname, __VA_ARGS__)
+
+// The generic version, which is used directly by the functions which open directories.
+// at_fd is the expression for the dirfd argument, or AT_FDCWD if there is none.
+// track is NONE, FD, DIR or CWD, and selects how the virtual path of the result is recorded (see fd_paths_opened()),
+// or RESOLVED, ALLOCATED or LINK, which map the returned path back if PATH_MAPPING_REVERSE is set (see unmap_result()),
+// or EXEC for the exec functions, which record nothing and map the path with map_exec_path_at().
+// overlay is the expression for the OVERLAY_* access to the path, which may copy it up first (see overlay_prepare()).
+#define OVERRIDE_FUNCTION_MODE_GENERIC(has_varargs, nargs, path_arg_pos, at_fd, track, overlay, returntype, funcname, ...) \
+OVERRIDE_ORIGINAL(has_varargs, nargs, returntype, funcname, __VA_ARGS__) \
 __NL__ returntype funcname (OVERRIDE_ARGS(has_varargs, nargs, __VA_ARGS__))\
 __NL__{\
 __NL__    debug_fprintf(stderr, #funcname "(%s) called\n", OVERRIDE_ARG(path_arg_pos, __VA_ARGS__));\
+__NL__    struct path_mapping_function_counters *counters = stats_function_counters(&original_##funcname);\
+__NL__    uint64_t start_time = stats_start(counters);\
+__NL__    struct trace_call call_trace;\
+__NL__    trace_start(&call_trace);\
 __NL__    char buffer[MAX_PATH];\
-__NL__    const char *new_path = fix_path(#funcname, OVERRIDE_ARG(path_arg_pos, __VA_ARGS__), buffer, sizeof buffer);\
+__NL__    const char *new_path = OVERRIDE_MAP(track)(#funcname, counters, at_fd, OVERRIDE_ARG(path_arg_pos, __VA_ARGS__), buffer, sizeof buffer);\
+__NL__    new_path = overlay_prepare(overlay, OVERRIDE_ARG(path_arg_pos, __VA_ARGS__), new_path, buffer, sizeof buffer);\
 __NL__ \
-__NL__    static OVERRIDE_TYPEDEF_NAME(funcname) orig_func = NULL;\
-__NL__    if (orig_func == NULL) {\
-__NL__        orig_func = (OVERRIDE_TYPEDEF_NAME(funcname))dlsym(RTLD_NEXT, #funcname);\
-__NL__    }\
+__NL__    OVERRIDE_TYPEDEF_NAME(funcname) orig_func = ORIGINAL_FUNCTION(funcname);\
+__NL__    returntype result;\
+__NL__    trace_call_original(&call_trace);\
 __NL__    OVERRIDE_DO_MODE_VARARG(has_varargs, nargs, path_arg_pos, __VA_ARGS__) \
-__NL__    return orig_func(OVERRIDE_RETURN_ARGS(nargs, path_arg_pos, __VA_ARGS__));\
+__NL__    result = orig_func(OVERRIDE_RETURN_ARGS(nargs, path_arg_pos, __VA_ARGS__));\
+__NL__    trace_finish(&call_trace, &original_##funcname, OVERRIDE_ARG(path_arg_pos, __VA_ARGS__), new_path);\
+__NL__    OVERRIDE_TRACK(track, result, at_fd, OVERRIDE_ARG(path_arg_pos, __VA_ARGS__))\
+__NL__    stats_finish(counters, start_time);\
+__NL__    return result;\
+__NL__}
+
+// The function which maps the path
+#define OVERRIDE_MAP(track)  OVERRIDE_MAP_##track
+#define OVERRIDE_MAP_NONE map_path_at
+#define OVERRIDE_MAP_FD map_path_at
+#define OVERRIDE_MAP_DIR map_path_at
+#define OVERRIDE_MAP_CWD map_path_at
+#define OVERRIDE_MAP_RESOLVED map_path_at
+#define OVERRIDE_MAP_ALLOCATED map_path_at
+#define OVERRIDE_MAP_LINK map_path_at
+#define OVERRIDE_MAP_EXEC map_exec_path_at
+
+// Records the virtual path of the file descriptor or DIR * returned by functions which open directories
+#define OVERRIDE_TRACK(track, result, at_fd, path)  OVERRIDE_TRACK_##track(result, at_fd, path)
+#define OVERRIDE_TRACK_NONE(result, at_fd, path) // Do nothing
+#define OVERRIDE_TRACK_EXEC(result, at_fd, path) // Do nothing
+#define OVERRIDE_TRACK_FD(result, at_fd, path) \
+__NL__    if (result >= 0) fd_paths_opened(result, at_fd, path);
+#define OVERRIDE_TRACK_DIR(result, at_fd, path) \
+__NL__    if (result != NULL) fd_paths_opened(dirfd(result), at_fd, path);
+#define OVERRIDE_TRACK_CWD(result, at_fd, path) \
+__NL__    if (result == 0) fd_paths_chdir(path);
+// Like OVERRIDE_DO_MODE_VARARG, these refer to the arguments of realpath() and readlink() by name
+#define OVERRIDE_TRACK_RESOLVED(result, at_fd, path) \
+__NL__    result = unmap_result("realpath", result, result == resolved_path ? PATH_MAX : 0);
+#define OVERRIDE_TRACK_ALLOCATED(result, at_fd, path) \
+__NL__    result = unmap_result("canonicalize_file_name", result, 0);
+#define OVERRIDE_TRACK_LINK(result, at_fd, path) \
+__NL__    result = unmap_link("readlink", buf, bufsiz, result);
+
+// Declare the typedef, the dispatch table entry and the resolver stub for the original function.
+// Use this directly for overrides which are not generated by OVERRIDE_FUNCTION.
+#define OVERRIDE_ORIGINAL(has_varargs, nargs, returntype, funcname, ...) \
+OVERRIDE_TYPEDEF(has_varargs, nargs, returntype, funcname, __VA_ARGS__) \
+__NL__ static returntype funcname##_resolve_stub(OVERRIDE_ARGS(has_varargs, nargs, __VA_ARGS__));\
+__NL__ static struct original_function original_##funcname ORIGINAL_FUNCTION_ATTRIBUTES = {\
+__NL__    (original_func_t)funcname##_resolve_stub, #funcname \
+__NL__ };\
+__NL__ static returntype funcname##_resolve_stub(OVERRIDE_ARGS(has_varargs, nargs, __VA_ARGS__))\
+__NL__{\
+__NL__    resolve_original_functions();\
+__NL__    OVERRIDE_TYPEDEF_NAME(funcname) orig_func = ORIGINAL_FUNCTION(funcname);\
+__NL__    if (orig_func == funcname##_resolve_stub) orig_func = (OVERRIDE_TYPEDEF_NAME(funcname))resolve_original_late(&original_##funcname);\
+__NL__    OVERRIDE_STUB_MODE_VARARG(has_varargs, nargs, __VA_ARGS__) \
+__NL__    return orig_func(OVERRIDE_CALL_ARGS(nargs, __VA_ARGS__));\
 __NL__}
 
-// Conditionally expands to the code used to handle the mode argument of open() and openat()
+// Conditionally expands to the code used to handle the mode argument of open() and openat().
+// The expansion ends with "else", so that it must be followed by the call without the mode.
 #define OVERRIDE_DO_MODE_VARARG(has_mode_vararg, nargs, path_arg_pos, ...) \
     OVERRIDE_DO_MODE_VARARG_##has_mode_vararg(nargs, path_arg_pos, __VA_ARGS__)
 #define OVERRIDE_DO_MODE_VARARG_0(nargs, path_arg_pos, ...) // Do nothing
@@ -315,8 +5193,41 @@ __NL__        va_list args;\
 __NL__        va_start(args, flags);\
 __NL__        int mode = va_arg(args, int);\
 __NL__        va_end(args);\
-__NL__        return orig_func(OVERRIDE_RETURN_ARGS(nargs, path_arg_pos, __VA_ARGS__), mode);\
+__NL__        result = orig_func(OVERRIDE_RETURN_ARGS(nargs, path_arg_pos, __VA_ARGS__), mode);\
+__NL__    } else
+
+// The exec functions with an env argument pass the mapping on to the new program (see exec_env())
+#define OVERRIDE_DO_MODE_VARARG_4(nargs, path_arg_pos, ...) \
+__NL__    EXEC_ENV(env);
+
+// Same as OVERRIDE_DO_MODE_VARARG, but passes all arguments through unchanged
+#define OVERRIDE_STUB_MODE_VARARG(has_mode_vararg, nargs, ...) \
+    OVERRIDE_STUB_MODE_VARARG_##has_mode_vararg(nargs, __VA_ARGS__)
+#define OVERRIDE_STUB_MODE_VARARG_0(nargs, ...) // Do nothing
+#define OVERRIDE_STUB_MODE_VARARG_1(nargs, ...) \
+__NL__    if (__OPEN_NEEDS_MODE(flags)) {\
+__NL__        va_list args;\
+__NL__        va_start(args, flags);\
+__NL__        int mode = va_arg(args, int);\
+__NL__        va_end(args);\
+__NL__        return orig_func(OVERRIDE_CALL_ARGS(nargs, __VA_ARGS__), mode);\
 __NL__    }
+// fcntl() takes one optional argument after cmd, which is either an int or a pointer
+#define OVERRIDE_STUB_MODE_VARARG_2(nargs, ...) \
+__NL__    va_list args;\
+__NL__    va_start(args, cmd);\
+__NL__    void *arg = va_arg(args, void *);\
+__NL__    va_end(args);\
+__NL__    return orig_func(OVERRIDE_CALL_ARGS(nargs, __VA_ARGS__), arg);
+// syscall() takes up to six arguments after the number, which are all passed as long
+#define OVERRIDE_STUB_MODE_VARARG_3(nargs, ...) \
+__NL__    va_list args;\
+__NL__    va_start(args, number);\
+__NL__    long a[6];\
+__NL__    for (int i = 0; i < 6; i++) a[i] = va_arg(args, long);\
+__NL__    va_end(args);\
+__NL__    return orig_func(OVERRIDE_CALL_ARGS(nargs, __VA_ARGS__), a[0], a[1], a[2], a[3], a[4], a[5]);
+#define OVERRIDE_STUB_MODE_VARARG_4(nargs, ...) // Do nothing
 
 
 /////////////////////////////////////////////////////////
@@ -325,26 +5236,33 @@ __NL__    }
 
 
 #ifndef DISABLE_OPEN
-OVERRIDE_FUNCTION_VARARGS(2, 1, int, open, const char *, pathname, int, flags)
-OVERRIDE_FUNCTION_VARARGS(2, 1, int, open64, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(1, 2, 1, AT_FDCWD, FD, overlay_open_access(flags), int, open, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(1, 2, 1, AT_FDCWD, FD, overlay_open_access(flags), int, open64, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, AT_FDCWD, FD, OVERLAY_REPLACE, int, creat, const char *, pathname, mode_t, mode)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, AT_FDCWD, FD, OVERLAY_REPLACE, int, creat64, const char *, pathname, mode_t, mode)
+// Called instead of open() with _FORTIFY_SOURCE if the flags are not constant
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, AT_FDCWD, FD, overlay_open_access(flags), int, __open_2, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, AT_FDCWD, FD, overlay_open_access(flags), int, __open64_2, const char *, pathname, int, flags)
 #endif // DISABLE_OPEN
 
 
 #ifndef DISABLE_OPENAT
-OVERRIDE_FUNCTION_VARARGS(3, 2, int, openat, int, dirfd, const char *, pathname, int, flags)
-OVERRIDE_FUNCTION_VARARGS(3, 2, int, openat64, int, dirfd, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(1, 3, 2, dirfd, FD, overlay_open_access(flags), int, openat, int, dirfd, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(1, 3, 2, dirfd, FD, overlay_open_access(flags), int, openat64, int, dirfd, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 3, 2, dirfd, FD, overlay_open_access(flags), int, __openat_2, int, dirfd, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 3, 2, dirfd, FD, overlay_open_access(flags), int, __openat64_2, int, dirfd, const char *, pathname, int, flags)
 #endif // DISABLE_OPENAT
 
 
 #ifndef DISABLE_FOPEN
-OVERRIDE_FUNCTION(2, 1, FILE*, fopen, const char *, filename, const char *, mode)
-OVERRIDE_FUNCTION(2, 1, FILE*, fopen64, const char *, filename, const char *, mode)
-OVERRIDE_FUNCTION(3, 1, FILE*, freopen, const char *, filename, const char *, mode, FILE *, stream)
+OVERRIDE_FUNCTION_WRITE(overlay_fopen_access(mode), 2, 1, FILE*, fopen, const char *, filename, const char *, mode)
+OVERRIDE_FUNCTION_WRITE(overlay_fopen_access(mode), 2, 1, FILE*, fopen64, const char *, filename, const char *, mode)
+OVERRIDE_FUNCTION_WRITE(overlay_fopen_access(mode), 3, 1, FILE*, freopen, const char *, filename, const char *, mode, FILE *, stream)
 #endif // DISABLE_FOPEN
 
 
 #ifndef DISABLE_CHDIR
-OVERRIDE_FUNCTION(1, 1, int, chdir, const char *, path)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 1, 1, AT_FDCWD, CWD, OVERLAY_READ, int, chdir, const char *, path)
 #endif // DISABLE_CHDIR
 
 
@@ -363,10 +5281,13 @@ OVERRIDE_FUNCTION(3, 2, int, __lxstat64, int, ver, const char *, path, struct st
 
 
 #ifndef DISABLE_FSTATAT
-OVERRIDE_FUNCTION(4, 2, int, fstatat, int, dirfd, const char *, pathname, struct stat *, statbuf, int, flags)
-OVERRIDE_FUNCTION(4, 2, int, fstatat64, int, dirfd, const char *, pathname, struct stat64 *, statbuf, int, flags)
-OVERRIDE_FUNCTION(5, 3, int, __fxstatat, int, ver, int, dirfd, const char *, pathname, struct stat *, statbuf, int, flags)
-OVERRIDE_FUNCTION(5, 3, int, __fxstatat64, int, ver, int, dirfd, const char *, pathname, struct stat64 *, statbuf, int, flags)
+OVERRIDE_FUNCTION_AT(4, 1, 2, int, fstatat, int, dirfd, const char *, pathname, struct stat *, statbuf, int, flags)
+OVERRIDE_FUNCTION_AT(4, 1, 2, int, fstatat64, int, dirfd, const char *, pathname, struct stat64 *, statbuf, int, flags)
+OVERRIDE_FUNCTION_AT(5, 2, 3, int, __fxstatat, int, ver, int, dirfd, const char *, pathname, struct stat *, statbuf, int, flags)
+OVERRIDE_FUNCTION_AT(5, 2, 3, int, __fxstatat64, int, ver, int, dirfd, const char *, pathname, struct stat64 *, statbuf, int, flags)
+#if __GLIBC_PREREQ(2, 28) // statx() exists since glibc 2.28, and is used by ls and stat of coreutils
+OVERRIDE_FUNCTION_AT(5, 1, 2, int, statx, int, dirfd, const char *, pathname, int, flags, unsigned int, mask, struct statx *, statxbuf)
+#endif
 #endif // DISABLE_FSTATAT
 
 
@@ -380,41 +5301,116 @@ OVERRIDE_FUNCTION(2, 1, int, statvfs64, const char *, path, struct statvfs64 *,
 
 #ifndef DISABLE_ACCESS
 OVERRIDE_FUNCTION(2, 1, int, access, const char *, pathname, int, mode)
-OVERRIDE_FUNCTION(4, 2, int, faccessat, int, dirfd, const char *, pathname, int, mode, int, flags)
+OVERRIDE_FUNCTION_AT(4, 1, 2, int, faccessat, int, dirfd, const char *, pathname, int, mode, int, flags)
 #endif // DISABLE_ACCESS
 
 
 #ifndef DISABLE_XATTR
 OVERRIDE_FUNCTION(4, 1, ssize_t, getxattr, const char *, path, const char *, name, void *, value, size_t, size)
 OVERRIDE_FUNCTION(4, 1, ssize_t, lgetxattr, const char *, path, const char *, name, void *, value, size_t, size)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 5, 1, int, setxattr, const char *, path, const char *, name, const void *, value, size_t, size, int, flags)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 5, 1, int, lsetxattr, const char *, path, const char *, name, const void *, value, size_t, size, int, flags)
+OVERRIDE_FUNCTION(3, 1, ssize_t, listxattr, const char *, path, char *, list, size_t, size)
+OVERRIDE_FUNCTION(3, 1, ssize_t, llistxattr, const char *, path, char *, list, size_t, size)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 2, 1, int, removexattr, const char *, path, const char *, name)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 2, 1, int, lremovexattr, const char *, path, const char *, name)
 #endif // DISABLE_XATTR
 
 
 #ifndef DISABLE_OPENDIR
-OVERRIDE_FUNCTION(1, 1, DIR *, opendir, const char *, name)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 1, 1, AT_FDCWD, DIR, OVERLAY_READ, DIR *, opendir, const char *, name)
 #endif // DISABLE_OPENDIR
 
 
 #ifndef DISABLE_MKDIR
-OVERRIDE_FUNCTION(2, 1, int, mkdir, const char *, pathname, mode_t, mode)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_CREATE, 2, 1, int, mkdir, const char *, pathname, mode_t, mode)
 #endif // DISABLE_MKDIR
 
 
 #ifndef DISABLE_FTW
-OVERRIDE_FUNCTION(3, 1, int, ftw, const char *, filename, __ftw_func_t, func, int, descriptors)
-OVERRIDE_FUNCTION(4, 1, int, nftw, const char *, filename, __nftw_func_t, func, int, descriptors, int, flags)
-OVERRIDE_FUNCTION(3, 1, int, ftw64, const char *, filename, __ftw64_func_t, func, int, descriptors)
-OVERRIDE_FUNCTION(4, 1, int, nftw64, const char *, filename, __nftw64_func_t, func, int, descriptors, int, flags)
+// With PATH_MAPPING_REVERSE, the callback is called through a trampoline, which passes the virtual path.
+// The callback of the innermost walk of the current thread is kept in a thread local variable.
+#define OVERRIDE_FTW(funcname, functype, stattype) \
+__NL__ static __thread functype funcname##_callback __attribute__((tls_model("initial-exec")));\
+__NL__ static int funcname##_trampoline(const char *filename, const struct stattype *status, int flag)\
+__NL__{\
+__NL__    char buffer[MAX_PATH];\
+__NL__    return funcname##_callback(unmap_path(#funcname, filename, buffer, sizeof buffer), status, flag);\
+__NL__}\
+OVERRIDE_ORIGINAL(0, 3, int, funcname, const char *, filename, functype, func, int, descriptors) \
+__NL__ int funcname(const char *filename, functype func, int descriptors)\
+__NL__{\
+__NL__    debug_fprintf(stderr, #funcname "(%s) called\n", filename);\
+__NL__    struct path_mapping_function_counters *counters = stats_function_counters(&original_##funcname);\
+__NL__    uint64_t start_time = stats_start(counters);\
+__NL__    struct trace_call call_trace;\
+__NL__    trace_start(&call_trace);\
+__NL__    char buffer[MAX_PATH];\
+__NL__    const char *new_path = map_path_at(#funcname, counters, AT_FDCWD, filename, buffer, sizeof buffer);\
+__NL__    functype previous = funcname##_callback;\
+__NL__    if (path_reverse_enabled) {\
+__NL__        funcname##_callback = func;\
+__NL__        func = funcname##_trampoline;\
+__NL__    }\
+__NL__    trace_call_original(&call_trace);\
+__NL__    int result = ORIGINAL_FUNCTION(funcname)(new_path, func, descriptors);\
+__NL__    trace_finish(&call_trace, &original_##funcname, filename, new_path);\
+__NL__    funcname##_callback = previous;\
+__NL__    stats_finish(counters, start_time);\
+__NL__    return result;\
+__NL__}
+
+// Same as OVERRIDE_FTW, but the trampoline also moves the base of the file name in struct FTW
+#define OVERRIDE_NFTW(funcname, functype, stattype) \
+__NL__ static __thread functype funcname##_callback __attribute__((tls_model("initial-exec")));\
+__NL__ static int funcname##_trampoline(const char *filename, const struct stattype *status, int flag, struct FTW *info)\
+__NL__{\
+__NL__    char buffer[MAX_PATH];\
+__NL__    const char *virtual_path = unmap_path(#funcname, filename, buffer, sizeof buffer);\
+__NL__    if (virtual_path == filename) return funcname##_callback(filename, status, flag, info);\
+__NL__    struct FTW virtual_info = *info;\
+__NL__    virtual_info.base += (int)strlen(virtual_path) - (int)strlen(filename);\
+__NL__    return funcname##_callback(virtual_path, status, flag, &virtual_info);\
+__NL__}\
+OVERRIDE_ORIGINAL(0, 4, int, funcname, const char *, filename, functype, func, int, descriptors, int, flags) \
+__NL__ int funcname(const char *filename, functype func, int descriptors, int flags)\
+__NL__{\
+__NL__    debug_fprintf(stderr, #funcname "(%s) called\n", filename);\
+__NL__    struct path_mapping_function_counters *counters = stats_function_counters(&original_##funcname);\
+__NL__    uint64_t start_time = stats_start(counters);\
+__NL__    struct trace_call call_trace;\
+__NL__    trace_start(&call_trace);\
+__NL__    char buffer[MAX_PATH];\
+__NL__    const char *new_path = map_path_at(#funcname, counters, AT_FDCWD, filename, buffer, sizeof buffer);\
+__NL__    functype previous = funcname##_callback;\
+__NL__    if (path_reverse_enabled) {\
+__NL__        funcname##_callback = func;\
+__NL__        func = funcname##_trampoline;\
+__NL__    }\
+__NL__    trace_call_original(&call_trace);\
+__NL__    int result = ORIGINAL_FUNCTION(funcname)(new_path, func, descriptors, flags);\
+__NL__    trace_finish(&call_trace, &original_##funcname, filename, new_path);\
+__NL__    funcname##_callback = previous;\
+__NL__    stats_finish(counters, start_time);\
+__NL__    return result;\
+__NL__}
+
+OVERRIDE_FTW(ftw, __ftw_func_t, stat)
+OVERRIDE_NFTW(nftw, __nftw_func_t, stat)
+OVERRIDE_FTW(ftw64, __ftw64_func_t, stat64)
+OVERRIDE_NFTW(nftw64, __nftw64_func_t, stat64)
 #endif // DISABLE_FTW
 
 
 #ifndef DISABLE_FTS
 typedef int (*fts_compare_func_t)(const FTSENT **, const FTSENT **);
-typedef FTS* (*orig_fts_open_func_type)(char * const *path_argv, int options, fts_compare_func_t compare);
+OVERRIDE_ORIGINAL(0, 3, FTS *, fts_open, char * const *, path_argv, int, options, fts_compare_func_t, compare)
 FTS *fts_open(char * const *path_argv, int options, fts_compare_func_t compare)
 {
     if (path_argv[0] == NULL) return NULL;
     debug_fprintf(stderr, "fts_open(%s) called\n", path_argv[0]);
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_fts_open);
+    uint64_t start_time = stats_start(counters);
 
     FTS *result = NULL;
     int argc = 0;
@@ -438,16 +5434,11 @@ FTS *fts_open(char * const *path_argv, int options, fts_compare_func_t compare)
         if (buffers[i] == NULL) {
             goto _fts_open_cleanup;
         }
-        new_paths[i] = fix_path("fts_open", path_argv[i], buffers[i], MAX_PATH);
+        new_paths[i] = map_path_at("fts_open", counters, AT_FDCWD, path_argv[i], buffers[i], MAX_PATH);
     }
     new_paths[argc] = NULL; // terminating null pointer
 
-    static orig_fts_open_func_type orig_func = NULL;
-    if (orig_func == NULL) {
-        orig_func = (orig_fts_open_func_type)dlsym(RTLD_NEXT, "fts_open");
-    }
-
-    result = orig_func((char * const *)new_paths, options, compare);
+    result = ORIGINAL_FUNCTION(fts_open)((char * const *)new_paths, options, compare);
 
 _fts_open_cleanup:
     for (int i = 0; i < argc; i++) {
@@ -457,8 +5448,102 @@ _fts_open_cleanup:
 _fts_open_cleanup_buffers:
     free(buffers);
 _fts_open_return:
+    stats_finish(counters, start_time);
     return result;
 }
+
+// With PATH_MAPPING_REVERSE, fts_read() returns entries with the virtual path in fts_path.
+// fts builds the paths of all entries in one buffer of the FTS, and expects fts_path of the
+// current entry to point there when it is called again. So the original fts_path is put back
+// before each call, and the virtual path is kept in a buffer per FTS, which lives until fts_close().
+struct fts_reverse {
+    FTS *fts;
+    FTSENT *entry;              // Entry whose fts_path points to buffer, or NULL
+    char *path;                 // Original fts_path and fts_pathlen of entry
+    unsigned short pathlen;
+    struct fts_reverse *next;
+    char buffer[MAX_PATH];
+};
+
+static struct fts_reverse *fts_reverse_list = NULL;
+static pthread_mutex_t fts_reverse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the state of fts, which is created if create is true. Must be called with fts_reverse_lock held.
+static struct fts_reverse *fts_reverse_find(FTS *fts, int create)
+{
+    for (struct fts_reverse *state = fts_reverse_list; state != NULL; state = state->next) {
+        if (state->fts == fts) return state;
+    }
+    if (!create) return NULL;
+    struct fts_reverse *state = malloc(sizeof *state);
+    if (state == NULL) return NULL;
+    state->fts = fts;
+    state->entry = NULL;
+    state->next = fts_reverse_list;
+    fts_reverse_list = state;
+    return state;
+}
+
+// Puts back the original fts_path of the entry which was last returned for fts, and frees the state if remove is true
+static void fts_reverse_restore(FTS *fts, int remove)
+{
+    pthread_mutex_lock(&fts_reverse_lock);
+    for (struct fts_reverse **link = &fts_reverse_list; *link != NULL; link = &(*link)->next) {
+        struct fts_reverse *state = *link;
+        if (state->fts != fts) continue;
+        if (state->entry != NULL) {
+            state->entry->fts_path = state->path;
+            state->entry->fts_pathlen = state->pathlen;
+            state->entry = NULL;
+        }
+        if (remove) {
+            *link = state->next;
+            free(state);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&fts_reverse_lock);
+}
+
+OVERRIDE_ORIGINAL(0, 1, FTSENT *, fts_read, FTS *, fts)
+FTSENT *fts_read(FTS *fts)
+{
+    if (!path_reverse_enabled) return ORIGINAL_FUNCTION(fts_read)(fts);
+    fts_reverse_restore(fts, 0);
+    FTSENT *entry = ORIGINAL_FUNCTION(fts_read)(fts);
+    if (entry == NULL) return entry;
+    char buffer[MAX_PATH];
+    const char *virtual_path = unmap_path("fts_read", entry->fts_path, buffer, sizeof buffer);
+    if (virtual_path == entry->fts_path) return entry;
+
+    pthread_mutex_lock(&fts_reverse_lock);
+    struct fts_reverse *state = fts_reverse_find(fts, 1);
+    if (state != NULL) {
+        strcpy(state->buffer, virtual_path);
+        state->entry = entry;
+        state->path = entry->fts_path;
+        state->pathlen = entry->fts_pathlen;
+        entry->fts_path = state->buffer;
+        entry->fts_pathlen = strlen(virtual_path);
+    }
+    pthread_mutex_unlock(&fts_reverse_lock);
+    return entry;
+}
+
+// fts_children() uses fts_path and fts_pathlen of the current entry, so the children keep their real paths
+OVERRIDE_ORIGINAL(0, 2, FTSENT *, fts_children, FTS *, fts, int, options)
+FTSENT *fts_children(FTS *fts, int options)
+{
+    if (path_reverse_enabled) fts_reverse_restore(fts, 0);
+    return ORIGINAL_FUNCTION(fts_children)(fts, options);
+}
+
+OVERRIDE_ORIGINAL(0, 1, int, fts_close, FTS *, fts)
+int fts_close(FTS *fts)
+{
+    if (path_reverse_enabled) fts_reverse_restore(fts, 1);
+    return ORIGINAL_FUNCTION(fts_close)(fts);
+}
 #endif // DISABLE_FTS
 
 
@@ -468,103 +5553,108 @@ OVERRIDE_FUNCTION(2, 1, long, pathconf, const char *, path, int, name)
 
 
 #ifndef DISABLE_REALPATH
-OVERRIDE_FUNCTION(2, 1, char *, realpath, const char *, path, char *, resolved_path)
-OVERRIDE_FUNCTION(1, 1, char *, canonicalize_file_name, const char *, path)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, AT_FDCWD, RESOLVED, OVERLAY_READ, char *, realpath, const char *, path, char *, resolved_path)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 1, 1, AT_FDCWD, ALLOCATED, OVERLAY_READ, char *, canonicalize_file_name, const char *, path)
+// The _FORTIFY_SOURCE variants check the size of the buffer and abort, so they are called with the mapped path
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 3, 1, AT_FDCWD, RESOLVED, OVERLAY_READ, char *, __realpath_chk, const char *, path, char *, resolved_path, size_t, resolved_len)
 #endif // DISABLE_REALPATH
 
 
 #ifndef DISABLE_READLINK
-OVERRIDE_FUNCTION(3, 1, ssize_t, readlink, const char *, pathname, char *, buf, size_t, bufsiz)
-OVERRIDE_FUNCTION(4, 2, ssize_t, readlinkat, int, dirfd, const char *, pathname, char *, buf, size_t, bufsiz)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 3, 1, AT_FDCWD, LINK, OVERLAY_READ, ssize_t, readlink, const char *, pathname, char *, buf, size_t, bufsiz)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 4, 2, dirfd, LINK, OVERLAY_READ, ssize_t, readlinkat, int, dirfd, const char *, pathname, char *, buf, size_t, bufsiz)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 4, 1, AT_FDCWD, LINK, OVERLAY_READ, ssize_t, __readlink_chk, const char *, pathname, char *, buf, size_t, bufsiz, size_t, buflen)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 5, 2, dirfd, LINK, OVERLAY_READ, ssize_t, __readlinkat_chk, int, dirfd, const char *, pathname, char *, buf, size_t, bufsiz, size_t, buflen)
 #endif // DISABLE_READLINK
 
 
 #ifndef DISABLE_SYMLINK
-OVERRIDE_FUNCTION(2, 2, int, symlink, const char *, target, const char *, linkpath)
-OVERRIDE_FUNCTION(3, 3, int, symlinkat, const char *, target, int, newdirfd, const char *, linkpath)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_CREATE, 2, 2, int, symlink, const char *, target, const char *, linkpath)
+OVERRIDE_FUNCTION_AT_WRITE(OVERLAY_CREATE, 3, 2, 3, int, symlinkat, const char *, target, int, newdirfd, const char *, linkpath)
 #endif // DISABLE_SYMLINK
 
 
 #ifndef DISABLE_MKFIFO
-OVERRIDE_FUNCTION(2, 1, int, mkfifo, const char *, filename, mode_t, mode)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_CREATE, 2, 1, int, mkfifo, const char *, filename, mode_t, mode)
 #endif // DISABLE_MKFIFO
 
 
 #ifndef DISABLE_MKNOD
-OVERRIDE_FUNCTION(3, 1, int, mknod, const char *, filename, mode_t, mode, dev_t, dev)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_CREATE, 3, 1, int, mknod, const char *, filename, mode_t, mode, dev_t, dev)
 #endif // DISABLE_MKNOD
 
 
 #ifndef DISABLE_UTIME
-OVERRIDE_FUNCTION(2, 1, int, utime, const char *, filename, const struct utimbuf *, times)
-OVERRIDE_FUNCTION(2, 1, int, utimes, const char *, filename, const struct timeval *, tvp)
-OVERRIDE_FUNCTION(2, 1, int, lutime, const char *, filename, const struct utimbuf *, tvp)
-OVERRIDE_FUNCTION(4, 2, int, utimensat, int, dirfd, const char *, pathname, const struct timespec *, times, int, flags)
-OVERRIDE_FUNCTION(3, 2, int, futimesat, int, dirfd, const char *, pathname, const struct timeval *, times)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 2, 1, int, utime, const char *, filename, const struct utimbuf *, times)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 2, 1, int, utimes, const char *, filename, const struct timeval *, tvp)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 2, 1, int, lutime, const char *, filename, const struct utimbuf *, tvp)
+OVERRIDE_FUNCTION_AT_WRITE(OVERLAY_WRITE, 4, 1, 2, int, utimensat, int, dirfd, const char *, pathname, const struct timespec *, times, int, flags)
+OVERRIDE_FUNCTION_AT_WRITE(OVERLAY_WRITE, 3, 1, 2, int, futimesat, int, dirfd, const char *, pathname, const struct timeval *, times)
 #endif // DISABLE_UTIME
 
 
 #ifndef DISABLE_CHMOD
-OVERRIDE_FUNCTION(2, 1, int, chmod, const char *, pathname, mode_t, mode)
-OVERRIDE_FUNCTION(4, 2, int, fchmodat, int, dirfd, const char *, pathname, mode_t, mode, int, flags)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 2, 1, int, chmod, const char *, pathname, mode_t, mode)
+OVERRIDE_FUNCTION_AT_WRITE(OVERLAY_WRITE, 4, 1, 2, int, fchmodat, int, dirfd, const char *, pathname, mode_t, mode, int, flags)
 #endif // DISABLE_CHMOD
 
 
 #ifndef DISABLE_CHOWN
-OVERRIDE_FUNCTION(3, 1, int, chown, const char *, pathname, uid_t, owner, gid_t, group)
-OVERRIDE_FUNCTION(3, 1, int, lchown, const char *, pathname, uid_t, owner, gid_t, group)
-OVERRIDE_FUNCTION(5, 2, int, fchownat, int, dirfd, const char *, pathname, uid_t, owner, gid_t, group, int, flags)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 3, 1, int, chown, const char *, pathname, uid_t, owner, gid_t, group)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_WRITE, 3, 1, int, lchown, const char *, pathname, uid_t, owner, gid_t, group)
+OVERRIDE_FUNCTION_AT_WRITE(OVERLAY_WRITE, 5, 1, 2, int, fchownat, int, dirfd, const char *, pathname, uid_t, owner, gid_t, group, int, flags)
 #endif // DISABLE_CHOWN
 
 
 #ifndef DISABLE_UNLINK
-OVERRIDE_FUNCTION(1, 1, int, unlink, const char *, pathname)
-OVERRIDE_FUNCTION(3, 2, int, unlinkat, int, dirfd, const char *, pathname, int, flags)
-OVERRIDE_FUNCTION(1, 1, int, rmdir, const char *, pathname)
-OVERRIDE_FUNCTION(1, 1, int, remove, const char *, pathname)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_UNLINK, 1, 1, int, unlink, const char *, pathname)
+OVERRIDE_FUNCTION_AT_WRITE(flags & AT_REMOVEDIR ? OVERLAY_RMDIR : OVERLAY_UNLINK, 3, 1, 2, int, unlinkat, int, dirfd, const char *, pathname, int, flags)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_RMDIR, 1, 1, int, rmdir, const char *, pathname)
+OVERRIDE_FUNCTION_WRITE(OVERLAY_REMOVE, 1, 1, int, remove, const char *, pathname)
 #endif // DISABLE_UNLINK
 
 
 #ifndef DISABLE_EXEC
-OVERRIDE_FUNCTION(2, 1, int, execv, const char *, filename, char * const*, argv)
-OVERRIDE_FUNCTION(3, 1, int, execve, const char *, filename, char * const*, argv, char * const*, env)
-OVERRIDE_FUNCTION(2, 1, int, execvp, const char *, filename, char * const*, argv)
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, AT_FDCWD, EXEC, OVERLAY_READ, int, execv, const char *, filename, char * const*, argv)
+OVERRIDE_FUNCTION_MODE_GENERIC(4, 3, 1, AT_FDCWD, EXEC, OVERLAY_READ, int, execve, const char *, filename, char * const*, argv, char * const*, env)
+// Names without a slash are searched in $PATH, not in the cwd
+OVERRIDE_FUNCTION_MODE_GENERIC(0, 2, 1, strchr(filename, '/') != NULL ? AT_FDCWD : NO_DIRFD, EXEC, OVERLAY_READ, int, execvp, const char *, filename, char * const*, argv)
+OVERRIDE_FUNCTION_MODE_GENERIC(4, 3, 1, strchr(filename, '/') != NULL ? AT_FDCWD : NO_DIRFD, EXEC, OVERLAY_READ, int, execvpe, const char *, filename, char * const*, argv, char * const*, env)
+#if __GLIBC_PREREQ(2, 34) // execveat() exists since glibc 2.34
+OVERRIDE_FUNCTION_MODE_GENERIC(4, 5, 2, dirfd, EXEC, OVERLAY_READ, int, execveat, int, dirfd, const char *, pathname, char * const*, argv, char * const*, env, int, flags)
+#endif
+OVERRIDE_FUNCTION_MODE_GENERIC(4, 6, 2, AT_FDCWD, NONE, OVERLAY_READ, int, posix_spawn, pid_t *, pid, const char *, path,
+        const posix_spawn_file_actions_t *, file_actions, const posix_spawnattr_t *, attrp, char * const*, argv, char * const*, env)
+OVERRIDE_FUNCTION_MODE_GENERIC(4, 6, 2, strchr(file, '/') != NULL ? AT_FDCWD : NO_DIRFD, NONE, OVERLAY_READ, int, posix_spawnp, pid_t *, pid, const char *, file,
+        const posix_spawn_file_actions_t *, file_actions, const posix_spawnattr_t *, attrp, char * const*, argv, char * const*, env)
+// The path is copied by the libc and opened by the child, so it is mapped now, relative to the current cwd
+OVERRIDE_FUNCTION_WRITE(overlay_open_access(oflag), 5, 3, int, posix_spawn_file_actions_addopen, posix_spawn_file_actions_t *, file_actions, int, fd, const char *, path, int, oflag, mode_t, mode)
+#if __GLIBC_PREREQ(2, 29) // posix_spawn_file_actions_addchdir_np() exists since glibc 2.29
+OVERRIDE_FUNCTION(2, 2, int, posix_spawn_file_actions_addchdir_np, posix_spawn_file_actions_t *, file_actions, const char *, path)
+#endif
+
+// fexecve() has no path, but the environment is passed on like for execve()
+OVERRIDE_ORIGINAL(0, 3, int, fexecve, int, fd, char * const*, argv, char * const*, env)
+int fexecve(int fd, char * const* argv, char * const* env)
+{
+    EXEC_ENV(env);
+    return ORIGINAL_FUNCTION(fexecve)(fd, argv, env);
+}
 
 int execl(const char *filename, const char *arg0, ...)
 {
     debug_fprintf(stderr, "execl(%s) called\n", filename);
 
     char buffer[MAX_PATH];
-    const char *new_path = fix_path("execl", filename, buffer, sizeof buffer);
+    // Counted as execv, because there is no dispatch table entry for the varargs version
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_execv);
+    stats_start(counters);
+    const char *new_path = map_exec_path_at("execl", counters, AT_FDCWD, filename, buffer, sizeof buffer);
 
     // Note: call execv, not execl, because we can't call varargs functions with an unknown number of args
-    static orig_execv_func_type execv_func = NULL;
-    if (execv_func == NULL) {
-        execv_func = (orig_execv_func_type)dlsym(RTLD_NEXT, "execv");
-    }
-
-    // count args
-    int argc = 1;
-    va_list args_list;
-    va_start(args_list, arg0);
-    while (va_arg(args_list, char *) != NULL) argc += 1;
+    EXECL_ARGV(argv, arg0, args_list);
     va_end(args_list);
-
-    // extract args
-    const char **argv_buffer = malloc(sizeof(char *) * (argc + 1));
-    va_start(args_list, arg0);
-    argv_buffer[0] = arg0;
-    argc = 1;
-    char *arg = NULL;
-    while ((arg = va_arg(args_list, char *)) != NULL) {
-        argv_buffer[argc++] = arg;
-    }
-    va_end(args_list);
-    argv_buffer[argc] = NULL;
-
-    int result = execv_func(new_path, (char * const*)argv_buffer);
-    free(argv_buffer); // We ONLY reach this if exec fails, so we need to clean up
-    return result;
+    return ORIGINAL_FUNCTION(execv)(new_path, (char * const*)argv);
 }
 
 int execlp(const char *filename, const char *arg0, ...)
@@ -572,165 +5662,547 @@ int execlp(const char *filename, const char *arg0, ...)
     debug_fprintf(stderr, "execlp(%s) called\n", filename);
 
     char buffer[MAX_PATH];
-    const char *new_path = fix_path("execlp", filename, buffer, sizeof buffer);
+    // Counted as execvp, because there is no dispatch table entry for the varargs version
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_execvp);
+    stats_start(counters);
+    const char *new_path = map_exec_path_at("execlp", counters, strchr(filename, '/') != NULL ? AT_FDCWD : NO_DIRFD, filename, buffer, sizeof buffer);
 
     // Note: call execvp, not execlp, because we can't call varargs functions with an unknown number of args
-    static orig_execvp_func_type execvp_func = NULL;
-    if (execvp_func == NULL) {
-        execvp_func = (orig_execvp_func_type)dlsym(RTLD_NEXT, "execvp");
-    }
-
-    // count args
-    int argc = 1;
-    va_list args_list;
-    va_start(args_list, arg0);
-    while (va_arg(args_list, char *) != NULL) argc += 1;
-    va_end(args_list);
-
-    // extract args
-    const char **argv_buffer = malloc(sizeof(char *) * (argc + 1));
-    va_start(args_list, arg0);
-    argv_buffer[0] = arg0;
-    argc = 1;
-    char *arg = NULL;
-    while ((arg = va_arg(args_list, char *)) != NULL) {
-        argv_buffer[argc++] = arg;
-    }
+    EXECL_ARGV(argv, arg0, args_list);
     va_end(args_list);
-    argv_buffer[argc] = NULL;
-
-    int result = execvp_func(new_path, (char * const*)argv_buffer);
-    free(argv_buffer); // We ONLY reach this if exec fails, so we need to clean up
-    return result;
+    return ORIGINAL_FUNCTION(execvp)(new_path, (char * const*)argv);
 }
 
 int execle(const char *filename, const char *arg0, ... /* , char *const env[] */)
 {
-    debug_fprintf(stderr, "execl(%s) called\n", filename);
+    debug_fprintf(stderr, "execle(%s) called\n", filename);
 
     char buffer[MAX_PATH];
-    const char *new_path = fix_path("execle", filename, buffer, sizeof buffer);
+    // Counted as execve, because there is no dispatch table entry for the varargs version
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_execve);
+    stats_start(counters);
+    const char *new_path = map_exec_path_at("execle", counters, AT_FDCWD, filename, buffer, sizeof buffer);
 
     // Note: call execve, not execle, because we can't call varargs functions with an unknown number of args
-    static orig_execve_func_type execve_func = NULL;
-    if (execve_func == NULL) {
-        execve_func = (orig_execve_func_type)dlsym(RTLD_NEXT, "execve");
-    }
-
-    // count args
-    int argc = 1;
-    va_list args_list;
-    va_start(args_list, arg0);
-    while (va_arg(args_list, char *) != NULL) argc += 1;
-    va_end(args_list);
-
-    // extract args
-    const char **argv_buffer = malloc(sizeof(char *) * (argc + 1));
-    va_start(args_list, arg0);
-    argv_buffer[0] = arg0;
-    argc = 1;
-    char *arg = NULL;
-    while ((arg = va_arg(args_list, char *)) != NULL) {
-        argv_buffer[argc++] = arg;
-    }
+    EXECL_ARGV(argv, arg0, args_list);
     char * const* env = va_arg(args_list, char * const*);
     va_end(args_list);
-    argv_buffer[argc] = NULL;
-
-    int result = execve_func(new_path, (char * const*)argv_buffer, env);
-    free(argv_buffer); // We ONLY reach this if exec fails, so we need to clean up
-    return result;
+    EXEC_ENV(env);
+    return ORIGINAL_FUNCTION(execve)(new_path, (char * const*)argv, env);
 }
 #endif // DISABLE_EXEC
 
 
 #ifndef DISABLE_RENAME
-typedef int (*orig_rename_func_type)(const char *oldpath, const char *newpath);
+// Like link() and linkat(), these record the old path in the trace, because a record only has room for one path
+OVERRIDE_ORIGINAL(0, 2, int, rename, const char *, oldpath, const char *, newpath)
 int rename(const char *oldpath, const char *newpath)
 {
     debug_fprintf(stderr, "rename(%s, %s) called\n", oldpath, newpath);
 
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_rename);
+    uint64_t start_time = stats_start(counters);
+    struct trace_call call_trace;
+    trace_start(&call_trace);
     char buffer[MAX_PATH], buffer2[MAX_PATH];
-    const char *new_oldpath = fix_path("rename-old", oldpath, buffer, sizeof buffer);
-    const char *new_newpath = fix_path("rename-new", newpath, buffer2, sizeof buffer2);
-
-    static orig_rename_func_type orig_func = NULL;
-    if (orig_func == NULL) {
-        orig_func = (orig_rename_func_type)dlsym(RTLD_NEXT, "rename");
-    }
-
-    return orig_func(new_oldpath, new_newpath);
+    const char *new_oldpath = map_path_at("rename-old", counters, AT_FDCWD, oldpath, buffer, sizeof buffer);
+    const char *new_newpath = map_path_at("rename-new", counters, AT_FDCWD, newpath, buffer2, sizeof buffer2);
+    int prepared = overlay_prepare_rename(oldpath, &new_oldpath, buffer, newpath, &new_newpath, buffer2, sizeof buffer);
+
+    trace_call_original(&call_trace);
+    int result = prepared ? ORIGINAL_FUNCTION(rename)(new_oldpath, new_newpath) : -1;
+    trace_finish(&call_trace, &original_rename, oldpath, new_oldpath);
+    stats_finish(counters, start_time);
+    return result;
 }
 
-typedef int (*orig_renameat_func_type)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath);
+OVERRIDE_ORIGINAL(0, 4, int, renameat, int, olddirfd, const char *, oldpath, int, newdirfd, const char *, newpath)
 int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
 {
     debug_fprintf(stderr, "renameat(%s, %s) called\n", oldpath, newpath);
 
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_renameat);
+    uint64_t start_time = stats_start(counters);
+    struct trace_call call_trace;
+    trace_start(&call_trace);
     char buffer[MAX_PATH], buffer2[MAX_PATH];
-    const char *new_oldpath = fix_path("renameat-old", oldpath, buffer, sizeof buffer);
-    const char *new_newpath = fix_path("renameat-new", newpath, buffer2, sizeof buffer2);
-
-    static orig_renameat_func_type orig_func = NULL;
-    if (orig_func == NULL) {
-        orig_func = (orig_renameat_func_type)dlsym(RTLD_NEXT, "renameat");
-    }
-
-    return orig_func(olddirfd, new_oldpath, newdirfd, new_newpath);
+    const char *new_oldpath = map_path_at("renameat-old", counters, olddirfd, oldpath, buffer, sizeof buffer);
+    const char *new_newpath = map_path_at("renameat-new", counters, newdirfd, newpath, buffer2, sizeof buffer2);
+    int prepared = overlay_prepare_rename(oldpath, &new_oldpath, buffer, newpath, &new_newpath, buffer2, sizeof buffer);
+
+    trace_call_original(&call_trace);
+    int result = prepared ? ORIGINAL_FUNCTION(renameat)(olddirfd, new_oldpath, newdirfd, new_newpath) : -1;
+    trace_finish(&call_trace, &original_renameat, oldpath, new_oldpath);
+    stats_finish(counters, start_time);
+    return result;
 }
 
-typedef int (*orig_renameat2_func_type)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath, unsigned int flags);
+OVERRIDE_ORIGINAL(0, 5, int, renameat2, int, olddirfd, const char *, oldpath, int, newdirfd, const char *, newpath, unsigned int, flags)
 int renameat2(int olddirfd, const char *oldpath, int newdirfd, const char *newpath, unsigned int flags)
 {
     debug_fprintf(stderr, "renameat2(%s, %s) called\n", oldpath, newpath);
 
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_renameat2);
+    uint64_t start_time = stats_start(counters);
+    struct trace_call call_trace;
+    trace_start(&call_trace);
     char buffer[MAX_PATH], buffer2[MAX_PATH];
-    const char *new_oldpath = fix_path("renameat2-old", oldpath, buffer, sizeof buffer);
-    const char *new_newpath = fix_path("renameat2-new", newpath, buffer2, sizeof buffer2);
-
-    static orig_renameat2_func_type orig_func = NULL;
-    if (orig_func == NULL) {
-        orig_func = (orig_renameat2_func_type)dlsym(RTLD_NEXT, "renameat2");
-    }
-
-    return orig_func(olddirfd, new_oldpath, newdirfd, new_newpath, flags);
+    const char *new_oldpath = map_path_at("renameat2-old", counters, olddirfd, oldpath, buffer, sizeof buffer);
+    const char *new_newpath = map_path_at("renameat2-new", counters, newdirfd, newpath, buffer2, sizeof buffer2);
+    int prepared = overlay_prepare_rename(oldpath, &new_oldpath, buffer, newpath, &new_newpath, buffer2, sizeof buffer);
+
+    trace_call_original(&call_trace);
+    int result = prepared ? ORIGINAL_FUNCTION(renameat2)(olddirfd, new_oldpath, newdirfd, new_newpath, flags) : -1;
+    trace_finish(&call_trace, &original_renameat2, oldpath, new_oldpath);
+    stats_finish(counters, start_time);
+    return result;
 }
 #endif // DISABLE_RENAME
 
 
 #ifndef DISABLE_LINK
-typedef int (*orig_link_func_type)(const char *oldpath, const char *newpath);
+OVERRIDE_ORIGINAL(0, 2, int, link, const char *, oldpath, const char *, newpath)
 int link(const char *oldpath, const char *newpath)
 {
     debug_fprintf(stderr, "link(%s, %s) called\n", oldpath, newpath);
 
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_link);
+    uint64_t start_time = stats_start(counters);
+    struct trace_call call_trace;
+    trace_start(&call_trace);
     char buffer[MAX_PATH], buffer2[MAX_PATH];
-    const char *new_oldpath = fix_path("link-old", oldpath, buffer, sizeof buffer);
-    const char *new_newpath = fix_path("link-new", newpath, buffer2, sizeof buffer2);
-
-    static orig_link_func_type orig_func = NULL;
-    if (orig_func == NULL) {
-        orig_func = (orig_link_func_type)dlsym(RTLD_NEXT, "link");
-    }
-
-    return orig_func(new_oldpath, new_newpath);
+    const char *new_oldpath = map_path_at("link-old", counters, AT_FDCWD, oldpath, buffer, sizeof buffer);
+    const char *new_newpath = map_path_at("link-new", counters, AT_FDCWD, newpath, buffer2, sizeof buffer2);
+    new_oldpath = overlay_prepare(OVERLAY_WRITE, oldpath, new_oldpath, buffer, sizeof buffer);
+    new_newpath = overlay_prepare(OVERLAY_CREATE, newpath, new_newpath, buffer2, sizeof buffer2);
+
+    trace_call_original(&call_trace);
+    int result = ORIGINAL_FUNCTION(link)(new_oldpath, new_newpath);
+    trace_finish(&call_trace, &original_link, oldpath, new_oldpath);
+    stats_finish(counters, start_time);
+    return result;
 }
 
-typedef int (*orig_linkat_func_type)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags);
+OVERRIDE_ORIGINAL(0, 5, int, linkat, int, olddirfd, const char *, oldpath, int, newdirfd, const char *, newpath, int, flags)
 int linkat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags)
 {
     debug_fprintf(stderr, "linkat(%s, %s) called\n", oldpath, newpath);
 
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_linkat);
+    uint64_t start_time = stats_start(counters);
+    struct trace_call call_trace;
+    trace_start(&call_trace);
     char buffer[MAX_PATH], buffer2[MAX_PATH];
-    const char *new_oldpath = fix_path("linkat-old", oldpath, buffer, sizeof buffer);
-    const char *new_newpath = fix_path("linkat-new", newpath, buffer2, sizeof buffer2);
+    const char *new_oldpath = map_path_at("linkat-old", counters, olddirfd, oldpath, buffer, sizeof buffer);
+    const char *new_newpath = map_path_at("linkat-new", counters, newdirfd, newpath, buffer2, sizeof buffer2);
+    new_oldpath = overlay_prepare(OVERLAY_WRITE, oldpath, new_oldpath, buffer, sizeof buffer);
+    new_newpath = overlay_prepare(OVERLAY_CREATE, newpath, new_newpath, buffer2, sizeof buffer2);
+
+    trace_call_original(&call_trace);
+    int result = ORIGINAL_FUNCTION(linkat)(olddirfd, new_oldpath, newdirfd, new_newpath, flags);
+    trace_finish(&call_trace, &original_linkat, oldpath, new_oldpath);
+    stats_finish(counters, start_time);
+    return result;
+}
+
+#endif // DISABLE_LINK
+
+
+#ifndef DISABLE_TRUNCATE
+OVERRIDE_FUNCTION_WRITE(length == 0 ? OVERLAY_REPLACE : OVERLAY_WRITE, 2, 1, int, truncate, const char *, path, off_t, length)
+OVERRIDE_FUNCTION_WRITE(length == 0 ? OVERLAY_REPLACE : OVERLAY_WRITE, 2, 1, int, truncate64, const char *, path, off64_t, length)
+#endif // DISABLE_TRUNCATE
+
+
+#ifndef DISABLE_HANDLE
+OVERRIDE_FUNCTION_AT(5, 1, 2, int, name_to_handle_at, int, dirfd, const char *, pathname, struct file_handle *, handle, int *, mount_id, int, flags)
+#endif // DISABLE_HANDLE
+
+
+// Return the virtual cwd, if there is one. Otherwise the real cwd is mapped back if PATH_MAPPING_REVERSE is set.
+OVERRIDE_ORIGINAL(0, 2, char *, getcwd, char *, buf, size_t, size)
+char *getcwd(char *buf, size_t size)
+{
+    char path[MAX_PATH];
+    ssize_t length = fd_paths_get(AT_FDCWD, path, sizeof path);
+    if (length < 0) {
+        char *result = ORIGINAL_FUNCTION(getcwd)(buf, size);
+        return result == buf ? unmap_result("getcwd", result, size) : unmap_result("getcwd", result, 0);
+    }
+    if (buf != NULL && size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size != 0 && size < (size_t)length + 1) {
+        errno = ERANGE;
+        return NULL;
+    }
+    if (buf == NULL) {
+        buf = malloc(size != 0 ? size : (size_t)length + 1);
+        if (buf == NULL) return NULL;
+    }
+    memcpy(buf, path, length + 1);
+    return buf;
+}
 
-    static orig_linkat_func_type orig_func = NULL;
-    if (orig_func == NULL) {
-        orig_func = (orig_linkat_func_type)dlsym(RTLD_NEXT, "linkat");
+OVERRIDE_ORIGINAL(0, 0, char *, get_current_dir_name, )
+char *get_current_dir_name()
+{
+    char path[MAX_PATH];
+    if (fd_paths_get(AT_FDCWD, path, sizeof path) < 0) {
+        return unmap_result("get_current_dir_name", ORIGINAL_FUNCTION(get_current_dir_name)(), 0);
     }
+    return strdup(path);
+}
 
-    return orig_func(olddirfd, new_oldpath, newdirfd, new_newpath, flags);
+// Called instead of getcwd() with _FORTIFY_SOURCE. The original aborts if size is larger than the buffer.
+OVERRIDE_ORIGINAL(0, 3, char *, __getcwd_chk, char *, buf, size_t, size, size_t, buflen)
+char *__getcwd_chk(char *buf, size_t size, size_t buflen)
+{
+    if (size > buflen) return ORIGINAL_FUNCTION(__getcwd_chk)(buf, size, buflen);
+    return getcwd(buf, size);
 }
 
-#endif // DISABLE_LINK
+#ifndef DISABLE_DIRFD
+// These do not map any paths, but keep the virtual paths of directory file descriptors up to date (see fd_paths)
+OVERRIDE_ORIGINAL(0, 1, int, close, int, fd)
+int close(int fd)
+{
+    fd_paths_set(fd, NULL);
+#ifndef DISABLE_IO_URING
+    uring_forget(fd);
+#endif
+    return ORIGINAL_FUNCTION(close)(fd);
+}
+
+OVERRIDE_ORIGINAL(0, 1, int, closedir, DIR *, dir)
+int closedir(DIR *dir)
+{
+    fd_paths_set(dirfd(dir), NULL);
+    return ORIGINAL_FUNCTION(closedir)(dir);
+}
+
+OVERRIDE_ORIGINAL(0, 1, int, dup, int, oldfd)
+int dup(int oldfd)
+{
+    int result = ORIGINAL_FUNCTION(dup)(oldfd);
+    if (result >= 0) fd_paths_dup(oldfd, result);
+    return result;
+}
+
+// F_DUPFD and F_DUPFD_CLOEXEC are used like dup(), e.g. by fts of gnulib in find
+#define OVERRIDE_FCNTL(funcname) \
+OVERRIDE_ORIGINAL(2, 2, int, funcname, int, fd, int, cmd) \
+__NL__ int funcname(int fd, int cmd, ...)\
+__NL__{\
+__NL__    va_list args;\
+__NL__    va_start(args, cmd);\
+__NL__    void *arg = va_arg(args, void *);\
+__NL__    va_end(args);\
+__NL__    int result = ORIGINAL_FUNCTION(funcname)(fd, cmd, arg);\
+__NL__    if (result >= 0 && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)) fd_paths_dup(fd, result);\
+__NL__    return result;\
+__NL__}
+
+OVERRIDE_FCNTL(fcntl)
+#if __GLIBC_PREREQ(2, 28) // fcntl64() exists since glibc 2.28
+OVERRIDE_FCNTL(fcntl64)
+#endif
+
+OVERRIDE_ORIGINAL(0, 2, int, dup2, int, oldfd, int, newfd)
+int dup2(int oldfd, int newfd)
+{
+    int result = ORIGINAL_FUNCTION(dup2)(oldfd, newfd);
+    if (result >= 0) fd_paths_dup(oldfd, result);
+    return result;
+}
+
+OVERRIDE_ORIGINAL(0, 3, int, dup3, int, oldfd, int, newfd, int, flags)
+int dup3(int oldfd, int newfd, int flags)
+{
+    int result = ORIGINAL_FUNCTION(dup3)(oldfd, newfd, flags);
+    if (result >= 0) fd_paths_dup(oldfd, result);
+    return result;
+}
+
+OVERRIDE_ORIGINAL(0, 1, int, fchdir, int, fd)
+int fchdir(int fd)
+{
+    int result = ORIGINAL_FUNCTION(fchdir)(fd);
+    if (result == 0) fd_paths_dup(fd, AT_FDCWD);
+    return result;
+}
+
+#ifdef CLOSE_RANGE_CLOEXEC // close_range() exists since glibc 2.34
+OVERRIDE_ORIGINAL(0, 3, int, close_range, unsigned int, first, unsigned int, last, int, flags)
+int close_range(unsigned int first, unsigned int last, int flags)
+{
+    int result = ORIGINAL_FUNCTION(close_range)(first, last, flags);
+    if (result == 0 && !(flags & CLOSE_RANGE_CLOEXEC)) fd_paths_clear_range(first, last);
+    return result;
+}
+#endif // CLOSE_RANGE_CLOEXEC
+
+#ifndef DISABLE_READDIR
+// Appends the mapped prefixes below the directory to the real entries, see dir_listing_next(),
+// and skips the whiteouts of PATH_MAPPING_OVERLAY
+#define OVERRIDE_READDIR(funcname, entry_type) \
+OVERRIDE_ORIGINAL(0, 1, struct entry_type *, funcname, DIR *, dir) \
+__NL__ struct entry_type *funcname(DIR *dir) \
+__NL__{\
+__NL__    int saved_errno = errno;\
+__NL__    struct entry_type *entry = ORIGINAL_FUNCTION(funcname)(dir);\
+__NL__    int fd = dirfd(dir);\
+__NL__    if (!fd_paths_exists(fd)) return entry;\
+__NL__    while (entry != NULL && overlay_enabled && overlay_is_whiteout(entry->d_name)) entry = ORIGINAL_FUNCTION(funcname)(dir);\
+__NL__    if (entry != NULL) {\
+__NL__        dir_listing_seen(fd, entry->d_name);\
+__NL__        return entry;\
+__NL__    }\
+__NL__    if (errno != saved_errno) return NULL; /* Real error */\
+__NL__    char name[sizeof entry->d_name];\
+__NL__    ino64_t ino;\
+__NL__    unsigned char type;\
+__NL__    if (dir_listing_next(fd, name, &ino, &type)) entry = dir_listing_buffer(fd);\
+__NL__    errno = saved_errno;\
+__NL__    if (entry == NULL) return NULL;\
+__NL__    entry->d_ino = ino;\
+__NL__    entry->d_off = 0;\
+__NL__    entry->d_reclen = sizeof *entry;\
+__NL__    entry->d_type = type;\
+__NL__    strcpy(entry->d_name, name);\
+__NL__    return entry;\
+__NL__}
+
+OVERRIDE_READDIR(readdir, dirent)
+OVERRIDE_READDIR(readdir64, dirent64)
+
+OVERRIDE_ORIGINAL(0, 1, void, rewinddir, DIR *, dir)
+void rewinddir(DIR *dir)
+{
+    ORIGINAL_FUNCTION(rewinddir)(dir);
+    int fd = dirfd(dir);
+    if (fd_paths_exists(fd)) dir_listing_reset(fd);
+}
+
+#if __GLIBC_PREREQ(2, 30) // getdents64() exists since glibc 2.30
+// readdir() of glibc uses the internal __getdents64(), so the entries are not appended twice
+OVERRIDE_ORIGINAL(0, 3, ssize_t, getdents64, int, fd, void *, buffer, size_t, length)
+ssize_t getdents64(int fd, void *buffer, size_t length)
+{
+    ssize_t result = ORIGINAL_FUNCTION(getdents64)(fd, buffer, length);
+    if (result < 0 || !fd_paths_exists(fd)) return result;
+    // The whiteouts of PATH_MAPPING_OVERLAY are removed, and if nothing else was read, the next entries are read
+    while (result > 0) {
+        ssize_t kept = 0;
+        for (ssize_t offset = 0; offset < result; ) {
+            struct dirent64 *entry = (struct dirent64 *)((char *)buffer + offset);
+            size_t entry_length = entry->d_reclen;
+            offset += entry_length;
+            if (overlay_enabled && overlay_is_whiteout(entry->d_name)) continue;
+            dir_listing_seen(fd, entry->d_name);
+            if ((char *)entry != (char *)buffer + kept) memmove((char *)buffer + kept, entry, entry_length);
+            kept += entry_length;
+        }
+        if (kept > 0) return kept;
+        result = ORIGINAL_FUNCTION(getdents64)(fd, buffer, length);
+        if (result < 0) return result;
+    }
+
+    // After the last real entry, fill the buffer with virtual entries in the format of the kernel.
+    // Only names which are certain to fit are taken, because dir_listing_next() can not go back.
+    int saved_errno = errno;
+    size_t used = 0;
+    char name[sizeof ((struct dirent64 *)0)->d_name];
+    ino64_t ino;
+    unsigned char type;
+    while (length - used >= sizeof(struct dirent64) && dir_listing_next(fd, name, &ino, &type)) {
+        struct dirent64 *entry = (struct dirent64 *)((char *)buffer + used);
+        size_t name_size = strlen(name) + 1;
+        entry->d_ino = ino;
+        entry->d_off = 0;
+        entry->d_reclen = (offsetof(struct dirent64, d_name) + name_size + 7) & ~(size_t)7;
+        entry->d_type = type;
+        memcpy(entry->d_name, name, name_size);
+        used += entry->d_reclen;
+    }
+    errno = saved_errno;
+    return used;
+}
+#endif // __GLIBC_PREREQ(2, 30)
+
+// scandir() of glibc calls readdir() internally, so it would not see the virtual entries.
+// Therefore it is implemented with the overrides of opendir(), readdir() and closedir().
+#define OVERRIDE_SCANDIR(funcname, entry_type, readdir_func) \
+__NL__ int funcname(const char *path, struct entry_type ***namelist,\
+__NL__        int (*filter)(const struct entry_type *), int (*compar)(const struct entry_type **, const struct entry_type **))\
+__NL__{\
+__NL__    DIR *dir = opendir(path);\
+__NL__    if (dir == NULL) return -1;\
+__NL__    int saved_errno = errno, error = 0;\
+__NL__    struct entry_type **list = NULL;\
+__NL__    size_t length = 0, capacity = 0;\
+__NL__    for (;;) {\
+__NL__        errno = 0;\
+__NL__        struct entry_type *entry = readdir_func(dir);\
+__NL__        if (entry == NULL) {\
+__NL__            error = errno;\
+__NL__            break;\
+__NL__        }\
+__NL__        if (filter != NULL && !filter(entry)) continue;\
+__NL__        if (length == capacity) {\
+__NL__            capacity = capacity == 0 ? 16 : 2 * capacity;\
+__NL__            struct entry_type **new_list = realloc(list, capacity * sizeof *list);\
+__NL__            if (new_list == NULL) {\
+__NL__                error = ENOMEM;\
+__NL__                break;\
+__NL__            }\
+__NL__            list = new_list;\
+__NL__        }\
+__NL__        size_t size = offsetof(struct entry_type, d_name) + strlen(entry->d_name) + 1;\
+__NL__        struct entry_type *copy = malloc(size);\
+__NL__        if (copy == NULL) {\
+__NL__            error = ENOMEM;\
+__NL__            break;\
+__NL__        }\
+__NL__        memcpy(copy, entry, size);\
+__NL__        list[length++] = copy;\
+__NL__    }\
+__NL__    closedir(dir);\
+__NL__    if (error != 0) {\
+__NL__        while (length > 0) free(list[--length]);\
+__NL__        free(list);\
+__NL__        errno = error;\
+__NL__        return -1;\
+__NL__    }\
+__NL__    if (compar != NULL) qsort(list, length, sizeof *list, (int (*)(const void *, const void *))compar);\
+__NL__    *namelist = list;\
+__NL__    errno = saved_errno;\
+__NL__    return length;\
+__NL__}
+
+OVERRIDE_SCANDIR(scandir, dirent, readdir)
+OVERRIDE_SCANDIR(scandir64, dirent64, readdir64)
+#endif // DISABLE_READDIR
+#endif // DISABLE_DIRFD
+
+#ifndef DISABLE_SECCOMP
+// Keep seccomp_handler() installed and SIGSYS unblocked, because the kernel kills the process otherwise
+
+OVERRIDE_ORIGINAL(0, 3, int, sigaction, int, sig, const struct sigaction *, act, struct sigaction *, oldact)
+int sigaction(int sig, const struct sigaction *act, struct sigaction *oldact)
+{
+    if (seccomp_active && sig == SIGSYS && act != NULL) {
+        info_fprintf(stderr, "PATH_MAPPING_SECCOMP: ignoring sigaction(SIGSYS)\n");
+        act = NULL;
+    }
+    return ORIGINAL_FUNCTION(sigaction)(sig, act, oldact);
+}
+
+#define OVERRIDE_SIGMASK(funcname) \
+OVERRIDE_ORIGINAL(0, 3, int, funcname, int, how, const sigset_t *, set, sigset_t *, oldset) \
+__NL__ int funcname(int how, const sigset_t *set, sigset_t *oldset)\
+__NL__{\
+__NL__    sigset_t new_set;\
+__NL__    if (seccomp_active && set != NULL && how != SIG_UNBLOCK && sigismember(set, SIGSYS)) {\
+__NL__        new_set = *set;\
+__NL__        sigdelset(&new_set, SIGSYS);\
+__NL__        set = &new_set;\
+__NL__    }\
+__NL__    return ORIGINAL_FUNCTION(funcname)(how, set, oldset);\
+__NL__}
+
+OVERRIDE_SIGMASK(sigprocmask)
+OVERRIDE_SIGMASK(pthread_sigmask)
+#endif // DISABLE_SECCOMP
+
+#ifndef DISABLE_IO_URING
+// Map the paths in io_uring SQEs, see uring_map_sqe(). Rings which are set up with the syscall are tracked,
+// and liburing's functions pass their struct io_uring, so rings of liburing need no tracking.
+
+OVERRIDE_ORIGINAL(3, 1, long, syscall, long, number)
+// Like the syscall() of the libc, this passes on six arguments, even if the caller passed fewer.
+// The missing ones are read from the stack of the caller, so AddressSanitizer must not check them.
+__attribute__((no_sanitize_address))
+long syscall(long number, ...)
+{
+    va_list args;
+    va_start(args, number);
+    long a[6];
+    for (int i = 0; i < 6; i++) a[i] = va_arg(args, long);
+    va_end(args);
+    if (number != SYS_io_uring_enter && number != SYS_io_uring_setup) {
+        return ORIGINAL_FUNCTION(syscall)(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_syscall);
+    uint64_t start_time = stats_start(counters);
+    if (number == SYS_io_uring_enter) uring_map_submitted(a[0], a[1], a[3], counters);
+    long result = ORIGINAL_FUNCTION(syscall)(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+    if (number == SYS_io_uring_setup && result >= 0) {
+        int saved_errno = errno;
+        uring_setup(result, (const struct io_uring_params *)a[1]);
+        errno = saved_errno;
+    }
+    stats_finish(counters, start_time);
+    return result;
+}
+
+// The wrappers of liburing, which may make the syscall without syscall()
+OVERRIDE_ORIGINAL(0, 2, int, io_uring_setup, unsigned, entries, struct io_uring_params *, params)
+int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    int result = ORIGINAL_FUNCTION(io_uring_setup)(entries, params);
+    if (result >= 0) uring_setup(result, params);
+    return result;
+}
+
+OVERRIDE_ORIGINAL(0, 5, int, io_uring_enter, unsigned, fd, unsigned, to_submit, unsigned, min_complete, unsigned, flags, sigset_t *, sig)
+int io_uring_enter(unsigned fd, unsigned to_submit, unsigned min_complete, unsigned flags, sigset_t *sig)
+{
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_io_uring_enter);
+    uint64_t start_time = stats_start(counters);
+    uring_map_submitted(fd, to_submit, flags, counters);
+    int result = ORIGINAL_FUNCTION(io_uring_enter)(fd, to_submit, min_complete, flags, sig);
+    stats_finish(counters, start_time);
+    return result;
+}
+
+OVERRIDE_ORIGINAL(0, 6, int, io_uring_enter2, unsigned, fd, unsigned, to_submit, unsigned, min_complete, unsigned, flags, sigset_t *, sig, size_t, sz)
+int io_uring_enter2(unsigned fd, unsigned to_submit, unsigned min_complete, unsigned flags, sigset_t *sig, size_t sz)
+{
+    struct path_mapping_function_counters *counters = stats_function_counters(&original_io_uring_enter2);
+    uint64_t start_time = stats_start(counters);
+    uring_map_submitted(fd, to_submit, flags, counters);
+    int result = ORIGINAL_FUNCTION(io_uring_enter2)(fd, to_submit, min_complete, flags, sig, sz);
+    stats_finish(counters, start_time);
+    return result;
+}
+
+// The functions of liburing which publish new SQEs to the kernel. The first argument is the ring.
+#define OVERRIDE_LIBURING(nargs, funcname, ...) \
+OVERRIDE_ORIGINAL(0, nargs, int, funcname, __VA_ARGS__) \
+__NL__ int funcname(OVERRIDE_ARGS(0, nargs, __VA_ARGS__))\
+__NL__{\
+__NL__    struct path_mapping_function_counters *counters = stats_function_counters(&original_##funcname);\
+__NL__    uint64_t start_time = stats_start(counters);\
+__NL__    uring_map_liburing(ring, counters);\
+__NL__    int result = ORIGINAL_FUNCTION(funcname)(OVERRIDE_CALL_ARGS(nargs, __VA_ARGS__));\
+__NL__    stats_finish(counters, start_time);\
+__NL__    return result;\
+__NL__}
+
+OVERRIDE_LIBURING(1, io_uring_submit, struct liburing_ring *, ring)
+OVERRIDE_LIBURING(1, io_uring_submit_and_get_events, struct liburing_ring *, ring)
+OVERRIDE_LIBURING(2, io_uring_submit_and_wait, struct liburing_ring *, ring, unsigned, wait_nr)
+OVERRIDE_LIBURING(5, io_uring_submit_and_wait_timeout, struct liburing_ring *, ring, void **, cqe_ptr, unsigned, wait_nr, void *, ts, sigset_t *, sigmask)
+// Submits pending SQEs together with a timeout SQE on kernels without IORING_FEAT_EXT_ARG
+OVERRIDE_LIBURING(5, io_uring_wait_cqes, struct liburing_ring *, ring, void **, cqe_ptr, unsigned, wait_nr, void *, ts, sigset_t *, sigmask)
+
+OVERRIDE_ORIGINAL(0, 1, void, io_uring_queue_exit, struct liburing_ring *, ring)
+void io_uring_queue_exit(struct liburing_ring *ring)
+{
+    uring_forget(ring->ring_fd);
+    ORIGINAL_FUNCTION(io_uring_queue_exit)(ring);
+}
+#endif // DISABLE_IO_URING
@@ -0,0 +1,168 @@
+/*
+MIT License
+
+Copyright (c) 2022 Fritz Webering
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Data formats shared between path-mapping.so and the bundled tools
+
+#ifndef PATH_MAPPING_H
+#define PATH_MAPPING_H
+
+#include <stdint.h>
+
+
+/////////////////////////////////////////////////////////
+//     Counters published in shared memory (stats)     //
+/////////////////////////////////////////////////////////
+
+
+// If PATH_MAPPING_STATS is set, each process publishes its counters in the shared memory segment
+// /path-mapping-stats.<pid> (see shm_open(3)), which Linux keeps in PATH_MAPPING_STATS_DIR,
+// and which is read by path-mapping-stat. The segment is removed when the process exits.
+//
+// Layout of the file:
+//   struct path_mapping_stats_header
+//   char function_names[n_functions][PATH_MAPPING_STATS_NAME_SIZE]
+//   uint32_t rule_strings[n_rules][2]     (offsets of prefix and destination in the string pool)
+//   char strings[]                        (string pool)
+//   shards[n_shards], each shard_size bytes, starting at shards_offset:
+//     struct path_mapping_function_counters functions[n_functions]
+//     uint64_t rule_hits[n_rules]
+//
+// Each thread increments the counters of one shard only, so the totals are the sums over all shards.
+
+#define PATH_MAPPING_STATS_MAGIC 0x5354415453504d50ull // "PMPSTATS"
+#define PATH_MAPPING_STATS_VERSION 1
+#define PATH_MAPPING_STATS_DIR "/dev/shm" // Where path-mapping-stat lists the segments
+#define PATH_MAPPING_STATS_PREFIX "path-mapping-stats."
+#define PATH_MAPPING_STATS_NAME_SIZE 32
+#define PATH_MAPPING_STATS_SHARDS 16
+
+#define PATH_MAPPING_STATS_TIMING 1 // time_ns is measured
+
+struct path_mapping_stats_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t flags;
+    uint32_t n_functions;
+    uint32_t n_rules;
+    uint32_t n_shards;
+    uint64_t size;              // Size of the whole file
+    uint64_t names_offset;
+    uint64_t rules_offset;
+    uint64_t strings_offset;
+    uint64_t shards_offset;
+    uint64_t shard_size;
+};
+
+struct path_mapping_function_counters {
+    uint64_t calls;             // Number of calls to the override
+    uint64_t mapped;            // Number of paths which were mapped
+    uint64_t too_long;          // Number of paths not mapped because the result was too long
+    uint64_t time_ns;           // Time spent in the override, if PATH_MAPPING_STATS_TIMING is set
+};
+
+
+/////////////////////////////////////////////////////////
+//     Binary traces of the calls (trace files)        //
+/////////////////////////////////////////////////////////
+
+
+// If PATH_MAPPING_TRACE is set to a directory, each process records every call of an override in the
+// file $PATH_MAPPING_TRACE/path-mapping-trace.<pid> (or .<pid>.<n> after exec()), which is read by
+// path-mapping-trace. The file stays when the process exits.
+//
+// Layout of the file:
+//   struct path_mapping_trace_header
+//   char function_names[n_functions][PATH_MAPPING_STATS_NAME_SIZE]
+//   rings[n_rings], each ring_size bytes, starting at rings_offset:
+//     struct path_mapping_trace_ring
+//     records                             (ring_size - sizeof(struct path_mapping_trace_ring) bytes)
+//
+// Each ring is written by one thread at a time. A record starts at head % capacity, where capacity is the
+// size of the records area, and never wraps around the end, which is filled with a padding record instead.
+// When the ring is full, the oldest records are overwritten, and tail moves to the oldest complete record.
+
+#define PATH_MAPPING_TRACE_MAGIC 0x4543415254504d50ull // "PMPTRACE"
+#define PATH_MAPPING_TRACE_VERSION 1
+#define PATH_MAPPING_TRACE_PREFIX "path-mapping-trace."
+#define PATH_MAPPING_TRACE_PADDING 0xffff // Function of a record which only fills the end of the ring
+
+struct path_mapping_trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t n_functions;
+    uint32_t n_rings;
+    uint64_t size;              // Size of the whole file
+    uint64_t names_offset;
+    uint64_t rings_offset;
+    uint64_t ring_size;
+    uint64_t start_ns;          // CLOCK_MONOTONIC when the file was created, like time_ns of the records
+    uint64_t untraced;          // Calls of threads which found no free ring
+    char exe[256];              // The program, truncated at the start
+};
+
+struct path_mapping_trace_ring {
+    uint64_t head;              // Number of bytes ever written
+    uint64_t tail;              // Start of the oldest complete record, counted like head
+    uint64_t dropped;           // Calls which were not recorded, e.g. in a signal handler during another call
+    uint32_t owner;             // Thread id of the thread which writes into the ring, 0 if it is free
+    uint32_t reserved;
+};
+
+struct path_mapping_trace_record {
+    uint32_t size;              // Size of the record including the paths, a multiple of 8
+    uint16_t function;          // Index into function_names, or PATH_MAPPING_TRACE_PADDING
+    uint16_t path_length;       // Length of the path, without the null byte
+    uint16_t mapped_length;     // Length of the mapped path, 0 if the path was not changed
+    uint16_t reserved;
+    uint32_t tid;
+    int32_t rule;               // The rule which mapped the path, or -1
+    int32_t error;              // errno set by the call, or 0
+    uint64_t time_ns;           // CLOCK_MONOTONIC at the start of the call
+    uint64_t duration_ns;
+    // Followed by the path and the mapped path, each terminated by a null byte
+};
+
+
+/////////////////////////////////////////////////////////
+//   Index files created by path-mapping-compile       //
+/////////////////////////////////////////////////////////
+
+
+// An index file starts with this header, followed by the compiled table at table_offset.
+// The layout of the table is private to path-mapping.c and depends on the version and on the
+// byte order, so index files can only be used with the same version on the same architecture.
+
+#define PATH_MAPPING_INDEX_MAGIC 0x5845444e49504d50ull // "PMPINDEX"
+#define PATH_MAPPING_INDEX_VERSION 4
+
+struct path_mapping_index_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t table_offset;      // Offset of the table from the start of the file
+    uint64_t table_size;
+};
+
+#endif // PATH_MAPPING_H
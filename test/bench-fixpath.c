@@ -0,0 +1,160 @@
+// Microbenchmark for fix_path(), compared with the linear scan over all mappings that it replaced.
+// Compiled together with path-mapping.c, like the unit tests.
+// Repeated lookups of the same path are answered by the per-thread cache, so "many-matching"
+// cycles through more different paths than the cache can hold to measure the lookups themselves.
+// The second table measures the same with wildcard patterns, which are matched by a DFA.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int path_mapping_load(const char *(*map)[2], int length);
+const char *fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size);
+size_t pathlen(const char *path);
+int path_prefix_matches(const char *prefix, const char *path);
+
+static const char *(*bench_map)[2] = NULL;
+static int bench_map_length = 0;
+
+// The implementation of fix_path() before the mappings were compiled into a trie
+static const char *linear_fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size)
+{
+    if (path == NULL) return path;
+
+    for (int i = 0; i < bench_map_length; i++) {
+        const char *prefix = bench_map[i][0];
+        if (path_prefix_matches(prefix, path)) {
+            const char *replace = bench_map[i][1];
+            size_t prefix_length = pathlen(prefix);
+            size_t new_length = strlen(path) + pathlen(replace) - prefix_length;
+            if (new_length > new_path_size - 1) {
+                return path;
+            }
+            const char *rest = path + prefix_length;
+            strcpy(new_path, replace);
+            strcat(new_path, rest);
+            return new_path;
+        }
+    }
+    return path;
+}
+
+typedef const char *(*fix_path_func)(const char *, const char *, char *, size_t);
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define MANY_PATHS 1024
+
+static double ns_per_call(fix_path_func func, const char **paths, int n_paths, long iterations)
+{
+    char buffer[4096];
+    volatile size_t sink = 0;
+    double start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        sink += (size_t)func("bench", paths[i % n_paths], buffer, sizeof buffer);
+    }
+    (void)sink;
+    return (now_ns() - start) / iterations;
+}
+
+// Mappings similar to what module wrapper scripts generate
+static void make_mapping(int n_rules)
+{
+    static char *strings = NULL;
+    free(strings);
+    free(bench_map);
+    strings = malloc(n_rules * 2 * 64);
+    bench_map = malloc(n_rules * sizeof *bench_map);
+    for (int i = 0; i < n_rules; i++) {
+        char *prefix = strings + i * 128, *dest = prefix + 64;
+        snprintf(prefix, 64, "/opt/modules/pkg%d/share", i);
+        snprintf(dest, 64, "/sw/pkg%d/v%d/share", i, i % 7);
+        bench_map[i][0] = prefix;
+        bench_map[i][1] = dest;
+    }
+    bench_map_length = n_rules;
+    if (path_mapping_load(bench_map, n_rules) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+// The same with a version wildcard in each prefix. Returns the time to compile the table in milliseconds,
+// or a negative number if the patterns need too many states.
+static double make_pattern_mapping(int n_rules)
+{
+    static char *strings = NULL;
+    static const char *(*map)[2] = NULL;
+    free(strings);
+    free(map);
+    strings = malloc(n_rules * 2 * 64);
+    map = malloc(n_rules * sizeof *map);
+    for (int i = 0; i < n_rules; i++) {
+        char *prefix = strings + i * 128, *dest = prefix + 64;
+        snprintf(prefix, 64, "/opt/modules/pkg%d-*/share", i);
+        snprintf(dest, 64, "/sw/pkg%d/$1/share", i);
+        map[i][0] = prefix;
+        map[i][1] = dest;
+    }
+    double start = now_ns();
+    if (path_mapping_load(map, n_rules) != 0) return -1;
+    return (now_ns() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    static const int rule_counts[] = { 1, 10, 100, 1000, 10000 };
+    static char matching[64], many[MANY_PATHS][64];
+    static const char *many_paths[MANY_PATHS];
+    static struct { const char *name; const char *path; } paths[] = {
+        { "non-matching", "/usr/lib/python3/site-packages/numpy/core/__init__.py" },
+        { "relative", "build/obj/main.o" },
+        { "near-miss", "/opt/modules/pkgX/share/data/file.txt" },
+        { "matching", matching },
+        { "many-matching", NULL },
+    };
+
+    printf("%7s  %-14s %12s %12s %9s\n", "rules", "path", "linear ns", "trie ns", "speedup");
+    for (size_t r = 0; r < sizeof rule_counts / sizeof rule_counts[0]; r++) {
+        make_mapping(rule_counts[r]);
+        snprintf(matching, sizeof matching, "/opt/modules/pkg%d/share/data/file.txt", rule_counts[r] / 2);
+        for (int i = 0; i < MANY_PATHS; i++) {
+            snprintf(many[i], sizeof many[i], "/opt/modules/pkg%d/share/data/file%d.txt", i % rule_counts[r], i);
+            many_paths[i] = many[i];
+        }
+        for (size_t p = 0; p < sizeof paths / sizeof paths[0]; p++) {
+            const char **path_list = paths[p].path != NULL ? &paths[p].path : many_paths;
+            int n_paths = paths[p].path != NULL ? 1 : MANY_PATHS;
+            // Scale down the number of linear iterations, otherwise 10000 rules take forever
+            long linear_iterations = iterations / (1 + rule_counts[r] / 100);
+            double linear = ns_per_call(linear_fix_path, path_list, n_paths, linear_iterations);
+            double trie = ns_per_call(fix_path, path_list, n_paths, iterations);
+            printf("%7d  %-14s %12.1f %12.1f %8.1fx\n", rule_counts[r], paths[p].name, linear, trie, linear / trie);
+        }
+    }
+
+    paths[2].path = "/opt/modules/pkgX-1.0/share/data/file.txt";
+    printf("\n%7s  %-14s %12s %12s\n", "rules", "path", "compile ms", "pattern ns");
+    for (size_t r = 0; r < sizeof rule_counts / sizeof rule_counts[0]; r++) {
+        double compile_ms = make_pattern_mapping(rule_counts[r]);
+        if (compile_ms < 0) continue;
+        snprintf(matching, sizeof matching, "/opt/modules/pkg%d-2.1/share/data/file.txt", rule_counts[r] / 2);
+        for (int i = 0; i < MANY_PATHS; i++) {
+            snprintf(many[i], sizeof many[i], "/opt/modules/pkg%d-%d/share/data/file.txt", i % rule_counts[r], i);
+        }
+        for (size_t p = 0; p < sizeof paths / sizeof paths[0]; p++) {
+            const char **path_list = paths[p].path != NULL ? &paths[p].path : many_paths;
+            int n_paths = paths[p].path != NULL ? 1 : MANY_PATHS;
+            double pattern = ns_per_call(fix_path, path_list, n_paths, iterations);
+            printf("%7d  %-14s %12.1f %12.1f\n", rule_counts[r], paths[p].name, compile_ms, pattern);
+        }
+    }
+    return 0;
+}
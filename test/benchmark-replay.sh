@@ -0,0 +1,62 @@
+#!/bin/bash
+# Measures the overhead of path-mapping.so on recorded workloads. Each strace file is replayed by
+# test/benchtool-replay.c without LD_PRELOAD (bare libc), and then with LD_PRELOAD and different numbers of mappings.
+# The output lists the time of one replay in milliseconds, the median and 99th percentile time per call
+# in nanoseconds (including one clock_gettime()), and the fraction of calls whose path was mapped.
+#
+# By default, the traces recorded by test/integration-tests.sh in $TESTDIR/strace are replayed.
+# These contain the paths after mapping, so the default BENCH_MAPPING maps the test directory to itself,
+# which maps the paths without changing which files are accessed.
+# For other traces, set BENCH_MAPPING to the PATH_MAPPING which should apply to them, e.g.
+#   strace -f -o python.trace python3 -c 'import json'
+#   BENCH_MAPPING=/usr/lib/python3:/usr/lib/python3 test/benchmark-replay.sh python.trace
+# Only the last mapping of PATH_MAPPING matches, the others are dummies like in test/benchmark.sh.
+#
+# Usage: test/benchmark-replay.sh [traces...]
+# Environment: TESTDIR, BENCH_MAPPING, BENCH_REPETITIONS, BENCH_RULES
+
+set -o errexit
+set -o nounset
+
+lib="$PWD/path-mapping-quiet.so"
+testdir="${TESTDIR:-/tmp/path-mapping}"
+tool="$testdir/benchtool-replay"
+rule_counts="${BENCH_RULES:-1 100 10000}"
+repetitions="${BENCH_REPETITIONS:-10}"
+mapping="${BENCH_MAPPING:-$testdir/real:$testdir/real}"
+
+if [[ $# -gt 0 ]]; then
+    traces=("$@")
+else
+    traces=()
+    for trace in "$testdir"/strace/*; do
+        [[ -s "$trace" ]] && traces+=("$trace")
+    done
+    if [[ ${#traces[@]} -eq 0 ]]; then
+        echo "No traces in $testdir/strace, run make test first or pass traces as arguments" >&2
+        exit 1
+    fi
+fi
+
+make_mapping() {
+    local n="$1"
+    for ((i = 1; i < n; i++)); do
+        echo -n "/m/$i:/d:"
+    done
+    echo -n "$mapping"
+}
+
+printf "%-24s %6s %7s  %10s %10s %9s  %8s %8s  %8s %8s %7s\n" \
+    trace rules calls "bare ms" "ms" "overhead" "bare p50" "p50" "bare p99" "p99" mapped
+for trace in "${traces[@]}"; do
+    # Traces without replayable calls are skipped, the tool prints why
+    read -r calls bare_ms bare_p50 bare_p99 _ < <("$tool" "$trace" "$repetitions") || continue
+    for rules in $rule_counts; do
+        read -r _ ms p50 p99 mapped < <(PATH_MAPPING_STATS=1 PATH_MAPPING="$(make_mapping "$rules")" LD_PRELOAD="$lib" \
+            "$tool" "$trace" "$repetitions")
+        awk -v t="$(basename "$trace")" -v r="$rules" -v c="$calls" -v bm="$bare_ms" -v m="$ms" \
+                -v b50="$bare_p50" -v p50="$p50" -v b99="$bare_p99" -v p99="$p99" -v f="$mapped" \
+            'BEGIN { printf "%-24.24s %6d %7d  %10.3f %10.3f %+8.1f%%  %8.1f %8.1f  %8.1f %8.1f %7s\n", \
+                     t, r, c, bm, m, (bm > 0 ? 100 * (m - bm) / bm : 0), b50, p50, b99, p99, f }'
+    done
+done
@@ -0,0 +1,78 @@
+#!/bin/bash
+# Measures the per-call overhead of path-mapping.so for each family of overridden functions.
+# Every function is called once without LD_PRELOAD (bare libc), and then with LD_PRELOAD
+# for a matching and a non-matching path, with different numbers of mappings and threads.
+#
+# The spawn family starts a new process per call, so it runs only 1/100 of the iterations.
+# Its overhead includes the startup of path-mapping.so in the child, which inherits LD_PRELOAD.
+#
+# If BENCH_SECCOMP is set, the matching paths are also measured with PATH_MAPPING_SECCOMP.
+#
+# Usage: test/benchmark.sh [families...]
+# Environment: TESTDIR, BENCH_ITERATIONS, BENCH_RULES, BENCH_THREADS, BENCH_SECCOMP, BENCH_URING_BATCH
+
+set -o errexit
+set -o nounset
+
+lib="$PWD/path-mapping-quiet.so"
+testdir="${TESTDIR:-/tmp/path-mapping}"
+benchdir="$testdir/bench"
+tool="$testdir/benchtool-calls"
+rule_counts="${BENCH_RULES:-1 10 100 1000 10000}"
+max_threads="$(nproc)"
+thread_counts="${BENCH_THREADS:-$(t=1; while [[ $t -lt $max_threads ]]; do echo -n "$t "; t=$((t * 2)); done; echo $max_threads)}"
+families="${*:-open openat fopen stat lstat fstatat access opendir realpath execv spawn syscall uring}"
+seccomp="${BENCH_SECCOMP:-}"
+
+rm -rf "$benchdir"
+mkdir -p "$benchdir/real/dir" "$benchdir/other"
+echo content >"$benchdir/real/file"
+echo content >"$benchdir/other/file"
+cp /bin/true "$benchdir/real/true"
+
+# Prints a PATH_MAPPING with $1 mappings, where only the last one matches the benchmark paths.
+# The other prefixes are kept short, so that 10000 of them still fit into one environment variable.
+make_mapping() {
+    local n="$1"
+    for ((i = 1; i < n; i++)); do
+        echo -n "/m/$i:/d:"
+    done
+    echo -n "$benchdir/virtual:$benchdir/real"
+}
+
+# Prints the benchmark path for a family, relative to the directory given as $1
+target() {
+    case "$2" in
+        opendir) echo "$1/dir" ;;
+        execv) echo "$1/missing" ;;
+        spawn) echo "$1/true" ;;
+        *) echo "$1/file" ;;
+    esac
+}
+
+printf "%-9s %6s %7s  %10s %12s %12s %12s %12s" \
+    family rules threads "bare ns" "match ns" "overhead" "no-match ns" "overhead"
+[[ "$seccomp" ]] && printf " %12s %12s" "seccomp ns" "overhead"
+printf "\n"
+for family in $families; do
+    iterations="${BENCH_ITERATIONS:-20000}"
+    [[ "$family" == spawn ]] && iterations=$(( (iterations + 99) / 100 ))
+    for threads in $thread_counts; do
+        bare="$("$tool" "$family" "$(target "$benchdir/real" "$family")" "$iterations" "$threads")"
+        for rules in $rule_counts; do
+            mapping="$(make_mapping "$rules")"
+            match="$(PATH_MAPPING="$mapping" LD_PRELOAD="$lib" \
+                "$tool" "$family" "$(target "$benchdir/virtual" "$family")" "$iterations" "$threads")"
+            nomatch="$(PATH_MAPPING="$mapping" LD_PRELOAD="$lib" \
+                "$tool" "$family" "$(target "$benchdir/real" "$family")" "$iterations" "$threads")"
+            awk -v f="$family" -v r="$rules" -v t="$threads" -v b="$bare" -v m="$match" -v n="$nomatch" \
+                'BEGIN { printf "%-9s %6d %7d  %10.1f %12.1f %+12.1f %12.1f %+12.1f", f, r, t, b, m, m - b, n, n - b }'
+            if [[ "$seccomp" ]]; then
+                trapped="$(PATH_MAPPING_SECCOMP=1 PATH_MAPPING="$mapping" LD_PRELOAD="$lib" \
+                    "$tool" "$family" "$(target "$benchdir/virtual" "$family")" "$iterations" "$threads")"
+                awk -v b="$bare" -v s="$trapped" 'BEGIN { printf " %12.1f %+12.1f", s, s - b }'
+            fi
+            echo
+        done
+    done
+done
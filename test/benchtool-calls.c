@@ -0,0 +1,177 @@
+// Calls one family of overridden functions in a loop and prints the time per call in nanoseconds.
+// Run with and without LD_PRELOAD by test/benchmark.sh to measure the overhead of path-mapping.so.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *path;
+static long iterations;
+
+static void call_open(void) { int fd = open(path, O_RDONLY); if (fd >= 0) close(fd); }
+static void call_openat(void) { int fd = openat(AT_FDCWD, path, O_RDONLY); if (fd >= 0) close(fd); }
+static void call_fopen(void) { FILE *f = fopen(path, "r"); if (f != NULL) fclose(f); }
+static void call_stat(void) { struct stat st; stat(path, &st); }
+static void call_lstat(void) { struct stat st; lstat(path, &st); }
+static void call_fstatat(void) { struct stat st; fstatat(AT_FDCWD, path, &st, 0); }
+static void call_access(void) { access(path, R_OK); }
+static void call_opendir(void) { DIR *dir = opendir(path); if (dir != NULL) closedir(dir); }
+static void call_realpath(void) { char resolved[PATH_MAX]; realpath(path, resolved); }
+// Bypasses the overrides, so the path is only mapped with PATH_MAPPING_SECCOMP
+static void call_syscall(void) { int fd = syscall(SYS_openat, AT_FDCWD, path, O_RDONLY); if (fd >= 0) close(fd); }
+// One call submits a batch of BENCH_URING_BATCH (default 256) openat SQEs to a ring of the thread and closes the files
+static __thread struct {
+    int fd;
+    unsigned entries, *sq_tail, *sq_array, *cq_head, *cq_tail, cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} ring = { -1 };
+
+static void call_uring(void)
+{
+    static unsigned batch = 0;
+    if (batch == 0) {
+        const char *env = getenv("BENCH_URING_BATCH");
+        batch = env != NULL && atoi(env) > 0 ? atoi(env) : 256;
+    }
+    if (ring.fd < 0) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof params);
+        ring.fd = syscall(SYS_io_uring_setup, batch, &params);
+        if (ring.fd < 0) exit(2);
+        char *sq = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQ_RING);
+        char *cq = mmap(NULL, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_CQ_RING);
+        ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) exit(2);
+        ring.entries = params.sq_entries;
+        ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+        ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+        ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        ring.cq_mask = params.cq_entries - 1;
+        ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    }
+    unsigned tail = *ring.sq_tail;
+    for (unsigned i = 0; i < batch && i < ring.entries; i++) {
+        unsigned index = (tail + i) & (ring.entries - 1);
+        struct io_uring_sqe *sqe = &ring.sqes[index];
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)path;
+        sqe->open_flags = O_RDONLY;
+        ring.sq_array[index] = index;
+    }
+    unsigned n = batch < ring.entries ? batch : ring.entries;
+    __atomic_store_n(ring.sq_tail, tail + n, __ATOMIC_RELEASE);
+    syscall(SYS_io_uring_enter, ring.fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0);
+    unsigned head = *ring.cq_head;
+    for (; head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE); head++) {
+        int fd = ring.cqes[head & ring.cq_mask].res;
+        if (fd >= 0) close(fd);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+// The path of the exec benchmark does not exist, so execv() fails and returns
+static void call_execv(void) { char *argv[] = { "bench", NULL }; execv(path, argv); }
+// Runs the program at path (a copy of true) with its own environment and waits for it
+static void call_spawn(void)
+{
+    char *argv[] = { "bench", NULL }, *env[] = { "BENCH=1", NULL };
+    pid_t pid;
+    if (posix_spawn(&pid, path, NULL, NULL, argv, env) == 0) waitpid(pid, NULL, 0);
+}
+
+static const struct {
+    const char *name;
+    void (*call)(void);
+} families[] = {
+    { "open", call_open },
+    { "openat", call_openat },
+    { "fopen", call_fopen },
+    { "stat", call_stat },
+    { "lstat", call_lstat },
+    { "fstatat", call_fstatat },
+    { "access", call_access },
+    { "opendir", call_opendir },
+    { "realpath", call_realpath },
+    { "execv", call_execv },
+    { "spawn", call_spawn },
+    { "syscall", call_syscall },
+    { "uring", call_uring },
+};
+
+static void (*call)(void) = NULL;
+static pthread_barrier_t barrier;
+
+static void *run(void *arg)
+{
+    pthread_barrier_wait(&barrier);
+    for (long i = 0; i < iterations; i++) {
+        call();
+    }
+    return NULL;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s [family] [path] [iterations] [threads]\n", argv[0]);
+        fprintf(stderr, "Families:");
+        for (size_t i = 0; i < sizeof families / sizeof families[0]; i++) fprintf(stderr, " %s", families[i].name);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof families / sizeof families[0]; i++) {
+        if (strcmp(families[i].name, argv[1]) == 0) call = families[i].call;
+    }
+    if (call == NULL) {
+        fprintf(stderr, "Unknown function family %s\n", argv[1]);
+        return 1;
+    }
+    path = argv[2];
+    iterations = atol(argv[3]);
+    int n_threads = atoi(argv[4]);
+    if (iterations <= 0 || n_threads <= 0) return 1;
+
+    // Warm up, so that lazy initialization is not measured
+    for (int i = 0; i < 100; i++) call();
+
+    pthread_t threads[n_threads];
+    pthread_barrier_init(&barrier, NULL, n_threads + 1);
+    for (int t = 0; t < n_threads; t++) {
+        pthread_create(&threads[t], NULL, run, NULL);
+    }
+    double start = now_ns();
+    pthread_barrier_wait(&barrier);
+    for (int t = 0; t < n_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    // Wall time per call of one thread. If the calls scale perfectly, this does not change with the number of threads.
+    printf("%.1f\n", elapsed / iterations);
+    return 0;
+}
@@ -0,0 +1,314 @@
+// Replays the path syscalls of a recorded strace through the overridden libc functions, and prints
+// the total time, the median and 99th percentile time per call, and the fraction of mapped paths.
+// Run with and without LD_PRELOAD by test/benchmark-replay.sh to measure the overhead on real workloads.
+//
+// Record a trace with e.g. "strace -f -o python.trace python3 -c 'import json'".
+// Lines with a dirfd other than AT_FDCWD, unfinished or resumed calls and syscalls without a path are skipped.
+// Nothing is modified: calls which would change the file system (mkdir, unlink, rename, chmod, ...)
+// are replayed as lstat() of their first path, and files are always opened read-only and closed again.
+// chdir() is replayed, so that relative paths resolve like in the recorded program.
+//
+// The fraction of mapped paths is read from the counters of path-mapping.so, which are only published
+// if PATH_MAPPING_STATS is set (see path-mapping-stat.c). Otherwise it is printed as "-".
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../path-mapping.h"
+
+enum replay_kind { REPLAY_OPEN, REPLAY_STAT, REPLAY_LSTAT, REPLAY_STATX, REPLAY_ACCESS, REPLAY_READLINK, REPLAY_CHDIR };
+
+struct replay_call {
+    enum replay_kind kind;
+    int flags;                  // Flags for open() and statx()
+    const char *path;
+};
+
+// Syscalls with a path as first argument, or as second argument after a dirfd (at = 1)
+static const struct {
+    const char *name;
+    int at;
+    enum replay_kind kind;
+} syscalls[] = {
+    { "open", 0, REPLAY_OPEN },
+    { "openat", 1, REPLAY_OPEN },
+    { "openat2", 1, REPLAY_OPEN },
+    { "creat", 0, REPLAY_LSTAT },
+    { "stat", 0, REPLAY_STAT },
+    { "stat64", 0, REPLAY_STAT },
+    { "lstat", 0, REPLAY_LSTAT },
+    { "lstat64", 0, REPLAY_LSTAT },
+    { "newfstatat", 1, REPLAY_STAT },
+    { "fstatat64", 1, REPLAY_STAT },
+    { "statx", 1, REPLAY_STATX },
+    { "statfs", 0, REPLAY_STAT },
+    { "access", 0, REPLAY_ACCESS },
+    { "faccessat", 1, REPLAY_ACCESS },
+    { "faccessat2", 1, REPLAY_ACCESS },
+    { "readlink", 0, REPLAY_READLINK },
+    { "readlinkat", 1, REPLAY_READLINK },
+    { "execve", 0, REPLAY_ACCESS },
+    { "execveat", 1, REPLAY_ACCESS },
+    { "chdir", 0, REPLAY_CHDIR },
+    { "truncate", 0, REPLAY_LSTAT },
+    { "mkdir", 0, REPLAY_LSTAT },
+    { "mkdirat", 1, REPLAY_LSTAT },
+    { "rmdir", 0, REPLAY_LSTAT },
+    { "unlink", 0, REPLAY_LSTAT },
+    { "unlinkat", 1, REPLAY_LSTAT },
+    { "rename", 0, REPLAY_LSTAT },
+    { "renameat", 1, REPLAY_LSTAT },
+    { "renameat2", 1, REPLAY_LSTAT },
+    { "link", 0, REPLAY_LSTAT },
+    { "symlink", 0, REPLAY_LSTAT },
+    { "chmod", 0, REPLAY_LSTAT },
+    { "fchmodat", 1, REPLAY_LSTAT },
+    { "chown", 0, REPLAY_LSTAT },
+    { "lchown", 0, REPLAY_LSTAT },
+    { "fchownat", 1, REPLAY_LSTAT },
+    { "utime", 0, REPLAY_LSTAT },
+    { "utimes", 0, REPLAY_LSTAT },
+    { "utimensat", 1, REPLAY_LSTAT },
+    { "getxattr", 0, REPLAY_STAT },
+    { "lgetxattr", 0, REPLAY_LSTAT },
+    { "listxattr", 0, REPLAY_STAT },
+    { "llistxattr", 0, REPLAY_LSTAT },
+};
+
+// Parses the quoted C string at *s into out (of size PATH_MAX). Returns 0 on success.
+static int parse_string(const char **s, char *out)
+{
+    const char *c = *s;
+    if (*c++ != '"') return -1;
+    size_t length = 0;
+    while (*c != '"') {
+        if (*c == '\0' || length >= PATH_MAX - 1) return -1;
+        int ch = (unsigned char)*c++;
+        if (ch == '\\') {
+            ch = (unsigned char)*c++;
+            switch (ch) {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'r': ch = '\r'; break;
+                case 'v': ch = '\v'; break;
+                case 'f': ch = '\f'; break;
+                case 'x':
+                    ch = 0;
+                    for (int i = 0; i < 2 && isxdigit((unsigned char)*c); i++, c++) {
+                        ch = ch * 16 + (*c <= '9' ? *c - '0' : (*c | 0x20) - 'a' + 10);
+                    }
+                    break;
+                case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+                    ch -= '0';
+                    for (int i = 0; i < 2 && *c >= '0' && *c <= '7'; i++) ch = ch * 8 + *c++ - '0';
+                    break;
+                case '\0': return -1;
+                default: break; // \" and \\ stand for themselves
+            }
+        }
+        out[length++] = (char)ch;
+    }
+    out[length] = '\0';
+    *s = c + 1;
+    return 0;
+}
+
+static int parse_open_flags(const char *s)
+{
+    int flags = O_RDONLY | O_NONBLOCK;
+    const char *end = strchr(s, ')');
+    size_t length = end != NULL ? (size_t)(end - s) : strlen(s);
+    if (memmem(s, length, "O_DIRECTORY", 11) != NULL) flags |= O_DIRECTORY;
+    if (memmem(s, length, "O_NOFOLLOW", 10) != NULL) flags |= O_NOFOLLOW;
+    if (memmem(s, length, "O_PATH", 6) != NULL) flags |= O_PATH;
+    return flags;
+}
+
+// Parses one line of strace output. Returns 1 if it contains a call which can be replayed.
+static int parse_line(const char *line, struct replay_call *call, char *path)
+{
+    const char *c = line;
+    // Skip "[pid 123] " or "123 " of strace -f, and timestamps of strace -t, -tt or -ttt
+    if (strncmp(c, "[pid", 4) == 0) c = strchr(c, ']') != NULL ? strchr(c, ']') + 1 : c;
+    for (;;) {
+        while (*c == ' ') c++;
+        if (*c < '0' || *c > '9') break;
+        while ((*c >= '0' && *c <= '9') || *c == ':' || *c == '.') c++;
+    }
+    const char *name = c;
+    while ((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9') || *c == '_') c++;
+    size_t name_length = c - name;
+    if (*c != '(' || strstr(c, "<unfinished") != NULL) return 0;
+    c++;
+    for (size_t i = 0; i < sizeof syscalls / sizeof syscalls[0]; i++) {
+        if (strlen(syscalls[i].name) != name_length || strncmp(syscalls[i].name, name, name_length) != 0) continue;
+        if (syscalls[i].at) {
+            // strace -y prints "AT_FDCWD</cwd>", which is fine. Other dirfds are not replayable.
+            if (strncmp(c, "AT_FDCWD", 8) != 0) return 0;
+            c = strchr(c, ',');
+            if (c == NULL) return 0;
+            c++;
+            while (*c == ' ') c++;
+        }
+        if (parse_string(&c, path) != 0) return 0;
+        call->kind = syscalls[i].kind;
+        call->flags = call->kind == REPLAY_OPEN ? parse_open_flags(c) : 0;
+        if (call->kind == REPLAY_STATX && strstr(c, "AT_SYMLINK_NOFOLLOW") != NULL) call->flags = AT_SYMLINK_NOFOLLOW;
+        return 1;
+    }
+    return 0;
+}
+
+static void replay(const struct replay_call *call)
+{
+    struct stat st;
+    switch (call->kind) {
+        case REPLAY_OPEN: {
+            int fd = open(call->path, call->flags);
+            if (fd >= 0) close(fd);
+            break;
+        }
+        case REPLAY_STAT: stat(call->path, &st); break;
+        case REPLAY_LSTAT: lstat(call->path, &st); break;
+        case REPLAY_STATX: {
+            struct statx stx;
+            statx(AT_FDCWD, call->path, call->flags, STATX_BASIC_STATS, &stx);
+            break;
+        }
+        case REPLAY_ACCESS: access(call->path, F_OK); break;
+        case REPLAY_READLINK: {
+            char buffer[PATH_MAX];
+            readlink(call->path, buffer, sizeof buffer);
+            break;
+        }
+        case REPLAY_CHDIR: if (chdir(call->path) != 0) {} break;
+    }
+}
+
+// Sums the mapped paths over all functions in the counters which this process publishes.
+// Returns 0 on success, or -1 if PATH_MAPPING_STATS is not set or path-mapping.so is not loaded.
+static int read_mapped_counter(uint64_t *mapped)
+{
+    char name[64];
+    snprintf(name, sizeof name, "/" PATH_MAPPING_STATS_PREFIX "%d", (int)getpid());
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    const struct path_mapping_stats_header *h = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof *h) {
+        h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (h == MAP_FAILED) return -1;
+    if (h->magic != PATH_MAPPING_STATS_MAGIC || h->version != PATH_MAPPING_STATS_VERSION
+            || h->shards_offset + (uint64_t)h->n_shards * h->shard_size > (uint64_t)st.st_size) {
+        munmap((void *)h, st.st_size);
+        return -1;
+    }
+    *mapped = 0;
+    for (uint32_t s = 0; s < h->n_shards; s++) {
+        const struct path_mapping_function_counters *functions =
+            (const void *)((const char *)h + h->shards_offset + s * h->shard_size);
+        for (uint32_t f = 0; f < h->n_functions; f++) {
+            *mapped += __atomic_load_n(&functions[f].mapped, __ATOMIC_RELAXED);
+        }
+    }
+    munmap((void *)h, st.st_size);
+    return 0;
+}
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *left, const void *right)
+{
+    double a = *(const double *)left, b = *(const double *)right;
+    return a < b ? -1 : a > b;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s [trace] [repetitions]\n", argv[0]);
+        fprintf(stderr, "Prints: calls, total ms per repetition, p50 ns, p99 ns, mapped fraction\n");
+        return 1;
+    }
+    long repetitions = argc == 3 ? atol(argv[2]) : 10;
+    if (repetitions <= 0) return 1;
+
+    FILE *file = fopen(argv[1], "r");
+    if (file == NULL) {
+        fprintf(stderr, "Can not open %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    size_t length = 0, capacity = 1024;
+    struct replay_call *calls = malloc(capacity * sizeof *calls);
+    char *line = NULL, path[PATH_MAX];
+    size_t line_size = 0;
+    while (calls != NULL && getline(&line, &line_size, file) > 0) {
+        if (!parse_line(line, &calls[length], path)) continue;
+        calls[length].path = strdup(path);
+        if (calls[length].path == NULL) return 1;
+        if (++length == capacity) {
+            capacity *= 2;
+            calls = realloc(calls, capacity * sizeof *calls);
+        }
+    }
+    free(line);
+    fclose(file);
+    double *times = calls != NULL ? malloc((length * repetitions + 1) * sizeof *times) : NULL;
+    if (times == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (length == 0) {
+        fprintf(stderr, "No replayable calls in %s\n", argv[1]);
+        return 1;
+    }
+
+    // Each repetition starts in the same directory, even if the trace contains chdir()
+    int start_dir = open(".", O_RDONLY | O_DIRECTORY);
+    // Warm up, so that lazy initialization and the first disk accesses are not measured
+    for (size_t i = 0; i < length; i++) replay(&calls[i]);
+
+    uint64_t mapped_before = 0, mapped_after = 0;
+    int counted = read_mapped_counter(&mapped_before) == 0;
+    double total = 0;
+    for (long r = 0; r < repetitions; r++) {
+        if (start_dir >= 0 && fchdir(start_dir) != 0) return 1;
+        double start = now_ns(), previous = start;
+        for (size_t i = 0; i < length; i++) {
+            replay(&calls[i]);
+            double now = now_ns();
+            times[r * length + i] = now - previous;
+            previous = now;
+        }
+        total += previous - start;
+    }
+    counted = counted && read_mapped_counter(&mapped_after) == 0;
+
+    size_t n = length * repetitions;
+    qsort(times, n, sizeof *times, compare_double);
+    printf("%zu %.3f %.1f %.1f ", length, total / repetitions / 1e6, times[n / 2], times[n * 99 / 100]);
+    if (counted) {
+        printf("%.3f\n", (double)(mapped_after - mapped_before) / n);
+    } else {
+        printf("-\n");
+    }
+    return 0;
+}
@@ -6,6 +6,10 @@ set -o errexit
 set -o nounset
 
 lib="$PWD/path-mapping.so"
+stat_tool="$PWD/path-mapping-stat"
+trace_tool="$PWD/path-mapping-trace"
+compile_tool="$PWD/path-mapping-compile"
+audit_lib="$PWD/path-mapping-audit.so"
 testdir="${TESTDIR:-/tmp/path-mapping}"
 
 export PATH_MAPPING="$testdir/virtual:$testdir/real"
@@ -243,6 +247,18 @@ test_bash_cd() { # Test chdir()
     check_output_file $'dir1\nfile0\ndir2\nfile1'
 }
 
+test_cwd() { # Tests relative paths, getcwd() and ".." in a virtual current directory
+    setup
+    LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "cd '$testdir'; cat virtual/file0; cd virtual/dir1; /bin/pwd; cat ../file0; cd ..; cat dir1/file1" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file "content0
+$testdir/virtual/dir1
+content0
+content1"
+}
+
 test_execl_0() {
     setup
     cp ./testtool-execl ./testtool-printenv real/
@@ -280,8 +296,269 @@ test_execle_3() {
         "$testdir/virtual/testtool-execl" execle "$testdir/virtual/testtool-printenv" 3 \
         >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
     check_strace_file
-    check_output_file $'arg1\narg2\narg3\nTEST1=value1\nTEST2=value2'
+    # The custom environment of execle() still gets the mapping, so that the new program is mapped too
+    check_output_file $'arg1\narg2\narg3\nTEST1=value1\nTEST2=value2\n'"LD_PRELOAD=$lib"$'\n'"PATH_MAPPING=$PATH_MAPPING"
+
+}
+
+test_readdir() { # Tests that the mapped prefix is listed in its parent directory
+    setup
+    LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "ls '$testdir' | grep -x virtual; find '$testdir' -maxdepth 1 -name virtual; echo '$testdir'/virt*al" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file "virtual
+$testdir/virtual
+$testdir/virtual"
+}
+
+test_reverse() { # Tests PATH_MAPPING_REVERSE with getcwd(), readlink() and nftw()
+    setup
+    ln -s "$testdir/real/file0" real/link0
+    PATH_MAPPING_REVERSE=1 LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "readlink virtual/link0; cd real/dir1; /bin/pwd; '$testdir/testtool-nftw' '$testdir/virtual/dir1/dir2' | sort" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file "$testdir/virtual/file0
+$testdir/virtual/dir1
+$testdir/virtual/dir1/dir2
+$testdir/virtual/dir1/dir2/file2
+$testdir/virtual/dir1/dir2/file3"
+}
+
+test_seccomp() { # Tests PATH_MAPPING_SECCOMP with a direct syscall and a child process
+    setup
+    # No strace, because it would show the trapped syscalls with the unmapped paths
+    PATH_MAPPING_SECCOMP=1 LD_PRELOAD="$lib" \
+        bash -c "'$testdir/testtool-syscall' virtual/file0; cat virtual/dir1/file1; cd virtual/dir1/dir2; cat file2" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file $'content0\ncontent1\ncontent2'
+}
+
+test_seccomp_no_aslr() { # Tests that PATH_MAPPING_SECCOMP does not kill children without the library if randomization is disabled
+    setup
+    setarch -R env PATH_MAPPING_SECCOMP=1 LD_PRELOAD="$lib" \
+        bash -c "cat virtual/file0; env -i /bin/cat '$testdir/real/dir1/file1'" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file $'content0\ncontent1'
+    grep -q 'PATH_MAPPING_SECCOMP: address space randomization is disabled' out/${FUNCNAME[0]}.err
+}
+
+test_io_uring() { # Tests paths in io_uring submissions, which do not go through the libc
+    setup
+    LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        ./testtool-uring virtual/file0 "$testdir/virtual/dir1/file1" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'content0\n9'
+}
+
+test_statx() { # Tests statx(), which is used by stat and ls of coreutils
+    setup
+    LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "stat -c %s '$testdir/virtual/file0'; ls '$testdir/virtual/dir1'" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'9\ndir2\nfile1'
+}
+
+test_metadata() { # Tests creat(), truncate(), statx(), name_to_handle_at(), the xattr functions and execveat()
+    setup
+    cp /bin/echo real/echo
+    LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        ./testtool-metadata "$testdir/virtual/dir1/new" virtual/echo \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'size 4\nxattr\nexec'
+    test "$(cat real/dir1/new)" == cont
+}
+
+test_spawn() { # Tests posix_spawn(), posix_spawnp() and vfork() with execle(), with a file action and a custom environment
+    setup
+    cp ./testtool-printenv real/
+    for mode in spawn spawnp vfork; do
+        LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+            ./testtool-spawn $mode "$testdir/virtual/testtool-printenv" virtual/out_$mode \
+            >out/${FUNCNAME[0]}_$mode 2>out/${FUNCNAME[0]}_$mode.err
+        check_strace_file
+        check_output_file ${FUNCNAME[0]}_$mode "exit 0"
+        test "$(cat real/out_$mode)" == "arg1
+TEST=spawn
+LD_PRELOAD=$lib
+PATH_MAPPING=$PATH_MAPPING"
+    done
+}
 
+test_fortify() { # Tests the _FORTIFY_SOURCE variants __open_2(), __realpath_chk(), __readlink_chk() and __getcwd_chk()
+    setup
+    ln -s "$testdir/real/file0" real/link0
+    PATH_MAPPING_REVERSE=1 LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "cd virtual/dir1; '$testdir/testtool-fortify' '$testdir/virtual/file0' ../link0" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file "content0
+$testdir/virtual/file0
+$testdir/virtual/file0
+$testdir/virtual/dir1"
+}
+
+test_layers() { # Tests a prefix with two destinations, where the first one contains only some files
+    setup
+    mkdir -p top/dir1
+    echo top0 >top/file0
+    LD_PRELOAD="$lib" PATH_MAPPING="$testdir/virtual:$testdir/top:$testdir/virtual:$testdir/real" strace -o "strace/${FUNCNAME[0]}" \
+        cat "$testdir/virtual/file0" "$testdir/virtual/dir1/file1" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'top0\ncontent1'
+    rm -r top
+}
+
+test_overlay() { # Tests PATH_MAPPING_OVERLAY, where changes to the second layer are made in a copy in the first one
+    setup
+    rm -rf upper
+    LD_PRELOAD="$lib" PATH_MAPPING="$testdir/virtual:$testdir/upper:$testdir/virtual:$testdir/real" PATH_MAPPING_OVERLAY=1 strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "v='$testdir/virtual'; echo more >>\$v/file0; chmod 600 \$v/dir1/file1; rm \$v/dir1/dir2/file2
+            mv \$v/dir1/dir2/file3 \$v/dir1/file3; cat \$v/file0; ls \$v/dir1/dir2; rm -r \$v/dir1/dir2; ls \$v/dir1
+            stat -c %a \$v/dir1/file1" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'content0\nmore\nfile1\nfile3\n600'
+    # The second layer is unchanged, and the first one has the copies and the whiteouts
+    [[ "$(cat real/file0)" == content0 && -f real/dir1/dir2/file2 && -f real/dir1/dir2/file3 ]]
+    [[ "$(stat -c %a upper/dir1/file1)" == 600 && -f upper/dir1/file3 && -f upper/dir1/.wh.dir2 ]]
+    rm -r upper
+}
+
+test_patterns() { # Tests a wildcard prefix with a capture in the destination, and an exclusion from it
+    setup
+    mkdir -p virtual-excluded
+    echo excluded >virtual-excluded/file
+    # The excluded path is accessed as it is, so the strace file is not checked
+    LD_PRELOAD="$lib" PATH_MAPPING="$testdir/virtual-*:$testdir/real/\$1:!$testdir/virtual-excluded:" \
+        cat "$testdir/virtual-dir1/file1" "$testdir/virtual-dir1/dir2/file2" "$testdir/virtual-excluded/file" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file $'content1\ncontent2\nexcluded'
+    rm -r virtual-excluded
+}
+
+test_openat() { # Tests paths relative to the dirfd of a parent directory of the mapping
+    setup
+    LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        ./testtool-openat "$testdir" virtual/dir1/file1 \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'content1\n9'
+}
+
+test_index_file() { # Tests PATH_MAPPING_FILE, including paths which can not be expressed in PATH_MAPPING
+    setup
+    printf '%s %s\n' "$testdir/virtual:with\\ space" "$testdir/real # comment" >rules.txt
+    "$compile_tool" rules.txt -o rules.idx >/dev/null
+    PATH_MAPPING= PATH_MAPPING_FILE="$testdir/rules.idx" LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        cat "$testdir/virtual:with space/dir1/file1" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file "content1"
+}
+
+test_shared_table() { # Tests that children use the table of the parent from PATH_MAPPING_TABLE, and ignore a broken one
+    setup
+    mapping="$(for i in {1..20}; do echo -n "/m/$i:/d:"; done)$PATH_MAPPING"
+    PATH_MAPPING="$mapping" LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "cat '$testdir/virtual/file0'
+            PATH_MAPPING_TABLE=\"\${PATH_MAPPING_TABLE%:*}:0\" cat '$testdir/virtual/dir1/file1'
+            PATH_MAPPING='$PATH_MAPPING' cat '$testdir/virtual/dir1/dir2/file2'" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_strace_file
+    check_output_file $'content0\ncontent1\ncontent2'
+    # strace publishes the table, and only bash and the first cat have the same mapping and a valid PATH_MAPPING_TABLE
+    test "$(grep -c 'PATH_MAPPING_TABLE: using the table' out/${FUNCNAME[0]}.err)" == 2
+}
+
+test_shared_table_damaged() { # Tests that children parse PATH_MAPPING if the table in PATH_MAPPING_TABLE is damaged
+    setup
+    mapping="$(for i in {1..20}; do echo -n "/m/$i:/d:"; done)$PATH_MAPPING"
+    PATH_MAPPING="$mapping" LD_PRELOAD="$lib" ./testtool-memfd cat "$testdir/virtual/file0" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file "0 crashed"
+    grep -q 'PATH_MAPPING_TABLE: the table in fd [0-9]* is damaged' out/${FUNCNAME[0]}.err
+    grep -q 'PATH_MAPPING_TABLE: using the table' out/${FUNCNAME[0]}.err
+}
+
+test_profiles() { # Tests a section of rules which only applies to cat, also when cat uses the table of bash
+    setup
+    mapping="@exe=no-such-program::$(for i in {1..20}; do echo -n "/m/$i:/d:"; done)@exe=cat::$PATH_MAPPING"
+    # bash has no rules, so its [[ -e ]] does not see the virtual file
+    PATH_MAPPING="$mapping" LD_PRELOAD="$lib" strace -o "strace/${FUNCNAME[0]}" \
+        bash -c "cat '$testdir/virtual/file0'
+            [[ -e '$testdir/virtual/file0' ]] || echo unmapped" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file $'content0\nunmapped'
+    grep -q 'PATH_MAPPING_TABLE: using the table' out/${FUNCNAME[0]}.err
+}
+
+test_reload() { # Tests PATH_MAPPING_RELOAD in a running bash
+    setup
+    echo "$testdir/virtual $testdir/real" >rules.txt
+    echo "$testdir/virtual2 $testdir/real/dir1" >rules2.txt
+    "$compile_tool" rules.txt -o rules.idx >/dev/null
+    PATH_MAPPING_FILE="$testdir/rules.idx" PATH_MAPPING_RELOAD=1 LD_PRELOAD="$lib" \
+        bash -c "read line <'$testdir/virtual/file0'; echo \$line
+            '$compile_tool' rules2.txt -o rules.idx >/dev/null
+            for i in {1..100}; do [[ -e '$testdir/virtual2/file1' ]] && break; sleep 0.05; done
+            read line <'$testdir/virtual2/file1'; echo \$line
+            [[ ! -e '$testdir/virtual/file0' ]]" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file $'content0\ncontent1'
+}
+
+test_stats() { # Tests the counters in shared memory and path-mapping-stat
+    setup
+    # The last command must not be path-mapping-stat, otherwise bash would exec() it in its own process
+    PATH_MAPPING_STATS=1 LD_PRELOAD="$lib" \
+        bash -c "echo \$\$; cd '$testdir/virtual/dir1'; '$stat_tool' \$\$; true" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    grep -qE '^chdir +1 +1 +0 *$' out/${FUNCNAME[0]}
+    grep -qE "^ +[1-9][0-9]*  \[0\] $testdir/virtual => $testdir/real\$" out/${FUNCNAME[0]}
+    test '!' -e "/dev/shm/path-mapping-stats.$(head -n 1 out/${FUNCNAME[0]})" # removed on exit
+}
+
+test_trace() { # Tests the trace files of bash and its child, and path-mapping-trace
+    setup
+    rm -rf trace && mkdir trace
+    PATH_MAPPING_TRACE="$testdir/trace" LD_PRELOAD="$lib" \
+        bash -c "cat '$testdir/virtual/file0'; [[ -e '$testdir/virtual/missing' ]] || true" \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    "$trace_tool" trace >trace.txt 2>>out/${FUNCNAME[0]}.err
+    grep -qE "^ +[0-9.]+ +[0-9]+ +[0-9]+ +open +[0-9.]+ +- +$testdir/virtual/file0 => $testdir/real/file0 \[0\]\$" trace.txt
+    grep -qE " ENOENT +$testdir/virtual/missing => $testdir/real/missing \[0\]\$" trace.txt
+    test "$(ls trace | wc -l)" -eq 3 # bash, the child of fork(), and cat after exec() in the child
+    "$trace_tool" -j trace | grep -q "\"mapped\": \"$testdir/real/file0\""
+}
+
+test_audit() { # Tests path-mapping-audit.so with dlopen() of a virtual path and of a name in a virtual directory of LD_LIBRARY_PATH
+    setup
+    mkdir real/lib
+    cp "$(./testtool-dlopen libm.so.6)" real/lib/libplugin.so
+    LD_AUDIT="$audit_lib" LD_PRELOAD="$lib" LD_LIBRARY_PATH="$testdir/missing:$testdir/virtual/lib" \
+        ./testtool-dlopen "$testdir/virtual/lib/libplugin.so" libplugin.so \
+        >out/${FUNCNAME[0]} 2>out/${FUNCNAME[0]}.err
+    check_output_file "$testdir/real/lib/libplugin.so"$'\n'"$testdir/real/lib/libplugin.so"
+    # Without path-mapping-audit.so, the loader does not see the virtual directory
+    test "$(LD_PRELOAD="$lib" LD_LIBRARY_PATH="$testdir/virtual/lib" ./testtool-dlopen libplugin.so 2>/dev/null || true)" == "not found"
+
+    # Startup time with 20 directories in LD_LIBRARY_PATH which do not exist and an optional plugin which is looked up 20 times,
+    # without LD_AUDIT from the real directory, and with path-mapping-audit.so from the virtual directory
+    local missing="$(for i in {1..20}; do echo -n "$testdir/missing$i:"; done)"
+    local plugins="libplugin.so $(for i in {1..20}; do echo -n "libmissing.so "; done)"
+    local start="$EPOCHREALTIME"
+    for i in {1..20}; do LD_LIBRARY_PATH="$missing$testdir/real/lib" ./testtool-dlopen $plugins >/dev/null || true; done
+    local middle="$EPOCHREALTIME"
+    for i in {1..20}; do LD_AUDIT="$audit_lib" LD_LIBRARY_PATH="$missing$testdir/virtual/lib" ./testtool-dlopen $plugins >/dev/null || true; done
+    local end="$EPOCHREALTIME"
+    awk -v s="$start" -v m="$middle" -v e="$end" \
+        'BEGIN { printf "  startup: %.2f ms without LD_AUDIT, %.2f ms with path-mapping-audit.so\n", (m - s) * 50, (e - m) * 50 }'
 }
 
 test_du() {
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Stress test and scalability curves for the overrides. test/stresstool.c calls each family of overridden
+# functions (and "all" of them in turn) from 1 to 128 threads for STRESS_SECONDS, checks the result of
+# every call, and interrupts the workers with a signal whose handler opens a file through the overrides.
+# The families fork, vfork, exec and spawn start processes from the threads, which check a file themselves.
+#
+# The first table lists the calls per second, the speedup over the first thread count and the efficiency
+# (the speedup divided by the increase in threads). Lock contention shows up as an efficiency which drops
+# well before the number of threads reaches the number of cores.
+# Afterwards, every family runs with the builds of the tool with ThreadSanitizer and with AddressSanitizer
+# and UndefinedBehaviorSanitizer, which stop at their first report.
+# The script fails if any call failed, or if a sanitizer reported an error.
+#
+# Usage: test/stress.sh [families...]
+# Environment: TESTDIR, STRESS_THREADS, STRESS_SECONDS, STRESS_SANITIZERS, STRESS_SANITIZER_THREADS
+
+set -o errexit
+set -o nounset
+
+testdir="${TESTDIR:-/tmp/path-mapping}"
+stressdir="$testdir/stress"
+families="${*:-open fopen openat stat lstat fstatat access readdir realpath readlink syscall cwd fork vfork exec spawn all}"
+thread_counts="${STRESS_THREADS:-1 2 4 8 16 32 64 128}"
+seconds="${STRESS_SECONDS:-1}"
+sanitizers="${STRESS_SANITIZERS-tsan asan}"
+sanitizer_threads="${STRESS_SANITIZER_THREADS:-4 32}"
+
+rm -rf "$stressdir"
+mkdir -p "$stressdir/real/dir"
+echo stress >"$stressdir/real/file"
+echo stress >"$stressdir/real/dir/file"
+ln -s file "$stressdir/real/link"
+export PATH_MAPPING="$stressdir/virtual:$stressdir/real"
+# Stop at the first report with a non-zero exit code, also in the child processes
+export TSAN_OPTIONS="halt_on_error=1 exitcode=66 ${TSAN_OPTIONS:-}"
+export ASAN_OPTIONS="halt_on_error=1 detect_leaks=0 ${ASAN_OPTIONS:-}"
+export UBSAN_OPTIONS="halt_on_error=1 print_stacktrace=1 ${UBSAN_OPTIONS:-}"
+
+failed=0
+first_threads="${thread_counts%% *}"
+
+echo "$(nproc) cores, $seconds s per run"
+printf "%-9s %7s %12s %8s %10s %8s %8s\n" family threads "calls/s" speedup efficiency failures signals
+for family in $families; do
+    base=""
+    for threads in $thread_counts; do
+        err="$stressdir/stresstool-$family-$threads.err"
+        status=0
+        output="$("$testdir/stresstool" "$family" "$stressdir" "$threads" "$seconds" 2>"$err")" || status=$?
+        if [[ -z "$output" ]]; then
+            echo "$family with $threads threads: stresstool failed with status $status, see $err"
+            failed=1
+            continue
+        fi
+        read -r _ _ _ rate failures signals <<<"$output"
+        [[ "$failures" -eq 0 ]] || failed=1
+        base="${base:-$rate}"
+        awk -v f="$family" -v t="$threads" -v t0="$first_threads" -v r="$rate" -v b="$base" -v n="$failures" -v s="$signals" \
+            'BEGIN { printf "%-9s %7d %12.0f %8.2f %9.0f%% %8d %8d\n", f, t, r, r / b, 100 * (r / b) / (t / t0), n, s }'
+    done
+done
+
+for sanitizer in $sanitizers; do
+    echo
+    printf "%-9s %-9s %7s  %s\n" sanitizer family threads result
+    for family in $families; do
+        for threads in $sanitizer_threads; do
+            err="$stressdir/stresstool-$sanitizer-$family-$threads.err"
+            result="ok"
+            if ! "$testdir/stresstool-$sanitizer" "$family" "$stressdir" "$threads" "$seconds" >/dev/null 2>"$err"; then
+                result="FAILED, see $err"
+                failed=1
+            fi
+            printf "%-9s %-9s %7d  %s\n" "$sanitizer" "$family" "$threads" "$result"
+        done
+    done
+done
+
+exit $failed
@@ -0,0 +1,270 @@
+// Calls one family of overridden functions (or all of them in turn) from many threads at once for a fixed time,
+// while another thread keeps interrupting the workers with a signal whose handler opens a file as well.
+// Every call checks that it reached the real file, so that races in the library show up as failures.
+// This tool is linked with path-mapping.c like the unit tests, so that it can be built with ThreadSanitizer
+// or AddressSanitizer (see test/stress.sh), and the programs it starts are copies of itself.
+//
+// DIR must contain virtual/, which PATH_MAPPING maps to real/, which contains the file "file",
+// the directory "dir" with another "file", and the symbolic link "link" to "file" (test/stress.sh creates them).
+//
+// Prints: family threads calls calls_per_second failures signals
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONTENT "stress\n"
+
+extern char **environ;
+
+static char file[PATH_MAX], dir[PATH_MAX], link_path[PATH_MAX], real_file[PATH_MAX], real_dir[PATH_MAX], self[PATH_MAX];
+static int stop = 0;
+static unsigned long signals_handled = 0, signal_failures = 0;
+
+// Returns true if fd is open and contains CONTENT, and closes it
+static int check_fd(int fd)
+{
+    char buffer[sizeof CONTENT];
+    ssize_t n = fd >= 0 ? read(fd, buffer, sizeof buffer) : -1;
+    if (fd >= 0) close(fd);
+    return n == sizeof CONTENT - 1 && memcmp(buffer, CONTENT, n) == 0;
+}
+
+static int wait_child(pid_t pid)
+{
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int call_open(void) { return check_fd(open(file, O_RDONLY)); }
+static int call_fopen(void)
+{
+    char buffer[sizeof CONTENT + 1];
+    FILE *f = fopen(file, "r");
+    if (f == NULL) return 0;
+    int ok = fgets(buffer, sizeof buffer, f) != NULL && strcmp(buffer, CONTENT) == 0;
+    fclose(f);
+    return ok;
+}
+// Also uses the table of directory fds, which all threads share
+static int call_openat(void)
+{
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    int ok = dirfd >= 0 && check_fd(openat(dirfd, "file", O_RDONLY));
+    if (dirfd >= 0) close(dirfd);
+    return ok;
+}
+static int call_stat(void) { struct stat st; return stat(file, &st) == 0 && st.st_size == sizeof CONTENT - 1; }
+static int call_lstat(void) { struct stat st; return lstat(link_path, &st) == 0 && S_ISLNK(st.st_mode); }
+static int call_fstatat(void) { struct stat st; return fstatat(AT_FDCWD, file, &st, 0) == 0 && st.st_size == sizeof CONTENT - 1; }
+static int call_access(void) { return access(file, R_OK) == 0; }
+static int call_readdir(void)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) return 0;
+    int found = 0;
+    for (struct dirent *entry; (entry = readdir(d)) != NULL; ) {
+        if (strcmp(entry->d_name, "file") == 0) found = 1;
+    }
+    closedir(d);
+    return found;
+}
+static int call_realpath(void) { char resolved[PATH_MAX]; return realpath(file, resolved) != NULL && strcmp(resolved, real_file) == 0; }
+static int call_readlink(void) { char buffer[16]; return readlink(link_path, buffer, sizeof buffer) == 4 && memcmp(buffer, "file", 4) == 0; }
+// syscall() bypasses the mapping without PATH_MAPPING_SECCOMP, so this only checks that the override passes it on
+static int call_syscall(void) { return check_fd(syscall(SYS_openat, AT_FDCWD, real_file, O_RDONLY)); }
+// The current directory is shared by all threads, but they all change into the same one
+static int call_cwd(void)
+{
+    char buffer[PATH_MAX];
+    return chdir(dir) == 0 && getcwd(buffer, sizeof buffer) != NULL && (strcmp(buffer, dir) == 0 || strcmp(buffer, real_dir) == 0);
+}
+static int call_fork(void)
+{
+    pid_t pid = fork();
+    if (pid == 0) _exit(call_open() ? 0 : 1);
+    return wait_child(pid);
+}
+// The children of vfork, exec and spawn are copies of this tool with --child, which open the file with their own library
+static int call_vfork(void)
+{
+    char *argv[] = { self, "--child", file, NULL };
+    pid_t pid = vfork();
+    if (pid == 0) {
+        execve(self, argv, environ);
+        _exit(127);
+    }
+    return wait_child(pid);
+}
+static int call_exec(void)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(self, self, "--child", file, (char *)NULL);
+        _exit(127);
+    }
+    return wait_child(pid);
+}
+static int call_spawn(void)
+{
+    char *argv[] = { self, "--child", file, NULL };
+    pid_t pid;
+    return posix_spawn(&pid, self, NULL, NULL, argv, environ) == 0 && wait_child(pid);
+}
+
+static const struct {
+    const char *name;
+    int (*call)(void);
+} families[] = {
+    { "open", call_open },
+    { "fopen", call_fopen },
+    { "openat", call_openat },
+    { "stat", call_stat },
+    { "lstat", call_lstat },
+    { "fstatat", call_fstatat },
+    { "access", call_access },
+    { "readdir", call_readdir },
+    { "realpath", call_realpath },
+    { "readlink", call_readlink },
+    { "syscall", call_syscall },
+    { "cwd", call_cwd },
+    { "fork", call_fork },
+    { "vfork", call_vfork },
+    { "exec", call_exec },
+    { "spawn", call_spawn },
+};
+#define N_FAMILIES (int)(sizeof families / sizeof families[0])
+
+static void handler(int sig)
+{
+    int saved_errno = errno;
+    if (call_open()) {
+        __atomic_add_fetch(&signals_handled, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&signal_failures, 1, __ATOMIC_RELAXED);
+    }
+    errno = saved_errno;
+}
+
+struct worker {
+    pthread_t thread;
+    int (*call)(void);          // NULL for all families in turn
+    unsigned long calls, failures;
+    char padding[64];           // Keeps the counters of different workers out of the same cache line
+};
+
+static struct worker *workers;
+static int n_workers;
+static pthread_barrier_t barrier;
+
+static void *work(void *arg)
+{
+    struct worker *worker = arg;
+    unsigned family = worker - workers;
+    pthread_barrier_wait(&barrier);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        int (*call)(void) = worker->call != NULL ? worker->call : families[family++ % N_FAMILIES].call;
+        if (!call()) worker->failures++;
+        worker->calls++;
+    }
+    return NULL;
+}
+
+// Sends SIGUSR1 to one worker after the other until the workers stop
+static void *signal_workers(void *arg)
+{
+    struct timespec delay = { 0, 100000 };
+    for (int i = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); i = (i + 1) % n_workers) {
+        pthread_kill(workers[i].thread, SIGUSR1);
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--child") == 0) {
+        return check_fd(open(argv[2], O_RDONLY)) ? 0 : 1;
+    }
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s [family|all] [dir] [threads] [seconds]\n", argv[0]);
+        fprintf(stderr, "Families:");
+        for (int i = 0; i < N_FAMILIES; i++) fprintf(stderr, " %s", families[i].name);
+        fprintf(stderr, "\n");
+        return 2;
+    }
+    int (*call)(void) = NULL;
+    for (int i = 0; i < N_FAMILIES; i++) {
+        if (strcmp(families[i].name, argv[1]) == 0) call = families[i].call;
+    }
+    if (call == NULL && strcmp(argv[1], "all") != 0) {
+        fprintf(stderr, "Unknown function family %s\n", argv[1]);
+        return 2;
+    }
+    snprintf(file, sizeof file, "%s/virtual/file", argv[2]);
+    snprintf(dir, sizeof dir, "%s/virtual/dir", argv[2]);
+    snprintf(link_path, sizeof link_path, "%s/virtual/link", argv[2]);
+    snprintf(real_file, sizeof real_file, "%s/real/file", argv[2]);
+    snprintf(real_dir, sizeof real_dir, "%s/real/dir", argv[2]);
+    ssize_t length = readlink("/proc/self/exe", self, sizeof self - 1);
+    n_workers = atoi(argv[3]);
+    double seconds = atof(argv[4]);
+    if (length <= 0 || n_workers <= 0 || seconds <= 0) return 2;
+    self[length] = '\0';
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    workers = calloc(n_workers, sizeof *workers);
+    if (workers == NULL) return 2;
+    pthread_barrier_init(&barrier, NULL, n_workers + 1);
+    for (int i = 0; i < n_workers; i++) {
+        workers[i].call = call;
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "Can not create %d threads\n", n_workers);
+            return 2;
+        }
+    }
+    pthread_t signaller;
+    pthread_barrier_wait(&barrier);
+    double start = now();
+    pthread_create(&signaller, NULL, signal_workers, NULL);
+    struct timespec duration = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_join(signaller, NULL);
+    unsigned long calls = 0, failures = 0;
+    for (int i = 0; i < n_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+        calls += workers[i].calls;
+        failures += workers[i].failures;
+    }
+    double elapsed = now() - start;
+    failures += signal_failures;
+
+    printf("%s %d %lu %.0f %lu %lu\n", argv[1], n_workers, calls, calls / elapsed, failures, signals_handled);
+    return failures > 0 ? 1 : 0;
+}
@@ -1,6 +1,34 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 int path_prefix_matches(const char *path, const char *prefix);
+int path_mapping_load(const char *(*map)[2], int length);
+const char *fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size);
+const char *reverse_fix_path(const char *function_name, const char *path, char *new_path, size_t new_path_size);
+void *path_mapping_compile_index(const char *(*map)[2], int length, size_t *size);
+int path_mapping_load_index(const char *filename);
+int path_mapping_watch(const char *filename);
+
+// Returns the mapped path as a string that can be compared with strcmp
+static const char *map(const char *path) {
+    static char buffer[4096];
+    const char *result = fix_path("test", path, buffer, sizeof buffer);
+    return result == NULL ? "(null)" : result;
+}
+
+// Returns the path mapped back to the virtual path
+static const char *unmap(const char *path) {
+    static char buffer[4096];
+    return reverse_fix_path("test", path, buffer, sizeof buffer);
+}
 
 void test_path_prefix_matches() {
     assert(path_prefix_matches("/example/dir/", "/example/dir/") != 0);
@@ -22,7 +50,537 @@ void test_path_prefix_matches() {
     assert(path_prefix_matches("/e", "/example") == 0);
 }
 
+void test_fix_path() {
+    const char *mapping[][2] = {
+        { "/example/dir", "/dest/dir" },
+        { "/example/dir/sub/", "/dest/sub" },
+        { "/example/dir/sub/deeper", "/dest/deeper/" },
+        { "/example/dir", "/ignored/duplicate" },
+        { "/other", "/" },
+    };
+    assert(path_mapping_load(mapping, sizeof mapping / sizeof mapping[0]) == 0);
+
+    assert(strcmp(map("/example/dir"), "/dest/dir") == 0);
+    assert(strcmp(map("/example/dir/"), "/dest/dir/") == 0);
+    assert(strcmp(map("/example/dir/file"), "/dest/dir/file") == 0);
+    assert(strcmp(map("/example/dirty/file"), "/example/dirty/file") == 0);
+    assert(strcmp(map("/example"), "/example") == 0);
+    assert(strcmp(map("example/dir"), "example/dir") == 0);
+    assert(strcmp(map("/example//dir"), "/example//dir") == 0);
+
+    // The longest matching prefix wins, regardless of the order of the mappings
+    assert(strcmp(map("/example/dir/sub"), "/dest/sub") == 0);
+    assert(strcmp(map("/example/dir/sub/file"), "/dest/sub/file") == 0);
+    assert(strcmp(map("/example/dir/subway"), "/dest/dir/subway") == 0);
+    assert(strcmp(map("/example/dir/sub/deeper/file"), "/dest/deeper//file") == 0);
+
+    // The destination is used literally, even if it has trailing slashes
+    assert(strcmp(map("/other"), "/") == 0);
+    assert(strcmp(map("/other/file"), "//file") == 0);
+
+    assert(fix_path("test", NULL, NULL, 0) == NULL);
+
+    // Paths which do not fit into the buffer are not mapped
+    char small[12];
+    assert(strcmp(fix_path("test", "/example/dir/file", small, sizeof small), "/example/dir/file") == 0);
+
+    // A root prefix matches all absolute paths, but not relative ones
+    const char *root_mapping[][2] = { { "/", "/root" } };
+    assert(path_mapping_load(root_mapping, 1) == 0);
+    assert(strcmp(map("/"), "/root/") == 0);
+    assert(strcmp(map("/file"), "/root/file") == 0);
+    assert(strcmp(map("file"), "file") == 0);
+
+    // Relative prefixes only match relative paths
+    const char *relative_mapping[][2] = { { "relative/dir", "/dest" } };
+    assert(path_mapping_load(relative_mapping, 1) == 0);
+    assert(strcmp(map("relative/dir/file"), "/dest/file") == 0);
+    assert(strcmp(map("/relative/dir/file"), "/relative/dir/file") == 0);
+
+    assert(path_mapping_load(mapping, 0) == 0);
+    assert(strcmp(map("/example/dir"), "/example/dir") == 0);
+}
+
+void test_fix_path_filter() {
+    // Many prefixes with one, two and more components, to make sure that
+    // the filter used to reject paths early never rejects a matching path
+    static char prefixes[300][64], dests[300][64];
+    static const char *mapping[300][2];
+    for (int i = 0; i < 300; i++) {
+        switch (i % 3) {
+            case 0: snprintf(prefixes[i], sizeof prefixes[i], "/top%d", i); break;
+            case 1: snprintf(prefixes[i], sizeof prefixes[i], "/opt/pkg%d", i); break;
+            case 2: snprintf(prefixes[i], sizeof prefixes[i], "/usr/share/pkg%d/data/", i); break;
+        }
+        snprintf(dests[i], sizeof dests[i], "/dest%d", i);
+        mapping[i][0] = prefixes[i];
+        mapping[i][1] = dests[i];
+    }
+    assert(path_mapping_load(mapping, 300) == 0);
+
+    char path[128], expected[128];
+    for (int i = 0; i < 300; i++) {
+        assert(snprintf(path, sizeof path, "%s/file", prefixes[i]) < (int)sizeof path);
+        snprintf(expected, sizeof expected, "/dest%d%s", i, i % 3 == 2 ? "//file" : "/file");
+        assert(strcmp(map(path), expected) == 0);
+    }
+    assert(strcmp(map("/opt"), "/opt") == 0);
+    assert(strcmp(map("/opt/pkg2"), "/opt/pkg2") == 0);
+    assert(strcmp(map("/usr/share/pkg2/data"), "/dest2") == 0);
+    assert(strcmp(map("/usr/share/pkg2"), "/usr/share/pkg2") == 0);
+    assert(strcmp(map("/usr/lib/python3/os.py"), "/usr/lib/python3/os.py") == 0);
+    assert(strcmp(map("relative/top0"), "relative/top0") == 0);
+    assert(strcmp(map(""), "") == 0);
+}
+
+// Writes size bytes of data to a new temporary file and returns its name
+static const char *write_temp_file(const void *data, size_t size) {
+    static char filename[] = "/tmp/test-pathmatching-XXXXXX";
+    strcpy(filename + strlen(filename) - 6, "XXXXXX");
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    assert(write(fd, data, size) == (ssize_t)size);
+    close(fd);
+    return filename;
+}
+
+void test_index_file() {
+    const char *mapping[][2] = {
+        { "/with:colon", "/dest/colon" },
+        { "/example/dir", "/dest/dir" },
+        { "/example/dir/sub", "/dest/sub" },
+    };
+    size_t size = 0;
+    char *index = path_mapping_compile_index(mapping, 3, &size);
+    assert(index != NULL);
+
+    const char *filename = write_temp_file(index, size);
+    assert(path_mapping_load_index(filename) == 0);
+    unlink(filename); // The mapping stays valid
+    assert(strcmp(map("/with:colon/file"), "/dest/colon/file") == 0);
+    assert(strcmp(map("/example/dir/file"), "/dest/dir/file") == 0);
+    assert(strcmp(map("/example/dir/sub/file"), "/dest/sub/file") == 0);
+    assert(strcmp(map("/example/other"), "/example/other") == 0);
+
+    // Truncated or modified files are rejected, and the old mappings are kept
+    filename = write_temp_file(index, size - 1);
+    assert(path_mapping_load_index(filename) != 0);
+    unlink(filename);
+    index[0] ^= 1;
+    filename = write_temp_file(index, size);
+    assert(path_mapping_load_index(filename) != 0);
+    unlink(filename);
+    assert(path_mapping_load_index("/nonexistent/index") != 0);
+    assert(strcmp(map("/with:colon/file"), "/dest/colon/file") == 0);
+
+    // Replacing a mapped table with a compiled one unmaps the file
+    assert(path_mapping_load(mapping, 1) == 0);
+    assert(strcmp(map("/example/dir/file"), "/example/dir/file") == 0);
+    free(index);
+}
+
+// Every byte of an index file is damaged in turn. The file must either be rejected,
+// or the lookups must stay within it.
+void test_damaged_index_file() {
+    const char *mapping[][2] = {
+        { "/example/dir", "/dest/dir" },
+        { "/example/dir", "/dest/layer" },
+        { "/example/dir/sub", "/dest/sub" },
+        { "/example/*.d", "/dest/$1" },
+        { "!/example/dir/private", "" },
+    };
+    size_t size = 0;
+    char *index = path_mapping_compile_index(mapping, sizeof mapping / sizeof mapping[0], &size);
+    assert(index != NULL);
+    int rejected = 0;
+    for (size_t i = 0; i < size; i++) {
+        index[i] ^= 0xff;
+        const char *filename = write_temp_file(index, size);
+        if (path_mapping_load_index(filename) != 0) rejected++;
+        unlink(filename);
+        map("/example/dir/sub/file");
+        map("/example/app.d/file");
+        map("/example/dir/private/file");
+        unmap("/dest/dir/file");
+        index[i] ^= 0xff;
+    }
+    assert(rejected > 0);
+    assert(path_mapping_load(mapping, 1) == 0);
+    free(index);
+}
+
+static int readers_running = 1;
+
+static void *reload_reader(void *arg) {
+    long *lookups = arg;
+    char buffer[4096];
+    while (__atomic_load_n(&readers_running, __ATOMIC_RELAXED)) {
+        const char *result = fix_path("test", "/reload/file", buffer, sizeof buffer);
+        assert(strcmp(result, "/dest_a/file") == 0 || strcmp(result, "/dest_b/file") == 0);
+        __atomic_add_fetch(lookups, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Replaces filename atomically, like path-mapping-compile does, and waits until the watcher has loaded it
+static void replace_and_wait(const char *filename, const void *index, size_t size, const char *expected) {
+    char temp[4096];
+    snprintf(temp, sizeof temp, "%s.tmp", filename);
+    FILE *file = fopen(temp, "w");
+    assert(file != NULL && fwrite(index, 1, size, file) == size && fclose(file) == 0);
+    assert(rename(temp, filename) == 0);
+    for (int i = 0; i < 2000 && strcmp(map("/reload/file"), expected) != 0; i++) {
+        struct timespec delay = { 0, 1000000 };
+        nanosleep(&delay, NULL);
+    }
+    assert(strcmp(map("/reload/file"), expected) == 0);
+}
+
+// The watcher can not be stopped, so the later tests run with the table reloadable and the watcher active
+void test_reload() {
+    const char *mapping_a[][2] = { { "/reload", "/dest_a" }, { "/other", "/x" } };
+    const char *mapping_b[][2] = { { "/reload", "/dest_b" } };
+    size_t size_a, size_b;
+    char *index_a = path_mapping_compile_index(mapping_a, 2, &size_a);
+    char *index_b = path_mapping_compile_index(mapping_b, 1, &size_b);
+    assert(index_a != NULL && index_b != NULL);
+
+    char directory[] = "/tmp/test-pathmatching-XXXXXX", filename[4096];
+    assert(mkdtemp(directory) != NULL);
+    snprintf(filename, sizeof filename, "%s/rules.idx", directory);
+    FILE *file = fopen(filename, "w");
+    assert(file != NULL && fwrite(index_a, 1, size_a, file) == size_a && fclose(file) == 0);
+    assert(path_mapping_watch(filename) == 0);
+    assert(path_mapping_load_index(filename) == 0);
+    assert(strcmp(map("/reload/file"), "/dest_a/file") == 0);
+
+    // Old tables are unmapped while the readers are running, so any missed reader would crash
+    pthread_t threads[4];
+    long lookups[4] = { 0 };
+    for (int t = 0; t < 4; t++) assert(pthread_create(&threads[t], NULL, reload_reader, &lookups[t]) == 0);
+    for (int i = 0; i < 20; i++) {
+        replace_and_wait(filename, index_b, size_b, "/dest_b/file");
+        replace_and_wait(filename, index_a, size_a, "/dest_a/file");
+    }
+    __atomic_store_n(&readers_running, 0, __ATOMIC_RELAXED);
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        assert(lookups[t] > 0);
+    }
+
+    // A broken file is ignored, and the last table stays in use
+    replace_and_wait(filename, index_b, size_b / 2, "/dest_a/file");
+
+    unlink(filename);
+    rmdir(directory);
+    free(index_a);
+    free(index_b);
+}
+
+static void *replace_reader(void *arg) {
+    long *lookups = arg;
+    char buffer[4096];
+    while (__atomic_load_n(&readers_running, __ATOMIC_RELAXED)) {
+        const char *result = fix_path("test", "/replace/file", buffer, sizeof buffer);
+        assert(strcmp(result, "/dest_a/file") == 0 || strcmp(result, "/dest_b/file") == 0);
+        __atomic_add_fetch(lookups, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Replaces the table back to back while readers look up paths. Each old table is freed at once, so a reader
+// which the writer did not wait for uses freed memory (see the builds with the sanitizers in the Makefile).
+// Runs after test_reload(), which makes the table reloadable.
+void test_replace() {
+    const char *mapping_a[][2] = { { "/replace", "/dest_a" } };
+    const char *mapping_b[][2] = { { "/replace", "/dest_b" }, { "/other", "/x" } };
+    assert(path_mapping_load(mapping_a, 1) == 0);
+    __atomic_store_n(&readers_running, 1, __ATOMIC_RELAXED);
+    pthread_t threads[4];
+    long lookups[4] = { 0 };
+    for (int t = 0; t < 4; t++) assert(pthread_create(&threads[t], NULL, replace_reader, &lookups[t]) == 0);
+    for (int i = 0; i < 200; i++) {
+        assert(path_mapping_load(mapping_b, 2) == 0);
+        assert(path_mapping_load(mapping_a, 1) == 0);
+    }
+    // With one core, the readers may not have started yet
+    for (int t = 0; t < 4; t++) {
+        while (__atomic_load_n(&lookups[t], __ATOMIC_RELAXED) == 0) sched_yield();
+    }
+    __atomic_store_n(&readers_running, 0, __ATOMIC_RELAXED);
+    for (int t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+        assert(lookups[t] > 0);
+    }
+}
+
+static int exit_handler_ran = 0;
+
+static void exit_handler(int sig) {
+    char buffer[4096];
+    assert(strcmp(fix_path("test", "/exit/file", buffer, sizeof buffer), "/dest/file") == 0);
+    exit_handler_ran = 1;
+}
+
+// Runs after the destructor of the per-thread path cache, because its key was created first
+static void exit_destructor(void *arg) {
+    raise(SIGUSR1);
+}
+
+static void *exit_thread(void *arg) {
+    pthread_key_t *key = arg;
+    map("/exit/file");
+    pthread_setspecific(*key, key);
+    return NULL;
+}
+
+// A signal handler which runs while a thread exits must not use the released cache of the thread
+void test_thread_exit() {
+    const char *mapping[][2] = { { "/exit", "/dest" } };
+    assert(path_mapping_load(mapping, 1) == 0);
+    map("/exit/file"); // Creates the key of the path cache
+    struct sigaction action = { .sa_handler = exit_handler }, old_action;
+    assert(sigaction(SIGUSR1, &action, &old_action) == 0);
+    pthread_key_t key;
+    assert(pthread_key_create(&key, exit_destructor) == 0);
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, exit_thread, &key) == 0);
+    pthread_join(thread, NULL);
+    assert(exit_handler_ran);
+    pthread_key_delete(key);
+    sigaction(SIGUSR1, &old_action, NULL);
+}
+
+static void touch(const char *dir, const char *name) {
+    char path[4096];
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    FILE *file = fopen(path, "w");
+    assert(file != NULL);
+    fclose(file);
+}
+
+void test_layers() {
+    char top[] = "/tmp/test-layers-XXXXXX", base[] = "/tmp/test-layers-XXXXXX";
+    assert(mkdtemp(top) != NULL && mkdtemp(base) != NULL);
+    touch(top, "both");
+    touch(base, "both");
+    touch(base, "base_only");
+    const char *mapping[][2] = {
+        { "/layers", top },
+        { "/layers/single", "/dest" },
+        { "/layers", base },
+    };
+    assert(path_mapping_load(mapping, sizeof mapping / sizeof mapping[0]) == 0);
+
+    char expected[4096];
+    // The first layer which contains the file wins
+    snprintf(expected, sizeof expected, "%s/both", top);
+    assert(strcmp(map("/layers/both"), expected) == 0);
+    snprintf(expected, sizeof expected, "%s/base_only", base);
+    assert(strcmp(map("/layers/base_only"), expected) == 0);
+    // New files are created in the first layer
+    snprintf(expected, sizeof expected, "%s/missing", top);
+    assert(strcmp(map("/layers/missing"), expected) == 0);
+    // Rules with a single destination are not affected
+    assert(strcmp(map("/layers/single/file"), "/dest/file") == 0);
+
+    // The result is cached, so a new file in the first layer is only seen after PATH_MAPPING_CACHE_TTL
+    touch(top, "base_only");
+    snprintf(expected, sizeof expected, "%s/base_only", base);
+    assert(strcmp(map("/layers/base_only"), expected) == 0);
+    usleep(1100 * 1000);
+    snprintf(expected, sizeof expected, "%s/base_only", top);
+    assert(strcmp(map("/layers/base_only"), expected) == 0);
+
+    char command[4096];
+    snprintf(command, sizeof command, "rm -r %s %s", top, base);
+    assert(system(command) == 0);
+}
+
+void test_reverse() {
+    const char *mapping[][2] = {
+        { "/example/dir", "/dest/dir" },
+        { "/example/dir/sub", "/dest/sub/" },
+        { "/layers", "/dest/top" },
+        { "/layers", "/dest/base" },
+        { "/second", "/dest/dir" },
+        { "relative", "/dest/relative" },
+        { "/root", "/" },
+    };
+    assert(path_mapping_load(mapping, sizeof mapping / sizeof mapping[0]) == 0);
+
+    assert(strcmp(unmap("/dest/dir"), "/example/dir") == 0);
+    assert(strcmp(unmap("/dest/dir/file"), "/example/dir/file") == 0);
+    assert(strcmp(unmap("/dest/sub/file"), "/example/dir/sub/file") == 0);
+    assert(strcmp(unmap("/dest/dirty"), "/root/dest/dirty") == 0);
+    // All layers map back to their prefix
+    assert(strcmp(unmap("/dest/top/file"), "/layers/file") == 0);
+    assert(strcmp(unmap("/dest/base/file"), "/layers/file") == 0);
+    // The first prefix wins, and relative prefixes are never used
+    assert(strcmp(unmap("/dest/relative/file"), "/root/dest/relative/file") == 0);
+    // The root destination matches everything else
+    assert(strcmp(unmap("/usr/bin"), "/root/usr/bin") == 0);
+    assert(strcmp(unmap("relative/file"), "relative/file") == 0);
+
+    // Paths which do not fit into the buffer are not mapped
+    char small[12];
+    assert(strcmp(reverse_fix_path("test", "/dest/dir/file", small, sizeof small), "/dest/dir/file") == 0);
+
+    const char *no_root[][2] = { { "/example/dir", "/dest/dir" } };
+    assert(path_mapping_load(no_root, 1) == 0);
+    assert(strcmp(unmap("/dest/dirty"), "/dest/dirty") == 0);
+    assert(strcmp(unmap("/dest"), "/dest") == 0);
+}
+
+void test_patterns() {
+    const char *mapping[][2] = {
+        { "/home/*/.cache/app", "/scratch/$1/app" },
+        { "/opt/app-*/share", "/data/share-$1" },
+        { "/opt/app-1.0/share/doc", "/docs" },
+        { "/src/**/include", "/include/$1" },
+        { "/v?/[a-c]*", "/x$2$1$3" },
+        { "/lit\\*/[!.]*", "/lit/$1$2" },
+        { "!/home/admin", "" },
+        { "/home", "/users" },
+        { "/data/**", "/all" },
+    };
+    assert(path_mapping_load(mapping, sizeof mapping / sizeof mapping[0]) == 0);
+
+    // Captures are inserted into the destination, and the rest of the path is appended
+    assert(strcmp(map("/home/bob/.cache/app"), "/scratch/bob/app") == 0);
+    assert(strcmp(map("/home/bob/.cache/app/db/file"), "/scratch/bob/app/db/file") == 0);
+    assert(strcmp(map("/opt/app-2.1/share/icons"), "/data/share-2.1/icons") == 0);
+    assert(strcmp(map("/opt/app-/share"), "/data/share-") == 0);
+    // Patterns match whole components, and * never matches a slash
+    assert(strcmp(map("/opt/app-2.1/shared"), "/opt/app-2.1/shared") == 0);
+    assert(strcmp(map("/opt/app-2/1/share"), "/opt/app-2/1/share") == 0);
+    // ** matches any number of components
+    assert(strcmp(map("/src/include/a.h"), "/include//a.h") == 0); // $1 is empty
+    assert(strcmp(map("/src/lib/include/a.h"), "/include/lib/a.h") == 0);
+    assert(strcmp(map("/src/a/b/c/include"), "/include/a/b/c") == 0);
+    assert(strcmp(map("/src/a/b/c/includes"), "/src/a/b/c/includes") == 0);
+    assert(strcmp(map("/data"), "/all") == 0);
+    assert(strcmp(map("/data/file"), "/all/file") == 0);
+    // ?, sets and escapes
+    assert(strcmp(map("/v1/beta/file"), "/xb1eta/file") == 0);
+    assert(strcmp(map("/v1/delta"), "/v1/delta") == 0);
+    assert(strcmp(map("/v12/beta"), "/v12/beta") == 0);
+    assert(strcmp(map("/lit*/file/x"), "/lit/file/x") == 0);
+    assert(strcmp(map("/lit*/.hidden"), "/lit*/.hidden") == 0);
+    assert(strcmp(map("/litx/file"), "/litx/file") == 0);
+
+    // The longest match wins, whether it is a literal prefix or a pattern
+    assert(strcmp(map("/opt/app-1.0/share/doc/index"), "/docs/index") == 0);
+    assert(strcmp(map("/opt/app-1.0/share/man"), "/data/share-1.0/man") == 0);
+    assert(strcmp(map("/home/bob/file"), "/users/bob/file") == 0);
+    // Exclusions win over literal prefixes of the same length, but not over longer matches
+    assert(strcmp(map("/home/admin/file"), "/home/admin/file") == 0);
+    assert(strcmp(map("/home/admin"), "/home/admin") == 0);
+    assert(strcmp(map("/home/admin/.cache/app/x"), "/scratch/admin/app/x") == 0);
+    assert(strcmp(map("/home/administrator"), "/users/administrator") == 0);
+
+    // Results which do not fit are not mapped
+    char small[12];
+    assert(strcmp(fix_path("test", "/home/bob/.cache/app", small, sizeof small), "/home/bob/.cache/app") == 0);
+    // Patterns are not mapped back
+    assert(strcmp(unmap("/scratch/bob/app"), "/scratch/bob/app") == 0);
+
+    // Many patterns are still looked up in one pass
+    static char prefixes[1000][64], dests[1000][64];
+    static const char *many[1000][2];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(prefixes[i], sizeof prefixes[i], "/home/*/.cache/app%d", i);
+        snprintf(dests[i], sizeof dests[i], "/scratch/$1/app%d", i);
+        many[i][0] = prefixes[i];
+        many[i][1] = dests[i];
+    }
+    assert(path_mapping_load(many, 1000) == 0);
+    assert(strcmp(map("/home/bob/.cache/app123/x"), "/scratch/bob/app123/x") == 0);
+    assert(strcmp(map("/home/bob/.cache/app1234/x"), "/home/bob/.cache/app1234/x") == 0);
+
+    // Patterns also work in index files
+    size_t size;
+    void *index = path_mapping_compile_index(mapping, sizeof mapping / sizeof mapping[0], &size);
+    assert(index != NULL);
+    const char *filename = write_temp_file(index, size);
+    free(index);
+    assert(path_mapping_load_index(filename) == 0);
+    assert(strcmp(map("/src/lib/include/a.h"), "/include/lib/a.h") == 0);
+    assert(strcmp(map("/home/admin/file"), "/home/admin/file") == 0);
+    unlink(filename);
+}
+
+void test_profiles() {
+    char uid_header[32], exe[4096], name_header[4096], path_header[4096];
+    snprintf(uid_header, sizeof uid_header, "@uid=%u", (unsigned)getuid());
+    ssize_t length = readlink("/proc/self/exe", exe, sizeof exe - 1);
+    assert(length > 0);
+    exe[length] = '\0';
+    // The basename with its last character as a wildcard, and the whole path below any directories
+    snprintf(name_header, sizeof name_header, "@exe=%s", strrchr(exe, '/') + 1);
+    name_header[strlen(name_header) - 1] = '?';
+    snprintf(path_header, sizeof path_header, "@exe=/**/%s", strrchr(exe, '/') + 1);
+    const char *mapping[][2] = {
+        { "/all", "/dest/all" },
+        { "@exe=no-such-program", "" },
+        { "/other", "/dest/other" },
+        { "@exe=no-such-program", "" },
+        { name_header, "" },
+        { "/test", "/dest/test" },
+        { "/all/test", "/dest/all-test" },
+        { path_header, "" },
+        { "/full", "/dest/full" },
+        { "@cgroup=/no/such/cgroup", "" },
+        { "/cgroup", "/dest/cgroup" },
+        { uid_header, "" },
+        { "/uid", "/dest/uid" },
+        { "@", "" },
+        { "/again", "/dest/again" },
+    };
+    assert(path_mapping_load(mapping, sizeof mapping / sizeof mapping[0]) == 0);
+    assert(strcmp(map("/all/file"), "/dest/all/file") == 0);
+    assert(strcmp(map("/other/file"), "/other/file") == 0);
+    // Consecutive headers are alternatives, and the executable is matched by its basename or its whole path
+    assert(strcmp(map("/test/file"), "/dest/test/file") == 0);
+    assert(strcmp(map("/all/test/file"), "/dest/all-test/file") == 0);
+    assert(strcmp(map("/full/file"), "/dest/full/file") == 0);
+    assert(strcmp(map("/cgroup/file"), "/cgroup/file") == 0);
+    assert(strcmp(map("/uid/file"), "/dest/uid/file") == 0);
+    assert(strcmp(map("/again/file"), "/dest/again/file") == 0);
+
+    // Without any rules which apply, nothing is mapped
+    const char *none[][2] = {
+        { "@exe=no-such-program", "" },
+        { "/all", "/dest/all" },
+    };
+    assert(path_mapping_load(none, 2) == 0);
+    const char *path = "/all/file";
+    assert(map(path) == path);
+
+    // Index files contain all sections
+    size_t size;
+    void *index = path_mapping_compile_index(mapping, sizeof mapping / sizeof mapping[0], &size);
+    assert(index != NULL);
+    const char *filename = write_temp_file(index, size);
+    free(index);
+    assert(path_mapping_load_index(filename) == 0);
+    assert(strcmp(map("/test/file"), "/dest/test/file") == 0);
+    assert(strcmp(map("/other/file"), "/other/file") == 0);
+    unlink(filename);
+}
+
 int main() {
     test_path_prefix_matches();
+    test_fix_path();
+    test_fix_path_filter();
+    test_index_file();
+    test_damaged_index_file();
+    test_reload();
+    test_replace();
+    test_thread_exit();
+    test_layers();
+    test_reverse();
+    test_patterns();
+    test_profiles();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,20 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <link.h>
+#include <stdio.h>
+
+// Loads each argument with dlopen() and prints the path of the library, or "not found"
+int main(int argc, char **argv) {
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        void *handle = dlopen(argv[i], RTLD_NOW | RTLD_LOCAL);
+        struct link_map *map;
+        if (handle != NULL && dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0) {
+            printf("%s\n", map->l_name);
+        } else {
+            printf("not found\n");
+            status = 1;
+        }
+    }
+    return status;
+}
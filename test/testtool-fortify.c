@@ -0,0 +1,37 @@
+#define _GNU_SOURCE
+#define _FORTIFY_SOURCE 2
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Uses the _FORTIFY_SOURCE variants __open_2(), __realpath_chk(), __readlink_chk() and __getcwd_chk().
+// Prints the file argv[1], the real path of argv[1], the target of the link argv[2] and the cwd.
+int main(int argc, const char **argv)
+{
+    if (argc < 3) {
+        return 1;
+    }
+    // Not constant, so that the checking variants are used
+    int flags = argc > 3 ? atoi(argv[3]) : O_RDONLY;
+    size_t size = argc > 4 ? (size_t)atoi(argv[4]) : PATH_MAX;
+    int fd = open(argv[1], flags);
+    if (fd < 0) return 2;
+    char buffer[PATH_MAX];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof buffer)) > 0) {
+        fwrite(buffer, 1, length, stdout);
+    }
+    close(fd);
+
+    if (realpath(argv[1], buffer) == NULL) return 3;
+    printf("%s\n", buffer);
+    length = readlink(argv[2], buffer, size - 1);
+    if (length < 0) return 4;
+    buffer[length] = '\0';
+    printf("%s\n", buffer);
+    if (getcwd(buffer, size) == NULL) return 5;
+    printf("%s\n", buffer);
+    return 0;
+}
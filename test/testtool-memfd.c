@@ -0,0 +1,52 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+// Runs the program argv[1] once for every byte of the table in PATH_MAPPING_TABLE, each time with a copy of
+// the table where that byte is damaged. The output of the program is discarded. Prints how many runs crashed.
+int main(int argc, char **argv)
+{
+    const char *variable = getenv("PATH_MAPPING_TABLE");
+    int fd;
+    unsigned long long inode, hash;
+    if (argc < 2 || variable == NULL || sscanf(variable, "%d:%llu:%llx", &fd, &inode, &hash) != 3) return 1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 2;
+    unsigned char *table = malloc(st.st_size);
+    if (table == NULL || pread(fd, table, st.st_size, 0) != st.st_size) return 3;
+
+    int crashed = 0;
+    struct stat damaged_st;
+    for (off_t i = 0; i < st.st_size; i++) {
+        table[i] ^= 0xff;
+        int damaged = memfd_create("damaged-table", MFD_ALLOW_SEALING);
+        if (damaged < 0 || write(damaged, table, st.st_size) != st.st_size
+                || fcntl(damaged, F_ADD_SEALS, SEALS) != 0 || fstat(damaged, &damaged_st) != 0) {
+            return 4;
+        }
+        char damaged_variable[64];
+        snprintf(damaged_variable, sizeof damaged_variable, "%d:%llu:%llx", damaged, (unsigned long long)damaged_st.st_ino, hash);
+        setenv("PATH_MAPPING_TABLE", damaged_variable, 1);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            if (null < 0 || dup2(null, 1) < 0) _exit(126);
+            execvp(argv[1], argv + 1);
+            _exit(127);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid) return 5;
+        if (WIFSIGNALED(status)) crashed++;
+        close(damaged);
+        table[i] ^= 0xff;
+    }
+    printf("%d crashed\n", crashed);
+    return 0;
+}
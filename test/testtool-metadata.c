@@ -0,0 +1,54 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Creates the file argv[1] with creat(), truncates it, and uses statx(), name_to_handle_at() and the xattr functions on it.
+// Then runs the program argv[2] with execveat(), if it is given.
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        return 1;
+    }
+    const char *path = argv[1];
+    int fd = creat(path, 0644);
+    if (fd < 0 || write(fd, "content\n", 8) != 8) return 2;
+    close(fd);
+    if (truncate(path, 4) != 0) return 3;
+
+    struct statx stx;
+    if (statx(AT_FDCWD, path, 0, STATX_SIZE, &stx) != 0) return 4;
+    printf("size %llu\n", (unsigned long long)stx.stx_size);
+
+    struct file_handle *handle = malloc(sizeof *handle + MAX_HANDLE_SZ);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mount_id;
+    // Some file systems do not support file handles, but the file must be found
+    if (name_to_handle_at(AT_FDCWD, path, handle, &mount_id, 0) != 0 && errno == ENOENT) return 5;
+    free(handle);
+
+    // Some file systems do not support user attributes
+    if (setxattr(path, "user.test", "value", 5, 0) == 0) {
+        char list[256], value[16];
+        ssize_t length = listxattr(path, list, sizeof list);
+        if (length <= 0 || memmem(list, length, "user.test", 10) == NULL) return 6;
+        if (getxattr(path, "user.test", value, sizeof value) != 5) return 7;
+        if (removexattr(path, "user.test") != 0) return 8;
+    } else if (errno != ENOTSUP && errno != EPERM) {
+        return 9;
+    }
+    printf("xattr\n");
+    fflush(stdout);
+
+    if (argc > 2) {
+        char *exec_argv[] = { argv[2], "exec", NULL };
+        execveat(AT_FDCWD, argv[2], exec_argv, environ, 0);
+        return 10;
+    }
+    return 0;
+}
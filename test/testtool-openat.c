@@ -0,0 +1,36 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Opens the directory argv[1] and prints the file argv[2] relative to it, using openat() on a dup() of the dirfd.
+// Then does the same through the file descriptor of opendir(), using fstatat().
+int main(int argc, const char **argv)
+{
+    if (argc < 3) {
+        return 1;
+    }
+    int dir_fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) return 2;
+    int dupfd = dup(dir_fd);
+    close(dir_fd);
+    int fd = openat(dupfd, argv[2], O_RDONLY);
+    if (fd < 0) return 3;
+    char buffer[256];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof buffer)) > 0) {
+        fwrite(buffer, 1, length, stdout);
+    }
+    close(fd);
+    close(dupfd);
+
+    DIR *dir = opendir(argv[1]);
+    if (dir == NULL) return 4;
+    struct stat st;
+    if (fstatat(dirfd(dir), argv[2], &st, 0) != 0) return 5;
+    printf("%lld\n", (long long)st.st_size);
+    closedir(dir);
+    return 0;
+}
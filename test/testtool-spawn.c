@@ -0,0 +1,43 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs the program argv[2] with posix_spawn(), posix_spawnp() or execl() after vfork() (argv[1] is spawn, spawnp or vfork).
+// The output of the program goes to the file argv[3], which the spawned child opens itself, and its environment
+// contains only TEST=spawn. Prints the exit status of the program.
+int main(int argc, char **argv)
+{
+    if (argc < 4) {
+        return 1;
+    }
+    const char *program = argv[2];
+    char *child_argv[] = { argv[2], "arg1", NULL };
+    char *child_env[] = { "TEST=spawn", NULL };
+    pid_t pid;
+    if (strcmp(argv[1], "vfork") == 0) {
+        pid = vfork();
+        if (pid == 0) {
+            int fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || dup2(fd, 1) < 0) _exit(126);
+            execle(program, program, "arg1", NULL, child_env);
+            _exit(127);
+        }
+    } else {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 1, argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int error = strcmp(argv[1], "spawnp") == 0
+            ? posix_spawnp(&pid, program, &actions, NULL, child_argv, child_env)
+            : posix_spawn(&pid, program, &actions, NULL, child_argv, child_env);
+        posix_spawn_file_actions_destroy(&actions);
+        if (error != 0) return 2;
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return 3;
+    printf("exit %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 0;
+}
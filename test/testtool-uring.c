@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Opens argv[1] and stats argv[2] with io_uring, set up with syscall() like liburing does on some architectures.
+// Prints the content of argv[1] and the size of argv[2].
+int main(int argc, const char **argv)
+{
+    if (argc < 3) {
+        return 1;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    int ring = syscall(SYS_io_uring_setup, 4, &params);
+    if (ring < 0) return 2;
+    char *sq = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(unsigned),
+            PROT_READ | PROT_WRITE, MAP_SHARED, ring, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED, ring, IORING_OFF_CQ_RING);
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED, ring, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) return 3;
+    unsigned *tail = (unsigned *)(sq + params.sq_off.tail);
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+
+    struct statx stx;
+    memset(sqes, 0, 2 * sizeof *sqes);
+    sqes[0].opcode = IORING_OP_OPENAT;
+    sqes[0].fd = AT_FDCWD;
+    sqes[0].addr = (unsigned long)argv[1];
+    sqes[0].open_flags = O_RDONLY;
+    sqes[0].user_data = 0;
+    sqes[1].opcode = IORING_OP_STATX;
+    sqes[1].fd = AT_FDCWD;
+    sqes[1].addr = (unsigned long)argv[2];
+    sqes[1].len = STATX_SIZE;
+    sqes[1].off = (unsigned long)&stx;
+    sqes[1].user_data = 1;
+    array[0] = 0;
+    array[1] = 1;
+    __atomic_store_n(tail, *tail + 2, __ATOMIC_RELEASE);
+    if (syscall(SYS_io_uring_enter, ring, 2, 2, IORING_ENTER_GETEVENTS, NULL, 0) != 2) return 4;
+
+    unsigned *cq_head = (unsigned *)(cq + params.cq_off.head);
+    unsigned *cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    struct io_uring_cqe *cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    int fd = -1, statx_result = -1;
+    for (unsigned i = *cq_head; i != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); i++) {
+        struct io_uring_cqe *cqe = &cqes[i & (params.cq_entries - 1)];
+        if (cqe->user_data == 0) fd = cqe->res;
+        else statx_result = cqe->res;
+    }
+    if (fd < 0) return 5;
+    if (statx_result < 0) return 6;
+    char buffer[256];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof buffer)) > 0) {
+        fwrite(buffer, 1, length, stdout);
+    }
+    printf("%llu\n", (unsigned long long)stx.stx_size);
+    close(fd);
+    close(ring);
+    return 0;
+}